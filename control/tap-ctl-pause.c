@@ -39,7 +39,8 @@
 #include "tap-ctl.h"
 
 int
-tap_ctl_pause(const int id, const int minor, struct timeval *timeout)
+tap_ctl_pause(const int id, const int minor, int flags,
+	      struct timeval *timeout)
 {
 	int err;
 	tapdisk_message_t message;
@@ -47,6 +48,7 @@ tap_ctl_pause(const int id, const int minor, struct timeval *timeout)
 	memset(&message, 0, sizeof(message));
 	message.type = TAPDISK_MESSAGE_PAUSE;
 	message.cookie = minor;
+	message.u.params.flags = flags;
 
 	err = tap_ctl_connect_send_and_receive(id, &message, timeout);
 	if (err)
@@ -262,7 +262,10 @@ tap_cli_create_usage(FILE *stream)
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
 		"[-r turn on read caching into leaf node] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
-		"fail over to the secondary image on ENOSPC]\n");
+		"fail over to the secondary image on ENOSPC] [-M "
+		"mirror to the secondary image asynchronously] "
+		"[-A turn on sequential read-ahead] "
+		"[-4 advertise 4K logical sectors]\n");
 }
 
 static int
@@ -278,7 +281,7 @@ tap_cli_create(int argc, char **argv)
 	flags     = 0;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rd:e:r2:sh")) != -1) {
+	while ((c = getopt(argc, argv, "a:Rd:e:r2:sMA4h")) != -1) {
 		switch (c) {
 		case 'a':
 			args = optarg;
@@ -303,6 +306,15 @@ tap_cli_create(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'M':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_READAHEAD;
+			break;
+		case '4':
+			flags |= TAPDISK_MESSAGE_FLAG_4K;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -601,21 +613,23 @@ usage:
 static void
 tap_cli_pause_usage(FILE *stream)
 {
-	fprintf(stream, "usage: pause <-m minor> [-p pid]\n");
+	fprintf(stream, "usage: pause <-m minor> [-p pid] [-k keep parents "
+		"open for a snapshot resume]\n");
 }
 
 static int
 tap_cli_pause(int argc, char **argv)
 {
-	int c, pid, minor;
+	int c, pid, minor, flags;
 	struct timeval *timeout;
 
 	pid     = -1;
 	minor   = -1;
+	flags   = 0;
 	timeout = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:t:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:kt:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -623,6 +637,9 @@ tap_cli_pause(int argc, char **argv)
 		case 'm':
 			minor = atoi(optarg);
 			break;
+		case 'k':
+			flags |= TAPDISK_MESSAGE_FLAG_KEEP_PARENTS;
+			break;
 		case 't':
 			timeout = tap_cli_timeout(optarg);
 			if (!timeout)
@@ -646,7 +663,7 @@ tap_cli_pause(int argc, char **argv)
 		}
 	}
 
-	return tap_ctl_pause(pid, minor, timeout);
+	return tap_ctl_pause(pid, minor, flags, timeout);
 
 usage:
 	tap_cli_pause_usage(stderr);
@@ -762,7 +779,10 @@ tap_cli_open_usage(FILE *stream)
 		"[-e <minor> stack on existing tapdisk for the parent chain] "
 		"[-r turn on read caching into leaf node] [-2 <path> "
 		"use secondary image (in mirror mode if no -s)] [-s "
-		"fail over to the secondary image on ENOSPC]\n");
+		"fail over to the secondary image on ENOSPC] [-M "
+		"mirror to the secondary image asynchronously] "
+		"[-A turn on sequential read-ahead] "
+		"[-4 advertise 4K logical sectors]\n");
 }
 
 static int
@@ -779,7 +799,7 @@ tap_cli_open(int argc, char **argv)
 	secondary = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:Rm:p:e:r2:sh")) != -1) {
+	while ((c = getopt(argc, argv, "a:Rm:p:e:r2:sMA4h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -807,6 +827,15 @@ tap_cli_open(int argc, char **argv)
 		case 's':
 			flags |= TAPDISK_MESSAGE_FLAG_STANDBY;
 			break;
+		case 'M':
+			flags |= TAPDISK_MESSAGE_FLAG_ASYNC;
+			break;
+		case 'A':
+			flags |= TAPDISK_MESSAGE_FLAG_READAHEAD;
+			break;
+		case '4':
+			flags |= TAPDISK_MESSAGE_FLAG_4K;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -899,6 +928,243 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_qos_usage(FILE *stream)
+{
+	fprintf(stream, "usage: qos <-m minor> [-p pid] "
+		"[-r read iops] [-w write iops] "
+		"[-R read bytes/s] [-W write bytes/s] [-b burst ms] "
+		"[-s share weight] [-q max %% of aio queue]\n"
+		"(settings not given are left unchanged)\n");
+}
+
+static int
+tap_cli_qos(int argc, char **argv)
+{
+	int c, pid, minor;
+	uint64_t iops[2], bps[2];
+	unsigned int burst_ms, weight, queue_pct;
+
+	pid       = -1;
+	minor     = -1;
+	burst_ms  = TAPDISK_MESSAGE_QOS_UNCHANGED32;
+	weight    = TAPDISK_MESSAGE_QOS_UNCHANGED32;
+	queue_pct = TAPDISK_MESSAGE_QOS_UNCHANGED32;
+	iops[0]   = iops[1] = TAPDISK_MESSAGE_QOS_UNCHANGED;
+	bps[0]    = bps[1]  = TAPDISK_MESSAGE_QOS_UNCHANGED;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:r:w:R:W:b:s:q:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'r':
+			iops[0] = strtoull(optarg, NULL, 10);
+			break;
+		case 'w':
+			iops[1] = strtoull(optarg, NULL, 10);
+			break;
+		case 'R':
+			bps[0] = strtoull(optarg, NULL, 10);
+			break;
+		case 'W':
+			bps[1] = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			burst_ms = atoi(optarg);
+			break;
+		case 's':
+			weight = atoi(optarg);
+			break;
+		case 'q':
+			queue_pct = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_qos_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (minor == -1)
+		goto usage;
+
+	if (pid == -1) {
+		pid = tap_ctl_find_pid(minor);
+		if (pid == -1) {
+			fprintf(stderr, "failed to find pid for %d\n", minor);
+			return pid;
+		}
+	}
+
+	return tap_ctl_qos(pid, minor, iops, bps, burst_ms,
+			   weight, queue_pct);
+
+usage:
+	tap_cli_qos_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_moderate_usage(FILE *stream)
+{
+	fprintf(stream, "usage: moderate <-m minor> [-p pid] "
+		"[-u max usecs to hold responses, 0 to disable] "
+		"[-n max responses to hold] "
+		"(settings not given are left unchanged)\n");
+}
+
+static int
+tap_cli_moderate(int argc, char **argv)
+{
+	int c, pid, minor;
+	unsigned int usecs, responses;
+
+	pid       = -1;
+	minor     = -1;
+	usecs     = TAPDISK_MESSAGE_KICK_UNCHANGED;
+	responses = TAPDISK_MESSAGE_KICK_UNCHANGED;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:u:n:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'u':
+			usecs = atoi(optarg);
+			break;
+		case 'n':
+			responses = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_moderate_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (minor == -1)
+		goto usage;
+
+	if (pid == -1) {
+		pid = tap_ctl_find_pid(minor);
+		if (pid == -1) {
+			fprintf(stderr, "failed to find pid for %d\n", minor);
+			return pid;
+		}
+	}
+
+	return tap_ctl_kick_moderation(pid, minor, usecs, responses);
+
+usage:
+	tap_cli_moderate_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_job_usage(FILE *stream, const char *name, int type)
+{
+	fprintf(stream, "usage: %s <-m minor> [-p pid] %s"
+		"[-r max bytes/s, 0 for unlimited] "
+		"[-d requests in flight] [-c cancel]\n", name,
+		(type == TAPDISK_MESSAGE_JOB_MIGRATE ?
+		 "<-a type:/path/to/new/image> " : ""));
+}
+
+static int
+tap_cli_job(int argc, char **argv, int type)
+{
+	int c, pid, minor, op;
+	unsigned int depth;
+	const char *args;
+	uint64_t rate;
+
+	pid   = -1;
+	minor = -1;
+	op    = TAPDISK_MESSAGE_JOB_START;
+	rate  = 0;
+	depth = 0;
+	args  = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:r:d:a:ch")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'a':
+			args = optarg;
+			break;
+		case 'c':
+			op = TAPDISK_MESSAGE_JOB_CANCEL;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_job_usage(stdout, argv[0], type);
+			return 0;
+		}
+	}
+
+	if (minor == -1)
+		goto usage;
+
+	if (type == TAPDISK_MESSAGE_JOB_MIGRATE &&
+	    op == TAPDISK_MESSAGE_JOB_START && !args)
+		goto usage;
+
+	if (pid == -1) {
+		pid = tap_ctl_find_pid(minor);
+		if (pid == -1) {
+			fprintf(stderr, "failed to find pid for %d\n", minor);
+			return pid;
+		}
+	}
+
+	return tap_ctl_job(pid, minor, op, type, rate, depth, args);
+
+usage:
+	tap_cli_job_usage(stderr, argv[0], type);
+	return EINVAL;
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	return tap_cli_job(argc, argv, TAPDISK_MESSAGE_JOB_COALESCE);
+}
+
+static int
+tap_cli_stream(int argc, char **argv)
+{
+	return tap_cli_job(argc, argv, TAPDISK_MESSAGE_JOB_STREAM);
+}
+
+static int
+tap_cli_migrate(int argc, char **argv)
+{
+	return tap_cli_job(argc, argv, TAPDISK_MESSAGE_JOB_MIGRATE);
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -915,6 +1181,11 @@ struct command commands[] = {
 	{ .name = "stats",        .func = tap_cli_stats         },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "qos",          .func = tap_cli_qos           },
+	{ .name = "moderate",     .func = tap_cli_moderate      },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
+	{ .name = "stream",       .func = tap_cli_stream        },
+	{ .name = "migrate",      .func = tap_cli_migrate       },
 };
 
 #define print_commands()					\
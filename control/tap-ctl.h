@@ -116,12 +116,22 @@ int tap_ctl_open(const int id, const int minor, const char *params, int flags,
 int tap_ctl_close(const int id, const int minor, const int force,
 		  struct timeval *timeout);
 
-int tap_ctl_pause(const int id, const int minor, struct timeval *timeout);
+int tap_ctl_pause(const int id, const int minor, int flags,
+		  struct timeval *timeout);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
 
+int tap_ctl_qos(const int id, const int minor,
+		const uint64_t iops[2], const uint64_t bps[2],
+		unsigned int burst_ms, unsigned int weight,
+		unsigned int queue_pct);
+int tap_ctl_kick_moderation(const int id, const int minor,
+			    unsigned int usecs, unsigned int responses);
+int tap_ctl_job(const int id, const int minor, int op, int type,
+		uint64_t rate, unsigned int depth, const char *params);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -41,6 +41,14 @@
  *   u32 count;
  * }
  * terminated by { 0, 0 }
+ *
+ * If the list doesn't fit in the shared memory region, the request is
+ * acked with "more" instead of "done", and LOGCMD_NEXT exports the
+ * next part.
+ *
+ * Writes are also recorded in a changed block tracking file which
+ * survives restarts (see tapdisk-cbt.h); LOGCMD_CBT_CLEAR starts a new
+ * epoch in it.
  */
 
 #include <errno.h>
@@ -57,6 +65,7 @@
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-cbt.h"
 
 #define MAX_CONNECTIONS 1
 
@@ -68,7 +77,14 @@ typedef struct poll_fd {
 struct tdlog_state {
   uint64_t     size;
 
-  void*        writelog;
+  unsigned long** leaves;
+  unsigned long*  summary;
+  uint64_t     nleaves;
+  uint64_t     dirty_leaves;
+
+  int          exporting;
+  int          export_clear;
+  uint64_t     export_cursor;
 
   char*        ctlpath;
   poll_fd_t    ctl;
@@ -81,6 +97,8 @@ struct tdlog_state {
 
   log_sring_t* sring;
   log_back_ring_t bring;
+
+  td_cbt_t*    cbt;
 };
 
 #define BDPRINTF(_f, _a...) syslog (LOG_DEBUG, "log: " _f "\n", ## _a)
@@ -92,123 +110,253 @@ static void ctl_request(event_id_t, char, void *);
 
 /* -- write log -- */
 
-/* large flat bitmaps don't scale particularly well either in size or scan
- * time, but they'll do for now */
+/* The dirty map has two levels: leaves of LEAF_BITS sectors, one bit
+ * per sector, allocated on first write, and a summary with one bit
+ * per allocated leaf. Memory follows the size of the change set, and
+ * scans skip clean leaves 64 at a time through the summary. */
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
 #define BITS_TO_LONGS(bits) (((bits)+BITS_PER_LONG-1)/BITS_PER_LONG)
 
 #define BITMAP_ENTRY(_nr, _bmap) ((unsigned long*)(_bmap))[(_nr)/BITS_PER_LONG]
 #define BITMAP_SHIFT(_nr) ((_nr) % BITS_PER_LONG)
 
-static inline int test_bit(int nr, void* bmap)
+#define LEAF_SHIFT 15
+#define LEAF_BITS  (1ULL << LEAF_SHIFT)
+#define LEAF_MASK  (LEAF_BITS - 1)
+#define LEAF_LONGS (LEAF_BITS / BITS_PER_LONG)
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+static inline int test_bit(uint64_t nr, void* bmap)
 {
   return (BITMAP_ENTRY(nr, bmap) >> BITMAP_SHIFT(nr)) & 1;
 }
 
-static inline void clear_bit(int nr, void* bmap)
+static inline void clear_bit(uint64_t nr, void* bmap)
 {
   BITMAP_ENTRY(nr, bmap) &= ~(1UL << BITMAP_SHIFT(nr));
 }
 
-static inline void set_bit(int nr, void* bmap)
+static inline void set_bit(uint64_t nr, void* bmap)
 {
   BITMAP_ENTRY(nr, bmap) |= (1UL << BITMAP_SHIFT(nr));
 }
 
-static inline int bitmap_size(uint64_t sz)
-{
-  return sz >> 3;
-}
-
 static int writelog_create(struct tdlog_state *s)
 {
-  uint64_t bmsize;
+  s->nleaves = (s->size + LEAF_BITS - 1) >> LEAF_SHIFT;
 
-  bmsize = bitmap_size(s->size);
+  BDPRINTF("allocating %"PRIu64" leaf pointers for dirty map", s->nleaves);
 
-  BDPRINTF("allocating %"PRIu64" bytes for dirty bitmap", bmsize);
-
-  if (!(s->writelog = calloc(bmsize, 1))) {
-    BWPRINTF("could not allocate dirty bitmap of size %"PRIu64, bmsize);
+  s->leaves = calloc(s->nleaves, sizeof(*s->leaves));
+  s->summary = calloc(BITS_TO_LONGS(s->nleaves), sizeof(unsigned long));
+  if (!s->leaves || !s->summary) {
+    BWPRINTF("could not allocate dirty map for %"PRIu64" sectors", s->size);
     return -1;
   }
 
   return 0;
 }
 
+/* first leaf from l on with dirty sectors, or nleaves */
+static uint64_t writelog_next_leaf(struct tdlog_state* s, uint64_t l)
+{
+  unsigned long w;
+
+  while (l < s->nleaves) {
+    w = BITMAP_ENTRY(l, s->summary) >> BITMAP_SHIFT(l);
+    if (w)
+      return l + __builtin_ctzl(w);
+    l = (l | (BITS_PER_LONG - 1)) + 1;
+  }
+
+  return s->nleaves;
+}
+
+static void writelog_free_leaf(struct tdlog_state* s, uint64_t l)
+{
+  free(s->leaves[l]);
+  s->leaves[l] = NULL;
+  clear_bit(l, s->summary);
+  s->dirty_leaves--;
+}
+
 static int writelog_free(struct tdlog_state *s)
 {
-  if (s->writelog)
-    free(s->writelog);
+  uint64_t l;
+
+  if (s->leaves && s->summary)
+    for (l = writelog_next_leaf(s, 0); l < s->nleaves;
+	 l = writelog_next_leaf(s, l + 1))
+      writelog_free_leaf(s, l);
+
+  free(s->leaves);
+  free(s->summary);
+  s->leaves = NULL;
+  s->summary = NULL;
 
   return 0;
 }
 
 static int writelog_set(struct tdlog_state* s, uint64_t sector, int count)
 {
-  int i;
+  uint64_t end, l;
+  unsigned long* leaf;
+
+  end = MIN(sector + count, s->size);
+
+  for (; sector < end; sector++) {
+    l = sector >> LEAF_SHIFT;
+    leaf = s->leaves[l];
+    if (!leaf) {
+      leaf = calloc(LEAF_LONGS, sizeof(unsigned long));
+      if (!leaf)
+	return -ENOMEM;
+      s->leaves[l] = leaf;
+      set_bit(l, s->summary);
+      s->dirty_leaves++;
+    }
 
-  for (i = 0; i < count; i++) 
-    set_bit(sector + i, s->writelog);
+    set_bit(sector & LEAF_MASK, leaf);
+  }
 
   return 0;
 }
 
+/* first dirty sector from sector on, or size */
+static uint64_t writelog_next_dirty(struct tdlog_state* s, uint64_t sector)
+{
+  unsigned long* leaf;
+  unsigned long w;
+  uint64_t i;
+
+  while (sector < s->size) {
+    leaf = s->leaves[sector >> LEAF_SHIFT];
+    if (!leaf) {
+      sector = writelog_next_leaf(s, (sector >> LEAF_SHIFT) + 1) << LEAF_SHIFT;
+      continue;
+    }
+
+    i = sector & LEAF_MASK;
+    w = BITMAP_ENTRY(i, leaf) >> BITMAP_SHIFT(i);
+    if (w)
+      return sector + __builtin_ctzl(w);
+    sector = (sector | (BITS_PER_LONG - 1)) + 1;
+  }
+
+  return s->size;
+}
+
+/* first clean sector from sector on, or size */
+static uint64_t writelog_next_clean(struct tdlog_state* s, uint64_t sector)
+{
+  unsigned long* leaf;
+  unsigned long w;
+  uint64_t i;
+
+  while (sector < s->size) {
+    leaf = s->leaves[sector >> LEAF_SHIFT];
+    if (!leaf)
+      return sector;
+
+    i = sector & LEAF_MASK;
+    w = ~BITMAP_ENTRY(i, leaf) >> BITMAP_SHIFT(i);
+    if (w)
+      return MIN(sector + __builtin_ctzl(w), s->size);
+    sector = (sector | (BITS_PER_LONG - 1)) + 1;
+  }
+
+  return s->size;
+}
+
 /* if end is 0, clear to end of disk */
 int writelog_clear(struct tdlog_state* s, uint64_t start, uint64_t end)
 {
+  uint64_t l, lstart, lend, i;
+
   if (!end)
     end = s->size;
 
-  /* clear to word boundaries */
-  while (BITMAP_SHIFT(start))
-    clear_bit(start++, s->writelog);
-  while (BITMAP_SHIFT(end))
-    clear_bit(end--, s->writelog);
+  while (start < end) {
+    l = start >> LEAF_SHIFT;
+    if (!s->leaves[l]) {
+      start = writelog_next_leaf(s, l + 1) << LEAF_SHIFT;
+      continue;
+    }
+
+    lstart = l << LEAF_SHIFT;
+    lend = MIN(lstart + LEAF_BITS, s->size);
+
+    if (start == lstart && end >= lend) {
+      writelog_free_leaf(s, l);
+      start = lend;
+      continue;
+    }
+
+    for (; start < MIN(end, lend); start++)
+      clear_bit(start & LEAF_MASK, s->leaves[l]);
 
-  memset(s->writelog + start / BITS_PER_LONG, 0, (end - start) >> 3);
+    for (i = 0; i < LEAF_LONGS && !s->leaves[l][i]; i++)
+      ;
+    if (i == LEAF_LONGS)
+      writelog_free_leaf(s, l);
+  }
 
   return 0;
 }
 
-/* returns last block exported (may not be end of disk if shm region
- * overflows) */
-static uint64_t writelog_export(struct tdlog_state* s)
+/* exports dirty extents from sector from on, clearing them if clear is
+ * set. returns 1 if the shm region filled up before the end of the
+ * disk; the export can then be resumed from s->export_cursor */
+static int writelog_export(struct tdlog_state* s, uint64_t from, int clear)
 {
   struct disk_range* range = s->shm;
-  uint64_t i = 0;
-
-  BDPRINTF("sector count: %"PRIu64, s->size);
-
-  for (i = 0; i < s->size; i++) {
-    if (test_bit(i, s->writelog)) {
-      /* range start */
-      range->sector = i;
-      range->count = 1;
-      /* find end */
-      for (i++; i < s->size && test_bit(i, s->writelog); i++)
-	range->count++;
-
-      BDPRINTF("export: dirty extent %"PRIu64":%u",
-	       range->sector, range->count);
-      range++;
-
-      /* out of space in shared memory region */
-      if ((void*)range >= bmend(s->shm)) {
-	BDPRINTF("out of space in shm region at sector %"PRIu64, i);
-	return i;
-      }
-
-      /* undo forloop increment */
-      i--;
+  struct disk_range* last = (struct disk_range*)bmend(s->shm) - 1;
+  uint64_t sector, end, extents;
+  int more;
+
+  BDPRINTF("sector count: %"PRIu64", dirty leaves: %"PRIu64", from: %"PRIu64,
+	   s->size, s->dirty_leaves, from);
+
+  more = 0;
+  extents = 0;
+
+  for (sector = from;; sector = end) {
+    sector = writelog_next_dirty(s, sector);
+    if (sector >= s->size)
+      break;
+
+    /* out of space in shared memory region */
+    if (range == last) {
+      BDPRINTF("out of space in shm region at sector %"PRIu64, sector);
+      more = 1;
+      break;
     }
+
+    end = writelog_next_clean(s, sector);
+    if (end - sector > UINT32_MAX)
+      end = sector + UINT32_MAX;
+
+    range->sector = sector;
+    range->count = end - sector;
+    range++;
+    extents++;
   }
 
   /* NULL-terminate range list */
   range->sector = 0;
   range->count = 0;
 
-  return i;
+  if (clear && sector > from)
+    writelog_clear(s, from, sector);
+
+  s->exporting = more;
+  s->export_clear = clear;
+  s->export_cursor = sector;
+
+  BDPRINTF("exported %"PRIu64" extents", extents);
+
+  return more;
 }
 
 /* -- communication channel -- */
@@ -457,15 +605,20 @@ static int ctl_get_shmpath(struct tdlog_state* s, int fd)
   return 0;
 }
 
+static inline const char* ctl_export_ack(int more)
+{
+  return more ? "more" : "done";
+}
+
 static int ctl_peek_writes(struct tdlog_state* s, int fd)
 {
-  int rc;
+  int rc, more;
 
   BDPRINTF("ctl: peeking bitmap");
 
-  writelog_export(s);
+  more = writelog_export(s, 0, 0);
 
-  if ((rc = write(fd, "done", CTLRSPLEN_PEEK)) < 0) {
+  if ((rc = write(fd, ctl_export_ack(more), CTLRSPLEN_PEEK)) < 0) {
     BWPRINTF("error writing peek ack: %s", strerror(errno));
     return -1;
   }
@@ -492,14 +645,13 @@ static int ctl_clear_writes(struct tdlog_state* s, int fd)
 /* get dirty bitmap and clear it atomically */
 static int ctl_get_writes(struct tdlog_state* s, int fd)
 {
-  int rc;
+  int rc, more;
 
   BDPRINTF("ctl: getting bitmap");
 
-  writelog_export(s);
-  writelog_clear(s, 0, 0);
+  more = writelog_export(s, 0, 1);
 
-  if ((rc = write(fd, "done", CTLRSPLEN_GET)) < 0) {
+  if ((rc = write(fd, ctl_export_ack(more), CTLRSPLEN_GET)) < 0) {
     BWPRINTF("error writing get ack: %s", strerror(errno));
     return -1;
   }
@@ -507,6 +659,48 @@ static int ctl_get_writes(struct tdlog_state* s, int fd)
   return 0;
 }
 
+/* continue a peek or get which didn't fit the shm region. only the
+ * exported part of a get has been cleared so far */
+static int ctl_next_writes(struct tdlog_state* s, int fd)
+{
+  int rc, more;
+
+  BDPRINTF("ctl: continuing export at %"PRIu64, s->export_cursor);
+
+  if (s->exporting)
+    more = writelog_export(s, s->export_cursor, s->export_clear);
+  else {
+    struct disk_range* range = s->shm;
+    range->sector = 0;
+    range->count = 0;
+    more = 0;
+  }
+
+  if ((rc = write(fd, ctl_export_ack(more), CTLRSPLEN_NEXT)) < 0) {
+    BWPRINTF("error writing next ack: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int ctl_clear_cbt(struct tdlog_state* s, int fd)
+{
+  const char* ack;
+  int rc;
+
+  BDPRINTF("ctl: clearing change tracking");
+
+  ack = (s->cbt && !td_cbt_clear(s->cbt)) ? "done" : "fail";
+
+  if ((rc = write(fd, ack, CTLRSPLEN_CBT_CLEAR)) < 0) {
+    BWPRINTF("error writing cbt clear ack: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
 /* get requests from ring */
 static int ctl_kick(struct tdlog_state* s, int fd)
 {
@@ -561,6 +755,10 @@ static int ctl_do_request(struct tdlog_state* s, int fd, struct log_ctlmsg* msg)
     return ctl_clear_writes(s, fd);
   } else if (!strncmp(msg->msg, LOGCMD_GET, 4)) {
     return ctl_get_writes(s, fd);
+  } else if (!strncmp(msg->msg, LOGCMD_NEXT, 4)) {
+    return ctl_next_writes(s, fd);
+  } else if (!strncmp(msg->msg, LOGCMD_CBT_CLEAR, 4)) {
+    return ctl_clear_cbt(s, fd);
   } else if (!strncmp(msg->msg, LOGCMD_KICK, 4)) {
     return ctl_kick(s, fd);
   }
@@ -616,6 +814,7 @@ static int tdlog_close(td_driver_t*);
 static int tdlog_open(td_driver_t* driver, const char* name, td_flag_t flags)
 {
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
+  char* cbtpath;
   int rc;
 
   memset(s, 0, sizeof(*s));
@@ -639,6 +838,14 @@ static int tdlog_open(td_driver_t* driver, const char* name, td_flag_t flags)
   SHARED_RING_INIT(s->sring);
   BACK_RING_INIT(&s->bring, s->sring, SRINGSIZE);
 
+  /* without the file, changes are only tracked in memory */
+  cbtpath = td_cbt_path(name);
+  if (cbtpath) {
+    if (td_cbt_open(driver, name, cbtpath, s->size, &s->cbt))
+      BWPRINTF("change tracking file %s unavailable", cbtpath);
+    free(cbtpath);
+  }
+
   BDPRINTF("opened ctl socket");
 
   return 0;
@@ -652,6 +859,11 @@ static int tdlog_close(td_driver_t* driver)
   shmem_close(s);
   writelog_free(s);
 
+  if (s->cbt) {
+    td_cbt_close(s->cbt);
+    s->cbt = NULL;
+  }
+
   return 0;
 }
 
@@ -665,8 +877,17 @@ static void tdlog_queue_write(td_driver_t* driver, td_request_t treq)
   struct tdlog_state* s = (struct tdlog_state*)driver->data;
   int rc;
 
-  writelog_set(s, treq.sec, treq.secs);
-  td_forward_request(treq);
+  /* an untracked write would be missed by the next sync */
+  if ((rc = writelog_set(s, treq.sec, treq.secs))) {
+    BWPRINTF("could not track write %"PRIu64":%d: %d", treq.sec, treq.secs, rc);
+    td_complete_request(treq, rc);
+    return;
+  }
+
+  if (s->cbt)
+    td_cbt_queue_write(s->cbt, treq);
+  else
+    td_forward_request(treq);
 }
 
 static int tdlog_get_parent_id(td_driver_t* driver, td_disk_id_t* id)
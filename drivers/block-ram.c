@@ -30,39 +30,120 @@
  * Copyright (c) 2008 Citrix Systems, Inc.
  */
 
+/*
+ * RAM disk. The image lives in an anonymous mapping, hugepage backed
+ * where the system has them reserved, and is populated lazily: the
+ * first request to touch a 2MB chunk reads it from the backing file
+ * through the aio queue, and requests wait until their chunks are in.
+ * TAPDISK2_RAM_PREFILL=1 also reads the rest of the image in the
+ * background, a few chunks at a time.
+ *
+ * Writes stay in memory and are dropped on close, unless
+ * TAPDISK2_RAM_WRITEBACK=<secs> is set: then chunks written are
+ * written back to the file every secs seconds, and on close.
+ *
+ * Each open image has its own state, so a tapdisk can serve any
+ * number of ram disks.
+ */
 
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <string.h>
 
+#include "list.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
+#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 
-char *img;
-long int   disksector_size;
-long int   disksize;
-long int   diskinfo;
-static int connections = 0;
+#define TDRAM_CHUNK_SHIFT      21
+#define TDRAM_CHUNK_SIZE       (1ULL << TDRAM_CHUNK_SHIFT)
+
+#define TDRAM_MAX_IO           32
+#define TDRAM_BACKGROUND_IO    8
+#define TDRAM_MAX_REQS         TAPDISK_DATA_REQUESTS
+
+#define TDRAM_CHUNK_EMPTY      0
+#define TDRAM_CHUNK_LOADING    1
+#define TDRAM_CHUNK_READY      2
 
+struct tdram_state;
+
+struct tdram_io {
+	struct tiocb           tiocb;
+	struct tdram_state    *prv;
+	uint64_t               chunk;
+	int                    write;
+	int                    background;
+	int                    busy;
+	struct tdram_io       *next;
+};
+
+struct tdram_request {
+	td_request_t           treq;
+	int                    write;
+	int                    allocated;
+	struct list_head       next;
+};
+
+/*
+ * Allocated apart from the driver: background I/O still in flight at
+ * close keeps it alive until the last completion.
+ */
 struct tdram_state {
-        int fd;
+	td_driver_t           *driver;
+	int                    fd;
+	int                    rdonly;
+	int                    closing;
+
+	char                  *mem;
+	size_t                 mem_size;
+	int                    hugetlb;
+
+	uint64_t               size;
+	uint64_t               chunks;
+	uint8_t               *chunk;
+	uint8_t               *dirty;
+
+	struct tdram_io        ios[TDRAM_MAX_IO];
+	struct tdram_io       *free_io;
+	int                    inflight;
+	int                    background;
+
+	struct tdram_request   reqs[TDRAM_MAX_REQS];
+	struct list_head       free_reqs;
+	struct list_head       waiting;
+
+	int                    prefill;
+	uint64_t               prefill_next;
+
+	int                    writeback;
+	int                    writeback_active;
+	uint64_t               writeback_next;
+	event_id_t             writeback_event;
+
+	uint64_t               loads;
+	uint64_t               writebacks;
+	uint64_t               waits;
+	uint64_t               errors;
 };
 
+#define tdram_state(_driver) (*(struct tdram_state **)(_driver)->data)
+
+static void tdram_kick(struct tdram_state *);
+
 /*Get Image size, secsize*/
 static int get_image_info(int fd, td_disk_info_t *info)
 {
 	int ret;
-	long size;
-	unsigned long total_size;
-	struct statvfs statBuf;
+	unsigned long long bytes;
 	struct stat stat;
 
 	ret = fstat(fd, &stat);
@@ -74,7 +155,9 @@ static int get_image_info(int fd, td_disk_info_t *info)
 	if (S_ISBLK(stat.st_mode)) {
 		/*Accessing block device directly*/
 		info->size = 0;
-		if (ioctl(fd,BLKGETSIZE,&info->size)!=0) {
+		if (ioctl(fd,BLKGETSIZE64,&bytes)==0) {
+			info->size = bytes >> SECTOR_SHIFT;
+		} else if (ioctl(fd,BLKGETSIZE,&info->size)!=0) {
 			DPRINTF("ERR: BLKGETSIZE failed, couldn't stat image");
 			return -EINVAL;
 		}
@@ -87,7 +170,6 @@ static int get_image_info(int fd, td_disk_info_t *info)
 		/*Get the sector size*/
 #if defined(BLKSSZGET)
 		{
-			int arg;
 			info->sector_size = DEFAULT_SECTOR_SIZE;
 			ioctl(fd, BLKSSZGET, &info->sector_size);
 			
@@ -109,51 +191,422 @@ static int get_image_info(int fd, td_disk_info_t *info)
 			(long long unsigned)info->size);
 	}
 
-	if (info->size == 0) {		
-		info->size =((uint64_t) MAX_RAMDISK_SIZE);
-		info->sector_size = DEFAULT_SECTOR_SIZE;
-	}
 	info->info = 0;
 
-        /*Store variables locally*/
-	disksector_size = info->sector_size;
-	disksize        = info->size;
-	diskinfo        = info->info;
 	DPRINTF("Image sector_size: \n\t[%lu]\n",
 		info->sector_size);
 
 	return 0;
 }
 
+static int
+tdram_map_memory(struct tdram_state *prv)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+	prv->mem_size = (prv->chunks << TDRAM_CHUNK_SHIFT);
+
+#ifdef MAP_HUGETLB
+	/* reserve the huge pages up front: with MAP_NORESERVE, running
+	 * out of them later is a SIGBUS, not a fallback */
+	prv->mem = mmap(NULL, prv->mem_size, PROT_READ | PROT_WRITE,
+			(flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+	if (prv->mem != MAP_FAILED) {
+		prv->hugetlb = 1;
+		return 0;
+	}
+#endif
+
+	prv->mem = mmap(NULL, prv->mem_size, PROT_READ | PROT_WRITE,
+			flags, -1, 0);
+	if (prv->mem == MAP_FAILED) {
+		prv->mem = NULL;
+		return -errno;
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(prv->mem, prv->mem_size, MADV_HUGEPAGE);
+#endif
+
+	return 0;
+}
+
+static inline size_t
+tdram_chunk_bytes(struct tdram_state *prv, uint64_t chunk)
+{
+	uint64_t left = prv->size - (chunk << TDRAM_CHUNK_SHIFT);
+
+	return (left < TDRAM_CHUNK_SIZE ? left : TDRAM_CHUNK_SIZE);
+}
+
+static void
+tdram_flush(struct tdram_state *prv)
+{
+	uint64_t c, off;
+	size_t len;
+	ssize_t ret;
+
+	for (c = 0; c < prv->chunks; c++) {
+		if (!prv->dirty[c])
+			continue;
+
+		off = c << TDRAM_CHUNK_SHIFT;
+		len = tdram_chunk_bytes(prv, c);
+
+		ret = pwrite(prv->fd, prv->mem + off, len, off);
+		if (ret != len) {
+			EPRINTF("writing back chunk %"PRIu64": %d\n",
+				c, (ret < 0 ? -errno : -EIO));
+			prv->errors++;
+			continue;
+		}
+
+		prv->dirty[c] = 0;
+		prv->writebacks++;
+	}
+}
+
+static void
+tdram_free(struct tdram_state *prv)
+{
+	if (prv->dirty && prv->writeback)
+		tdram_flush(prv);
+
+	DPRINTF("ram: closing, %"PRIu64" chunks loaded, %"PRIu64" written "
+		"back, %"PRIu64" errors\n",
+		prv->loads, prv->writebacks, prv->errors);
+
+	if (prv->mem)
+		munmap(prv->mem, prv->mem_size);
+	if (prv->fd != -1)
+		close(prv->fd);
+
+	free(prv->chunk);
+	free(prv->dirty);
+	free(prv);
+}
+
+static struct tdram_io *
+tdram_get_io(struct tdram_state *prv, int background)
+{
+	struct tdram_io *io;
+
+	if (background && prv->background >= TDRAM_BACKGROUND_IO)
+		return NULL;
+
+	io = prv->free_io;
+	if (!io)
+		return NULL;
+
+	prv->free_io   = io->next;
+	io->busy       = 1;
+	io->background = background;
+	prv->background += background;
+	prv->inflight++;
+
+	return io;
+}
+
+static void
+tdram_put_io(struct tdram_state *prv, struct tdram_io *io)
+{
+	prv->background -= io->background;
+	prv->inflight--;
+	io->busy = 0;
+
+	io->next     = prv->free_io;
+	prv->free_io = io;
+}
+
+/*
+ * Requests beyond the pool are allocated, so guest requests never
+ * bounce off a full pool.
+ */
+static struct tdram_request *
+tdram_get_request(struct tdram_state *prv)
+{
+	struct tdram_request *req;
+
+	if (list_empty(&prv->free_reqs)) {
+		req = calloc(1, sizeof(*req));
+		if (req) {
+			req->allocated = 1;
+			INIT_LIST_HEAD(&req->next);
+		}
+		return req;
+	}
+
+	return list_entry(prv->free_reqs.next, struct tdram_request, next);
+}
+
+static void
+tdram_put_request(struct tdram_state *prv, struct tdram_request *req)
+{
+	if (req->allocated) {
+		list_del(&req->next);
+		free(req);
+	} else
+		list_move(&req->next, &prv->free_reqs);
+}
+
+static void
+tdram_fail_waiting(struct tdram_state *prv, uint64_t chunk, int err)
+{
+	struct tdram_request *req, *tmp;
+	uint64_t first, last, size;
+	td_request_t treq;
+
+	size = prv->driver->info.sector_size;
+
+	list_for_each_entry_safe(req, tmp, &prv->waiting, next) {
+		first = (req->treq.sec * size) >> TDRAM_CHUNK_SHIFT;
+		last  = ((req->treq.sec + req->treq.secs) * size - 1) >>
+			TDRAM_CHUNK_SHIFT;
+
+		if (chunk < first || chunk > last)
+			continue;
+
+		treq = req->treq;
+		tdram_put_request(prv, req);
+		td_complete_request(treq, err);
+	}
+}
+
+static void
+tdram_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct tdram_io *io = arg;
+	struct tdram_state *prv = io->prv;
+	uint64_t chunk = io->chunk;
+	int write = io->write;
+
+	tdram_put_io(prv, io);
+
+	if (err) {
+		EPRINTF("%s chunk %"PRIu64": %d\n",
+			(write ? "writing back" : "loading"), chunk, err);
+		prv->errors++;
+	}
+
+	if (write) {
+		if (err)
+			prv->dirty[chunk] = 1;
+		else
+			prv->writebacks++;
+	} else {
+		prv->chunk[chunk] = (err ? TDRAM_CHUNK_EMPTY :
+				     TDRAM_CHUNK_READY);
+		if (!err)
+			prv->loads++;
+	}
+
+	if (prv->closing) {
+		if (!prv->inflight)
+			tdram_free(prv);
+		return;
+	}
+
+	if (err && !write)
+		tdram_fail_waiting(prv, chunk, err);
+
+	tdram_kick(prv);
+}
+
+static int
+tdram_start_io(struct tdram_state *prv, uint64_t chunk,
+	       int write, int background)
+{
+	struct tdram_io *io;
+	uint64_t off;
+	size_t len;
+
+	io = tdram_get_io(prv, background);
+	if (!io)
+		return -EBUSY;
+
+	off       = chunk << TDRAM_CHUNK_SHIFT;
+	len       = tdram_chunk_bytes(prv, chunk);
+	io->chunk = chunk;
+	io->write = write;
+
+	if (write) {
+		prv->dirty[chunk] = 0;
+		td_prep_write(&io->tiocb, prv->fd, prv->mem + off, len, off,
+			      tdram_complete, io);
+	} else {
+		prv->chunk[chunk] = TDRAM_CHUNK_LOADING;
+		td_prep_read(&io->tiocb, prv->fd, prv->mem + off, len, off,
+			     tdram_complete, io);
+	}
+
+	td_queue_tiocb(prv->driver, &io->tiocb);
+	return 0;
+}
+
+/*
+ * Are all chunks of the range in? Starts loading those which aren't.
+ */
+static int
+tdram_ready(struct tdram_state *prv, td_request_t *treq)
+{
+	uint64_t c, first, last, size;
+	int ready = 1;
+
+	size  = prv->driver->info.sector_size;
+	first = (treq->sec * size) >> TDRAM_CHUNK_SHIFT;
+	last  = ((treq->sec + treq->secs) * size - 1) >> TDRAM_CHUNK_SHIFT;
+
+	for (c = first; c <= last; c++) {
+		if (prv->chunk[c] == TDRAM_CHUNK_READY)
+			continue;
+
+		ready = 0;
+		if (prv->chunk[c] == TDRAM_CHUNK_EMPTY)
+			tdram_start_io(prv, c, 0, 0);
+	}
+
+	return ready;
+}
+
+static void
+tdram_do_request(struct tdram_state *prv, td_request_t treq, int write)
+{
+	uint64_t c, off, size;
+
+	size = treq.secs * prv->driver->info.sector_size;
+	off  = treq.sec  * (uint64_t)prv->driver->info.sector_size;
+
+	if (!write) {
+		memcpy(treq.buf, prv->mem + off, size);
+		goto out;
+	}
+
+	memcpy(prv->mem + off, treq.buf, size);
+
+	if (prv->writeback)
+		for (c = off >> TDRAM_CHUNK_SHIFT;
+		     c <= (off + size - 1) >> TDRAM_CHUNK_SHIFT; c++)
+			prv->dirty[c] = 1;
+
+out:
+	td_complete_request(treq, 0);
+}
+
+/*
+ * Background work uses up to TDRAM_BACKGROUND_IO slots, leaving the
+ * rest to chunks requests are waiting for.
+ */
+static void
+tdram_background(struct tdram_state *prv)
+{
+	while (prv->prefill && prv->prefill_next < prv->chunks) {
+		if (prv->chunk[prv->prefill_next] == TDRAM_CHUNK_EMPTY &&
+		    tdram_start_io(prv, prv->prefill_next, 0, 1))
+			return;
+		prv->prefill_next++;
+	}
+
+	while (prv->writeback_active) {
+		if (prv->writeback_next == prv->chunks) {
+			prv->writeback_active = 0;
+			break;
+		}
+
+		if (prv->dirty[prv->writeback_next] &&
+		    tdram_start_io(prv, prv->writeback_next, 1, 1))
+			return;
+		prv->writeback_next++;
+	}
+}
+
+static void
+tdram_kick(struct tdram_state *prv)
+{
+	struct tdram_request *req, *tmp;
+	td_request_t treq;
+	int write;
+
+	list_for_each_entry_safe(req, tmp, &prv->waiting, next) {
+		if (!tdram_ready(prv, &req->treq))
+			continue;
+
+		treq  = req->treq;
+		write = req->write;
+		tdram_put_request(prv, req);
+		tdram_do_request(prv, treq, write);
+	}
+
+	tdram_background(prv);
+}
+
+static void
+tdram_writeback_event(event_id_t id, char mode, void *private)
+{
+	struct tdram_state *prv = private;
+
+	if (prv->writeback_active)
+		return;
+
+	prv->writeback_active = 1;
+	prv->writeback_next   = 0;
+	tdram_background(prv);
+}
+
+static void
+tdram_queue_request(td_driver_t *driver, td_request_t treq, int write)
+{
+	struct tdram_state *prv = tdram_state(driver);
+	struct tdram_request *req;
+
+	if (tdram_ready(prv, &treq)) {
+		tdram_do_request(prv, treq, write);
+		goto out;
+	}
+
+	req = tdram_get_request(prv);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		goto out;
+	}
+
+	req->treq  = treq;
+	req->write = write;
+	list_move_tail(&req->next, &prv->waiting);
+	prv->waits++;
+
+out:
+	tdram_background(prv);
+}
+
 /* Open the disk file and initialize ram state. */
 int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
 {
-	char *p;
-	uint64_t size;
-	int i, fd, ret = 0, count = 0, o_flags;
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
-
-	connections++;
-
-	if (connections > 1) {
-		driver->info.sector_size = disksector_size;
-		driver->info.size        = disksize;
-		driver->info.info        = diskinfo; 
-		DPRINTF("Image already open, returning parameters:\n");
-		DPRINTF("Image size: \n\tpre sector_shift  [%llu]\n\tpost "
-			"sector_shift [%llu]\n",
-			(long long unsigned)(driver->info.size << SECTOR_SHIFT),
-			(long long unsigned)driver->info.size);
-		DPRINTF("Image sector_size: \n\t[%lu]\n",
-			driver->info.sector_size);
+	struct tdram_state *prv;
+	int i, fd, ret, o_flags, scratch;
+	const char *env;
 
-		prv->fd = -1;
-		goto done;
+	prv = calloc(1, sizeof(*prv));
+	if (!prv)
+		return -ENOMEM;
+
+	prv->fd     = -1;
+	prv->driver = driver;
+	prv->rdonly = !!(flags & TD_OPEN_RDONLY);
+	INIT_LIST_HEAD(&prv->free_reqs);
+	INIT_LIST_HEAD(&prv->waiting);
+
+	for (i = 0; i < TDRAM_MAX_IO; i++) {
+		prv->ios[i].prv  = prv;
+		prv->ios[i].next = prv->free_io;
+		prv->free_io     = &prv->ios[i];
 	}
 
+	for (i = 0; i < TDRAM_MAX_REQS; i++)
+		list_add_tail(&prv->reqs[i].next, &prv->free_reqs);
+
 	/* Open the file */
 	o_flags = O_DIRECT | O_LARGEFILE | 
-		((flags == TD_OPEN_RDONLY) ? O_RDONLY : O_RDWR);
+		(prv->rdonly ? O_RDONLY : O_RDWR);
         fd = open(name, o_flags);
 
         if ((fd == -1) && (errno == EINVAL)) {
@@ -169,83 +622,127 @@ int tdram_open (td_driver_t *driver, const char *name, td_flag_t flags)
         if (fd == -1) {
 		DPRINTF("Unable to open [%s]!\n",name);
         	ret = 0 - errno;
-        	goto done;
+        	goto fail;
         }
 
         prv->fd = fd;
 
 	ret = get_image_info(fd, &driver->info);
-	size = MAX_RAMDISK_SIZE;
-
-	if (driver->info.size > size) {
-		DPRINTF("Disk exceeds limit, must be less than [%d]MB",
-			(MAX_RAMDISK_SIZE<<SECTOR_SHIFT)>>20);
-		return -ENOMEM;
+	if (ret)
+		goto fail;
+
+	prv->size = driver->info.size * driver->info.sector_size;
+
+	env = getenv("TAPDISK2_RAM_WRITEBACK");
+	if (env && !prv->rdonly && prv->size)
+		prv->writeback = atoi(env);
+
+	env = getenv("TAPDISK2_RAM_PREFILL");
+	if (env && atoi(env))
+		prv->prefill = 1;
+
+	/* an empty file makes a scratch disk of the default size */
+	scratch = !prv->size;
+	if (scratch) {
+		driver->info.size        = MAX_RAMDISK_SIZE;
+		driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+		prv->size    = driver->info.size * driver->info.sector_size;
+		prv->prefill = 0;
 	}
 
-	/*Read the image into memory*/
-	if (posix_memalign((void **)&img, 
-			   DEFAULT_SECTOR_SIZE,
-			   driver->info.size << SECTOR_SHIFT)) {
-		DPRINTF("Mem malloc failed\n");
-		return -errno;
+	prv->chunks = (prv->size + TDRAM_CHUNK_SIZE - 1) >> TDRAM_CHUNK_SHIFT;
+	prv->chunk  = calloc(prv->chunks, sizeof(*prv->chunk));
+	prv->dirty  = calloc(prv->chunks, sizeof(*prv->dirty));
+	if (!prv->chunk || !prv->dirty) {
+		ret = -ENOMEM;
+		goto fail;
 	}
-	p = img;
-	DPRINTF("Reading %llu bytes.......",
-		(long long unsigned)driver->info.size << SECTOR_SHIFT);
-
-	for (i = 0; i < driver->info.size; i++) {
-		ret = read(prv->fd, p, driver->info.sector_size);
-		if (ret != driver->info.sector_size) {
-			DPRINTF("ret = %d, errno = %d\n", ret, errno);
-			ret = 0 - errno;
-			break;
-		} else {
-			count += ret;
-			p = img + count;
-		}
+
+	ret = tdram_map_memory(prv);
+	if (ret) {
+		EPRINTF("mapping %"PRIu64" bytes: %d\n", prv->size, ret);
+		goto fail;
 	}
-	DPRINTF("[%d]\n",count);
-	if (count != driver->info.size << SECTOR_SHIFT) {
-		ret = -1;
-	} else {
-		ret = 0;
+
+	if (scratch)
+		memset(prv->chunk, TDRAM_CHUNK_READY, prv->chunks);
+
+	if (prv->writeback > 0) {
+		ret = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+						    -1, prv->writeback,
+						    tdram_writeback_event,
+						    prv);
+		if (ret < 0)
+			goto fail;
+
+		prv->writeback_event = ret;
 	}
 
-done:
+	DPRINTF("ram: %s, %"PRIu64" bytes in %s pages, prefill %d, "
+		"write-back %ds\n", name, prv->size,
+		(prv->hugetlb ? "huge" : "normal"), prv->prefill,
+		prv->writeback);
+
+	tdram_state(driver) = prv;
+	return 0;
+
+fail:
+	prv->writeback = 0;
+	tdram_free(prv);
 	return ret;
 }
 
 void tdram_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
-
-	memcpy(treq.buf, img + offset, size);
-
-	td_complete_request(treq, 0);
+	tdram_queue_request(driver, treq, 0);
 }
 
 void tdram_queue_write(td_driver_t *driver, td_request_t treq)
 {
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
-	int      size    = treq.secs * driver->info.sector_size;
-	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
-	
 	/* We assume that write access is controlled
 	 * at a higher level for multiple disks */
-	memcpy(img + offset, treq.buf, size);
-
-	td_complete_request(treq, 0);
+	tdram_queue_request(driver, treq, 1);
 }
 
+/*
+ * Chunk I/O still in flight completes after the driver is gone, so
+ * the last completion releases the state and does the final write-back.
+ * Its tiocbs are taken off the vbd's queue share, which goes with the vbd.
+ */
 int tdram_close(td_driver_t *driver)
 {
-	struct tdram_state *prv = (struct tdram_state *)driver->data;
-	
-	connections--;
-	
+	struct tdram_state *prv = tdram_state(driver);
+	struct tdram_request *req, *tmp;
+	td_request_t treq;
+	int i;
+
+	if (prv->writeback_event > 0) {
+		tapdisk_server_unregister_event(prv->writeback_event);
+		prv->writeback_event = 0;
+	}
+
+	list_for_each_entry_safe(req, tmp, &prv->waiting, next) {
+		treq = req->treq;
+		tdram_put_request(prv, req);
+		td_complete_request(treq, -EIO);
+	}
+
+	prv->closing          = 1;
+	prv->prefill          = 0;
+	prv->writeback_active = 0;
+
+	if (!prv->inflight)
+		tdram_free(prv);
+	else {
+		DPRINTF("ram: %d chunk ios in flight at close\n",
+			prv->inflight);
+
+		for (i = 0; i < TDRAM_MAX_IO; i++)
+			if (prv->ios[i].busy)
+				td_unshare_tiocb(&prv->ios[i].tiocb);
+	}
+
+	tdram_state(driver) = NULL;
 	return 0;
 }
 
@@ -260,10 +757,34 @@ int tdram_validate_parent(td_driver_t *driver,
 	return -EINVAL;
 }
 
+static void
+tdram_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct tdram_state *prv = tdram_state(driver);
+	uint64_t c, ready = 0, dirty = 0;
+
+	for (c = 0; c < prv->chunks; c++) {
+		ready += prv->chunk[c] == TDRAM_CHUNK_READY;
+		dirty += prv->dirty[c];
+	}
+
+	tapdisk_stats_field(st, "chunks", "{");
+	tapdisk_stats_field(st, "total", "llu", prv->chunks);
+	tapdisk_stats_field(st, "ready", "llu", ready);
+	tapdisk_stats_field(st, "dirty", "llu", dirty);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "loads", "llu", prv->loads);
+	tapdisk_stats_field(st, "writebacks", "llu", prv->writebacks);
+	tapdisk_stats_field(st, "waits", "llu", prv->waits);
+	tapdisk_stats_field(st, "errors", "llu", prv->errors);
+	tapdisk_stats_field(st, "hugetlb", "d", prv->hugetlb);
+}
+
 struct tap_disk tapdisk_ram = {
 	.disk_type          = "tapdisk_ram",
 	.flags              = 0,
-	.private_data_size  = sizeof(struct tdram_state),
+	.private_data_size  = sizeof(struct tdram_state *),
 	.td_open            = tdram_open,
 	.td_close           = tdram_close,
 	.td_queue_read      = tdram_queue_read,
@@ -271,4 +792,5 @@ struct tap_disk tapdisk_ram = {
 	.td_get_parent_id   = tdram_get_parent_id,
 	.td_validate_parent = tdram_validate_parent,
 	.td_debug           = NULL,
+	.td_stats           = tdram_stats,
 };
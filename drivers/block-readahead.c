@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sequential read-ahead, stacked on top of the leaf image.
+ *
+ * A handful of read streams are tracked per VBD. Once a stream has
+ * been sequential for READAHEAD_TRIGGER reads, the next read which
+ * misses is extended to a full window, read into a buffer from a
+ * bounded pool. Subsequent reads inside the window are served from
+ * the buffer, or wait for it while the read is still in flight.
+ * Writes drop any buffer they overlap, and no window is opened over
+ * a write still in flight. Writes which find the request pool empty
+ * are queued until a request is released.
+ *
+ * The extended read is issued on behalf of the guest request which
+ * triggered it, so no I/O is ever in flight without a guest request
+ * pending, and pause/close need no extra care.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-utils.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+
+#ifdef DEBUG
+#define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
+#else
+#define DBG(_f, _a...) ((void)0)
+#endif
+
+#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
+#define BUG()           td_panic()
+#define BUG_ON(_cond)   if (_cond) { td_panic(); }
+
+#define MIN(a, b)       ((a) <= (b) ? (a) : (b))
+#define MAX(a, b)       ((a) >= (b) ? (a) : (b))
+
+#define READAHEAD_STREAMS               8
+#define READAHEAD_TRIGGER               2
+#define READAHEAD_BUFFERS               16
+#define READAHEAD_WINDOW_SECS           256
+#define READAHEAD_REQUESTS              TAPDISK_DATA_REQUESTS
+
+typedef struct readahead                readahead_t;
+typedef struct readahead_buffer         readahead_buffer_t;
+typedef struct readahead_request        readahead_request_t;
+typedef struct readahead_deferred       readahead_deferred_t;
+
+struct readahead_stream {
+	td_sector_t                     next;
+	int                             seq;
+	unsigned long                   lru;
+};
+
+struct readahead_request {
+	td_request_t                    treq;
+	readahead_buffer_t             *rbuf;
+	readahead_request_t            *next;
+};
+
+struct readahead_deferred {
+	td_request_t                    treq;
+	readahead_deferred_t           *next;
+};
+
+struct readahead_buffer {
+	enum { RA_FREE = 0, RA_PENDING, RA_VALID } state;
+
+	char                           *buf;
+	td_sector_t                     sec;
+	int                             secs;
+
+	/* sectors of the window read still outstanding */
+	int                             secs_pending;
+	int                             err;
+	td_sector_t                     err_sec;
+	td_sector_t                     err_end;
+	int                             stale;
+
+	/* the request carrying the read, then those waiting on it */
+	readahead_request_t            *owner;
+	readahead_request_t            *waiters;
+
+	unsigned long                   lru;
+};
+
+struct readahead {
+	char                           *name;
+	td_sector_t                     size;
+
+	struct readahead_stream         streams[READAHEAD_STREAMS];
+	readahead_buffer_t              buffers[READAHEAD_BUFFERS];
+	unsigned long                   tick;
+
+	readahead_request_t             requests[READAHEAD_REQUESTS];
+	readahead_request_t            *request_free_list[READAHEAD_REQUESTS];
+	int                             requests_free;
+
+	/* guest writes forwarded and not yet completed */
+	readahead_request_t            *writes;
+
+	/* guest writes waiting for a request */
+	readahead_deferred_t           *deferred;
+	readahead_deferred_t           *deferred_tail;
+
+	char                           *buf;
+	size_t                          bufsz;
+
+	struct {
+		uint64_t                windows;
+		uint64_t                hits;
+		uint64_t                waits;
+		uint64_t                misses;
+		uint64_t                dropped;
+	} st;
+};
+
+static void readahead_run_deferred(readahead_t *);
+
+static inline readahead_request_t *
+readahead_get_request(readahead_t *ra)
+{
+	if (!ra->requests_free)
+		return NULL;
+
+	return ra->request_free_list[--ra->requests_free];
+}
+
+static inline void
+readahead_put_request(readahead_t *ra, readahead_request_t *rreq)
+{
+	rreq->rbuf = NULL;
+	rreq->next = NULL;
+	ra->request_free_list[ra->requests_free++] = rreq;
+}
+
+static inline int
+readahead_buffer_covers(readahead_buffer_t *rbuf, td_request_t *treq)
+{
+	return (treq->sec >= rbuf->sec &&
+		treq->sec + treq->secs <= rbuf->sec + rbuf->secs);
+}
+
+static inline int
+readahead_range_overlaps(td_sector_t sec, td_sector_t end,
+			 td_request_t *treq)
+{
+	return (treq->sec < end && sec < treq->sec + treq->secs);
+}
+
+static inline int
+readahead_buffer_overlaps(readahead_buffer_t *rbuf, td_request_t *treq)
+{
+	return readahead_range_overlaps(rbuf->sec, rbuf->sec + rbuf->secs, treq);
+}
+
+/*
+ * Only the part of the window which failed is bad, requests outside
+ * it are served from the buffer.
+ */
+static inline int
+readahead_buffer_failed(readahead_buffer_t *rbuf, td_request_t *treq)
+{
+	return (rbuf->err &&
+		readahead_range_overlaps(rbuf->err_sec, rbuf->err_end, treq));
+}
+
+static int
+readahead_write_pending(readahead_t *ra, td_sector_t sec, int secs)
+{
+	readahead_request_t *rreq;
+
+	for (rreq = ra->writes; rreq; rreq = rreq->next)
+		if (readahead_range_overlaps(sec, sec + secs, &rreq->treq))
+			return 1;
+
+	return 0;
+}
+
+static inline void
+readahead_copy(readahead_buffer_t *rbuf, td_request_t *treq)
+{
+	size_t off = (treq->sec - rbuf->sec) << SECTOR_SHIFT;
+
+	memcpy(treq->buf, rbuf->buf + off, treq->secs << SECTOR_SHIFT);
+}
+
+static readahead_buffer_t *
+readahead_find_buffer(readahead_t *ra, td_request_t *treq)
+{
+	readahead_buffer_t *rbuf;
+	int i;
+
+	for (i = 0; i < READAHEAD_BUFFERS; i++) {
+		rbuf = &ra->buffers[i];
+		if (rbuf->state != RA_FREE && !rbuf->stale &&
+		    readahead_buffer_covers(rbuf, treq))
+			return rbuf;
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a free buffer, or recycle the least recently used valid one.
+ * Buffers with a read in flight are never recycled.
+ */
+static readahead_buffer_t *
+readahead_alloc_buffer(readahead_t *ra)
+{
+	readahead_buffer_t *rbuf, *lru;
+	int i;
+
+	lru = NULL;
+
+	for (i = 0; i < READAHEAD_BUFFERS; i++) {
+		rbuf = &ra->buffers[i];
+
+		if (rbuf->state == RA_FREE)
+			return rbuf;
+
+		if (rbuf->state == RA_VALID && (!lru || rbuf->lru < lru->lru))
+			lru = rbuf;
+	}
+
+	if (lru) {
+		lru->state = RA_FREE;
+		ra->st.dropped++;
+	}
+
+	return lru;
+}
+
+/*
+ * Returns the stream @treq continues, or starts a new one in place
+ * of the least recently used.
+ */
+static struct readahead_stream *
+readahead_track_stream(readahead_t *ra, td_request_t *treq)
+{
+	struct readahead_stream *s, *lru;
+	int i;
+
+	lru = NULL;
+
+	for (i = 0; i < READAHEAD_STREAMS; i++) {
+		s = &ra->streams[i];
+
+		if (s->seq && s->next == treq->sec) {
+			s->seq++;
+			goto out;
+		}
+
+		if (!lru || s->lru < lru->lru)
+			lru = s;
+	}
+
+	s      = lru;
+	s->seq = 1;
+
+out:
+	s->next = treq->sec + treq->secs;
+	s->lru  = ++ra->tick;
+	return s;
+}
+
+static void
+readahead_complete_window(readahead_t *ra, readahead_buffer_t *rbuf)
+{
+	readahead_request_t *rreq, *next;
+
+	rreq = rbuf->owner;
+	if (readahead_buffer_failed(rbuf, &rreq->treq))
+		td_complete_request(rreq->treq, rbuf->err);
+	else {
+		readahead_copy(rbuf, &rreq->treq);
+		td_complete_request(rreq->treq, 0);
+	}
+	readahead_put_request(ra, rreq);
+
+	for (rreq = rbuf->waiters; rreq; rreq = next) {
+		next = rreq->next;
+
+		if (readahead_buffer_failed(rbuf, &rreq->treq))
+			/* let the image below report its own error */
+			td_forward_request(rreq->treq);
+		else {
+			readahead_copy(rbuf, &rreq->treq);
+			td_complete_request(rreq->treq, 0);
+		}
+
+		readahead_put_request(ra, rreq);
+	}
+
+	rbuf->owner   = NULL;
+	rbuf->waiters = NULL;
+	rbuf->state   = (rbuf->err || rbuf->stale) ? RA_FREE : RA_VALID;
+}
+
+static void
+readahead_complete_req(td_request_t treq, int err)
+{
+	readahead_request_t *rreq = treq.cb_data;
+	readahead_buffer_t *rbuf = rreq->rbuf;
+	readahead_t *ra = rreq->treq.image->driver->data;
+
+	BUG_ON(rbuf->secs_pending < treq.secs);
+
+	rbuf->secs_pending -= treq.secs;
+
+	if (err) {
+		if (!rbuf->err) {
+			rbuf->err     = err;
+			rbuf->err_sec = treq.sec;
+			rbuf->err_end = treq.sec + treq.secs;
+		} else {
+			rbuf->err_sec = MIN(rbuf->err_sec, treq.sec);
+			rbuf->err_end = MAX(rbuf->err_end, treq.sec + treq.secs);
+		}
+	}
+
+	if (rbuf->secs_pending)
+		return;
+
+	readahead_complete_window(ra, rbuf);
+	readahead_run_deferred(ra);
+}
+
+static void
+readahead_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	readahead_t *ra = driver->data;
+	struct readahead_stream *stream;
+	readahead_request_t *rreq;
+	readahead_buffer_t *rbuf;
+	td_request_t clone;
+	int secs;
+
+	rbuf = readahead_find_buffer(ra, &treq);
+	if (rbuf) {
+		readahead_track_stream(ra, &treq);
+		rbuf->lru = ++ra->tick;
+
+		if (rbuf->state == RA_VALID) {
+			ra->st.hits++;
+			readahead_copy(rbuf, &treq);
+			td_complete_request(treq, 0);
+
+			/* consumed to the end, nobody will be back */
+			if (treq.sec + treq.secs == rbuf->sec + rbuf->secs)
+				rbuf->state = RA_FREE;
+			return;
+		}
+
+		rreq = readahead_get_request(ra);
+		if (!rreq)
+			goto forward;
+
+		ra->st.waits++;
+		rreq->treq    = treq;
+		rreq->rbuf    = rbuf;
+		rreq->next    = rbuf->waiters;
+		rbuf->waiters = rreq;
+		return;
+	}
+
+	ra->st.misses++;
+
+	stream = readahead_track_stream(ra, &treq);
+	if (stream->seq <= READAHEAD_TRIGGER)
+		goto forward;
+
+	secs = READAHEAD_WINDOW_SECS;
+	if (treq.sec + secs > ra->size)
+		secs = ra->size - treq.sec;
+	if (secs <= treq.secs)
+		goto forward;
+
+	/* the window could read the old data back */
+	if (readahead_write_pending(ra, treq.sec, secs))
+		goto forward;
+
+	rreq = readahead_get_request(ra);
+	if (!rreq)
+		goto forward;
+
+	rbuf = readahead_alloc_buffer(ra);
+	if (!rbuf) {
+		readahead_put_request(ra, rreq);
+		goto forward;
+	}
+
+	DBG("%s: window 0x%"PRIx64" + 0x%x\n", ra->name, treq.sec, secs);
+
+	ra->st.windows++;
+	rbuf->state        = RA_PENDING;
+	rbuf->sec          = treq.sec;
+	rbuf->secs         = secs;
+	rbuf->secs_pending = secs;
+	rbuf->err          = 0;
+	rbuf->err_sec      = 0;
+	rbuf->err_end      = 0;
+	rbuf->stale        = 0;
+	rbuf->owner        = rreq;
+	rbuf->waiters      = NULL;
+	rbuf->lru          = ++ra->tick;
+
+	rreq->treq    = treq;
+	rreq->rbuf    = rbuf;
+
+	clone         = treq;
+	clone.secs    = secs;
+	clone.buf     = rbuf->buf;
+	clone.cb      = readahead_complete_req;
+	clone.cb_data = rreq;
+
+	td_forward_request(clone);
+	return;
+
+forward:
+	td_forward_request(treq);
+}
+
+static void
+readahead_complete_write(td_request_t treq, int err)
+{
+	readahead_request_t *rreq = treq.cb_data;
+	readahead_t *ra = rreq->treq.image->driver->data;
+	readahead_request_t **pprev;
+
+	pprev = &ra->writes;
+	while (*pprev != rreq) {
+		BUG_ON(!*pprev);
+		pprev = &(*pprev)->next;
+	}
+	*pprev = rreq->next;
+
+	td_complete_request(rreq->treq, err);
+	readahead_put_request(ra, rreq);
+
+	readahead_run_deferred(ra);
+}
+
+static void
+readahead_drop_buffers(readahead_t *ra, td_request_t *treq)
+{
+	readahead_buffer_t *rbuf;
+	int i;
+
+	for (i = 0; i < READAHEAD_BUFFERS; i++) {
+		rbuf = &ra->buffers[i];
+
+		if (rbuf->state == RA_FREE ||
+		    !readahead_buffer_overlaps(rbuf, treq))
+			continue;
+
+		if (rbuf->state == RA_VALID)
+			rbuf->state = RA_FREE;
+		else
+			rbuf->stale = 1;
+	}
+}
+
+static void
+readahead_forward_write(readahead_t *ra, readahead_request_t *rreq,
+			td_request_t treq)
+{
+	td_request_t clone;
+
+	rreq->treq = treq;
+	rreq->next = ra->writes;
+	ra->writes = rreq;
+
+	clone         = treq;
+	clone.cb      = readahead_complete_write;
+	clone.cb_data = rreq;
+
+	td_forward_request(clone);
+}
+
+/*
+ * Windows opened while a write was queued are dropped again when it
+ * is finally forwarded.
+ */
+static void
+readahead_run_deferred(readahead_t *ra)
+{
+	readahead_deferred_t *dreq;
+	readahead_request_t *rreq;
+	td_request_t treq;
+
+	while ((dreq = ra->deferred)) {
+		rreq = readahead_get_request(ra);
+		if (!rreq)
+			break;
+
+		ra->deferred = dreq->next;
+		if (!ra->deferred)
+			ra->deferred_tail = NULL;
+
+		treq = dreq->treq;
+		free(dreq);
+
+		readahead_drop_buffers(ra, &treq);
+		readahead_forward_write(ra, rreq, treq);
+	}
+}
+
+static void
+readahead_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	readahead_t *ra = driver->data;
+	readahead_deferred_t *dreq;
+	readahead_request_t *rreq;
+
+	readahead_drop_buffers(ra, &treq);
+
+	rreq = NULL;
+	if (!ra->deferred)
+		rreq = readahead_get_request(ra);
+
+	if (!rreq) {
+		dreq = malloc(sizeof(*dreq));
+		if (!dreq) {
+			td_complete_request(treq, -EBUSY);
+			return;
+		}
+
+		dreq->treq = treq;
+		dreq->next = NULL;
+		if (ra->deferred_tail)
+			ra->deferred_tail->next = dreq;
+		else
+			ra->deferred = dreq;
+		ra->deferred_tail = dreq;
+		return;
+	}
+
+	readahead_forward_write(ra, rreq, treq);
+}
+
+static int
+readahead_close(td_driver_t *driver)
+{
+	readahead_t *ra = driver->data;
+
+	DPRINTF("Closing read-ahead for %s\n", ra->name);
+
+	if (ra->buf)
+		munmap(ra->buf, ra->bufsz);
+
+	free(ra->name);
+	return 0;
+}
+
+static int
+readahead_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	readahead_t *ra = driver->data;
+	int i, err;
+	size_t rbufsz;
+
+	err = tapdisk_namedup(&ra->name, (char *)name);
+	if (err)
+		goto fail;
+
+	ra->size = driver->info.size;
+
+	rbufsz    = READAHEAD_WINDOW_SECS << SECTOR_SHIFT;
+	ra->bufsz = READAHEAD_BUFFERS * rbufsz;
+
+	ra->buf = mmap(NULL, ra->bufsz, PROT_READ|PROT_WRITE,
+		       MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (ra->buf == MAP_FAILED) {
+		ra->buf = NULL;
+		err = -errno;
+		goto fail;
+	}
+
+	for (i = 0; i < READAHEAD_BUFFERS; i++)
+		ra->buffers[i].buf = ra->buf + i * rbufsz;
+
+	ra->requests_free = READAHEAD_REQUESTS;
+	for (i = 0; i < READAHEAD_REQUESTS; i++)
+		ra->request_free_list[i] = &ra->requests[i];
+
+	DPRINTF("Opening read-ahead for %s\n", ra->name);
+	return 0;
+
+fail:
+	readahead_close(driver);
+	return err;
+}
+
+static int
+readahead_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	return -EINVAL;
+}
+
+static int
+readahead_validate_parent(td_driver_t *driver,
+			  td_driver_t *pdriver, td_flag_t flags)
+{
+	if (strcmp(driver->name, pdriver->name))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void
+readahead_debug(td_driver_t *driver)
+{
+	readahead_t *ra = driver->data;
+	readahead_buffer_t *rbuf;
+	int i;
+
+	WARN("READ-AHEAD %s: windows: %"PRIu64" hits: %"PRIu64" "
+	     "waits: %"PRIu64" misses: %"PRIu64" dropped: %"PRIu64"\n",
+	     ra->name, ra->st.windows, ra->st.hits, ra->st.waits,
+	     ra->st.misses, ra->st.dropped);
+
+	for (i = 0; i < READAHEAD_BUFFERS; i++) {
+		rbuf = &ra->buffers[i];
+		if (rbuf->state == RA_FREE)
+			continue;
+
+		WARN("buffer %d: %s 0x%"PRIx64" + 0x%x%s\n", i,
+		     rbuf->state == RA_PENDING ? "pending" : "valid",
+		     rbuf->sec, rbuf->secs, rbuf->stale ? " stale" : "");
+	}
+}
+
+static void
+readahead_stats(td_driver_t *driver, td_stats_t *st)
+{
+	readahead_t *ra = driver->data;
+
+	tapdisk_stats_field(st, "windows", "llu", ra->st.windows);
+	tapdisk_stats_field(st, "hits", "llu", ra->st.hits);
+	tapdisk_stats_field(st, "waits", "llu", ra->st.waits);
+	tapdisk_stats_field(st, "misses", "llu", ra->st.misses);
+	tapdisk_stats_field(st, "dropped", "llu", ra->st.dropped);
+}
+
+struct tap_disk tapdisk_readahead = {
+	.disk_type                  = "tapdisk_readahead",
+	.flags                      = 0,
+	.private_data_size          = sizeof(readahead_t),
+	.td_open                    = readahead_open,
+	.td_close                   = readahead_close,
+	.td_queue_read              = readahead_queue_read,
+	.td_queue_write             = readahead_queue_write,
+	.td_get_parent_id           = readahead_get_parent_id,
+	.td_validate_parent         = readahead_validate_parent,
+	.td_debug                   = readahead_debug,
+	.td_stats                   = readahead_stats,
+};
@@ -56,13 +56,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <uuid/uuid.h> /* For whatever reason, Linux packages this in */
                        /* e2fsprogs-devel.                            */
 #include <string.h>    /* for memset.                                 */
+#include <endian.h>
 #include <libaio.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/vfs.h>
 
 #include "libvhd.h"
 #include "tapdisk.h"
@@ -195,9 +199,16 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+struct vhd_mapping {
+	void                     *addr;
+	size_t                    size;
+};
+
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
+	struct vhd_mapping        bat_map;     /* read-only images: bat and */
+	struct vhd_mapping        batmap_map;  /* batmap mapped from file */
 	vhd_flag_t                status;
 	uint32_t                  pbw_blk;     /* blk num of pending write */
 	uint64_t                  pbw_offset;  /* file offset of same */
@@ -240,9 +251,13 @@ struct vhd_state {
 						* (unallocated) datablock */
 
 	struct vhd_bat_state      bat;
+	u32                       open_allocated; /* blocks at open */
+	u32                       open_full;
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
+	int                       bm_bytes;    /* byte-wise runs, see
+						* vhd_bitmap_set_range */
 	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
 
 	int                       bm_free_count;
@@ -274,7 +289,12 @@ struct vhd_state {
 #define set_vhd_flag(word, flag)   ((word) |= (flag))
 #define clear_vhd_flag(word, flag) ((word) &= ~(flag))
 
-#define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
+#define __bat_entry(s, blk)        ((s)->bat.bat.bat[(blk)])
+
+/* mapped BATs stay big-endian, as on disk */
+#define bat_entry(s, blk)						\
+	((s)->bat.bat_map.addr ?					\
+	 be32toh(__bat_entry(s, blk)) : __bat_entry(s, blk))
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
@@ -283,6 +303,13 @@ static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
+/*
+ * Parents may be opened on the threads of tapdisk_vbd_open_parents.
+ * The libvhd log level, the zero buffer, SPB and the crypto setup are
+ * global: only the version check and BAT reads run unlocked.
+ */
+static pthread_mutex_t    _vhd_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 vhd_initialize(struct vhd_state *s)
 {
@@ -439,7 +466,6 @@ find_next_free_block(struct vhd_state *s)
 {
 	int err;
 	off64_t eom;
-	uint32_t i, entry;
 
 	err = vhd_end_of_headers(&s->vhd, &eom);
 	if (err)
@@ -450,22 +476,216 @@ find_next_free_block(struct vhd_state *s)
 	if ((s->first_db + s->bm_secs) % s->spp)
 		s->first_db += (s->spp - ((s->first_db + s->bm_secs) % s->spp));
 
+	return 0;
+}
+
+/*
+ * One pass over the BAT at open: block counts for the open log and,
+ * for writable images, next_db past the last allocated block.
+ */
+static void
+vhd_scan_bat(struct vhd_state *s)
+{
+	uint32_t i, entry, allocated, full;
+	int rdwr;
+
+	rdwr      = !test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY);
+	allocated = 0;
+	full      = 0;
+
+	/* counting would fault in all of a mapped bat */
+	if (!rdwr && (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET) ||
+		      s->bat.bat_map.addr))
+		return;
+
 	for (i = 0; i < s->bat.bat.entries; i++) {
 		entry = bat_entry(s, i);
-		if (entry != DD_BLK_UNUSED && entry >= s->next_db)
+		if (entry == DD_BLK_UNUSED)
+			continue;
+
+		allocated++;
+		if (test_batmap(s, i))
+			full++;
+
+		if (rdwr && entry >= s->next_db)
 			s->next_db = entry + s->spb + s->bm_secs;
 	}
 
-	return 0;
+	s->open_allocated = allocated;
+	s->open_full      = full;
+}
+
+static void
+vhd_unmap(struct vhd_mapping *m)
+{
+	if (m->addr)
+		munmap(m->addr, m->size);
+	m->addr = NULL;
+	m->size = 0;
 }
 
 static void
 vhd_free_bat(struct vhd_state *s)
 {
-	free(s->bat.bat.bat);
-	free(s->bat.batmap.map);
+	if (s->bat.bat_map.addr)
+		vhd_unmap(&s->bat.bat_map);
+	else
+		free(s->bat.bat.bat);
+
+	if (s->bat.batmap_map.addr)
+		vhd_unmap(&s->bat.batmap_map);
+	else
+		free(s->bat.batmap.map);
+
 	free(s->bat.bat_buf);
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
+}
+
+static int
+vhd_map(struct vhd_state *s, off64_t off, size_t size,
+	struct vhd_mapping *m, void **ptr)
+{
+	off64_t base, end;
+
+	/* pages past the end of the file would fault on access */
+	end = lseek64(s->vhd.fd, 0, SEEK_END);
+	if (end == (off64_t)-1)
+		return -errno;
+	if (off + size > end)
+		return -EINVAL;
+
+	base    = off & ~((off64_t)getpagesize() - 1);
+	m->size = size + (off - base);
+	m->addr = mmap(NULL, m->size, PROT_READ, MAP_SHARED, s->vhd.fd, base);
+	if (m->addr == MAP_FAILED) {
+		m->addr = NULL;
+		m->size = 0;
+		return -errno;
+	}
+
+	*ptr = (char *)m->addr + (off - base);
+	return 0;
+}
+
+static int
+vhd_map_batmap(struct vhd_state *s)
+{
+	vhd_batmap_t *batmap = &s->bat.batmap;
+	size_t map_size;
+	void *map;
+	int err, i;
+
+	err = vhd_read_batmap_header(&s->vhd, batmap);
+	if (err)
+		return err;
+
+	err = vhd_validate_batmap_header(batmap);
+	if (err)
+		return err;
+
+	map_size = vhd_sectors_to_bytes(secs_round_up_no_zero(
+			s->vhd.footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+
+	err = vhd_map(s, batmap->header.batmap_offset, map_size,
+		      &s->bat.batmap_map, &map);
+	if (err)
+		return err;
+
+	batmap->map = map;
+
+	/* see vhd_initialize_bat() on retries */
+	for (i = 0; i < VHD_BATMAP_MAX_RETRIES; i++) {
+		err = vhd_validate_batmap(&s->vhd, batmap);
+		if (!err)
+			return 0;
+	}
+
+	vhd_unmap(&s->bat.batmap_map);
+	batmap->map = NULL;
+	return err;
+}
+
+#define VHD_EXT_SUPER_MAGIC       0xEF53
+#define VHD_XFS_SUPER_MAGIC       0x58465342
+#define VHD_BTRFS_SUPER_MAGIC     0x9123683E
+#define VHD_TMPFS_SUPER_MAGIC     0x01021994
+
+/*
+ * A read error on a mapped page raises SIGBUS, which takes the whole
+ * tapdisk down. Only map regular files on local filesystems, where
+ * the pages can't go away under us: not NFS, nor LVs which may be
+ * deactivated.
+ */
+static int
+vhd_mappable(struct vhd_state *s)
+{
+	struct statfs fst;
+	struct stat st;
+
+	if (s->driver->storage != TAPDISK_STORAGE_TYPE_EXT)
+		return 0;
+
+	if (fstat(s->vhd.fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	if (fstatfs(s->vhd.fd, &fst))
+		return 0;
+
+	switch ((uint32_t)fst.f_type) {
+	case VHD_EXT_SUPER_MAGIC:
+	case VHD_XFS_SUPER_MAGIC:
+	case VHD_BTRFS_SUPER_MAGIC:
+	case VHD_TMPFS_SUPER_MAGIC:
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read-only images on local storage map their bat and batmap from the
+ * file instead of copying them to the heap: tapdisks sharing a parent
+ * share the page cache, and only the parts of the bat used are read in.
+ * Everything else keeps the heap copy.
+ */
+static int
+vhd_map_bat(struct vhd_state *s)
+{
+	vhd_bat_t *bat = &s->bat.bat;
+	size_t size;
+	void *map;
+	int err;
+
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) || s->vhd.devops)
+		return -EOPNOTSUPP;
+
+	if (!vhd_mappable(s))
+		return -EOPNOTSUPP;
+
+	bat->entries = s->vhd.footer.curr_size >> VHD_BLOCK_SHIFT;
+	bat->spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
+	size         = bat->entries * sizeof(uint32_t);
+
+	err = vhd_map(s, s->vhd.header.table_offset, size,
+		      &s->bat.bat_map, &map);
+	if (err) {
+		memset(bat, 0, sizeof(*bat));
+		return err;
+	}
+
+	bat->bat = map;
+
+	if (vhd_has_batmap(&s->vhd)) {
+		err = vhd_map_batmap(s);
+		if (err) {
+			EPRINTF("%s: mapping batmap: %d\n", s->vhd.file, err);
+			EPRINTF("%s: ignoring non-critical batmap error\n",
+				s->vhd.file);
+			memset(&s->bat.batmap, 0, sizeof(s->bat.batmap));
+		}
+	}
+
+	return 0;
 }
 
 static int
@@ -473,10 +693,13 @@ vhd_initialize_bat(struct vhd_state *s)
 {
 	int err, psize, i;
 
-	memset(&s->bat, 0, sizeof(struct vhd_bat));
+	memset(&s->bat, 0, sizeof(s->bat));
 
 	psize = getpagesize();
 
+	if (!vhd_map_bat(s))
+		goto out;
+
 	err = vhd_read_bat(&s->vhd, &s->bat.bat);
 	if (err) {
 		EPRINTF("%s: reading bat: %d\n", s->vhd.file, err);
@@ -527,6 +750,9 @@ vhd_initialize_bat(struct vhd_state *s)
 				s->vhd.file);
 	}
 
+out:
+	vhd_scan_bat(s);
+
 	err = posix_memalign((void **)&s->bat.bat_buf,
 			     VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
 	if (err) {
@@ -618,6 +844,8 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 	s->spp     = getpagesize() >> VHD_SECTOR_SHIFT;
 	s->spb     = s->vhd.header.block_size >> VHD_SECTOR_SHIFT;
 	s->bm_secs = secs_round_up_no_zero(s->spb >> 3);
+	s->bm_bytes = !(vhd_creator_tapdisk(&s->vhd) &&
+			s->vhd.footer.crtr_ver == 0x00000001);
 
 	s->padbm_size = (s->bm_secs / getpagesize()) * getpagesize();
 	if (s->bm_secs % getpagesize())
@@ -668,34 +896,48 @@ vhd_check_version(struct vhd_state *s)
 }
 
 static void
-vhd_log_open(struct vhd_state *s)
+vhd_log_open(struct vhd_state *s, struct timeval *start)
 {
 	char buf[5];
-	uint32_t i, allocated, full;
+	struct timeval now, delta;
 
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
 		return;
 
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &delta);
+
 	snprintf(buf, sizeof(buf), "%s", s->vhd.footer.crtr_app);
 	if (!vhd_type_dynamic(&s->vhd)) {
-		DPRINTF("%s version: %s 0x%08x\n",
-			s->vhd.file, buf, s->vhd.footer.crtr_ver);
+		DPRINTF("%s version: %s 0x%08x, t: %lu.%06lus\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver,
+			(unsigned long)delta.tv_sec,
+			(unsigned long)delta.tv_usec);
 		return;
 	}
 
-	allocated = 0;
-	full      = 0;
-
-	for (i = 0; i < s->bat.bat.entries; i++) {
-		if (bat_entry(s, i) != DD_BLK_UNUSED)
-			allocated++;
-		if (test_batmap(s, i))
-			full++;
+	/* a mapped BAT isn't walked at open: no block counts */
+	if (s->bat.bat_map.addr) {
+		DPRINTF("%s version: %s 0x%08x, b: %u, "
+			"bat: %llu mapped, batmap: %d, t: %lu.%06lus\n",
+			s->vhd.file, buf, s->vhd.footer.crtr_ver,
+			s->bat.bat.entries,
+			(unsigned long long)
+			vhd_bytes_padded(s->bat.bat.entries * sizeof(uint32_t)),
+			!!s->bat.batmap.map,
+			(unsigned long)delta.tv_sec,
+			(unsigned long)delta.tv_usec);
+		return;
 	}
 
-	DPRINTF("%s version: %s 0x%08x, b: %u, a: %u, f: %u, n: %llu\n",
+	DPRINTF("%s version: %s 0x%08x, b: %u, a: %u, f: %u, n: %llu, "
+		"bat: %llu, batmap: %d, t: %lu.%06lus\n",
 		s->vhd.file, buf, s->vhd.footer.crtr_ver, s->bat.bat.entries,
-		allocated, full, s->next_db);
+		s->open_allocated, s->open_full, s->next_db,
+		(unsigned long long)
+		vhd_bytes_padded(s->bat.bat.entries * sizeof(uint32_t)),
+		!!s->bat.batmap.map,
+		(unsigned long)delta.tv_sec, (unsigned long)delta.tv_usec);
 }
 
 static int
@@ -703,8 +945,12 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 {
         int i, o_flags, err;
 	struct vhd_state *s;
+	struct timeval start;
 
         DBG(TLOG_INFO, "vhd_open: %s\n", name);
+	gettimeofday(&start, NULL);
+	pthread_mutex_lock(&_vhd_open_lock);
+
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT))
 		libvhd_set_log_level(1);
 
@@ -716,7 +962,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	err = vhd_initialize(s);
 	if (err)
-		return err;
+		goto out;
 
 	o_flags = ((test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY)) ? 
 		   VHD_OPEN_RDONLY : VHD_OPEN_RDWR);
@@ -734,10 +980,12 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_open(&s->vhd, name, o_flags);
 		if (err) {
 			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
-			return err;
+			goto out;
 		}
 	}
 
+	pthread_mutex_unlock(&_vhd_open_lock);
+
 	err = vhd_check_version(s);
 	if (err)
 		goto fail;
@@ -750,7 +998,9 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 			goto fail;
 	}
 
-	vhd_log_open(s);
+	pthread_mutex_lock(&_vhd_open_lock);
+
+	vhd_log_open(s, &start);
 
 	SPB = s->spb;
 
@@ -768,7 +1018,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 	err = vhd_open_crypto(&s->vhd, name);
 	if (err) {
 		DPRINTF("failed to init crypto: %d\n", err);
-		goto fail;
+		goto fail_locked;
 	}
 
 	if (test_vhd_flag(flags, VHD_FLAG_OPEN_STRICT) && 
@@ -776,18 +1026,23 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_kill_footer(s);
 		if (err) {
 			DPRINTF("ERROR killing footer: %d\n", err);
-			goto fail;
+			goto fail_locked;
 		}
 		s->writes++;
 	}
 
+	pthread_mutex_unlock(&_vhd_open_lock);
         return 0;
 
  fail:
+	pthread_mutex_lock(&_vhd_open_lock);
+ fail_locked:
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
 	vhd_free(s);
+ out:
+	pthread_mutex_unlock(&_vhd_open_lock);
 	return err;
 }
 
@@ -823,7 +1078,8 @@ vhd_log_close(struct vhd_state *s)
 {
 	uint32_t i, allocated, full;
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET))
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_QUIET) ||
+	    s->bat.bat_map.addr)
 		return;
 
 	allocated = 0;
@@ -1309,6 +1565,7 @@ read_bitmap_cache_span(struct vhd_state *s,
 {
 	int ret;
 	u32 blk, sec;
+	uint8_t match;
 	struct vhd_bitmap *bm;
 
 	/* in fixed disks, every block is present */
@@ -1325,13 +1582,46 @@ read_bitmap_cache_span(struct vhd_state *s,
 	
 	ASSERT(bm && bitmap_valid(bm));
 
-	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
+	match = value ? 0xff : 0;
+
+	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++) {
+		if (s->bm_bytes && !(sec & 7) && nr_secs - ret >= 8 &&
+		    (uint8_t)bm->map[sec >> 3] == match) {
+			sec += 7;
+			ret += 7;
+			continue;
+		}
+
 		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
 			break;
+	}
 
 	return ret;
 }
 
+/*
+ * With the current bit order (see vhd_bitmap_test), eight sectors
+ * starting on a multiple of 8 are one byte of the bitmap. Every
+ * request on a 4K vbd covers whole bytes, so set those a byte (4K of
+ * data) at a time.
+ */
+static void
+vhd_bitmap_set_range(struct vhd_state *s, char *map, u32 sec, int secs)
+{
+	while (secs > 0) {
+		if (s->bm_bytes && !(sec & 7) && secs >= 8) {
+			map[sec >> 3] = (char)0xff;
+			sec  += 8;
+			secs -= 8;
+			continue;
+		}
+
+		vhd_bitmap_set(&s->vhd, map, sec);
+		sec++;
+		secs--;
+	}
+}
+
 static inline struct vhd_request *
 alloc_vhd_request(struct vhd_state *s)
 {
@@ -1354,6 +1644,24 @@ free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 	s->vreq_free[s->vreq_free_count++] = req;
 }
 
+/*
+ * Metadata I/O which allocating writes wait on. Queued at high
+ * priority, so the transactions don't sit behind bulk data I/O.
+ */
+static inline int
+vhd_op_metadata(int op)
+{
+	switch (op) {
+	case VHD_OP_BAT_WRITE:
+	case VHD_OP_BITMAP_READ:
+	case VHD_OP_BITMAP_WRITE:
+	case VHD_OP_ZERO_BM_WRITE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static inline void
 aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
@@ -1362,6 +1670,8 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
 		     vhd_sectors_to_bytes(req->treq.secs),
 		     offset, vhd_complete, req);
+	if (vhd_op_metadata(req->op))
+		tiocb->prio = TIOCB_PRIO_HIGH;
 	td_queue_tiocb(s->driver, tiocb);
 
 	s->queued++;
@@ -1378,6 +1688,8 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
 		      vhd_sectors_to_bytes(req->treq.secs),
 		      offset, vhd_complete, req);
+	if (vhd_op_metadata(req->op))
+		tiocb->prio = TIOCB_PRIO_HIGH;
 	td_queue_tiocb(s->driver, tiocb);
 
 	s->queued++;
@@ -1419,7 +1731,7 @@ schedule_bat_write(struct vhd_state *s)
 	blk = s->bat.pbw_blk;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &__bat_entry(s, blk - (blk % 128)), 512);
 
 	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
 
@@ -2086,7 +2398,7 @@ signal_completion(struct vhd_request *list, int error)
 static void
 start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i, error = 0;
+	int error = 0;
 	struct vhd_transaction *tx;
 	struct vhd_request *r, *next;
 
@@ -2110,12 +2422,10 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 		add_to_transaction(tx, r);
 		if (test_vhd_flag(r->flags, VHD_FLAG_REQ_FINISHED)) {
 			tx->finished++;
-			if (!r->error) {
-				u32 sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
-			}
+			if (!r->error)
+				vhd_bitmap_set_range(s, bm->shadow,
+						     r->treq.sec % s->spb,
+						     r->treq.secs);
 		}
 		r = next;
 	}
@@ -2231,7 +2541,7 @@ finish_bat_write(struct vhd_request *req)
 	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
 
 	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
+		__bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
 		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
 	} else
 		tx->error = req->error;
@@ -2395,7 +2705,6 @@ finish_data_read(struct vhd_request *req)
 static void
 finish_data_write(struct vhd_request *req)
 {
-	int i;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = (struct vhd_state *)req->state;
 
@@ -2418,8 +2727,8 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			vhd_bitmap_set_range(s, bm->shadow, sec,
+					     req->treq.secs);
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -47,12 +47,19 @@
 #define LOGCMD_CLEAR "clrw"
 #define LOGCMD_GET   "getw"
 #define LOGCMD_KICK  "kick"
+#define LOGCMD_NEXT  "next"
+#define LOGCMD_CBT_CLEAR "cbtc"
 
 #define CTLRSPLEN_SHMP  256
 #define CTLRSPLEN_PEEK  4
 #define CTLRSPLEN_CLEAR 4
 #define CTLRSPLEN_GET   4
 #define CTLRSPLEN_KICK  0
+#define CTLRSPLEN_NEXT  4
+#define CTLRSPLEN_CBT_CLEAR 4
+
+/* peek, get and next are acked with "done", or "more" if the extent
+ * list filled the bitmap area: send next for the rest. */
 
 /* shmregion is arbitrarily capped at 8 megs for a minimum of
  * 64 MB of data per read (if there are no contiguous regions)
@@ -65,8 +65,8 @@ typedef struct event {
 	event_id_t                   id;
 
 	int                          fd;
-	int                          timeout;
-	int                          deadline;
+	struct timeval               timeout;
+	struct timeval               deadline;
 
 	event_cb_t                   cb;
 	void                        *private;
@@ -77,8 +77,8 @@ typedef struct event {
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
-	int diff;
-	struct timeval now;
+	long diff;
+	struct timeval now, delta;
 	event_t *event;
 
 	FD_ZERO(&s->read_fds);
@@ -86,7 +86,7 @@ scheduler_prepare_events(scheduler_t *s)
 	FD_ZERO(&s->except_fds);
 
 	s->max_fd  = -1;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	s->timeout = SCHEDULER_MAX_TIMEOUT * 1000000L;
 
 	gettimeofday(&now, NULL);
 
@@ -110,15 +110,18 @@ scheduler_prepare_events(scheduler_t *s)
 		}
 
 		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
+			if (timercmp(&event->deadline, &now, >)) {
+				timersub(&event->deadline, &now, &delta);
+				diff = delta.tv_sec * 1000000L + delta.tv_usec;
 				s->timeout = MIN(s->timeout, diff);
-			else
+			} else
 				s->timeout = 0;
 		}
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	s->timeout = MIN(s->timeout, s->max_timeout * 1000000L);
+	if (s->max_timeout_us >= 0)
+		s->timeout = MIN(s->timeout, s->max_timeout_us);
 }
 
 static int
@@ -163,7 +166,7 @@ scheduler_check_events(scheduler_t *s, int nfds)
 		}
 
 		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
-		    (event->deadline <= now.tv_sec))
+		    !timercmp(&event->deadline, &now, >))
 			event->pending = SCHEDULER_POLL_TIMEOUT;
 	}
 
@@ -176,7 +179,7 @@ scheduler_event_callback(event_t *event, char mode)
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
+		timeradd(&now, &event->timeout, &event->deadline);
 	}
 
 	event->cb(event->id, mode, event->private);
@@ -206,9 +209,13 @@ scheduler_run_events(scheduler_t *s)
 	return n_dispatched;
 }
 
-int
-scheduler_register_event(scheduler_t *s, char mode, int fd,
-			 int timeout, event_cb_t cb, void *private)
+/*
+ * Timeout events fire every timeout_ms, measured from the last
+ * callback. Deadlines are kept to the microsecond.
+ */
+event_id_t
+scheduler_register_event_ms(scheduler_t *s, char mode, int fd,
+			    long timeout_ms, event_cb_t cb, void *private)
 {
 	event_t *event;
 	struct timeval now;
@@ -229,8 +236,9 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 
 	event->mode     = mode;
 	event->fd       = fd;
-	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
+	event->timeout.tv_sec  = timeout_ms / 1000;
+	event->timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	timeradd(&now, &event->timeout, &event->deadline);
 	event->cb       = cb;
 	event->private  = private;
 	event->id       = s->uuid++;
@@ -244,6 +252,14 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	return event->id;
 }
 
+event_id_t
+scheduler_register_event(scheduler_t *s, char mode, int fd,
+			 int timeout, event_cb_t cb, void *private)
+{
+	return scheduler_register_event_ms(s, mode, fd, timeout * 1000L,
+					   cb, private);
+}
+
 void
 scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
@@ -293,6 +309,20 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 		s->max_timeout = MIN(s->max_timeout, timeout);
 }
 
+/*
+ * Sub-second bound on the next wait, for deadlines which aren't
+ * worth a timeout event of their own.
+ */
+void
+scheduler_set_max_timeout_us(scheduler_t *s, long usecs)
+{
+	if (usecs < 0)
+		return;
+
+	if (s->max_timeout_us < 0 || usecs < s->max_timeout_us)
+		s->max_timeout_us = usecs;
+}
+
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
@@ -310,11 +340,11 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
+	tv.tv_sec  = s->timeout / 1000000;
+	tv.tv_usec = s->timeout % 1000000;
 
-	DBG("timeout: %d, max_timeout: %d\n",
-	    s->timeout, s->max_timeout);
+	DBG("timeout: %ldus, max_timeout: %d, max_timeout_us: %ld\n",
+	    s->timeout, s->max_timeout, s->max_timeout_us);
 
 	ret = select(s->max_fd + 1, &s->read_fds,
 		     &s->write_fds, &s->except_fds, &tv);
@@ -325,8 +355,9 @@ scheduler_wait_for_events(scheduler_t *s)
 	ret = scheduler_check_events(s, ret);
 	BUG_ON(ret);
 
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
-	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
+	s->timeout        = SCHEDULER_MAX_TIMEOUT * 1000000L;
+	s->max_timeout    = SCHEDULER_MAX_TIMEOUT;
+	s->max_timeout_us = -1;
 
 	scheduler_run_events(s);
 
@@ -346,6 +377,7 @@ scheduler_initialize(scheduler_t *s)
 
 	s->uuid  = 1;
 	s->depth = 0;
+	s->max_timeout_us = -1;
 
 	FD_ZERO(&s->read_fds);
 	FD_ZERO(&s->write_fds);
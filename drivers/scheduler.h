@@ -54,8 +54,9 @@ typedef struct scheduler {
 
 	int                          uuid;
 	int                          max_fd;
-	int                          timeout;
+	long                         timeout;        /* usecs */
 	int                          max_timeout;
+	long                         max_timeout_us;
 	int                          depth;
 } scheduler_t;
 
@@ -63,9 +64,13 @@ void scheduler_initialize(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
+event_id_t scheduler_register_event_ms(scheduler_t *, char mode,
+				       int fd, long timeout_ms,
+				       event_cb_t cb, void *private);
 void scheduler_unregister_event(scheduler_t *,  event_id_t);
 void scheduler_mask_event(scheduler_t *, event_id_t, int masked);
 void scheduler_set_max_timeout(scheduler_t *, int);
+void scheduler_set_max_timeout_us(scheduler_t *, long);
 int scheduler_wait_for_events(scheduler_t *);
 
 #endif
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Block stream: copy-on-read chain flattening in the background.
+ *
+ * Walks the disk and pulls every sector the leaf doesn't own up from
+ * its parents, the way block-lcache does for what the guest happens
+ * to read. Each chunk is read from the leaf with forwarding turned
+ * off; whatever the leaf doesn't hold comes back -ENODATA and is
+ * retried one image further down, until found or found nowhere.
+ * Sectors held by a parent are written to the leaf, sectors held by
+ * none are left unallocated, so they still read back as zeros once
+ * the parents are gone.
+ *
+ * Guest writes race the copy: a chunk could read a parent before and
+ * write the leaf after a guest write to the same sectors. Chunks and
+ * guest writes therefore exclude each other (lock_writes).
+ *
+ * When done, the leaf is self-contained and the parents are dropped
+ * from the chain. On-disk, the leaf still names its parent; making
+ * it standalone is left to the toolstack.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "tapdisk-job.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+
+struct td_stream {
+	td_image_t                  *leaf;
+};
+
+static int
+tapdisk_stream_start(td_job_t *job)
+{
+	td_vbd_t *vbd = job->vbd;
+	td_image_t *image, *leaf, *tmp;
+	struct td_stream *s;
+	int i;
+
+	if (vbd->secondary ||
+	    td_flag_test(vbd->flags,
+			 TD_OPEN_ADD_CACHE |
+			 TD_OPEN_LOCAL_CACHE |
+			 TD_OPEN_VHD_INDEX)) {
+		EPRINTF("%s: stream not supported in this configuration\n",
+			vbd->name);
+		return -EOPNOTSUPP;
+	}
+
+	/* the leaf sits right above the first parent */
+	leaf = NULL;
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (td_flag_test(image->flags, TD_OPEN_SHAREABLE))
+			break;
+		leaf = image;
+	}
+
+	if (!leaf || tapdisk_vbd_is_last_image(vbd, leaf)) {
+		EPRINTF("%s: no parents to stream from\n", vbd->name);
+		return -ENOENT;
+	}
+
+	if (td_flag_test(leaf->flags, TD_OPEN_RDONLY)) {
+		EPRINTF("%s: %s is read-only\n", vbd->name, leaf->name);
+		return -EROFS;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->leaf   = leaf;
+	job->data = s;
+
+	for (i = 0; i < job->depth; i++)
+		td_flag_set(job->reqs[i].vreq.flags, TD_VREQ_NOFORWARD);
+
+	job->cursor = 0;
+	job->end    = leaf->info.size;
+
+	DBG(TLOG_WARN, "%s: streaming parents into %s\n",
+	    vbd->name, leaf->name);
+
+	return 0;
+}
+
+static void
+tapdisk_stream_write_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+
+	if (!res)
+		req->job->secs_copied += treq.secs;
+
+	tapdisk_job_complete_secs(req, treq.secs, res);
+}
+
+static void
+tapdisk_stream_skip(td_job_request_t *req, int secs)
+{
+	req->job->secs_skipped += secs;
+	tapdisk_job_complete_secs(req, secs, 0);
+}
+
+static void
+tapdisk_stream_read_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+	td_job_t *job = req->job;
+	struct td_stream *s = job->data;
+	td_vbd_t *vbd = job->vbd;
+	td_image_t *next;
+
+	if (res && res != -ENODATA) {
+		tapdisk_job_complete_secs(req, treq.secs, res);
+		return;
+	}
+
+	if (job->state != TD_JOB_RUNNING) {
+		tapdisk_job_complete_secs(req, treq.secs, 0);
+		return;
+	}
+
+	if (!res) {
+		if (treq.image == s->leaf)
+			tapdisk_stream_skip(req, treq.secs);
+		else {
+			treq.op    = TD_OP_WRITE;
+			treq.image = s->leaf;
+			treq.cb    = tapdisk_stream_write_done;
+
+			td_queue_write(s->leaf, treq);
+		}
+		return;
+	}
+
+	/* not in treq.image: look one further down */
+	if (tapdisk_vbd_is_last_image(vbd, treq.image)) {
+		tapdisk_stream_skip(req, treq.secs);
+		return;
+	}
+
+	next = tapdisk_vbd_next_image(treq.image);
+
+	/* past the end of a smaller parent reads zeros, see
+	 * __tapdisk_vbd_reissue_td_request */
+	if (treq.sec + treq.secs > next->info.size) {
+		int secs = 0;
+
+		if (next->info.size > treq.sec)
+			secs = next->info.size - treq.sec;
+
+		tapdisk_stream_skip(req, treq.secs - secs);
+		if (!secs)
+			return;
+
+		treq.secs = secs;
+	}
+
+	treq.image = next;
+	td_queue_read(next, treq);
+}
+
+static void
+tapdisk_stream_copy(td_job_t *job, td_job_request_t *req)
+{
+	struct td_stream *s = job->data;
+	td_request_t treq;
+
+	tapdisk_job_prep_request(req, &treq, s->leaf,
+				 TD_OP_READ, tapdisk_stream_read_done);
+
+	td_queue_read(s->leaf, treq);
+}
+
+static int
+tapdisk_stream_finish(td_job_t *job)
+{
+	struct td_stream *s = job->data;
+	td_vbd_t *vbd = job->vbd;
+	td_image_t *parent;
+
+	while (!tapdisk_vbd_is_last_image(vbd, s->leaf)) {
+		parent = tapdisk_vbd_next_image(s->leaf);
+
+		DBG(TLOG_WARN, "%s: dropping %s from the chain\n",
+		    vbd->name, parent->name);
+
+		tapdisk_vbd_drop_image(vbd, parent);
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_stream_abort(td_job_t *job)
+{
+}
+
+const struct td_job_ops tapdisk_job_stream_ops = {
+	.name        = "stream",
+	.lock_writes = 1,
+	.start       = tapdisk_stream_start,
+	.copy        = tapdisk_stream_copy,
+	.finish      = tapdisk_stream_finish,
+	.abort       = tapdisk_stream_abort,
+};
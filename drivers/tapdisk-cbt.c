@@ -0,0 +1,837 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "libvhd.h"
+#include "tapdisk-cbt.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+
+#define TD_CBT_MAX_IO           32
+#define TD_CBT_MAX_REQS         TAPDISK_DATA_REQUESTS
+#define TD_CBT_XATTR            "user.tapdisk.cbt.generation"
+
+struct td_cbt_io {
+	struct tiocb            tiocb;
+	td_cbt_t               *cbt;
+	int                     busy;
+	struct td_cbt_io       *next;
+};
+
+struct td_cbt_request {
+	td_request_t            treq;
+	uint64_t                batch;
+	int                     allocated;
+	struct list_head        next;
+};
+
+/*
+ * Map pages are written in batches, one batch at a time. A write
+ * which set new bits waits for the batch after the one in flight;
+ * page_need records which batch a page's bits are durable with, for
+ * writes to blocks already set in memory.
+ */
+struct td_cbt {
+	td_driver_t            *driver;
+	char                   *image;
+	char                   *path;
+	int                     fd;
+	int                     failed;
+	int                     closing;
+
+	struct td_cbt_header   *header;
+	uint8_t                *map;
+	uint8_t                *old_map;
+	size_t                  map_size;
+	uint64_t                sectors;
+	uint64_t                bits;
+	uint64_t                pages;
+	uint8_t                *page_dirty;
+	uint64_t               *page_need;
+
+	int                     active;
+	int                     inflight;
+	int                     batch_err;
+	uint64_t                next_page;
+	uint64_t                started;
+	uint64_t                completed;
+
+	struct td_cbt_io        ios[TD_CBT_MAX_IO];
+	struct td_cbt_io       *free_io;
+
+	struct td_cbt_request   reqs[TD_CBT_MAX_REQS];
+	struct list_head        free_reqs;
+	struct list_head        waiting;
+
+	uint64_t                batches;
+	uint64_t                page_writes;
+	uint64_t                waits;
+};
+
+static void td_cbt_kick(td_cbt_t *);
+
+static inline int
+td_cbt_test_bit(uint8_t *map, uint64_t bit)
+{
+	return map[bit >> 3] & (1 << (bit & 7));
+}
+
+static inline void
+td_cbt_set_bit(uint8_t *map, uint64_t bit)
+{
+	map[bit >> 3] |= (1 << (bit & 7));
+}
+
+static inline uint64_t
+td_cbt_page(uint64_t bit)
+{
+	return (bit >> 3) / TD_CBT_PAGE_SIZE;
+}
+
+char *
+td_cbt_path(const char *name)
+{
+	const char *env, *dir;
+	struct stat st;
+	char *path, *p;
+	int err;
+
+	env = getenv("TAPDISK2_CBT");
+	if (env && !atoi(env))
+		return NULL;
+
+	dir = getenv("TAPDISK2_CBT_DIR");
+	if (dir) {
+		err = asprintf(&path, "%s/%s.cbt", dir, name);
+		if (err == -1)
+			return NULL;
+
+		for (p = path + strlen(dir) + 1; *p; p++)
+			if (*p == '/' || *p == ':')
+				*p = '_';
+
+		return path;
+	}
+
+	/* next to the image, unless it is a device */
+	if (stat(name, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	err = asprintf(&path, "%s.cbt", name);
+	return (err == -1 ? NULL : path);
+}
+
+static int
+td_cbt_pwrite(td_cbt_t *cbt, void *buf, size_t size, off64_t off)
+{
+	ssize_t ret;
+
+	ret = pwrite(cbt->fd, buf, size, off);
+	if (ret == size)
+		return 0;
+
+	return (ret < 0 ? -errno : -EIO);
+}
+
+static int
+td_cbt_write_header(td_cbt_t *cbt)
+{
+	return td_cbt_pwrite(cbt, cbt->header, TD_CBT_HEADER_SIZE, 0);
+}
+
+/*
+ * Writes beyond the request pool get an allocated request, so they
+ * wait for their batch like the rest.
+ */
+static struct td_cbt_request *
+td_cbt_get_request(td_cbt_t *cbt)
+{
+	struct td_cbt_request *req;
+
+	if (list_empty(&cbt->free_reqs)) {
+		req = calloc(1, sizeof(*req));
+		if (req) {
+			req->allocated = 1;
+			INIT_LIST_HEAD(&req->next);
+		}
+		return req;
+	}
+
+	return list_entry(cbt->free_reqs.next, struct td_cbt_request, next);
+}
+
+static void
+td_cbt_put_request(td_cbt_t *cbt, struct td_cbt_request *req)
+{
+	if (req->allocated) {
+		list_del(&req->next);
+		free(req);
+	} else
+		list_move(&req->next, &cbt->free_reqs);
+}
+
+/*
+ * Stop tracking: guest writes go ahead without waiting, and the file
+ * is marked invalid, so the next open starts a new generation.
+ */
+static void
+td_cbt_fail(td_cbt_t *cbt, int err)
+{
+	struct td_cbt_request *req, *tmp;
+	td_request_t treq;
+
+	EPRINTF("%s: updating change map: %d, tracking stopped\n",
+		cbt->path, err);
+
+	cbt->failed = 1;
+	cbt->header->flags |= TD_CBT_FLAG_INVALID;
+	td_cbt_write_header(cbt);
+
+	list_for_each_entry_safe(req, tmp, &cbt->waiting, next) {
+		treq = req->treq;
+		td_cbt_put_request(cbt, req);
+		td_forward_request(treq);
+	}
+}
+
+static void
+td_cbt_free(td_cbt_t *cbt)
+{
+	uint64_t p;
+	int err;
+
+	if (cbt->fd != -1 && !cbt->failed) {
+		err = 0;
+		for (p = 0; p < cbt->pages && !err; p++)
+			if (cbt->page_dirty[p])
+				err = td_cbt_pwrite(cbt,
+						    cbt->map + p * TD_CBT_PAGE_SIZE,
+						    TD_CBT_PAGE_SIZE,
+						    TD_CBT_HEADER_SIZE +
+						    p * TD_CBT_PAGE_SIZE);
+
+		if (!err) {
+			cbt->header->flags &= ~TD_CBT_FLAG_OPEN;
+			err = td_cbt_write_header(cbt);
+		}
+
+		if (err)
+			EPRINTF("%s: closing: %d\n", cbt->path, err);
+	}
+
+	DPRINTF("%s: %"PRIu64" batches, %"PRIu64" page writes, "
+		"%"PRIu64" waits\n", cbt->path, cbt->batches,
+		cbt->page_writes, cbt->waits);
+
+	if (cbt->fd != -1)
+		close(cbt->fd);
+
+	free(cbt->page_need);
+	free(cbt->page_dirty);
+	free(cbt->old_map);
+	free(cbt->map);
+	free(cbt->header);
+	free(cbt->path);
+	free(cbt->image);
+	free(cbt);
+}
+
+static void
+td_cbt_release(td_cbt_t *cbt)
+{
+	struct td_cbt_request *req, *tmp;
+	td_request_t treq;
+
+	list_for_each_entry_safe(req, tmp, &cbt->waiting, next) {
+		if (req->batch > cbt->completed)
+			continue;
+
+		treq = req->treq;
+		td_cbt_put_request(cbt, req);
+		td_forward_request(treq);
+	}
+}
+
+static void
+td_cbt_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct td_cbt_io *io = arg;
+	td_cbt_t *cbt = io->cbt;
+
+	io->busy     = 0;
+	io->next     = cbt->free_io;
+	cbt->free_io = io;
+	cbt->inflight--;
+
+	if (err && !cbt->batch_err)
+		cbt->batch_err = err;
+
+	if (!cbt->inflight && cbt->old_map) {
+		free(cbt->old_map);
+		cbt->old_map = NULL;
+	}
+
+	if (cbt->closing) {
+		if (!cbt->inflight)
+			td_cbt_free(cbt);
+		return;
+	}
+
+	td_cbt_kick(cbt);
+}
+
+static int
+td_cbt_write_page(td_cbt_t *cbt, uint64_t page)
+{
+	struct td_cbt_io *io;
+
+	io = cbt->free_io;
+	if (!io)
+		return -EBUSY;
+
+	cbt->free_io = io->next;
+	io->busy     = 1;
+	cbt->inflight++;
+	cbt->page_writes++;
+	cbt->page_dirty[page] = 0;
+
+	td_prep_write(&io->tiocb, cbt->fd,
+		      (char *)cbt->map + page * TD_CBT_PAGE_SIZE,
+		      TD_CBT_PAGE_SIZE,
+		      TD_CBT_HEADER_SIZE + page * TD_CBT_PAGE_SIZE,
+		      td_cbt_complete, io);
+	td_queue_tiocb(cbt->driver, &io->tiocb);
+
+	return 0;
+}
+
+static int
+td_cbt_dirty(td_cbt_t *cbt)
+{
+	uint64_t p;
+
+	for (p = 0; p < cbt->pages; p++)
+		if (cbt->page_dirty[p])
+			return 1;
+
+	return 0;
+}
+
+static void
+td_cbt_kick(td_cbt_t *cbt)
+{
+	for (;;) {
+		if (cbt->failed)
+			return;
+
+		if (!cbt->active) {
+			if (!td_cbt_dirty(cbt))
+				return;
+
+			cbt->active    = 1;
+			cbt->batch_err = 0;
+			cbt->next_page = 0;
+			cbt->started++;
+			cbt->batches++;
+		}
+
+		for (; cbt->next_page < cbt->pages; cbt->next_page++) {
+			if (!cbt->page_dirty[cbt->next_page])
+				continue;
+
+			if (td_cbt_write_page(cbt, cbt->next_page))
+				return;
+		}
+
+		if (cbt->inflight)
+			return;
+
+		cbt->active = 0;
+
+		if (cbt->batch_err) {
+			td_cbt_fail(cbt, cbt->batch_err);
+			return;
+		}
+
+		cbt->completed = cbt->started;
+		td_cbt_release(cbt);
+	}
+}
+
+void
+td_cbt_queue_write(td_cbt_t *cbt, td_request_t treq)
+{
+	struct td_cbt_request *req;
+	uint64_t bit, first, last, page, need;
+
+	if (cbt->failed) {
+		td_forward_request(treq);
+		return;
+	}
+
+	/* don't set bits we couldn't wait for */
+	req = td_cbt_get_request(cbt);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	first = treq.sec >> TD_CBT_BLOCK_SHIFT;
+	last  = (treq.sec + treq.secs - 1) >> TD_CBT_BLOCK_SHIFT;
+	need  = 0;
+
+	for (bit = first; bit <= last && bit < cbt->bits; bit++) {
+		page = td_cbt_page(bit);
+
+		if (!td_cbt_test_bit(cbt->map, bit)) {
+			td_cbt_set_bit(cbt->map, bit);
+			cbt->page_dirty[page] = 1;
+			cbt->page_need[page]  = cbt->started + 1;
+		}
+
+		if (cbt->page_need[page] > need)
+			need = cbt->page_need[page];
+	}
+
+	if (need <= cbt->completed) {
+		if (req->allocated)
+			free(req);
+		td_forward_request(treq);
+		return;
+	}
+
+	req->treq  = treq;
+	req->batch = need;
+	list_move_tail(&req->next, &cbt->waiting);
+	cbt->waits++;
+
+	td_cbt_kick(cbt);
+}
+
+/*
+ * Start a new epoch: writes from here on are the changes since the
+ * clear. Writes still waiting for their bits keep them. The cleared
+ * map reaches the file lazily, through the usual batches.
+ *
+ * Pages in flight are written straight from the map, so while a batch
+ * is active the clear goes to a fresh map and the old one is freed
+ * once its writes are done.
+ */
+int
+td_cbt_clear(td_cbt_t *cbt)
+{
+	struct td_cbt_request *req;
+	uint64_t bit, first, last, p;
+	uint8_t *map;
+	int err;
+
+	if (cbt->failed)
+		return -EIO;
+
+	if (cbt->inflight) {
+		/* the previous clear's map is still being written */
+		if (cbt->old_map)
+			return -EBUSY;
+
+		if (posix_memalign((void **)&map, TD_CBT_PAGE_SIZE,
+				   cbt->map_size))
+			return -ENOMEM;
+
+		cbt->old_map = cbt->map;
+		cbt->map     = map;
+	}
+
+	memset(cbt->map, 0, cbt->map_size);
+
+	list_for_each_entry(req, &cbt->waiting, next) {
+		first = req->treq.sec >> TD_CBT_BLOCK_SHIFT;
+		last  = (req->treq.sec + req->treq.secs - 1) >>
+			TD_CBT_BLOCK_SHIFT;
+		for (bit = first; bit <= last && bit < cbt->bits; bit++)
+			td_cbt_set_bit(cbt->map, bit);
+	}
+
+	for (p = 0; p < cbt->pages; p++)
+		cbt->page_dirty[p] = 1;
+
+	cbt->header->epoch++;
+	err = td_cbt_write_header(cbt);
+	if (err) {
+		td_cbt_fail(cbt, err);
+		return err;
+	}
+
+	DPRINTF("%s: cleared, generation %"PRIu64" epoch %"PRIu64"\n",
+		cbt->path, cbt->header->generation, cbt->header->epoch);
+
+	td_cbt_kick(cbt);
+	return 0;
+}
+
+static int
+td_cbt_header_valid(struct td_cbt_header *h)
+{
+	return (!memcmp(h->magic, TD_CBT_MAGIC, sizeof(h->magic)) &&
+		h->version == TD_CBT_VERSION);
+}
+
+/*
+ * The footer uuid of a VHD image, null for anything else.
+ */
+static void
+td_cbt_image_uuid(td_cbt_t *cbt, uuid_t uuid)
+{
+	vhd_context_t vhd;
+
+	uuid_clear(uuid);
+
+	if (vhd_open(&vhd, cbt->image, VHD_OPEN_RDONLY))
+		return;
+
+	uuid_copy(uuid, vhd.footer.uuid);
+	vhd_close(&vhd);
+}
+
+/*
+ * Where the image takes user xattrs, the generation is stamped on it
+ * as well: a replaced or restored image doesn't carry it. Device
+ * nodes and NFSv3 don't, and do without.
+ */
+static int
+td_cbt_image_generation(td_cbt_t *cbt, uint64_t *generation)
+{
+	ssize_t ret;
+
+	ret = getxattr(cbt->image, TD_CBT_XATTR,
+		       generation, sizeof(*generation));
+	if (ret == sizeof(*generation))
+		return 0;
+
+	return (ret < 0 ? -errno : -EINVAL);
+}
+
+static int
+td_cbt_bind(td_cbt_t *cbt)
+{
+	if (setxattr(cbt->image, TD_CBT_XATTR, &cbt->header->generation,
+		     sizeof(cbt->header->generation), 0))
+		return -errno;
+
+	return 0;
+}
+
+static int
+td_cbt_load(td_cbt_t *cbt)
+{
+	struct td_cbt_header *h = cbt->header;
+	uint64_t generation;
+	uuid_t uuid;
+	ssize_t ret;
+
+	ret = pread(cbt->fd, h, TD_CBT_HEADER_SIZE, 0);
+	if (ret != TD_CBT_HEADER_SIZE || !td_cbt_header_valid(h))
+		return -EINVAL;
+
+	if (h->flags & TD_CBT_FLAG_INVALID)
+		return -ESTALE;
+
+	if (h->sectors != cbt->sectors ||
+	    h->block_shift != TD_CBT_BLOCK_SHIFT)
+		return -ESTALE;
+
+	td_cbt_image_uuid(cbt, uuid);
+	if (uuid_compare(uuid, h->image_uuid))
+		return -ESTALE;
+
+	if ((h->flags & TD_CBT_FLAG_BOUND) &&
+	    (td_cbt_image_generation(cbt, &generation) ||
+	     generation != h->generation))
+		return -ESTALE;
+
+	ret = pread(cbt->fd, cbt->map, cbt->map_size, TD_CBT_HEADER_SIZE);
+	if (ret != cbt->map_size)
+		return -EINVAL;
+
+	/* bits are set ahead of writes: the map is still good */
+	if (h->flags & TD_CBT_FLAG_OPEN)
+		DPRINTF("%s: not closed cleanly, keeping map\n", cbt->path);
+
+	return 0;
+}
+
+static int
+td_cbt_create(td_cbt_t *cbt)
+{
+	struct td_cbt_header *h = cbt->header;
+	uint64_t generation;
+	int err;
+
+	if (td_cbt_header_valid(h))
+		generation = h->generation + 1;
+	else
+		generation = ((uint64_t)time(NULL) << 16) ^ getpid();
+
+	memset(h, 0, TD_CBT_HEADER_SIZE);
+	memcpy(h->magic, TD_CBT_MAGIC, sizeof(h->magic));
+	h->version     = TD_CBT_VERSION;
+	h->generation  = generation;
+	h->sectors     = cbt->sectors;
+	h->block_shift = TD_CBT_BLOCK_SHIFT;
+	td_cbt_image_uuid(cbt, h->image_uuid);
+
+	memset(cbt->map, 0, cbt->map_size);
+
+	if (ftruncate(cbt->fd, TD_CBT_HEADER_SIZE + cbt->map_size))
+		return -errno;
+
+	err = td_cbt_pwrite(cbt, cbt->map, cbt->map_size, TD_CBT_HEADER_SIZE);
+	if (err)
+		return err;
+
+	err = td_cbt_bind(cbt);
+	if (!err)
+		h->flags |= TD_CBT_FLAG_BOUND;
+	else
+		DPRINTF("%s: generation not stamped on %s: %d\n",
+			cbt->path, cbt->image, err);
+
+	DPRINTF("%s: new map, generation %"PRIu64"\n", cbt->path, generation);
+	return 0;
+}
+
+int
+td_cbt_open(td_driver_t *driver, const char *image, const char *path,
+	    uint64_t sectors, td_cbt_t **_cbt)
+{
+	td_cbt_t *cbt;
+	int i, err, flags;
+
+	*_cbt = NULL;
+
+	cbt = calloc(1, sizeof(*cbt));
+	if (!cbt)
+		return -ENOMEM;
+
+	cbt->fd      = -1;
+	cbt->driver  = driver;
+	cbt->sectors = sectors;
+	INIT_LIST_HEAD(&cbt->free_reqs);
+	INIT_LIST_HEAD(&cbt->waiting);
+
+	for (i = 0; i < TD_CBT_MAX_IO; i++) {
+		cbt->ios[i].cbt  = cbt;
+		cbt->ios[i].next = cbt->free_io;
+		cbt->free_io     = &cbt->ios[i];
+	}
+
+	for (i = 0; i < TD_CBT_MAX_REQS; i++)
+		list_add_tail(&cbt->reqs[i].next, &cbt->free_reqs);
+
+	err = -ENOMEM;
+	cbt->path  = strdup(path);
+	cbt->image = strdup(image);
+	if (!cbt->path || !cbt->image)
+		goto fail;
+
+	cbt->bits     = (sectors + (1 << TD_CBT_BLOCK_SHIFT) - 1) >>
+		TD_CBT_BLOCK_SHIFT;
+	cbt->map_size = (cbt->bits + 7) >> 3;
+	cbt->map_size = ((cbt->map_size + TD_CBT_PAGE_SIZE - 1) /
+			 TD_CBT_PAGE_SIZE) * TD_CBT_PAGE_SIZE;
+	cbt->pages    = cbt->map_size / TD_CBT_PAGE_SIZE;
+
+	if (posix_memalign((void **)&cbt->header, TD_CBT_PAGE_SIZE,
+			   TD_CBT_HEADER_SIZE)) {
+		cbt->header = NULL;
+		goto fail;
+	}
+
+	if (posix_memalign((void **)&cbt->map, TD_CBT_PAGE_SIZE,
+			   cbt->map_size)) {
+		cbt->map = NULL;
+		goto fail;
+	}
+
+	cbt->page_dirty = calloc(cbt->pages, sizeof(*cbt->page_dirty));
+	cbt->page_need  = calloc(cbt->pages, sizeof(*cbt->page_need));
+	if (!cbt->page_dirty || !cbt->page_need)
+		goto fail;
+
+	memset(cbt->header, 0, TD_CBT_HEADER_SIZE);
+
+	/* map updates must be on disk before the writes they cover */
+	flags   = O_RDWR | O_CREAT | O_DSYNC;
+	cbt->fd = open(path, flags | O_DIRECT, 0600);
+	if (cbt->fd == -1 && errno == EINVAL)
+		cbt->fd = open(path, flags, 0600);
+	if (cbt->fd == -1) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = td_cbt_load(cbt);
+	if (err) {
+		DPRINTF("%s: no usable map: %d\n", path, err);
+		err = td_cbt_create(cbt);
+		if (err)
+			goto fail;
+	}
+
+	cbt->header->flags |= TD_CBT_FLAG_OPEN;
+	err = td_cbt_write_header(cbt);
+	if (err)
+		goto fail;
+
+	DPRINTF("%s: tracking %"PRIu64" sectors, generation %"PRIu64
+		" epoch %"PRIu64"\n", path, sectors,
+		cbt->header->generation, cbt->header->epoch);
+
+	*_cbt = cbt;
+	return 0;
+
+fail:
+	EPRINTF("%s: opening change map: %d\n", path, err);
+	cbt->failed = 1;
+	td_cbt_free(cbt);
+	return err;
+}
+
+/*
+ * Page writes still in flight complete after the driver is gone, the
+ * last one frees the map. They are taken off the vbd's queue share,
+ * which goes with the vbd.
+ */
+void
+td_cbt_close(td_cbt_t *cbt)
+{
+	int i;
+
+	cbt->closing = 1;
+
+	if (!cbt->inflight) {
+		td_cbt_free(cbt);
+		return;
+	}
+
+	for (i = 0; i < TD_CBT_MAX_IO; i++)
+		if (cbt->ios[i].busy)
+			td_unshare_tiocb(&cbt->ios[i].tiocb);
+}
+
+int
+td_cbt_reader_open(td_cbt_reader_t *r, const char *path)
+{
+	size_t size;
+	ssize_t ret;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = open(path, O_RDONLY);
+	if (r->fd == -1)
+		return -errno;
+
+	err = -EINVAL;
+	ret = pread(r->fd, &r->header, sizeof(r->header), 0);
+	if (ret != sizeof(r->header) || !td_cbt_header_valid(&r->header))
+		goto fail;
+
+	err = -ESTALE;
+	if (r->header.flags & TD_CBT_FLAG_INVALID)
+		goto fail;
+
+	r->bits = (r->header.sectors + (1ULL << r->header.block_shift) - 1) >>
+		r->header.block_shift;
+	size    = (r->bits + 7) >> 3;
+
+	err    = -ENOMEM;
+	r->map = malloc(size);
+	if (!r->map)
+		goto fail;
+
+	err = -EIO;
+	ret = pread(r->fd, r->map, size, TD_CBT_HEADER_SIZE);
+	if (ret != size)
+		goto fail;
+
+	return 0;
+
+fail:
+	td_cbt_reader_close(r);
+	return err;
+}
+
+/*
+ * Next changed extent from the cursor on. Returns 1 past the last.
+ */
+int
+td_cbt_reader_next(td_cbt_reader_t *r, uint64_t *sector, uint64_t *secs)
+{
+	uint64_t bit, end;
+	int shift = r->header.block_shift;
+
+	for (bit = r->cursor; bit < r->bits; bit++)
+		if (td_cbt_test_bit(r->map, bit))
+			break;
+
+	if (bit >= r->bits)
+		return 1;
+
+	for (end = bit + 1; end < r->bits; end++)
+		if (!td_cbt_test_bit(r->map, end))
+			break;
+
+	r->cursor = end;
+
+	*sector = bit << shift;
+	*secs   = (end << shift) - *sector;
+	if (*sector + *secs > r->header.sectors)
+		*secs = r->header.sectors - *sector;
+
+	return 0;
+}
+
+void
+td_cbt_reader_close(td_cbt_reader_t *r)
+{
+	if (r->fd != -1)
+		close(r->fd);
+	free(r->map);
+	r->fd  = -1;
+	r->map = NULL;
+}
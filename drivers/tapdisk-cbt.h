@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_CBT_H_
+#define _TAPDISK_CBT_H_
+
+#include <inttypes.h>
+#include <uuid/uuid.h>
+
+#include "list.h"
+#include "tapdisk.h"
+
+/*
+ * Changed block tracking sidecar. The file holds a header page and a
+ * bitmap with one bit per 2^block_shift sectors, in host byte order.
+ *
+ * Bits are set on disk before the guest write they cover is passed
+ * down (write-ahead), so the map is a superset of the changes even
+ * after a crash. Clearing is lazy: a stale bit only costs a block of
+ * extra backup.
+ *
+ * generation changes whenever the map had to be started over (bad
+ * header, resized disk, failed map update); backup tools must fall
+ * back to a full copy when it isn't what they saw last. epoch counts
+ * clears. TD_CBT_FLAG_OPEN is set while a tapdisk tracks writes.
+ * Writes made without a tracking tapdisk are not seen.
+ *
+ * The map is bound to its image by size and, for VHDs, the footer
+ * uuid; a map which doesn't match is started over. Where the image
+ * can hold user xattrs the generation is stamped on it as well
+ * (TD_CBT_FLAG_BOUND), which also catches a VHD restored in place.
+ */
+
+#define TD_CBT_MAGIC            "tdcbt001"
+#define TD_CBT_VERSION          1
+#define TD_CBT_HEADER_SIZE      4096
+#define TD_CBT_PAGE_SIZE        4096
+#define TD_CBT_BLOCK_SHIFT      7           /* 64k per bit */
+
+#define TD_CBT_FLAG_OPEN        0x1
+#define TD_CBT_FLAG_INVALID     0x2
+#define TD_CBT_FLAG_BOUND       0x4
+
+struct td_cbt_header {
+	char                    magic[8];
+	uint32_t                version;
+	uint32_t                flags;
+	uint64_t                generation;
+	uint64_t                epoch;
+	uint64_t                sectors;
+	uint32_t                block_shift;
+	uint32_t                reserved;
+	uuid_t                  image_uuid;
+};
+
+typedef struct td_cbt           td_cbt_t;
+typedef struct td_cbt_reader    td_cbt_reader_t;
+
+int td_cbt_open(td_driver_t *, const char *image, const char *path,
+		uint64_t sectors, td_cbt_t **);
+void td_cbt_close(td_cbt_t *);
+void td_cbt_queue_write(td_cbt_t *, td_request_t);
+int td_cbt_clear(td_cbt_t *);
+char *td_cbt_path(const char *name);
+
+/* for backup tools */
+struct td_cbt_reader {
+	int                     fd;
+	struct td_cbt_header    header;
+	uint8_t                *map;
+	uint64_t                bits;
+	uint64_t                cursor;
+};
+
+int td_cbt_reader_open(td_cbt_reader_t *, const char *path);
+int td_cbt_reader_next(td_cbt_reader_t *, uint64_t *sector, uint64_t *secs);
+void td_cbt_reader_close(td_cbt_reader_t *);
+
+#endif
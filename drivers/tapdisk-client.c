@@ -179,6 +179,18 @@ static void ctlmsg_init(struct log_ctlmsg* msg, const char* cmd)
   memcpy(msg->msg, cmd, 4);
 }
 
+/* peek, get and next acks: 1 if the export continues with next */
+static int ctl_export_more(const char* rsp)
+{
+  if (!strncmp(rsp, "more", 4))
+    return 1;
+  if (!strncmp(rsp, "done", 4))
+    return 0;
+
+  BWPRINTF("unexpected export ack: %.4s", rsp);
+  return -1;
+}
+
 static int ctl_get_writes(int fd)
 {
   struct log_ctlmsg req;
@@ -192,7 +204,7 @@ static int ctl_get_writes(int fd)
     return -1;
   }
 
-  return 0;
+  return ctl_export_more(rsp);
 }
 
 static int ctl_peek_writes(int fd)
@@ -208,7 +220,23 @@ static int ctl_peek_writes(int fd)
     return -1;
   }
 
-  return 0;
+  return ctl_export_more(rsp);
+}
+
+static int ctl_next_writes(int fd)
+{
+  struct log_ctlmsg req;
+  char rsp[CTLRSPLEN_NEXT];
+  int rc;
+
+  ctlmsg_init(&req, LOGCMD_NEXT);
+
+  if ((rc = ctl_talk(fd, &req, rsp, CTLRSPLEN_NEXT)) < 0) {
+    BWPRINTF("error getting next writes");
+    return -1;
+  }
+
+  return ctl_export_more(rsp);
 }
 
 /* submit pending requests */
@@ -274,7 +302,7 @@ static int writelog_map(struct writelog* wl)
   return 0;
 }
 
-static int writelog_dump(struct writelog* wl)
+static int writelog_dump(struct writelog* wl, int fd)
 {
   struct disk_range* range = wl->shm;
 
@@ -367,21 +395,31 @@ static int writelog_free(struct writelog* wl)
   return 0;
 }
 
-int get_writes(struct writelog* wl, int fd, int peek)
+/* the dirty extents may not fit the shm region in one go: hand each
+ * batch to @batch, then fetch the rest with next. */
+int get_writes(struct writelog* wl, int fd, int peek,
+	       int (*batch)(struct writelog*, int))
 {
-  int rc;
+  int more;
 
   if (peek)
-    rc = ctl_peek_writes(fd);
+    more = ctl_peek_writes(fd);
   else
-    rc = ctl_get_writes(fd);
+    more = ctl_get_writes(fd);
 
-  if (rc < 0)
-    return rc;
+  while (more >= 0) {
+    wl->cur = wl->shm;
 
-  wl->cur = wl->shm;
+    if (batch(wl, fd) < 0)
+      return -1;
 
-  return 0;
+    if (!more)
+      return 0;
+
+    more = ctl_next_writes(fd);
+  }
+
+  return -1;
 }
 
 int await_responses(struct writelog* wl, int fd)
@@ -420,13 +458,11 @@ int await_responses(struct writelog* wl, int fd)
  *    into the ring
  * 5. when entire bitmap has been queued, go to 1?
  */
-int read_loop(struct writelog* wl, int fd)
+static int read_batch(struct writelog* wl, int fd)
 {
   int rc;
 
-  if (get_writes(wl, fd, 1) < 0)
-    return -1;
-  writelog_dump(wl);
+  writelog_dump(wl, fd);
 
   do {
     rc = writelog_enqueue_requests(wl);
@@ -441,9 +477,19 @@ int read_loop(struct writelog* wl, int fd)
       return -1;
   } while (rc > 0);
 
+  /* next overwrites the extents, and its ack mustn't race a kick */
+  while (!rc && wl->inflight)
+    if (await_responses(wl, fd) < 0)
+      return -1;
+
   return rc;
 }
 
+int read_loop(struct writelog* wl, int fd)
+{
+  return get_writes(wl, fd, 1, read_batch);
+}
+
 int main(int argc, char* argv[])
 {
   int fd;
@@ -472,18 +518,16 @@ int main(int argc, char* argv[])
 
   switch (cmd) {
   case 'p':
-    if (get_writes(&wl, fd, 1) < 0)
+    if (get_writes(&wl, fd, 1, writelog_dump) < 0)
       return 1;
-    writelog_dump(&wl);
     break;
   case 'c':
     if (ctl_clear_writes(fd) < 0)
       return 1;
     break;
   case 'g':
-    if (get_writes(&wl, fd, 0) < 0)
+    if (get_writes(&wl, fd, 0, writelog_dump) < 0)
       return 1;
-    writelog_dump(&wl);
     break;
   case 'r':
     if (read_loop(&wl, fd) < 0)
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Online coalesce: merge the leaf's parent into the grandparent
+ * while the VBD stays live, then drop the parent from the chain.
+ *
+ *   leaf -> parent -> target -> ...    becomes    leaf -> target -> ...
+ *
+ * The target is reopened read-write for the duration. Only sectors
+ * present in the parent are read (reads of the parent are not
+ * forwarded down the chain) and written to the target through its
+ * driver. The guest never writes either image, and reads which reach
+ * the target only cover sectors the parent doesn't hold, so copies
+ * don't race with guest I/O.
+ *
+ * On-disk, the leaf still names the parent, which holds the same
+ * data as the target now. Reparenting the leaf is left to the
+ * toolstack, as after vhd-util coalesce.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "tapdisk-job.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+
+struct td_coalesce {
+	td_image_t                  *parent;
+	td_image_t                  *target;
+	int                          rdwr;
+};
+
+static void
+tapdisk_coalesce_set_rdonly(td_image_t *image, int rdonly)
+{
+	if (rdonly) {
+		td_flag_set(image->flags, TD_OPEN_RDONLY | TD_OPEN_SHAREABLE);
+		td_flag_set(image->driver->state, TD_DRIVER_RDONLY);
+	} else {
+		td_flag_clear(image->flags, TD_OPEN_RDONLY | TD_OPEN_SHAREABLE);
+		td_flag_clear(image->driver->state, TD_DRIVER_RDONLY);
+	}
+}
+
+static int
+tapdisk_coalesce_reopen(td_vbd_t *vbd, td_image_t *image, int rdonly)
+{
+	int err;
+
+	td_close(image);
+
+	tapdisk_coalesce_set_rdonly(image, rdonly);
+	err = td_open(image);
+	if (!err)
+		return 0;
+
+	EPRINTF("%s: reopening %s %s: %d\n", vbd->name, image->name,
+		(rdonly ? "read-only" : "read-write"), err);
+
+	tapdisk_coalesce_set_rdonly(image, !rdonly);
+	if (td_open(image)) {
+		EPRINTF("%s: lost %s\n", vbd->name, image->name);
+		td_flag_set(vbd->state, TD_VBD_CLOSED | TD_VBD_DEAD);
+	}
+
+	return err;
+}
+
+static int
+tapdisk_coalesce_start(td_job_t *job)
+{
+	td_vbd_t *vbd = job->vbd;
+	td_image_t *image, *parent, *target, *tmp;
+	struct td_coalesce *c;
+	int i, err;
+
+	if (vbd->secondary ||
+	    td_flag_test(vbd->flags,
+			 TD_OPEN_ADD_CACHE |
+			 TD_OPEN_LOCAL_CACHE |
+			 TD_OPEN_VHD_INDEX |
+			 TD_OPEN_REUSE_PARENT)) {
+		EPRINTF("%s: coalesce not supported in this configuration\n",
+			vbd->name);
+		return -EOPNOTSUPP;
+	}
+
+	parent = NULL;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (td_flag_test(image->flags, TD_OPEN_SHAREABLE)) {
+			parent = image;
+			break;
+		}
+
+	if (!parent || parent->type != DISK_TYPE_VHD ||
+	    tapdisk_vbd_is_last_image(vbd, parent)) {
+		EPRINTF("%s: no parent to coalesce\n", vbd->name);
+		return -ENOENT;
+	}
+
+	target = tapdisk_vbd_next_image(parent);
+
+	/* we write the one and drop the other, keep it to ourselves */
+	if (parent->driver->refcnt > 1 || target->driver->refcnt > 1) {
+		EPRINTF("%s: %s or %s shared with other vbds\n",
+			vbd->name, parent->name, target->name);
+		return -EBUSY;
+	}
+
+	if (parent->info.size > target->info.size) {
+		EPRINTF("%s: %s larger than %s\n",
+			vbd->name, parent->name, target->name);
+		return -EINVAL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->parent = parent;
+	c->target = target;
+	job->data = c;
+
+	err = tapdisk_coalesce_reopen(vbd, target, 0);
+	if (err)
+		return err;
+
+	c->rdwr = 1;
+
+	for (i = 0; i < job->depth; i++)
+		td_flag_set(job->reqs[i].vreq.flags, TD_VREQ_NOFORWARD);
+
+	job->cursor = 0;
+	job->end    = parent->info.size;
+
+	DBG(TLOG_WARN, "%s: coalescing %s into %s\n",
+	    vbd->name, parent->name, target->name);
+
+	return 0;
+}
+
+static void
+tapdisk_coalesce_write_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+
+	if (!res)
+		req->job->secs_copied += treq.secs;
+
+	tapdisk_job_complete_secs(req, treq.secs, res);
+}
+
+static void
+tapdisk_coalesce_read_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+	td_job_t *job = req->job;
+	struct td_coalesce *c = job->data;
+
+	/* not in the parent, nothing to merge */
+	if (res == -ENODATA) {
+		job->secs_skipped += treq.secs;
+		tapdisk_job_complete_secs(req, treq.secs, 0);
+		return;
+	}
+
+	if (res || job->state != TD_JOB_RUNNING) {
+		tapdisk_job_complete_secs(req, treq.secs, res);
+		return;
+	}
+
+	treq.op    = TD_OP_WRITE;
+	treq.image = c->target;
+	treq.cb    = tapdisk_coalesce_write_done;
+
+	td_queue_write(c->target, treq);
+}
+
+static void
+tapdisk_coalesce_copy(td_job_t *job, td_job_request_t *req)
+{
+	struct td_coalesce *c = job->data;
+	td_request_t treq;
+
+	tapdisk_job_prep_request(req, &treq, c->parent,
+				 TD_OP_READ, tapdisk_coalesce_read_done);
+
+	td_queue_read(c->parent, treq);
+}
+
+static int
+tapdisk_coalesce_finish(td_job_t *job)
+{
+	struct td_coalesce *c = job->data;
+	td_vbd_t *vbd = job->vbd;
+	int err;
+
+	/* closing flushes the target's footer and batmap */
+	err = tapdisk_coalesce_reopen(vbd, c->target, 1);
+	c->rdwr = 0;
+	if (err)
+		return err;
+
+	DBG(TLOG_WARN, "%s: dropping %s from the chain\n",
+	    vbd->name, c->parent->name);
+
+	tapdisk_vbd_drop_image(vbd, c->parent);
+	c->parent = NULL;
+
+	return 0;
+}
+
+static void
+tapdisk_coalesce_abort(td_job_t *job)
+{
+	struct td_coalesce *c = job->data;
+
+	if (c && c->rdwr) {
+		tapdisk_coalesce_reopen(job->vbd, c->target, 1);
+		c->rdwr = 0;
+	}
+}
+
+const struct td_job_ops tapdisk_job_coalesce_ops = {
+	.name   = "coalesce",
+	.start  = tapdisk_coalesce_start,
+	.copy   = tapdisk_coalesce_copy,
+	.finish = tapdisk_coalesce_finish,
+	.abort  = tapdisk_coalesce_abort,
+};
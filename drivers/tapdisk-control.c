@@ -49,6 +49,7 @@
 #include "blktap2.h"
 #include "blktaplib.h"
 #include "tapdisk-vbd.h"
+#include "tapdisk-job.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
@@ -734,6 +735,12 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		flags |= TD_OPEN_REUSE_PARENT;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_STANDBY)
 		flags |= TD_OPEN_STANDBY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_READAHEAD)
+		flags |= TD_OPEN_READAHEAD;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ASYNC)
+		flags |= TD_OPEN_MIRROR_ASYNC;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_4K)
+		flags |= TD_OPEN_4K;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_SECONDARY) {
 		flags |= TD_OPEN_SECONDARY;
 		secondary_type = tapdisk_disktype_parse_params(
@@ -879,6 +886,9 @@ tapdisk_control_pause_vbd(struct tapdisk_ctl_conn *conn,
 		goto out;
 	}
 
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_KEEP_PARENTS)
+		td_flag_set(vbd->state, TD_VBD_KEEP_PARENTS);
+
 	do {
 		err = tapdisk_vbd_pause(vbd);
 
@@ -979,7 +989,152 @@ out:
 		conn->out.prod += rv;
 }
 
-struct tapdisk_control_info message_infos[] = {
+static void
+tapdisk_control_qos(struct tapdisk_ctl_conn *conn,
+		    tapdisk_message_t *request)
+{
+	tapdisk_message_qos_t *qos = &request->u.qos;
+	tapdisk_message_t response;
+	uint64_t iops[2], bps[2];
+	unsigned int burst_ms;
+	int i, err, weight, percent;
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		iops[i] = qos->iops[i];
+		if (iops[i] == TAPDISK_MESSAGE_QOS_UNCHANGED)
+			iops[i] = vbd->qos.iops[i].rate;
+
+		bps[i] = qos->bps[i];
+		if (bps[i] == TAPDISK_MESSAGE_QOS_UNCHANGED)
+			bps[i] = vbd->qos.bps[i].rate;
+	}
+
+	burst_ms = qos->burst_ms;
+	if (burst_ms == TAPDISK_MESSAGE_QOS_UNCHANGED32)
+		burst_ms = vbd->qos.burst_ms;
+
+	weight = qos->weight;
+	if (qos->weight == TAPDISK_MESSAGE_QOS_UNCHANGED32)
+		weight = vbd->share.weight;
+
+	percent = qos->queue_pct;
+	if (qos->queue_pct == TAPDISK_MESSAGE_QOS_UNCHANGED32)
+		percent = vbd->share.percent;
+
+	tapdisk_vbd_set_qos(vbd, iops, bps, burst_ms);
+	tapdisk_vbd_set_share(vbd, weight, percent);
+	err = 0;
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_QOS_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_kick(struct tapdisk_ctl_conn *conn,
+		     tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	unsigned int usecs, responses;
+	td_vbd_t *vbd;
+	int err;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	usecs = request->u.kick.usecs;
+	if (usecs == TAPDISK_MESSAGE_KICK_UNCHANGED)
+		usecs = vbd->kick_usecs;
+
+	responses = request->u.kick.responses;
+	if (responses == TAPDISK_MESSAGE_KICK_UNCHANGED)
+		responses = vbd->kick_responses;
+
+	tapdisk_vbd_set_kick_moderation(vbd, usecs, responses);
+	err = 0;
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_KICK_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_job(struct tapdisk_ctl_conn *conn,
+		    tapdisk_message_t *request)
+{
+	tapdisk_message_t response;
+	const char *params;
+	td_vbd_t *vbd;
+	int err, type;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	params = NULL;
+
+	switch (request->u.job.type) {
+	case TAPDISK_MESSAGE_JOB_COALESCE:
+		type = TD_JOB_COALESCE;
+		break;
+	case TAPDISK_MESSAGE_JOB_STREAM:
+		type = TD_JOB_STREAM;
+		break;
+	case TAPDISK_MESSAGE_JOB_MIGRATE:
+		type = TD_JOB_MIGRATE;
+		request->u.job.params[sizeof(request->u.job.params) - 1] = 0;
+		params = request->u.job.params;
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
+	}
+
+	switch (request->u.job.op) {
+	case TAPDISK_MESSAGE_JOB_START:
+		err = tapdisk_vbd_start_job(vbd, type,
+					    request->u.job.rate,
+					    request->u.job.depth, params);
+		break;
+	case TAPDISK_MESSAGE_JOB_CANCEL:
+		err = (vbd->job && vbd->job->type == type ?
+		       tapdisk_vbd_cancel_job(vbd) : -ENOENT);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+
+out:
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_JOB_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+
+	tapdisk_control_write_message(conn, &response);
+}
+
+struct tapdisk_control_info message_infos[TAPDISK_MESSAGE_MAX + 1] = {
 	[TAPDISK_MESSAGE_PID] = {
 		.handler = tapdisk_control_get_pid,
 		.flags   = TAPDISK_MSG_REENTER,
@@ -1016,6 +1171,18 @@ struct tapdisk_control_info message_infos[] = {
 		.handler = tapdisk_control_stats,
 		.flags   = TAPDISK_MSG_REENTER,
 	},
+	[TAPDISK_MESSAGE_QOS] = {
+		.handler = tapdisk_control_qos,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_KICK] = {
+		.handler = tapdisk_control_kick,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
+	[TAPDISK_MESSAGE_JOB] = {
+		.handler = tapdisk_control_job,
+		.flags   = TAPDISK_MSG_VERBOSE,
+	},
 };
 
 
@@ -1038,7 +1205,7 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	if (err)
 		goto invalid;
 
-	if (message.type > TAPDISK_MESSAGE_EXIT)
+	if (message.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	info = &message_infos[message.type];
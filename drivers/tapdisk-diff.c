@@ -34,6 +34,8 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "scheduler.h"
@@ -99,43 +101,490 @@ struct tapdisk_stream {
 	struct tapdisk_stream_request    requests[MAX_STREAM_REQUESTS];
 };
 
+/*
+ * Where each sector of the current block lives in one image chain.
+ * owner[i] is the index of the vhd holding sector i, depth for the
+ * base below the last vhd (a raw file or a fixed vhd, addressed by
+ * virtual sector), or -1 if nothing in the chain has it. Images which
+ * aren't vhd or aio are opaque: all base, at no known location.
+ */
+struct tapdisk_diff_chain {
+	vhd_context_t                  **vhds;
+	struct stat                     *st;
+	int                              depth;
+
+	int                              base;
+	int                              base_known;
+	struct stat                      base_st;
+
+	int                             *owner;
+};
+
+struct tapdisk_diff_extent {
+	uint64_t                         sec;
+	uint64_t                         secs;
+};
+
+/*
+ * Sectors of the current block that must be read and compared: those
+ * allocated in either chain, unless both resolve to the same offset in
+ * the same file.
+ */
+struct tapdisk_diff_map {
+	struct tapdisk_diff_chain        chain[2];
+
+	uint64_t                         blk;
+	int                              loaded;
+	char                            *cmp;
+
+	struct tapdisk_diff_extent      *extents;
+	int                              n_extents;
+	int                              max_extents;
+
+	uint64_t                         secs_compared;
+	uint64_t                         secs_differ;
+};
+
 static unsigned int tapdisk_stream_count;
 
 static void tapdisk_stream_close_image(struct tapdisk_stream *);
 
 static char *program;
 static struct tapdisk_stream stream1, stream2;
-static vhd_context_t vhd1;
+static struct tapdisk_diff_map diff;
 
 static void
 usage(FILE *stream)
 {
-	printf("usage: %s <-n type:/path/to/image> <-m type:/path/to/image>\n",
-			program);
+	fprintf(stream, "usage: %s <-n type:/path/to/image> "
+		"<-m type:/path/to/image>\n", program);
+	fprintf(stream, "Compares sectors allocated in either image chain, "
+		"skipping sectors both\nchains share, and prints each "
+		"differing extent as <sector> <count>.\n");
+}
+
+static void
+tapdisk_diff_chain_close(struct tapdisk_diff_chain *c)
+{
+	int i;
+
+	for (i = 0; i < c->depth; i++) {
+		vhd_close(c->vhds[i]);
+		free(c->vhds[i]);
+	}
+
+	free(c->vhds);
+	free(c->st);
+	free(c->owner);
+	memset(c, 0, sizeof(*c));
 }
 
 static int
-open_vhd(const char *path, vhd_context_t *vhd)
+tapdisk_diff_chain_add(struct tapdisk_diff_chain *c, const char *name)
 {
+	vhd_context_t *vhd, **vhds;
+	struct stat *st;
 	int err;
 
-	err = vhd_open(vhd, path, VHD_OPEN_RDONLY);
+	vhd = calloc(1, sizeof(*vhd));
+	if (!vhd)
+		return -ENOMEM;
+
+	err = vhd_open(vhd, name, VHD_OPEN_RDONLY);
 	if (err) {
-		printf("error opening %s: %d\n", path, err);
+		fprintf(stderr, "error opening %s: %d\n", name, err);
+		free(vhd);
 		return err;
 	}
 
+	/* fixed vhds are laid out like raw images */
+	if (!vhd_type_dynamic(vhd)) {
+		vhd_close(vhd);
+		free(vhd);
+		c->base = 1;
+		c->base_known = !stat(name, &c->base_st);
+		return 1;
+	}
+
+	vhds = realloc(c->vhds, (c->depth + 1) * sizeof(*vhds));
+	if (vhds)
+		c->vhds = vhds;
+
+	st = realloc(c->st, (c->depth + 1) * sizeof(*st));
+	if (st)
+		c->st = st;
+
+	if (!vhds || !st) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (vhd->spb != 1 << SPB_SHIFT) {
+		fprintf(stderr, "%s: unsupported block size\n", name);
+		err = -EINVAL;
+		goto fail;
+	}
+
 	err = vhd_get_bat(vhd);
+	if (err) {
+		fprintf(stderr, "error reading BAT for %s: %d\n", name, err);
+		goto fail;
+	}
+
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err) {
+			fprintf(stderr, "error reading batmap for %s: %d\n",
+				name, err);
+			goto fail;
+		}
+	}
+
+	if (stat(name, &c->st[c->depth])) {
+		err = -errno;
+		goto fail;
+	}
+
+	c->vhds[c->depth++] = vhd;
+	return 0;
+
+fail:
+	vhd_close(vhd);
+	free(vhd);
+	return err;
+}
+
+static int
+tapdisk_diff_chain_open(struct tapdisk_diff_chain *c, int type,
+			const char *path)
+{
+	char *name, *parent;
+	vhd_context_t *vhd;
+	int err;
+
+	memset(c, 0, sizeof(*c));
+
+	c->owner = malloc((1 << SPB_SHIFT) * sizeof(*c->owner));
+	if (!c->owner)
+		return -ENOMEM;
+
+	switch (type) {
+	case DISK_TYPE_VHD:
+		break;
+	case DISK_TYPE_AIO:
+		c->base = 1;
+		c->base_known = !stat(path, &c->base_st);
+		return 0;
+	default:
+		c->base = 1;
+		return 0;
+	}
+
+	name = strdup(path);
+	if (!name) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (;;) {
+		err = tapdisk_diff_chain_add(c, name);
+		if (err < 0)
+			goto fail;
+		if (err > 0)
+			break;
+
+		vhd = c->vhds[c->depth - 1];
+		if (vhd->footer.type != HD_TYPE_DIFF)
+			break;
+
+		err = vhd_parent_locator_get(vhd, &parent);
+		if (err) {
+			fprintf(stderr, "%s: error finding parent: %d\n",
+				name, err);
+			goto fail;
+		}
+
+		free(name);
+		name = parent;
+
+		if (vhd_parent_raw(vhd)) {
+			c->base = 1;
+			c->base_known = !stat(name, &c->base_st);
+			break;
+		}
+	}
+
+	free(name);
+	return 0;
+
+fail:
+	free(name);
+	tapdisk_diff_chain_close(c);
+	return err;
+}
+
+static int
+tapdisk_diff_chain_load(struct tapdisk_diff_chain *c, uint64_t blk)
+{
+	vhd_context_t *vhd;
+	int d, i, left, err;
+	char *bm;
+
+	left = 1 << SPB_SHIFT;
+	for (i = 0; i < 1 << SPB_SHIFT; i++)
+		c->owner[i] = -1;
+
+	for (d = 0; d < c->depth && left; d++) {
+		vhd = c->vhds[d];
+
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (vhd_has_batmap(vhd) &&
+		    vhd_batmap_test(vhd, &vhd->batmap, blk)) {
+			for (i = 0; i < 1 << SPB_SHIFT; i++)
+				if (c->owner[i] == -1)
+					c->owner[i] = d;
+			left = 0;
+			break;
+		}
+
+		err = vhd_read_bitmap(vhd, blk, &bm);
+		if (err) {
+			fprintf(stderr, "%s: error reading bitmap %"PRIu64": "
+				"%d\n", vhd->file, blk, err);
+			return err;
+		}
+
+		for (i = 0; i < 1 << SPB_SHIFT; i++)
+			if (c->owner[i] == -1 && vhd_bitmap_test(vhd, bm, i)) {
+				c->owner[i] = d;
+				left--;
+			}
+
+		free(bm);
+	}
+
+	if (left && c->base)
+		for (i = 0; i < 1 << SPB_SHIFT; i++)
+			if (c->owner[i] == -1)
+				c->owner[i] = c->depth;
+
+	return 0;
+}
+
+/*
+ * File and sector holding sector i of block blk, or NULL if unknown.
+ */
+static struct stat *
+tapdisk_diff_chain_locate(struct tapdisk_diff_chain *c, uint64_t blk,
+			  int i, uint64_t *sec)
+{
+	vhd_context_t *vhd;
+	int d = c->owner[i];
+
+	if (d < c->depth) {
+		vhd  = c->vhds[d];
+		*sec = (uint64_t)vhd->bat.bat[blk] + vhd->bm_secs + i;
+		return c->st + d;
+	}
+
+	if (!c->base_known)
+		return NULL;
+
+	*sec = (blk << SPB_SHIFT) + i;
+	return &c->base_st;
+}
+
+static int
+tapdisk_diff_map_load(uint64_t blk)
+{
+	struct tapdisk_diff_chain *c1, *c2;
+	struct stat *st1, *st2;
+	uint64_t sec1, sec2;
+	int i, err;
+
+	c1 = &diff.chain[0];
+	c2 = &diff.chain[1];
+	diff.loaded = 0;
+
+	err = tapdisk_diff_chain_load(c1, blk);
 	if (err)
-	{
-		printf("error reading BAT for %s: %d\n", path, err);
-		vhd_close(vhd);
 		return err;
+
+	err = tapdisk_diff_chain_load(c2, blk);
+	if (err)
+		return err;
+
+	for (i = 0; i < 1 << SPB_SHIFT; i++) {
+		diff.cmp[i] = 0;
+
+		if (c1->owner[i] == -1 && c2->owner[i] == -1)
+			continue;
+
+		if (c1->owner[i] != -1 && c2->owner[i] != -1) {
+			st1 = tapdisk_diff_chain_locate(c1, blk, i, &sec1);
+			st2 = tapdisk_diff_chain_locate(c2, blk, i, &sec2);
+			if (st1 && st2 && sec1 == sec2 &&
+			    st1->st_dev == st2->st_dev &&
+			    st1->st_ino == st2->st_ino)
+				continue;
+		}
+
+		diff.cmp[i] = 1;
+	}
+
+	diff.blk    = blk;
+	diff.loaded = 1;
+	return 0;
+}
+
+/*
+ * Advance *sec to the next sector to compare and return the length of
+ * the run there, within one block. Zero at the end.
+ */
+static int
+tapdisk_diff_map_next(uint64_t *sec, uint64_t end, uint32_t *secs)
+{
+	uint64_t blk;
+	uint32_t i, n;
+	int err;
+
+	*secs = 0;
+
+	while (*sec < end) {
+		blk = *sec >> SPB_SHIFT;
+
+		if (!diff.loaded || diff.blk != blk) {
+			err = tapdisk_diff_map_load(blk);
+			if (err)
+				return err;
+		}
+
+		i = *sec - (blk << SPB_SHIFT);
+		while (i < 1 << SPB_SHIFT && !diff.cmp[i])
+			i++;
+
+		*sec = MIN((blk << SPB_SHIFT) + i, end);
+		if (i == 1 << SPB_SHIFT || *sec == end)
+			continue;
+
+		for (n = 0; i + n < 1 << SPB_SHIFT && diff.cmp[i + n]; n++)
+			;
+
+		*secs = MIN(n, end - *sec);
+		break;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_diff_map_open(int type1, const char *path1,
+		      int type2, const char *path2)
+{
+	int err;
+
+	memset(&diff, 0, sizeof(diff));
+
+	diff.cmp = malloc(1 << SPB_SHIFT);
+	if (!diff.cmp)
+		return -ENOMEM;
+
+	err = tapdisk_diff_chain_open(&diff.chain[0], type1, path1);
+	if (err)
+		return err;
+
+	return tapdisk_diff_chain_open(&diff.chain[1], type2, path2);
+}
+
+static void
+tapdisk_diff_map_close(void)
+{
+	tapdisk_diff_chain_close(&diff.chain[0]);
+	tapdisk_diff_chain_close(&diff.chain[1]);
+	free(diff.extents);
+	free(diff.cmp);
+	memset(&diff, 0, sizeof(diff));
+}
+
+static int
+tapdisk_diff_add_extent(uint64_t sec, uint64_t secs)
+{
+	struct tapdisk_diff_extent *e;
+	int max;
+
+	diff.secs_differ += secs;
+
+	if (diff.n_extents) {
+		e = diff.extents + diff.n_extents - 1;
+		if (e->sec + e->secs == sec) {
+			e->secs += secs;
+			return 0;
+		}
 	}
 
+	if (diff.n_extents == diff.max_extents) {
+		max = diff.max_extents ? diff.max_extents * 2 : 64;
+		e   = realloc(diff.extents, max * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+
+		diff.extents     = e;
+		diff.max_extents = max;
+	}
+
+	e = diff.extents + diff.n_extents++;
+	e->sec  = sec;
+	e->secs = secs;
+
 	return 0;
 }
 
+static int
+tapdisk_diff_extent_cmp(const void *a, const void *b)
+{
+	const struct tapdisk_diff_extent *e1 = a, *e2 = b;
+
+	if (e1->sec < e2->sec)
+		return -1;
+	return e1->sec > e2->sec;
+}
+
+/*
+ * Requests complete out of order, so extents are sorted and merged
+ * once at the end.
+ */
+static void
+tapdisk_diff_print_extents(FILE *stream)
+{
+	struct tapdisk_diff_extent *e, *last;
+	int i;
+
+	qsort(diff.extents, diff.n_extents, sizeof(*diff.extents),
+	      tapdisk_diff_extent_cmp);
+
+	last = NULL;
+	for (i = 0; i < diff.n_extents; i++) {
+		e = diff.extents + i;
+
+		if (last && last->sec + last->secs == e->sec) {
+			last->secs += e->secs;
+			continue;
+		}
+
+		if (last)
+			fprintf(stream, "%"PRIu64" %"PRIu64"\n",
+				last->sec, last->secs);
+		last = e;
+	}
+
+	if (last)
+		fprintf(stream, "%"PRIu64" %"PRIu64"\n",
+			last->sec, last->secs);
+}
+
 static inline void
 tapdisk_stream_poll_initialize(struct tapdisk_stream_poll *p)
 {
@@ -255,13 +704,18 @@ tapdisk_stream_queue_completed(struct tapdisk_stream *s,
 	list_add_tail(&sreq->next, &s->completed_list);
 }
 
+/*
+ * Compare the whole request in one go and only look for the differing
+ * sectors when it doesn't match.
+ */
 static int 
 tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
 		struct tapdisk_stream_request  *sreq2)
 {
 	unsigned long idx1, idx2;
 	char *buf1, *buf2;
-	int result;
+	uint32_t i, n;
+	int err;
 
 	assert(sreq1->seqno == sreq2->seqno);
 	assert(sreq1->secs == sreq2->secs);
@@ -272,8 +726,27 @@ tapdisk_result_compare(struct tapdisk_stream_request *sreq1,
 	buf1 = (char *)MMAP_VADDR(stream1.vbd->ring.vstart, idx1, 0);
 	buf2 = (char *)MMAP_VADDR(stream2.vbd->ring.vstart, idx2, 0);
 
-	result = memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT);
-	return result;
+	diff.secs_compared += sreq1->secs;
+
+	if (!memcmp(buf1, buf2, sreq1->secs << SECTOR_SHIFT))
+		return 0;
+
+	for (i = 0; i < sreq1->secs; i += n) {
+		for (n = 0; i + n < sreq1->secs; n++)
+			if (!memcmp(buf1 + ((i + n) << SECTOR_SHIFT),
+				    buf2 + ((i + n) << SECTOR_SHIFT),
+				    1 << SECTOR_SHIFT))
+				break;
+
+		if (n) {
+			err = tapdisk_diff_add_extent(sreq1->sec + i, n);
+			if (err)
+				return err;
+		} else
+			n = 1;
+	}
+
+	return 0;
 }
 
 static int
@@ -346,10 +819,10 @@ tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
 	}
 
 	if (tapdisk_stream_process_data()) {
-		fprintf(stderr, "mismatch at sector %llu\n",
+		fprintf(stderr, "out of memory at sector %"PRIu64"\n",
 				sreq->sec);
-		stream1.err = EINVAL;
-		stream2.err = EINVAL;
+		stream1.err = ENOMEM;
+		stream2.err = ENOMEM;
 	}
 
 	tapdisk_stream_poll_set(&stream1.poll);
@@ -409,7 +882,8 @@ static void
 tapdisk_stream_enqueue1(void)
 {
 	td_vbd_t *vbd;
-	int i, idx, psize, blk;
+	int i, idx, psize, err;
+	uint32_t run;
 	struct tapdisk_stream *s = &stream1;
 
 	vbd = s->vbd;
@@ -420,15 +894,14 @@ tapdisk_stream_enqueue1(void)
 		td_vbd_request_t *vreq;
 		struct tapdisk_stream_request *sreq;
 
-		/* skip any blocks that are not present in this image */
-		blk = s->cur >> SPB_SHIFT;
-		while (s->cur < s->end && vhd1.bat.bat[blk] == DD_BLK_UNUSED) {
-			//printf("skipping block %d\n", blk);
-			blk++;
-			s->cur = blk << SPB_SHIFT;
+		/* skip sectors neither chain has, or both share */
+		err = tapdisk_diff_map_next(&s->cur, s->end, &run);
+		if (err) {
+			s->err = -err;
+			break;
 		}
 
-		if (s->cur >= s->end)
+		if (!run)
 			break;
 
 		sreq = tapdisk_stream_get_request(s);
@@ -451,13 +924,13 @@ tapdisk_stream_enqueue1(void)
 			uint32_t secs;
 			struct blkif_request_segment *seg = breq->seg + i;
 
-			secs = MIN(s->end - s->cur, psize >> SECTOR_SHIFT);
-			secs = MIN(((blk + 1) << SPB_SHIFT) - s->cur, secs);
+			secs = MIN(run, psize >> SECTOR_SHIFT);
 			if (!secs)
 				break;
 
 			sreq->secs += secs;
 			s->cur     += secs;
+			run        -= secs;
 
 			seg->first_sect = 0;
 			seg->last_sect  = secs - 1;
@@ -730,10 +1203,9 @@ tapdisk_stream_run(struct tapdisk_stream *s)
 int
 main(int argc, char *argv[])
 {
-	int c, err, type1;
+	int c, err, type1, type2;
 	const char *arg1 = NULL, *arg2 = NULL;
-	const disk_info_t *info;
-	const char *path1;
+	const char *path1, *path2;
 
 	err    = 0;
 
@@ -762,14 +1234,15 @@ main(int argc, char *argv[])
 	if (type1 < 0)
 		return type1;
 
-	if (type1 != DISK_TYPE_VHD) {
-		printf("error: first VDI is not VHD\n");
-		return EINVAL;
-	}
+	type2 = tapdisk_disktype_parse_params(arg2, &path2);
+	if (type2 < 0)
+		return type2;
 
-	err = open_vhd(path1, &vhd1);
-	if (err)
+	err = tapdisk_diff_map_open(type1, path1, type2, path2);
+	if (err) {
+		tapdisk_diff_map_close();
 		return err;
+	}
 
 	tapdisk_start_logging("tapdisk-diff", "daemon");
 
@@ -799,16 +1272,22 @@ main(int argc, char *argv[])
 	}
 
 	tapdisk_server_run();
-	
+
+	err = stream1.err ? : stream2.err;
+	if (!err && diff.n_extents) {
+		tapdisk_diff_print_extents(stdout);
+		err = EINVAL;
+	}
+
 out2:
 	tapdisk_stream_release(&stream2);
 out1:
 	tapdisk_stream_release(&stream1);
 out:
-	vhd_close(&vhd1);
+	tapdisk_diff_map_close();
 	tapdisk_stop_logging();
 
-	return err ? : stream1.err;
+	return err;
 
 fail_usage:
 	usage(stderr);
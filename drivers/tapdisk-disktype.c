@@ -104,6 +104,12 @@ static const disk_info_t local_cache_disk = {
        0,
 };
 
+static const disk_info_t readahead_disk = {
+       "ra",
+       "sequential read-ahead (ra)",
+       0,
+};
+
 
 const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_AIO]	= &aio_disk,
@@ -117,6 +123,7 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_VINDEX]	= &vhd_index_disk,
 	[DISK_TYPE_LOG]	= &log_disk,
 	[DISK_TYPE_LOCAL_CACHE] = &local_cache_disk,
+	[DISK_TYPE_READAHEAD]   = &readahead_disk,
 	0,
 };
 
@@ -137,6 +144,7 @@ extern struct tap_disk tapdisk_vhd_index;
 extern struct tap_disk tapdisk_log;
 #endif
 extern struct tap_disk tapdisk_local_cache;
+extern struct tap_disk tapdisk_readahead;
 
 const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_AIO]         = &tapdisk_aio,
@@ -156,6 +164,7 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_LOG]         = &tapdisk_log,
 #endif
 	[DISK_TYPE_LOCAL_CACHE] = &tapdisk_local_cache,
+	[DISK_TYPE_READAHEAD]   = &tapdisk_readahead,
 	0,
 };
 
@@ -46,6 +46,7 @@
 #define DISK_TYPE_LOG         9
 #define DISK_TYPE_REMUS       10
 #define DISK_TYPE_LOCAL_CACHE 11
+#define DISK_TYPE_READAHEAD   12
 
 #define DISK_TYPE_NAME_MAX    32
 
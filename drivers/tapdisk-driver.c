@@ -95,9 +95,26 @@ tapdisk_driver_free(td_driver_t *driver)
 	free(driver);
 }
 
+/*
+ * Share of the vbd whose request is being issued. A driver shared by
+ * several vbds charges each tiocb to the vbd it was queued for, not to
+ * whichever vbd opened the image first.
+ */
+static struct tqueue_share *td_issuing_share;
+
+struct tqueue_share *
+tapdisk_driver_set_issuing_share(struct tqueue_share *share)
+{
+	struct tqueue_share *prev = td_issuing_share;
+
+	td_issuing_share = share;
+	return prev;
+}
+
 void
 tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 {
+	tiocb->share = td_issuing_share ? : driver->share;
 	tapdisk_server_queue_tiocb(tiocb);
 }
 
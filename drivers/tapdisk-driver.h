@@ -54,6 +54,9 @@ struct td_driver_handle {
 	void                        *data;
 	const struct tap_disk       *ops;
 
+	/* aio queue share tiocbs are charged to, NULL for the default */
+	struct tqueue_share         *share;
+
 	struct list_head             next;
 };
 
@@ -61,6 +64,7 @@ td_driver_t *tapdisk_driver_allocate(int, char *, td_flag_t);
 void tapdisk_driver_free(td_driver_t *);
 
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
+struct tqueue_share *tapdisk_driver_set_issuing_share(struct tqueue_share *);
 
 void tapdisk_driver_debug(td_driver_t *);
 
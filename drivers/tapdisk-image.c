@@ -162,6 +162,11 @@ tapdisk_image_check_ring_request(td_image_t *image, blkif_request_t *req)
 	if (req->sector_number + nsects > info->size)
 		goto fail;
 
+	/* the guest was told about 4K sectors, hold it to that */
+	if (td_flag_test(image->flags, TD_OPEN_4K) &&
+	    ((req->sector_number | total) & TD_4K_SECTOR_MASK))
+		goto fail;
+
 	return 0;
 
 fail:
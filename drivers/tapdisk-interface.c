@@ -164,11 +164,20 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+static inline struct tqueue_share *
+td_image_share(td_image_t *image)
+{
+	td_vbd_t *vbd = (td_vbd_t *)image->private;
+
+	return vbd ? &vbd->share : NULL;
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
 	int err;
 	td_driver_t *driver;
+	struct tqueue_share *share;
 
 	driver = image->driver;
 	if (!driver) {
@@ -185,7 +194,9 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	share = tapdisk_driver_set_issuing_share(td_image_share(image));
 	driver->ops->td_queue_write(driver, treq);
+	tapdisk_driver_set_issuing_share(share);
 	return;
 
 fail:
@@ -197,6 +208,7 @@ td_queue_read(td_image_t *image, td_request_t treq)
 {
 	int err;
 	td_driver_t *driver;
+	struct tqueue_share *share;
 
 	driver = image->driver;
 	if (!driver) {
@@ -213,7 +225,9 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	share = tapdisk_driver_set_issuing_share(td_image_share(image));
 	driver->ops->td_queue_read(driver, treq);
+	tapdisk_driver_set_issuing_share(share);
 	return;
 
 fail:
@@ -238,6 +252,16 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+/*
+ * For tiocbs still in flight when their driver closes: the vbd they
+ * were charged to may be freed before they complete.
+ */
+void
+td_unshare_tiocb(struct tiocb *tiocb)
+{
+	tapdisk_server_unshare_tiocb(tiocb);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
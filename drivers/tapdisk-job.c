@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-job.h"
+#include "tapdisk-server.h"
+#include "tapdisk-log.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)                    ((a) <= (b) ? (a) : (b))
+
+static const char *
+tapdisk_job_state_name(int state)
+{
+	switch (state) {
+	case TD_JOB_STARTING:
+		return "starting";
+	case TD_JOB_RUNNING:
+		return "running";
+	case TD_JOB_STOPPING:
+		return "stopping";
+	case TD_JOB_FINISHING:
+		return "finishing";
+	case TD_JOB_DONE:
+		return "done";
+	case TD_JOB_FAILED:
+		return "failed";
+	case TD_JOB_CANCELLED:
+		return "cancelled";
+	default:
+		return "unknown";
+	}
+}
+
+static const struct td_job_ops *
+tapdisk_job_type_ops(int type)
+{
+	switch (type) {
+	case TD_JOB_COALESCE:
+		return &tapdisk_job_coalesce_ops;
+	case TD_JOB_STREAM:
+		return &tapdisk_job_stream_ops;
+	case TD_JOB_MIGRATE:
+		return &tapdisk_job_migrate_ops;
+	default:
+		return NULL;
+	}
+}
+
+int
+tapdisk_job_create(td_vbd_t *vbd, int type, uint64_t rate, int depth,
+		   const char *params, td_job_t **_job)
+{
+	const struct td_job_ops *ops;
+	td_job_request_t *req;
+	td_job_t *job;
+	int i, err;
+
+	ops = tapdisk_job_type_ops(type);
+	if (!ops)
+		return -EINVAL;
+
+	if (!depth)
+		depth = TD_JOB_DEFAULT_DEPTH;
+	if (depth < 0 || depth > TD_JOB_MAX_DEPTH)
+		return -EINVAL;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+
+	job->type  = type;
+	job->ops   = ops;
+	job->vbd   = vbd;
+	job->state = TD_JOB_STARTING;
+	job->depth = depth;
+	job->rate  = rate;
+	INIT_LIST_HEAD(&job->free);
+	INIT_LIST_HEAD(&job->retry);
+
+	tapdisk_qos_init(&job->qos);
+	if (rate) {
+		const uint64_t iops[2] = { 0, 0 };
+		const uint64_t bps[2]  = { rate, rate };
+
+		tapdisk_qos_set(&job->qos, iops, bps, 0);
+	}
+
+	err = -ENOMEM;
+	if (params) {
+		job->params = strdup(params);
+		if (!job->params)
+			goto fail;
+	}
+
+	job->reqs = calloc(depth, sizeof(td_job_request_t));
+	if (!job->reqs)
+		goto fail;
+
+	err = posix_memalign((void **)&job->bufs, getpagesize(),
+			     depth * (TD_JOB_CHUNK_SECS << SECTOR_SHIFT));
+	if (err) {
+		job->bufs = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	for (i = 0; i < depth; i++) {
+		req = &job->reqs[i];
+
+		req->job = job;
+		req->buf = job->bufs + i * (TD_JOB_CHUNK_SECS << SECTOR_SHIFT);
+
+		/* never queued on the vbd, see tapdisk_vbd_forward_request */
+		req->vreq.vbd   = vbd;
+		req->vreq.flags = TD_VREQ_INTERNAL;
+		INIT_LIST_HEAD(&req->vreq.next);
+
+		list_add_tail(&req->next, &job->free);
+	}
+
+	gettimeofday(&job->started, NULL);
+
+	*_job = job;
+	return 0;
+
+fail:
+	tapdisk_job_free(job);
+	return err;
+}
+
+void
+tapdisk_job_free(td_job_t *job)
+{
+	if (!job)
+		return;
+
+	free(job->data);
+	free(job->params);
+	free(job->bufs);
+	free(job->reqs);
+	free(job);
+}
+
+int
+tapdisk_job_busy(td_job_t *job)
+{
+	return job && job->inflight;
+}
+
+int
+tapdisk_job_active(td_job_t *job)
+{
+	return job && job->state < TD_JOB_DONE;
+}
+
+static int
+tapdisk_job_overlap(td_sector_t sec, int secs,
+		    td_sector_t _sec, int _secs)
+{
+	return sec < _sec + _secs && _sec < sec + secs;
+}
+
+/*
+ * Guest writes overlapping a chunk in flight (or bounced for retry)
+ * wait on the vbd queue until the chunk is done.
+ */
+int
+tapdisk_job_write_blocked(td_job_t *job, td_vbd_request_t *vreq)
+{
+	td_sector_t sec;
+	int i, secs;
+
+	if (!job || !job->ops->lock_writes ||
+	    vreq->req.operation != BLKIF_OP_WRITE)
+		return 0;
+
+	sec  = vreq->req.sector_number;
+	secs = tapdisk_vbd_request_secs(vreq);
+
+	for (i = 0; i < job->depth; i++) {
+		td_job_request_t *req = &job->reqs[i];
+
+		if (req->busy &&
+		    tapdisk_job_overlap(sec, secs, req->sec, req->secs))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* conversely, chunks wait for guest writes already issued */
+static int
+tapdisk_job_chunk_blocked(td_job_t *job, td_job_request_t *req)
+{
+	td_vbd_request_t *vreq, *tmp;
+	td_vbd_t *vbd = job->vbd;
+
+	if (!job->ops->lock_writes)
+		return 0;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests)
+		if (vreq->req.operation == BLKIF_OP_WRITE &&
+		    tapdisk_job_overlap(req->sec, req->secs,
+					vreq->req.sector_number,
+					tapdisk_vbd_request_secs(vreq)))
+			return 1;
+
+	return 0;
+}
+
+static int
+tapdisk_job_queue_ready(td_job_t *job)
+{
+	return !td_flag_test(job->vbd->state,
+			     TD_VBD_DEAD |
+			     TD_VBD_CLOSED |
+			     TD_VBD_QUIESCED |
+			     TD_VBD_QUIESCE_REQUESTED |
+			     TD_VBD_PAUSE_REQUESTED |
+			     TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+/*
+ * Jobs borrow the queue quiesce of pause, but back off entirely
+ * whenever somebody else holds it. A pause or shutdown will close
+ * the job along with the vdi.
+ */
+static int
+tapdisk_job_quiesce(td_job_t *job)
+{
+	td_vbd_t *vbd = job->vbd;
+
+	if (td_flag_test(vbd->state,
+			 TD_VBD_DEAD |
+			 TD_VBD_CLOSED |
+			 TD_VBD_PAUSE_REQUESTED |
+			 TD_VBD_PAUSED |
+			 TD_VBD_SHUTDOWN_REQUESTED))
+		return -EBUSY;
+
+	if (!job->quiesced &&
+	    td_flag_test(vbd->state,
+			 TD_VBD_QUIESCED | TD_VBD_QUIESCE_REQUESTED))
+		return -EBUSY;
+
+	job->quiesced = 1;
+
+	return tapdisk_vbd_quiesce_queue(vbd);
+}
+
+static void
+tapdisk_job_unquiesce(td_job_t *job)
+{
+	td_vbd_t *vbd = job->vbd;
+
+	if (!job->quiesced)
+		return;
+
+	job->quiesced = 0;
+
+	if (td_flag_test(vbd->state,
+			 TD_VBD_DEAD |
+			 TD_VBD_PAUSE_REQUESTED |
+			 TD_VBD_SHUTDOWN_REQUESTED))
+		return;
+
+	tapdisk_vbd_start_queue(vbd);
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static void
+tapdisk_job_end(td_job_t *job, int state, int err)
+{
+	tapdisk_job_unquiesce(job);
+
+	job->state = state;
+	job->err   = err;
+	gettimeofday(&job->ended, NULL);
+
+	DBG(TLOG_WARN, "%s: %s job %s: %d, %"PRIu64" secs copied, "
+	    "%"PRIu64" skipped\n", job->vbd->name, job->ops->name,
+	    tapdisk_job_state_name(state), err,
+	    job->secs_copied, job->secs_skipped);
+}
+
+static void
+tapdisk_job_stop(td_job_t *job, int err)
+{
+	switch (job->state) {
+	case TD_JOB_STARTING:
+		tapdisk_job_end(job, (err ? TD_JOB_FAILED : TD_JOB_CANCELLED),
+				err);
+		break;
+
+	case TD_JOB_RUNNING:
+	case TD_JOB_FINISHING:
+		job->state = TD_JOB_STOPPING;
+		job->err   = err;
+		break;
+	}
+}
+
+void
+tapdisk_job_cancel(td_job_t *job)
+{
+	tapdisk_job_stop(job, 0);
+}
+
+/*
+ * The vdi is going away under the job (pause, shutdown). Nothing is
+ * in flight, and the chain will be closed as a whole. Whatever start()
+ * set up outside the chain is undone here.
+ */
+void
+tapdisk_job_close(td_job_t *job)
+{
+	if (!tapdisk_job_active(job))
+		return;
+
+	if (job->state != TD_JOB_STARTING)
+		job->ops->abort(job);
+
+	job->quiesced = 0;
+	tapdisk_job_end(job, TD_JOB_CANCELLED, -ESHUTDOWN);
+}
+
+/*
+ * Guest writes are mirrored from the moment start() returns until
+ * the job ends. Either way, the caller holds on to the image for as
+ * long as the write is in flight, and the job won't end under it
+ * without the queue quiesced.
+ */
+td_image_t *
+tapdisk_job_mirror(td_job_t *job)
+{
+	if (!job || !job->ops->mirror)
+		return NULL;
+
+	if (job->state != TD_JOB_RUNNING && job->state != TD_JOB_FINISHING)
+		return NULL;
+
+	return job->ops->mirror(job);
+}
+
+void
+tapdisk_job_mirror_failed(td_job_t *job, td_request_t treq, int err)
+{
+	job->ops->mirror_failed(job, treq, err);
+}
+
+void
+tapdisk_job_prep_request(td_job_request_t *req, td_request_t *treq,
+			 td_image_t *image, int op, td_callback_t cb)
+{
+	memset(treq, 0, sizeof(*treq));
+
+	treq->op      = op;
+	treq->buf     = req->buf;
+	treq->sec     = req->sec;
+	treq->secs    = req->secs;
+	treq->image   = image;
+	treq->cb      = cb;
+	treq->cb_data = req;
+	treq->private = &req->vreq;
+}
+
+void
+tapdisk_job_complete_secs(td_job_request_t *req, int secs, int err)
+{
+	td_job_t *job = req->job;
+
+	if (err && (!req->error || req->error == -EBUSY))
+		req->error = err;
+
+	req->secs_pending -= secs;
+	if (req->secs_pending)
+		return;
+
+	job->inflight--;
+
+	if (req->error == -EBUSY && job->state == TD_JOB_RUNNING) {
+		job->retries++;
+		list_add_tail(&req->next, &job->retry);
+		return;
+	}
+
+	if (req->error && req->error != -EBUSY) {
+		ERR(req->error, "%s: %s job: chunk 0x%08"PRIx64
+		    " secs 0x%04x failed", job->vbd->name,
+		    job->ops->name, req->sec, req->secs);
+		tapdisk_job_stop(job, req->error);
+	} else if (!req->error)
+		job->secs_done += req->secs;
+
+	req->busy = 0;
+	list_add_tail(&req->next, &job->free);
+}
+
+static void
+tapdisk_job_issue_request(td_job_t *job, td_job_request_t *req)
+{
+	list_del_init(&req->next);
+
+	req->error        = 0;
+	req->busy         = 1;
+	req->secs_pending = req->secs;
+	job->inflight++;
+
+	job->ops->copy(job, req);
+}
+
+static void
+tapdisk_job_issue(td_job_t *job)
+{
+	td_job_request_t *req;
+	struct timeval now;
+	int retries;
+
+	if (!tapdisk_job_queue_ready(job))
+		return;
+
+	/* chunks bounced with -EBUSY get one more go per pass */
+	retries = 0;
+	list_for_each_entry(req, &job->retry, next)
+		retries++;
+
+	while (retries--) {
+		req = list_entry(job->retry.next, td_job_request_t, next);
+		if (tapdisk_job_chunk_blocked(job, req)) {
+			list_move_tail(&req->next, &job->retry);
+			continue;
+		}
+		tapdisk_job_issue_request(job, req);
+	}
+
+	if (!list_empty(&job->retry))
+		tapdisk_server_set_max_timeout_us(TD_JOB_THROTTLE_USECS);
+
+	gettimeofday(&now, NULL);
+
+	while (job->state == TD_JOB_RUNNING &&
+	       !list_empty(&job->free) && job->cursor < job->end) {
+		req = list_entry(job->free.next, td_job_request_t, next);
+
+		req->sec  = job->cursor;
+		req->secs = MIN(job->end - job->cursor, TD_JOB_CHUNK_SECS);
+
+		if (tapdisk_job_chunk_blocked(job, req)) {
+			tapdisk_server_set_max_timeout_us(TD_JOB_THROTTLE_USECS);
+			break;
+		}
+
+		if (!tapdisk_qos_admit(&job->qos, 0,
+				       req->secs << SECTOR_SHIFT, &now)) {
+			tapdisk_server_set_max_timeout_us(TD_JOB_THROTTLE_USECS);
+			break;
+		}
+
+		job->cursor += req->secs;
+		tapdisk_job_issue_request(job, req);
+	}
+}
+
+void
+tapdisk_job_check(td_job_t *job)
+{
+	int err;
+
+	switch (job->state) {
+	case TD_JOB_STARTING:
+		err = tapdisk_job_quiesce(job);
+		if (err)
+			return;
+
+		err = job->ops->start(job);
+		if (err) {
+			tapdisk_job_end(job, TD_JOB_FAILED, err);
+			return;
+		}
+
+		tapdisk_job_unquiesce(job);
+		job->state = TD_JOB_RUNNING;
+
+		DBG(TLOG_WARN, "%s: %s job started: 0x%08"PRIx64" secs, "
+		    "rate %"PRIu64", depth %d\n", job->vbd->name,
+		    job->ops->name, job->end, job->rate, job->depth);
+		/* fall through */
+
+	case TD_JOB_RUNNING:
+		tapdisk_job_issue(job);
+
+		if (job->state != TD_JOB_RUNNING || job->inflight ||
+		    job->cursor < job->end || !list_empty(&job->retry))
+			return;
+
+		job->state = TD_JOB_FINISHING;
+		/* fall through */
+
+	case TD_JOB_FINISHING:
+		err = tapdisk_job_quiesce(job);
+		if (err)
+			return;
+
+		if (job->ops->refill && job->ops->refill(job)) {
+			tapdisk_job_unquiesce(job);
+			job->state = TD_JOB_RUNNING;
+			tapdisk_job_issue(job);
+			return;
+		}
+
+		err = job->ops->finish(job);
+		tapdisk_job_end(job, (err ? TD_JOB_FAILED : TD_JOB_DONE), err);
+		return;
+
+	case TD_JOB_STOPPING:
+		if (job->inflight)
+			return;
+
+		err = tapdisk_job_quiesce(job);
+		if (err)
+			return;
+
+		job->ops->abort(job);
+		tapdisk_job_end(job,
+				(job->err ? TD_JOB_FAILED : TD_JOB_CANCELLED),
+				job->err);
+		return;
+	}
+}
+
+void
+tapdisk_job_stats(td_job_t *job, td_stats_t *st)
+{
+	struct timeval now, delta;
+
+	if (tapdisk_job_active(job))
+		gettimeofday(&now, NULL);
+	else
+		now = job->ended;
+	timersub(&now, &job->started, &delta);
+
+	tapdisk_stats_field(st, "type", "s", job->ops->name);
+	tapdisk_stats_field(st, "state", "s",
+			    tapdisk_job_state_name(job->state));
+	tapdisk_stats_field(st, "error", "d", job->err);
+
+	tapdisk_stats_field(st, "progress", "[");
+	tapdisk_stats_val(st, "llu", job->secs_done);
+	tapdisk_stats_val(st, "llu", job->end);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "copied", "llu", job->secs_copied);
+	tapdisk_stats_field(st, "skipped", "llu", job->secs_skipped);
+	tapdisk_stats_field(st, "retries", "llu", job->retries);
+	tapdisk_stats_field(st, "rate", "llu", job->rate);
+	tapdisk_stats_field(st, "depth", "d", job->depth);
+	tapdisk_stats_field(st, "inflight", "d", job->inflight);
+	tapdisk_stats_field(st, "usecs", "llu",
+			    (unsigned long long)delta.tv_sec * 1000000ULL +
+			    delta.tv_usec);
+
+	if (job->ops->stats)
+		job->ops->stats(job, st);
+}
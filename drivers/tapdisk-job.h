@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_JOB_H_
+#define _TAPDISK_JOB_H_
+
+#include <sys/time.h>
+
+#include "tapdisk.h"
+#include "tapdisk-qos.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Background block jobs. A job walks the virtual disk in chunks,
+ * issuing its own requests down the image chain next to guest I/O,
+ * throttled by a token bucket and a fixed queue depth. Jobs run from
+ * tapdisk_vbd_check_state(). Chain changes at start and end are made
+ * with the VBD queue briefly quiesced.
+ */
+
+#define TD_JOB_COALESCE             1
+#define TD_JOB_STREAM               2
+#define TD_JOB_MIGRATE              3
+
+#define TD_JOB_STARTING             1
+#define TD_JOB_RUNNING              2
+#define TD_JOB_STOPPING             3
+#define TD_JOB_FINISHING            4
+#define TD_JOB_DONE                 5
+#define TD_JOB_FAILED               6
+#define TD_JOB_CANCELLED            7
+
+#define TD_JOB_DEFAULT_DEPTH        4
+#define TD_JOB_MAX_DEPTH            32
+#define TD_JOB_CHUNK_SECS           2048
+#define TD_JOB_THROTTLE_USECS       10000
+
+typedef struct td_job               td_job_t;
+typedef struct td_job_request       td_job_request_t;
+
+struct td_job_request {
+	td_vbd_request_t            vreq;
+	td_job_t                   *job;
+
+	char                       *buf;
+	td_sector_t                 sec;
+	int                         secs;
+	int                         secs_pending;
+	int                         error;
+	int                         busy;
+
+	struct list_head            next;
+};
+
+struct td_job_ops {
+	const char                 *name;
+	/* guest writes and chunks in flight exclude each other */
+	int                          lock_writes;
+
+	/* queue quiesced: set up the chain, pick the range to walk */
+	int  (*start)               (td_job_t *);
+	/* copy one chunk, tapdisk_job_complete_secs() as it completes */
+	void (*copy)                (td_job_t *, td_job_request_t *);
+	/* queue quiesced, range done: commit chain changes */
+	int  (*finish)              (td_job_t *);
+	/* queue quiesced, nothing in flight: undo start() */
+	void (*abort)               (td_job_t *);
+
+	/* optional: queue quiesced, range done: walk another range,
+	 * return nonzero to keep running instead of finishing */
+	int  (*refill)              (td_job_t *);
+	/* optional: image guest writes also go to while running */
+	td_image_t *(*mirror)       (td_job_t *);
+	/* a guest write to mirror() failed, the guest never knows */
+	void (*mirror_failed)       (td_job_t *, td_request_t, int err);
+	/* optional: type specific stats */
+	void (*stats)               (td_job_t *, td_stats_t *);
+};
+
+struct td_job {
+	int                         type;
+	const struct td_job_ops    *ops;
+	td_vbd_t                   *vbd;
+	/* type specific argument, e.g. the migration target */
+	char                       *params;
+
+	int                         state;
+	int                         err;
+	int                         quiesced;
+
+	td_sector_t                 cursor;
+	td_sector_t                 end;
+
+	int                         depth;
+	int                         inflight;
+	uint64_t                    rate;
+	struct td_qos               qos;
+
+	td_job_request_t           *reqs;
+	char                       *bufs;
+	struct list_head            free;
+	struct list_head            retry;
+
+	uint64_t                    secs_done;
+	uint64_t                    secs_copied;
+	uint64_t                    secs_skipped;
+	uint64_t                    retries;
+
+	struct timeval              started;
+	struct timeval              ended;
+
+	void                       *data;
+};
+
+int tapdisk_job_create(td_vbd_t *, int type, uint64_t rate, int depth,
+		       const char *params, td_job_t **);
+void tapdisk_job_free(td_job_t *);
+void tapdisk_job_check(td_job_t *);
+void tapdisk_job_cancel(td_job_t *);
+void tapdisk_job_close(td_job_t *);
+int tapdisk_job_busy(td_job_t *);
+int tapdisk_job_active(td_job_t *);
+int tapdisk_job_write_blocked(td_job_t *, td_vbd_request_t *);
+void tapdisk_job_stats(td_job_t *, td_stats_t *);
+td_image_t *tapdisk_job_mirror(td_job_t *);
+void tapdisk_job_mirror_failed(td_job_t *, td_request_t, int err);
+
+void tapdisk_job_prep_request(td_job_request_t *, td_request_t *,
+			      td_image_t *, int op, td_callback_t);
+void tapdisk_job_complete_secs(td_job_request_t *, int secs, int err);
+
+extern const struct td_job_ops tapdisk_job_coalesce_ops;
+extern const struct td_job_ops tapdisk_job_stream_ops;
+extern const struct td_job_ops tapdisk_job_migrate_ops;
+
+#endif
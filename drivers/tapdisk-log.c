@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -65,10 +66,15 @@ struct tlog {
 
 static struct tlog tapdisk_log;
 
+/* drivers may log from open threads, see tapdisk_vbd_open_parents() */
+static pthread_mutex_t tapdisk_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 tlog_logfile_vprint(const char *fmt, va_list ap)
 {
+	pthread_mutex_lock(&tapdisk_log_lock);
 	tapdisk_logfile_vprintf(&tapdisk_log.logfile, fmt, ap);
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 static void
@@ -183,7 +189,9 @@ tlog_vsyslog(int prio, const char *fmt, va_list ap)
 {
 	td_syslog_t *syslog = &tapdisk_log.syslog;
 
+	pthread_mutex_lock(&tapdisk_log_lock);
 	tapdisk_vsyslog(syslog, prio, fmt, ap);
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
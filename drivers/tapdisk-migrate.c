@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Live migration (drive-mirror): move the vbd onto a new image.
+ *
+ * The target must be a new image without a parent, the size of the
+ * vbd. Every chunk of the virtual disk is read through the chain and
+ * written to the target. Chunks reading as zeros are skipped only if
+ * the target is a dynamic VHD with nothing allocated, which already
+ * reads back as zeros; other targets get the zeros written.
+ * Meanwhile, guest writes go to the target as well as the chain.
+ * Guest writes and chunks in flight exclude each other, so the copy
+ * never overtakes a write.
+ *
+ * A chunk is copied while its bit is set in the dirty map. All start
+ * out dirty; a guest write the target fails re-dirties its chunks
+ * (and the target no longer counts as empty). Once the walk is done,
+ * with the queue quiesced, remaining dirty chunks make another pass.
+ * When none are left, the vbd is reopened on the target, like a
+ * pause/resume with a new path.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libvhd.h"
+#include "tapdisk-job.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-log.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
+
+#define TD_MIGRATE_MAX_PASSES        8
+
+#define BITS_PER_WORD                (8 * sizeof(unsigned long))
+
+struct td_migrate {
+	td_image_t                  *target;
+	const char                  *path;
+	int                          type;
+
+	/* sparse target, no failed writes to it yet: zero chunks
+	 * are skipped */
+	int                          empty;
+	int                          pass;
+	uint64_t                     mirror_errors;
+
+	uint64_t                     chunks;
+	uint64_t                     dirty_chunks;
+	unsigned long                dirty[0];
+};
+
+static inline int
+tapdisk_migrate_test(struct td_migrate *m, uint64_t chunk)
+{
+	return !!(m->dirty[chunk / BITS_PER_WORD] &
+		  (1UL << (chunk % BITS_PER_WORD)));
+}
+
+static void
+tapdisk_migrate_set(struct td_migrate *m, uint64_t chunk)
+{
+	if (chunk >= m->chunks || tapdisk_migrate_test(m, chunk))
+		return;
+
+	m->dirty[chunk / BITS_PER_WORD] |= 1UL << (chunk % BITS_PER_WORD);
+	m->dirty_chunks++;
+}
+
+static void
+tapdisk_migrate_clear(struct td_migrate *m, uint64_t chunk)
+{
+	if (!tapdisk_migrate_test(m, chunk))
+		return;
+
+	m->dirty[chunk / BITS_PER_WORD] &= ~(1UL << (chunk % BITS_PER_WORD));
+	m->dirty_chunks--;
+}
+
+static void
+tapdisk_migrate_mark(struct td_migrate *m, td_sector_t sec, int secs)
+{
+	uint64_t chunk;
+
+	for (chunk = sec / TD_JOB_CHUNK_SECS;
+	     chunk <= (sec + secs - 1) / TD_JOB_CHUNK_SECS; chunk++)
+		tapdisk_migrate_set(m, chunk);
+}
+
+/* whether the target reads back as zeros: a VHD with an empty BAT */
+static int
+tapdisk_migrate_target_empty(struct td_migrate *m)
+{
+	vhd_context_t vhd;
+	uint32_t i;
+	int err, empty;
+
+	if (m->type != DISK_TYPE_VHD)
+		return 0;
+
+	err = vhd_open(&vhd, m->path, VHD_OPEN_RDONLY);
+	if (err)
+		return 0;
+
+	empty = 0;
+
+	if (vhd_type_dynamic(&vhd) && !vhd_get_bat(&vhd)) {
+		for (i = 0; i < vhd.bat.entries; i++)
+			if (vhd.bat.bat[i] != DD_BLK_UNUSED)
+				break;
+		empty = (i == vhd.bat.entries);
+	}
+
+	vhd_close(&vhd);
+	return empty;
+}
+
+static void
+tapdisk_migrate_close_target(struct td_migrate *m)
+{
+	if (!m || !m->target)
+		return;
+
+	td_close(m->target);
+	tapdisk_image_free(m->target);
+	m->target = NULL;
+}
+
+static int
+tapdisk_migrate_open_target(td_job_t *job, struct td_migrate *m)
+{
+	td_vbd_t *vbd = job->vbd;
+	td_image_t *leaf, *target;
+	td_disk_id_t id;
+	int err;
+
+	leaf   = tapdisk_vbd_leaf_image(vbd);
+	target = tapdisk_image_allocate((char *)m->path, m->type, 0, vbd);
+	if (!target)
+		return -ENOMEM;
+
+	err = td_open(target);
+	if (err) {
+		EPRINTF("%s: opening %s: %d\n", vbd->name, m->path, err);
+		tapdisk_image_free(target);
+		return err;
+	}
+
+	m->target = target;
+
+	err = td_get_parent_id(target, &id);
+	if (err != TD_NO_PARENT) {
+		if (!err) {
+			free(id.name);
+			err = -EINVAL;
+		}
+		EPRINTF("%s: %s has a parent\n", vbd->name, m->path);
+		goto fail;
+	}
+
+	if (target->info.size != leaf->info.size) {
+		EPRINTF("%s: %s size %llu != vbd size %llu\n",
+			vbd->name, m->path,
+			(unsigned long long)target->info.size,
+			(unsigned long long)leaf->info.size);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_migrate_close_target(m);
+	return err;
+}
+
+static int
+tapdisk_migrate_start(td_job_t *job)
+{
+	td_vbd_t *vbd = job->vbd;
+	struct td_migrate *m;
+	const char *path;
+	uint64_t i, chunks;
+	td_sector_t size;
+	int type, err;
+
+	if (vbd->secondary ||
+	    td_flag_test(vbd->flags,
+			 TD_OPEN_ADD_CACHE |
+			 TD_OPEN_LOCAL_CACHE |
+			 TD_OPEN_LOG_DIRTY |
+			 TD_OPEN_VHD_INDEX |
+			 TD_OPEN_REUSE_PARENT)) {
+		EPRINTF("%s: migration not supported in this configuration\n",
+			vbd->name);
+		return -EOPNOTSUPP;
+	}
+
+	if (!job->params)
+		return -EINVAL;
+
+	type = tapdisk_disktype_parse_params(job->params, &path);
+	if (type < 0)
+		return type;
+
+	size   = tapdisk_vbd_leaf_image(vbd)->info.size;
+	chunks = (size + TD_JOB_CHUNK_SECS - 1) / TD_JOB_CHUNK_SECS;
+
+	m = calloc(1, sizeof(*m) + ((chunks + BITS_PER_WORD - 1) /
+				    BITS_PER_WORD) * sizeof(unsigned long));
+	if (!m)
+		return -ENOMEM;
+
+	m->path   = path;
+	m->type   = type;
+	m->empty  = tapdisk_migrate_target_empty(m);
+	m->chunks = chunks;
+	job->data = m;
+
+	err = tapdisk_migrate_open_target(job, m);
+	if (err)
+		return err;
+
+	for (i = 0; i < chunks; i++)
+		tapdisk_migrate_set(m, i);
+
+	job->cursor = 0;
+	job->end    = size;
+
+	DBG(TLOG_WARN, "%s: migrating to %s\n", vbd->name, job->params);
+
+	return 0;
+}
+
+static void
+tapdisk_migrate_write_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+	struct td_migrate *m = req->job->data;
+
+	if (!res)
+		req->job->secs_copied += treq.secs;
+	else if (res == -EBUSY)
+		/* bounced, the retry has to copy it again */
+		tapdisk_migrate_mark(m, req->sec, req->secs);
+
+	tapdisk_job_complete_secs(req, treq.secs, res);
+}
+
+static int
+tapdisk_migrate_zero(const char *buf, int secs)
+{
+	const unsigned long *p = (const unsigned long *)buf;
+	size_t i, n = (secs << SECTOR_SHIFT) / sizeof(*p);
+
+	for (i = 0; i < n; i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static void
+tapdisk_migrate_read_done(td_request_t treq, int res)
+{
+	td_job_request_t *req = treq.cb_data;
+	td_job_t *job = req->job;
+	struct td_migrate *m = job->data;
+
+	if (res == -EBUSY)
+		tapdisk_migrate_mark(m, req->sec, req->secs);
+
+	if (res || job->state != TD_JOB_RUNNING) {
+		tapdisk_job_complete_secs(req, treq.secs, res);
+		return;
+	}
+
+	if (m->empty && tapdisk_migrate_zero(treq.buf, treq.secs)) {
+		job->secs_skipped += treq.secs;
+		tapdisk_job_complete_secs(req, treq.secs, 0);
+		return;
+	}
+
+	treq.op    = TD_OP_WRITE;
+	treq.image = m->target;
+	treq.cb    = tapdisk_migrate_write_done;
+
+	td_queue_write(m->target, treq);
+}
+
+static void
+tapdisk_migrate_copy(td_job_t *job, td_job_request_t *req)
+{
+	struct td_migrate *m = job->data;
+	uint64_t chunk = req->sec / TD_JOB_CHUNK_SECS;
+	td_image_t *leaf;
+	td_request_t treq;
+
+	if (!tapdisk_migrate_test(m, chunk)) {
+		job->secs_skipped += req->secs;
+		tapdisk_job_complete_secs(req, req->secs, 0);
+		return;
+	}
+
+	tapdisk_migrate_clear(m, chunk);
+
+	leaf = tapdisk_vbd_leaf_image(job->vbd);
+	tapdisk_job_prep_request(req, &treq, leaf,
+				 TD_OP_READ, tapdisk_migrate_read_done);
+
+	td_queue_read(leaf, treq);
+}
+
+static int
+tapdisk_migrate_refill(td_job_t *job)
+{
+	struct td_migrate *m = job->data;
+	uint64_t chunk;
+
+	if (!m->dirty_chunks || m->pass >= TD_MIGRATE_MAX_PASSES)
+		return 0;
+
+	for (chunk = 0; !tapdisk_migrate_test(m, chunk); chunk++)
+		;
+
+	m->pass++;
+	job->cursor    = chunk * TD_JOB_CHUNK_SECS;
+	job->secs_done = job->cursor;
+
+	DBG(TLOG_WARN, "%s: migration pass %d: %"PRIu64" dirty chunks\n",
+	    job->vbd->name, m->pass, m->dirty_chunks);
+
+	return 1;
+}
+
+static td_image_t *
+tapdisk_migrate_mirror(td_job_t *job)
+{
+	struct td_migrate *m = job->data;
+
+	return m->target;
+}
+
+static void
+tapdisk_migrate_mirror_failed(td_job_t *job, td_request_t treq, int err)
+{
+	struct td_migrate *m = job->data;
+
+	if (!m->mirror_errors++)
+		ERR(err, "%s: migration: write to %s failed, "
+		    "copying again", job->vbd->name, m->path);
+
+	m->empty = 0;
+	tapdisk_migrate_mark(m, treq.sec, treq.secs);
+}
+
+static int
+tapdisk_migrate_finish(td_job_t *job)
+{
+	struct td_migrate *m = job->data;
+	td_vbd_t *vbd = job->vbd;
+	int err;
+
+	if (m->dirty_chunks) {
+		EPRINTF("%s: migration: %"PRIu64" chunks still dirty "
+			"after %d passes\n", vbd->name, m->dirty_chunks,
+			m->pass);
+		tapdisk_migrate_close_target(m);
+		return -EIO;
+	}
+
+	/* closing flushes the target, the vbd opens it afresh */
+	tapdisk_migrate_close_target(m);
+
+	DBG(TLOG_WARN, "%s: pivoting to %s\n", vbd->name, job->params);
+
+	err = tapdisk_vbd_reopen_vdi(vbd, m->type, m->path);
+	if (err)
+		EPRINTF("%s: pivot to %s failed: %d\n",
+			vbd->name, job->params, err);
+
+	return err;
+}
+
+static void
+tapdisk_migrate_abort(td_job_t *job)
+{
+	tapdisk_migrate_close_target(job->data);
+}
+
+static void
+tapdisk_migrate_stats(td_job_t *job, td_stats_t *st)
+{
+	struct td_migrate *m = job->data;
+
+	if (!m)
+		return;
+
+	tapdisk_stats_field(st, "target", "s", job->params);
+	tapdisk_stats_field(st, "pass", "d", m->pass);
+	tapdisk_stats_field(st, "dirty", "[");
+	tapdisk_stats_val(st, "llu", m->dirty_chunks);
+	tapdisk_stats_val(st, "llu", m->chunks);
+	tapdisk_stats_leave(st, ']');
+	tapdisk_stats_field(st, "mirror_errors", "llu", m->mirror_errors);
+}
+
+const struct td_job_ops tapdisk_job_migrate_ops = {
+	.name          = "migrate",
+	.lock_writes   = 1,
+	.start         = tapdisk_migrate_start,
+	.copy          = tapdisk_migrate_copy,
+	.finish        = tapdisk_migrate_finish,
+	.abort         = tapdisk_migrate_abort,
+	.refill        = tapdisk_migrate_refill,
+	.mirror        = tapdisk_migrate_mirror,
+	.mirror_failed = tapdisk_migrate_mirror_failed,
+	.stats         = tapdisk_migrate_stats,
+};
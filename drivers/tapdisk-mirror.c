@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-mirror.h"
+#include "tapdisk-server.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-log.h"
+
+#define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
+#define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
+
+#define MIN(a, b)                    ((a) <= (b) ? (a) : (b))
+
+#define BITS_PER_WORD                (8 * sizeof(unsigned long))
+
+static inline int
+tapdisk_mirror_test(td_mirror_t *m, uint64_t blk)
+{
+	return !!(m->dirty[blk / BITS_PER_WORD] &
+		  (1UL << (blk % BITS_PER_WORD)));
+}
+
+static inline void
+tapdisk_mirror_set(td_mirror_t *m, uint64_t blk)
+{
+	if (tapdisk_mirror_test(m, blk))
+		return;
+
+	m->dirty[blk / BITS_PER_WORD] |= 1UL << (blk % BITS_PER_WORD);
+	m->dirty_blocks++;
+}
+
+static inline void
+tapdisk_mirror_clear(td_mirror_t *m, uint64_t blk)
+{
+	if (!tapdisk_mirror_test(m, blk))
+		return;
+
+	m->dirty[blk / BITS_PER_WORD] &= ~(1UL << (blk % BITS_PER_WORD));
+	m->dirty_blocks--;
+}
+
+static int64_t
+tapdisk_mirror_next_dirty(td_mirror_t *m, uint64_t blk)
+{
+	unsigned long word;
+
+	while (blk < m->blocks) {
+		word = m->dirty[blk / BITS_PER_WORD] >> (blk % BITS_PER_WORD);
+		if (!word) {
+			blk = (blk / BITS_PER_WORD + 1) * BITS_PER_WORD;
+			continue;
+		}
+
+		blk += __builtin_ctzl(word);
+		return blk < m->blocks ? (int64_t)blk : -1;
+	}
+
+	return -1;
+}
+
+int
+tapdisk_mirror_create(td_vbd_t *vbd, td_sector_t sectors, td_mirror_t **_m)
+{
+	td_mirror_request_t *req;
+	td_mirror_t *m;
+	size_t words;
+	char *env;
+	int i, err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	m->vbd     = vbd;
+	m->sectors = sectors;
+	m->blocks  = (sectors + TD_MIRROR_BLOCK_SECS - 1) >>
+		TD_MIRROR_BLOCK_SHIFT;
+	m->depth   = TD_MIRROR_DEFAULT_DEPTH;
+	INIT_LIST_HEAD(&m->free);
+	INIT_LIST_HEAD(&m->busy);
+
+	env = getenv("TAPDISK2_MIRROR_DEPTH");
+	if (env) {
+		i = atoi(env);
+		if (i > TD_MIRROR_RESYNC_DEPTH && i <= TD_MIRROR_MAX_DEPTH)
+			m->depth = i;
+	}
+
+	err   = -ENOMEM;
+	words = (m->blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	m->dirty = calloc(words ? : 1, sizeof(unsigned long));
+	if (!m->dirty)
+		goto fail;
+
+	m->reqs = calloc(m->depth, sizeof(td_mirror_request_t));
+	if (!m->reqs)
+		goto fail;
+
+	err = posix_memalign((void **)&m->bufs, getpagesize(),
+			     m->depth * (TD_MIRROR_BLOCK_SECS << SECTOR_SHIFT));
+	if (err) {
+		m->bufs = NULL;
+		err = -err;
+		goto fail;
+	}
+
+	for (i = 0; i < m->depth; i++) {
+		req = &m->reqs[i];
+
+		req->mirror = m;
+		req->buf    = m->bufs + i * (TD_MIRROR_BLOCK_SECS << SECTOR_SHIFT);
+
+		/* never queued on the vbd, see tapdisk_vbd_forward_request */
+		req->vreq.vbd   = vbd;
+		req->vreq.flags = TD_VREQ_INTERNAL;
+		INIT_LIST_HEAD(&req->vreq.next);
+
+		list_add_tail(&req->next, &m->free);
+	}
+
+	env = getenv("TAPDISK2_MIRROR_RESYNC");
+	if (env && atoi(env))
+		tapdisk_mirror_mark(m, 0, sectors);
+
+	*_m = m;
+	return 0;
+
+fail:
+	tapdisk_mirror_free(m);
+	return err;
+}
+
+void
+tapdisk_mirror_free(td_mirror_t *m)
+{
+	if (!m)
+		return;
+
+	free(m->bufs);
+	free(m->reqs);
+	free(m->dirty);
+	free(m);
+}
+
+void
+tapdisk_mirror_attach(td_mirror_t *m, td_image_t *image)
+{
+	m->image = image;
+	timerclear(&m->retry_at);
+
+	DBG(TLOG_WARN, "%s: async mirror to %s, depth %d, "
+	    "%"PRIu64" dirty blocks\n", m->vbd->name, image->name,
+	    m->depth, m->dirty_blocks);
+}
+
+/*
+ * The vdi is being closed (pause, shutdown). Nothing is in flight;
+ * the dirty map stays with the vbd for the next attach.
+ */
+void
+tapdisk_mirror_detach(td_mirror_t *m)
+{
+	if (!m)
+		return;
+
+	m->image = NULL;
+}
+
+int
+tapdisk_mirror_busy(td_mirror_t *m)
+{
+	return m && m->inflight;
+}
+
+void
+tapdisk_mirror_mark(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	uint64_t blk, last;
+
+	if (!m || !secs || sec >= m->sectors)
+		return;
+
+	blk  = sec >> TD_MIRROR_BLOCK_SHIFT;
+	last = (sec + secs - 1) >> TD_MIRROR_BLOCK_SHIFT;
+	if (last >= m->blocks)
+		last = m->blocks - 1;
+
+	for (; blk <= last; blk++)
+		tapdisk_mirror_set(m, blk);
+}
+
+static int
+tapdisk_mirror_overlap(td_sector_t sec, int secs,
+		       td_sector_t _sec, int _secs)
+{
+	return sec < _sec + _secs && _sec < sec + secs;
+}
+
+/* copies to the secondary may complete in any order, none may overlap */
+static int
+tapdisk_mirror_blocked(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	td_mirror_request_t *req;
+
+	list_for_each_entry(req, &m->busy, next)
+		if (tapdisk_mirror_overlap(sec, secs, req->sec, req->secs))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * A block read back while a guest write to it is still on its way to
+ * the primary may miss the write, so resync waits for those too.
+ */
+static int
+tapdisk_mirror_resync_blocked(td_mirror_t *m, td_sector_t sec, int secs)
+{
+	td_vbd_request_t *vreq, *tmp;
+	td_vbd_t *vbd = m->vbd;
+
+	if (tapdisk_mirror_blocked(m, sec, secs))
+		return 1;
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->pending_requests)
+		if (vreq->req.operation == BLKIF_OP_WRITE &&
+		    tapdisk_mirror_overlap(sec, secs,
+					   vreq->req.sector_number,
+					   tapdisk_vbd_request_secs(vreq)))
+			return 1;
+
+	return 0;
+}
+
+static int
+tapdisk_mirror_backoff(td_mirror_t *m, struct timeval *now)
+{
+	struct timeval delta;
+
+	if (!timerisset(&m->retry_at) || timercmp(now, &m->retry_at, >=))
+		return 0;
+
+	timersub(&m->retry_at, now, &delta);
+	tapdisk_server_set_max_timeout_us(delta.tv_sec * 1000000 +
+					  delta.tv_usec);
+	return 1;
+}
+
+static td_mirror_request_t *
+tapdisk_mirror_get(td_mirror_t *m, td_sector_t sec, int secs, int64_t blk)
+{
+	td_mirror_request_t *req;
+
+	req = list_entry(m->free.next, td_mirror_request_t, next);
+	list_move_tail(&req->next, &m->busy);
+
+	req->sec          = sec;
+	req->secs         = secs;
+	req->secs_pending = secs;
+	req->error        = 0;
+	req->block        = blk;
+	gettimeofday(&req->queued, NULL);
+
+	m->inflight++;
+	m->secs_inflight += secs;
+	if (blk >= 0)
+		m->resyncing++;
+
+	return req;
+}
+
+static void
+tapdisk_mirror_put(td_mirror_t *m, td_mirror_request_t *req)
+{
+	struct timeval now;
+	int err = req->error;
+
+	list_move_tail(&req->next, &m->free);
+
+	m->inflight--;
+	m->secs_inflight -= req->secs;
+	if (req->block >= 0)
+		m->resyncing--;
+
+	if (!err)
+		return;
+
+	tapdisk_mirror_mark(m, req->sec, req->secs);
+
+	/* out of requests down there, not worth backing off */
+	if (err == -EBUSY) {
+		m->overflows++;
+		return;
+	}
+
+	m->errors++;
+
+	gettimeofday(&now, NULL);
+	if (!timerisset(&m->retry_at) || timercmp(&now, &m->retry_at, >=))
+		ERR(err, "%s: async mirror: %s 0x%04x secs at 0x%08"PRIx64
+		    " failed, backing off", m->vbd->name,
+		    (req->block >= 0 ? "resync" : "write"),
+		    req->secs, req->sec);
+
+	m->retry_at.tv_sec  = now.tv_sec;
+	m->retry_at.tv_usec = now.tv_usec + TD_MIRROR_RETRY_USECS;
+	while (m->retry_at.tv_usec >= 1000000) {
+		m->retry_at.tv_sec++;
+		m->retry_at.tv_usec -= 1000000;
+	}
+}
+
+static void
+tapdisk_mirror_write_done(td_request_t treq, int res)
+{
+	td_mirror_request_t *req = treq.cb_data;
+	td_mirror_t *m = req->mirror;
+
+	if (res && !req->error)
+		req->error = res;
+
+	req->secs_pending -= treq.secs;
+	if (req->secs_pending)
+		return;
+
+	if (!req->error) {
+		if (req->block >= 0)
+			m->blocks_resynced++;
+		else
+			m->secs_mirrored += req->secs;
+	}
+
+	tapdisk_mirror_put(m, req);
+}
+
+static void
+tapdisk_mirror_write(td_mirror_t *m, td_mirror_request_t *req)
+{
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+
+	req->secs_pending = req->secs;
+
+	treq.op      = TD_OP_WRITE;
+	treq.buf     = req->buf;
+	treq.sec     = req->sec;
+	treq.secs    = req->secs;
+	treq.image   = m->image;
+	treq.cb      = tapdisk_mirror_write_done;
+	treq.cb_data = req;
+	treq.private = &req->vreq;
+
+	td_queue_write(m->image, treq);
+}
+
+static void
+tapdisk_mirror_read_done(td_request_t treq, int res)
+{
+	td_mirror_request_t *req = treq.cb_data;
+	td_mirror_t *m = req->mirror;
+
+	if (res && !req->error)
+		req->error = res;
+
+	req->secs_pending -= treq.secs;
+	if (req->secs_pending)
+		return;
+
+	/* written again meanwhile: left dirty for another pass */
+	if (req->error || tapdisk_mirror_test(m, req->block)) {
+		tapdisk_mirror_put(m, req);
+		return;
+	}
+
+	tapdisk_mirror_write(m, req);
+}
+
+/*
+ * Returns nonzero if the write was not queued. The caller marks the
+ * range once the primary has it (tapdisk_mirror_mark), so a resync
+ * can't read back what came before.
+ */
+int
+tapdisk_mirror_queue_write(td_mirror_t *m, td_request_t treq)
+{
+	td_mirror_request_t *req;
+	struct timeval now;
+
+	if (!m->image)
+		return -ENODEV;
+
+	gettimeofday(&now, NULL);
+	if (tapdisk_mirror_backoff(m, &now))
+		return -EAGAIN;
+
+	if (treq.secs > TD_MIRROR_BLOCK_SECS || list_empty(&m->free) ||
+	    tapdisk_mirror_blocked(m, treq.sec, treq.secs)) {
+		m->overflows++;
+		return -EBUSY;
+	}
+
+	req = tapdisk_mirror_get(m, treq.sec, treq.secs, -1);
+	memcpy(req->buf, treq.buf, treq.secs << SECTOR_SHIFT);
+	m->writes++;
+
+	tapdisk_mirror_write(m, req);
+	return 0;
+}
+
+static int
+tapdisk_mirror_queue_ready(td_mirror_t *m)
+{
+	return m->image &&
+		!td_flag_test(m->vbd->state,
+			      TD_VBD_DEAD |
+			      TD_VBD_CLOSED |
+			      TD_VBD_QUIESCED |
+			      TD_VBD_QUIESCE_REQUESTED |
+			      TD_VBD_PAUSE_REQUESTED |
+			      TD_VBD_SHUTDOWN_REQUESTED);
+}
+
+static void
+tapdisk_mirror_resync(td_mirror_t *m, int64_t blk)
+{
+	td_mirror_request_t *req;
+	td_request_t treq;
+	td_image_t *leaf;
+	td_sector_t sec;
+	int secs;
+
+	sec  = (td_sector_t)blk << TD_MIRROR_BLOCK_SHIFT;
+	secs = MIN(m->sectors - sec, TD_MIRROR_BLOCK_SECS);
+
+	tapdisk_mirror_clear(m, blk);
+	req  = tapdisk_mirror_get(m, sec, secs, blk);
+	leaf = tapdisk_vbd_leaf_image(m->vbd);
+
+	memset(&treq, 0, sizeof(treq));
+
+	treq.op      = TD_OP_READ;
+	treq.buf     = req->buf;
+	treq.sec     = sec;
+	treq.secs    = secs;
+	treq.image   = leaf;
+	treq.cb      = tapdisk_mirror_read_done;
+	treq.cb_data = req;
+	treq.private = &req->vreq;
+
+	td_queue_read(leaf, treq);
+}
+
+/*
+ * Called from tapdisk_vbd_check_state(): resync a few dirty blocks,
+ * round robin, leaving most of the queue to guest writes.
+ */
+void
+tapdisk_mirror_check(td_mirror_t *m)
+{
+	struct timeval now;
+	uint64_t start, blk;
+	int64_t next;
+	int wrapped;
+
+	if (!m->dirty_blocks || !tapdisk_mirror_queue_ready(m))
+		return;
+
+	gettimeofday(&now, NULL);
+	if (tapdisk_mirror_backoff(m, &now))
+		return;
+
+	start   = m->cursor;
+	blk     = start;
+	wrapped = 0;
+
+	while (m->resyncing < TD_MIRROR_RESYNC_DEPTH &&
+	       !list_empty(&m->free)) {
+		next = tapdisk_mirror_next_dirty(m, blk);
+		if (next < 0 && !wrapped) {
+			blk     = 0;
+			wrapped = 1;
+			continue;
+		}
+
+		if (next < 0 || (wrapped && (uint64_t)next >= start))
+			break;
+
+		blk = next + 1;
+
+		if (tapdisk_mirror_resync_blocked(m,
+				(td_sector_t)next << TD_MIRROR_BLOCK_SHIFT,
+				TD_MIRROR_BLOCK_SECS))
+			continue;
+
+		m->cursor = blk;
+		tapdisk_mirror_resync(m, next);
+	}
+}
+
+void
+tapdisk_mirror_stats(td_mirror_t *m, td_stats_t *st)
+{
+	td_mirror_request_t *oldest;
+	struct timeval now, lag;
+
+	timerclear(&lag);
+	if (!list_empty(&m->busy)) {
+		oldest = list_entry(m->busy.next, td_mirror_request_t, next);
+		gettimeofday(&now, NULL);
+		timersub(&now, &oldest->queued, &lag);
+	}
+
+	tapdisk_stats_field(st, "attached", "d", !!m->image);
+	tapdisk_stats_field(st, "depth", "d", m->depth);
+	tapdisk_stats_field(st, "inflight", "d", m->inflight);
+	tapdisk_stats_field(st, "inflight_secs", "llu", m->secs_inflight);
+	tapdisk_stats_field(st, "lag_usecs", "llu",
+			    (unsigned long long)lag.tv_sec * 1000000ULL +
+			    lag.tv_usec);
+
+	tapdisk_stats_field(st, "dirty", "[");
+	tapdisk_stats_val(st, "llu", m->dirty_blocks);
+	tapdisk_stats_val(st, "llu", m->blocks);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "block_secs", "d", TD_MIRROR_BLOCK_SECS);
+	tapdisk_stats_field(st, "writes", "llu", m->writes);
+	tapdisk_stats_field(st, "mirrored", "llu", m->secs_mirrored);
+	tapdisk_stats_field(st, "overflows", "llu", m->overflows);
+	tapdisk_stats_field(st, "errors", "llu", m->errors);
+	tapdisk_stats_field(st, "resynced", "llu", m->blocks_resynced);
+}
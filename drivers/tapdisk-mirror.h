@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_MIRROR_H_
+#define _TAPDISK_MIRROR_H_
+
+#include <sys/time.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Asynchronous mirror to the secondary image. Guest writes complete
+ * once the primary chain has them. A copy of each write goes to the
+ * secondary through a bounded pool of buffers; writes which don't
+ * fit, would race a copy in flight to the same sectors, or fail on the
+ * secondary, mark their blocks dirty instead. Resync reads dirty
+ * blocks back from the primary chain and writes them to the secondary
+ * in the background.
+ *
+ * The secondary is kept out of the chain and never read. It is taken
+ * to match the primary when first attached, unless
+ * TAPDISK2_MIRROR_RESYNC=1 asks for a full copy. The dirty map is in
+ * memory only: it survives pause/resume, not a tapdisk restart.
+ */
+
+#define TD_MIRROR_BLOCK_SHIFT       7           /* 64k per bit */
+#define TD_MIRROR_BLOCK_SECS        (1 << TD_MIRROR_BLOCK_SHIFT)
+#define TD_MIRROR_DEFAULT_DEPTH     64
+#define TD_MIRROR_MAX_DEPTH         1024
+#define TD_MIRROR_RESYNC_DEPTH      4
+#define TD_MIRROR_RETRY_USECS       1000000
+
+typedef struct td_mirror            td_mirror_t;
+typedef struct td_mirror_request    td_mirror_request_t;
+
+struct td_mirror_request {
+	td_vbd_request_t            vreq;
+	td_mirror_t                *mirror;
+
+	char                       *buf;
+	td_sector_t                 sec;
+	int                         secs;
+	int                         secs_pending;
+	int                         error;
+
+	/* the block being resynced, -1 for guest writes */
+	int64_t                     block;
+	struct timeval              queued;
+
+	struct list_head            next;
+};
+
+struct td_mirror {
+	td_vbd_t                   *vbd;
+	td_image_t                 *image;
+
+	td_sector_t                 sectors;
+	uint64_t                    blocks;
+	unsigned long              *dirty;
+	uint64_t                    dirty_blocks;
+	uint64_t                    cursor;
+
+	int                         depth;
+	int                         inflight;
+	int                         resyncing;
+	uint64_t                    secs_inflight;
+
+	td_mirror_request_t        *reqs;
+	char                       *bufs;
+	struct list_head            free;
+	/* in flight, oldest first */
+	struct list_head            busy;
+
+	/* no copies to the secondary until then, after an error */
+	struct timeval              retry_at;
+
+	uint64_t                    writes;
+	uint64_t                    secs_mirrored;
+	uint64_t                    overflows;
+	uint64_t                    errors;
+	uint64_t                    blocks_resynced;
+};
+
+int tapdisk_mirror_create(td_vbd_t *, td_sector_t sectors, td_mirror_t **);
+void tapdisk_mirror_free(td_mirror_t *);
+void tapdisk_mirror_attach(td_mirror_t *, td_image_t *);
+void tapdisk_mirror_detach(td_mirror_t *);
+int tapdisk_mirror_busy(td_mirror_t *);
+int tapdisk_mirror_queue_write(td_mirror_t *, td_request_t);
+void tapdisk_mirror_mark(td_mirror_t *, td_sector_t sec, int secs);
+void tapdisk_mirror_check(td_mirror_t *);
+void tapdisk_mirror_stats(td_mirror_t *, td_stats_t *);
+
+#endif
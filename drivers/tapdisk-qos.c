@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "tapdisk-qos.h"
+
+#define TD_QOS_SCALE                 1000000LL
+
+#define MIN(a, b)                    ((a) <= (b) ? (a) : (b))
+
+static inline int64_t
+tapdisk_qos_usecs(const struct timeval *tv)
+{
+	return (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static void
+tapdisk_qos_bucket_set(struct td_qos_bucket *b,
+		       uint64_t rate, unsigned int burst_ms)
+{
+	b->rate  = rate;
+	b->burst = rate * burst_ms / 1000;
+	if (rate && !b->burst)
+		b->burst = 1;
+	b->level = b->burst * TD_QOS_SCALE;
+}
+
+static void
+tapdisk_qos_bucket_refill(struct td_qos_bucket *b, int64_t usecs)
+{
+	int64_t max = b->burst * TD_QOS_SCALE;
+
+	if (!b->rate || b->level >= max)
+		return;
+
+	/* NB. cap first, rate * usecs may overflow after a long idle. */
+	if (usecs >= (max - b->level) / (int64_t)b->rate + 1)
+		b->level = max;
+	else
+		b->level = MIN(max, b->level + (int64_t)b->rate * usecs);
+}
+
+static int
+tapdisk_qos_bucket_ready(struct td_qos_bucket *b, uint64_t cost)
+{
+	if (!b->rate)
+		return 1;
+
+	/* let requests larger than the whole bucket through on a full
+	 * bucket, they will leave it in debt. */
+	return b->level >= (int64_t)MIN(cost, b->burst) * TD_QOS_SCALE;
+}
+
+static void
+tapdisk_qos_bucket_consume(struct td_qos_bucket *b, uint64_t cost)
+{
+	if (b->rate)
+		b->level -= (int64_t)cost * TD_QOS_SCALE;
+}
+
+void
+tapdisk_qos_init(struct td_qos *qos)
+{
+	memset(qos, 0, sizeof(*qos));
+}
+
+void
+tapdisk_qos_set(struct td_qos *qos, const uint64_t iops[2],
+		const uint64_t bps[2], unsigned int burst_ms)
+{
+	int i;
+
+	if (!burst_ms)
+		burst_ms = TD_QOS_DEFAULT_BURST_MS;
+	qos->burst_ms = burst_ms;
+
+	for (i = 0; i < 2; i++) {
+		tapdisk_qos_bucket_set(&qos->iops[i], iops[i], burst_ms);
+		tapdisk_qos_bucket_set(&qos->bps[i], bps[i], burst_ms);
+	}
+
+	gettimeofday(&qos->ts, NULL);
+}
+
+int
+tapdisk_qos_enabled(struct td_qos *qos)
+{
+	return (qos->iops[0].rate || qos->iops[1].rate ||
+		qos->bps[0].rate || qos->bps[1].rate);
+}
+
+static void
+tapdisk_qos_refill(struct td_qos *qos, const struct timeval *now)
+{
+	int64_t usecs;
+	int i;
+
+	usecs = tapdisk_qos_usecs(now) - tapdisk_qos_usecs(&qos->ts);
+	if (usecs <= 0)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		tapdisk_qos_bucket_refill(&qos->iops[i], usecs);
+		tapdisk_qos_bucket_refill(&qos->bps[i], usecs);
+	}
+
+	qos->ts = *now;
+}
+
+/*
+ * Returns 1 and charges the buckets if a request of @bytes may be
+ * issued now, 0 if it has to wait for a refill.
+ */
+int
+tapdisk_qos_admit(struct td_qos *qos, int write, uint64_t bytes,
+		  const struct timeval *now)
+{
+	struct td_qos_bucket *iops, *bps;
+
+	write = !!write;
+	iops  = &qos->iops[write];
+	bps   = &qos->bps[write];
+
+	if (!iops->rate && !bps->rate)
+		return 1;
+
+	tapdisk_qos_refill(qos, now);
+
+	if (!tapdisk_qos_bucket_ready(iops, 1) ||
+	    !tapdisk_qos_bucket_ready(bps, bytes)) {
+		if (!timerisset(&qos->throttled_since)) {
+			qos->throttled_since = *now;
+			qos->throttles++;
+		}
+		return 0;
+	}
+
+	tapdisk_qos_bucket_consume(iops, 1);
+	tapdisk_qos_bucket_consume(bps, bytes);
+
+	if (timerisset(&qos->throttled_since)) {
+		qos->throttle_usecs +=
+			tapdisk_qos_usecs(now) -
+			tapdisk_qos_usecs(&qos->throttled_since);
+		timerclear(&qos->throttled_since);
+	}
+
+	return 1;
+}
+
+static int64_t
+tapdisk_qos_bucket_wait(struct td_qos_bucket *b, uint64_t cost)
+{
+	int64_t need;
+
+	if (!b->rate)
+		return 0;
+
+	need = (int64_t)MIN(cost, b->burst) * TD_QOS_SCALE - b->level;
+	if (need <= 0)
+		return 0;
+
+	return (need + b->rate - 1) / (int64_t)b->rate;
+}
+
+/*
+ * Usecs until the buckets refill enough to admit a request of
+ * @bytes, as of the last tapdisk_qos_admit().
+ */
+long
+tapdisk_qos_wait(struct td_qos *qos, int write, uint64_t bytes)
+{
+	int64_t iops, bps;
+
+	write = !!write;
+	iops  = tapdisk_qos_bucket_wait(&qos->iops[write], 1);
+	bps   = tapdisk_qos_bucket_wait(&qos->bps[write], bytes);
+
+	return iops > bps ? iops : bps;
+}
+
+void
+tapdisk_qos_stats(struct td_qos *qos, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "iops", "[");
+	tapdisk_stats_val(st, "llu", qos->iops[0].rate);
+	tapdisk_stats_val(st, "llu", qos->iops[1].rate);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "bps", "[");
+	tapdisk_stats_val(st, "llu", qos->bps[0].rate);
+	tapdisk_stats_val(st, "llu", qos->bps[1].rate);
+	tapdisk_stats_leave(st, ']');
+
+	tapdisk_stats_field(st, "throttles", "llu", qos->throttles);
+	tapdisk_stats_field(st, "throttle_usecs", "llu", qos->throttle_usecs);
+}
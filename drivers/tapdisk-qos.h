@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2011, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_QOS_H_
+#define _TAPDISK_QOS_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "tapdisk-stats.h"
+
+/*
+ * Per-VBD token buckets. Each bucket refills at 'rate' units per
+ * second, up to 'burst' units. A zero rate means unlimited.
+ *
+ * Levels are kept in units * 10^6, so refills at microsecond
+ * resolution don't lose fractional tokens.
+ */
+
+#define TD_QOS_DEFAULT_BURST_MS     1000
+
+struct td_qos_bucket {
+	uint64_t                     rate;
+	uint64_t                     burst;
+	int64_t                      level;
+};
+
+struct td_qos {
+	struct td_qos_bucket         iops[2];
+	struct td_qos_bucket         bps[2];
+	unsigned int                 burst_ms;
+
+	struct timeval               ts;
+
+	struct timeval               throttled_since;
+	uint64_t                     throttles;
+	uint64_t                     throttle_usecs;
+};
+
+void tapdisk_qos_init(struct td_qos *);
+void tapdisk_qos_set(struct td_qos *, const uint64_t iops[2],
+		     const uint64_t bps[2], unsigned int burst_ms);
+int tapdisk_qos_enabled(struct td_qos *);
+int tapdisk_qos_admit(struct td_qos *, int write, uint64_t bytes,
+		      const struct timeval *now);
+long tapdisk_qos_wait(struct td_qos *, int write, uint64_t bytes);
+void tapdisk_qos_stats(struct td_qos *, td_stats_t *);
+
+#endif
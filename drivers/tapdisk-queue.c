@@ -69,50 +69,187 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 	}
 
 	queue->iocbs[queue->queued++] = iocb;
+	tiocb->share->inflight++;
 }
 
-static inline int
-deferred_tiocbs(struct tqueue *queue)
+/*
+ * Insert behind the high priority iocbs already queued, ahead of
+ * everything else. Keeps the tiocb chain in iocbs[] order.
+ */
+static inline void
+queue_tiocb_prio(struct tqueue *queue, struct tiocb *tiocb)
 {
-	return (queue->deferred.head != NULL);
+	int pos = queue->queued_prio;
+
+	if (pos == queue->queued) {
+		queue_tiocb(queue, tiocb);
+		queue->queued_prio++;
+		return;
+	}
+
+	memmove(queue->iocbs + pos + 1, queue->iocbs + pos,
+		(queue->queued - pos) * sizeof(struct iocb *));
+
+	tiocb->next = queue->iocbs[pos + 1]->data;
+	if (pos) {
+		struct tiocb *prev = (struct tiocb *)
+			queue->iocbs[pos - 1]->data;
+		prev->next = tiocb;
+	}
+
+	queue->iocbs[pos] = &tiocb->iocb;
+	queue->queued++;
+	queue->queued_prio++;
+	tiocb->share->inflight++;
 }
 
 static inline void
-defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+tlist_add(struct tlist *list, struct tiocb *tiocb)
 {
-	struct tlist *list = &queue->deferred;
-
 	if (!list->head)
 		list->head = list->tail = tiocb;
 	else
 		list->tail = list->tail->next = tiocb;
+}
+
+static inline struct tiocb *
+tlist_pop(struct tlist *list)
+{
+	struct tiocb *tiocb = list->head;
+
+	if (tiocb) {
+		list->head = tiocb->next;
+		if (!list->head)
+			list->tail = NULL;
+		tiocb->next = NULL;
+	}
+
+	return tiocb;
+}
+
+static int
+tlist_remove(struct tlist *list, struct tiocb *tiocb)
+{
+	struct tiocb **pprev, *prev = NULL;
+
+	for (pprev = &list->head; *pprev; pprev = &(*pprev)->next) {
+		if (*pprev == tiocb) {
+			*pprev = tiocb->next;
+			if (list->tail == tiocb)
+				list->tail = prev;
+			tiocb->next = NULL;
+			return 1;
+		}
+		prev = *pprev;
+	}
+
+	return 0;
+}
+
+static inline int
+share_full(struct tqueue_share *share)
+{
+	return share->limit && share->inflight >= share->limit;
+}
+
+static inline int
+deferred_tiocbs(struct tqueue_share *share)
+{
+	return (share->deferred.head != NULL);
+}
+
+static inline void
+defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+{
+	struct tqueue_share *share = tiocb->share;
+
+	if (tiocb->prio == TIOCB_PRIO_HIGH)
+		tlist_add(&queue->urgent, tiocb);
+	else {
+		if (!deferred_tiocbs(share))
+			list_add_tail(&share->next, &queue->waiting);
+		tlist_add(&share->deferred, tiocb);
+		share->tiocbs_deferred++;
+		share->deferrals++;
+	}
 
 	queue->tiocbs_deferred++;
 	queue->deferrals++;
 }
 
 static inline void
-queue_deferred_tiocb(struct tqueue *queue)
+queue_deferred_tiocb(struct tqueue *queue, struct tqueue_share *share)
 {
-	struct tlist *list = &queue->deferred;
-
-	if (list->head) {
-		struct tiocb *tiocb = list->head;
+	struct tiocb *tiocb;
 
-		list->head = tiocb->next;
-		if (!list->head)
-			list->tail = NULL;
+	tiocb = tlist_pop(&share->deferred);
+	if (tiocb) {
+		if (!deferred_tiocbs(share))
+			list_del_init(&share->next);
 
 		queue_tiocb(queue, tiocb);
+		share->tiocbs_deferred--;
 		queue->tiocbs_deferred--;
 	}
 }
 
 static inline void
+queue_urgent_tiocbs(struct tqueue *queue)
+{
+	struct tiocb *tiocb;
+
+	while (!tapdisk_queue_full(queue) &&
+	       (tiocb = tlist_pop(&queue->urgent))) {
+		queue_tiocb_prio(queue, tiocb);
+		queue->tiocbs_deferred--;
+	}
+}
+
+/*
+ * Deficit round robin over the waiting shares. A share keeps its
+ * remaining deficit when the queue fills up mid-turn, so the next
+ * refill resumes where this one stopped.
+ */
+static void
 queue_deferred_tiocbs(struct tqueue *queue)
 {
-	while (!tapdisk_queue_full(queue) && deferred_tiocbs(queue))
-		queue_deferred_tiocb(queue);
+	struct tqueue_share *share;
+	int idle = 0;
+
+	queue_urgent_tiocbs(queue);
+
+	while (!tapdisk_queue_full(queue) && !list_empty(&queue->waiting)) {
+		share = list_entry(queue->waiting.next,
+				   struct tqueue_share, next);
+
+		if (!share->deficit)
+			share->deficit = share->weight;
+
+		while (share->deficit && !share_full(share) &&
+		       !tapdisk_queue_full(queue) && deferred_tiocbs(share)) {
+			queue_deferred_tiocb(queue, share);
+			share->deficit--;
+			idle = 0;
+		}
+
+		if (!deferred_tiocbs(share)) {
+			share->deficit = 0;
+			continue;
+		}
+
+		if (tapdisk_queue_full(queue))
+			break;
+
+		/* turn over: out of deficit, or at its limit */
+		if (share_full(share)) {
+			share->deficit = 0;
+			/* every waiting share is capped */
+			if (++idle > queue->tiocbs_deferred)
+				break;
+		}
+
+		list_move_tail(&share->next, &queue->waiting);
+	}
 }
 
 /*
@@ -124,6 +261,8 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	int err;
 	struct iocb *iocb = &tiocb->iocb;
 
+	tiocb->share->inflight--;
+
 	if (res == iocb->u.c.nbytes)
 		err = 0;
 	else if ((int)res < 0)
@@ -152,6 +291,7 @@ cancel_tiocbs(struct tqueue *queue, int err)
 	tiocb  = queue->iocbs[0]->data;
 	queued = queue->queued;
 	queue->queued = 0;
+	queue->queued_prio = 0;
 
 	for (; tiocb != NULL; tiocb = tiocb->next)
 		complete_tiocb(queue, tiocb, err);
@@ -240,6 +380,7 @@ tapdisk_rwio_submit(struct tqueue *queue)
 	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 
 	queue->queued = 0;
+	queue->queued_prio = 0;
 
 	for (i = 0; i < merged; i++) {
 		ep      = rwio->aio_events + i;
@@ -530,6 +671,7 @@ tapdisk_lio_submit(struct tqueue *queue)
 	queue->iocbs_pending  += submitted;
 	queue->tiocbs_pending += queue->queued;
 	queue->queued          = 0;
+	queue->queued_prio     = 0;
 
 	if (err)
 		queue->tiocbs_pending -= 
@@ -613,6 +755,8 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 
 	queue->size   = size;
 	queue->filter = filter;
+	INIT_LIST_HEAD(&queue->waiting);
+	tapdisk_queue_init_share(&queue->share);
 
 	if (!size)
 		return 0;
@@ -652,7 +796,8 @@ tapdisk_free_queue(struct tqueue *queue)
 void 
 tapdisk_debug_queue(struct tqueue *queue)
 {
-	struct tiocb *tiocb = queue->deferred.head;
+	struct tqueue_share *share;
+	struct tiocb *tiocb;
 
 	WARN("TAPDISK QUEUE:\n");
 	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
@@ -660,9 +805,22 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
 
-	if (tiocb) {
-		WARN("deferred:\n");
-		for (; tiocb != NULL; tiocb = tiocb->next) {
+	if (queue->urgent.head) {
+		WARN("deferred: urgent\n");
+		for (tiocb = queue->urgent.head; tiocb; tiocb = tiocb->next) {
+			struct iocb *io = &tiocb->iocb;
+			WARN("%s of %lu bytes at %lld\n",
+			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
+			      "write" : "read"),
+			     io->u.c.nbytes, io->u.c.offset);
+		}
+	}
+
+	list_for_each_entry(share, &queue->waiting, next) {
+		WARN("deferred: share %p weight: %d, limit: %d, inflight: %d, "
+		     "deficit: %d\n", share, share->weight, share->limit,
+		     share->inflight, share->deficit);
+		for (tiocb = share->deferred.head; tiocb; tiocb = tiocb->next) {
 			struct iocb *io = &tiocb->iocb;
 			WARN("%s of %lu bytes at %lld\n",
 			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
@@ -672,6 +830,111 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+void
+tapdisk_queue_init_share(struct tqueue_share *share)
+{
+	memset(share, 0, sizeof(*share));
+	share->weight = TQUEUE_SHARE_DEFAULT_WEIGHT;
+	INIT_LIST_HEAD(&share->next);
+}
+
+/*
+ * @weight: tiocbs per round, 0 restores the default.
+ * @percent: cap on the share of the queue size, 0 for none.
+ */
+void
+tapdisk_queue_set_share(struct tqueue *queue, struct tqueue_share *share,
+			int weight, int percent)
+{
+	share->weight  = weight > 0 ? weight : TQUEUE_SHARE_DEFAULT_WEIGHT;
+	share->percent = 0;
+	share->deficit = 0;
+	share->limit   = 0;
+
+	if (percent > 0 && percent < 100) {
+		share->percent = percent;
+		share->limit = queue->size * percent / 100;
+		if (!share->limit)
+			share->limit = 1;
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+/*
+ * Tiocbs still deferred on @share are handed to the default share, so
+ * nothing references it once it is released.
+ */
+void
+tapdisk_queue_release_share(struct tqueue *queue, struct tqueue_share *share)
+{
+	struct tiocb *tiocb;
+	struct tlist deferred;
+
+	if (share->inflight)
+		WARN("releasing busy share %p: inflight: %d\n",
+		     share, share->inflight);
+
+	if (share == &queue->share || !deferred_tiocbs(share)) {
+		list_del_init(&share->next);
+		return;
+	}
+
+	deferred = share->deferred;
+	share->deferred.head = share->deferred.tail = NULL;
+	list_del_init(&share->next);
+
+	while ((tiocb = tlist_pop(&deferred))) {
+		share->tiocbs_deferred--;
+
+		tiocb->share = &queue->share;
+		if (!deferred_tiocbs(tiocb->share))
+			list_add_tail(&tiocb->share->next, &queue->waiting);
+		tlist_add(&tiocb->share->deferred, tiocb);
+		tiocb->share->tiocbs_deferred++;
+	}
+
+	share->deficit = 0;
+	queue_deferred_tiocbs(queue);
+}
+
+/*
+ * Charges a tiocb, deferred or in flight, to the default share
+ * instead, for submitters which may go away before it completes.
+ */
+void
+tapdisk_queue_unshare_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+{
+	struct tqueue_share *share = tiocb->share;
+	struct tiocb *t;
+
+	if (!share || share == &queue->share)
+		return;
+
+	for (t = queue->urgent.head; t; t = t->next)
+		if (t == tiocb)
+			goto out;
+
+	if (tlist_remove(&share->deferred, tiocb)) {
+		share->tiocbs_deferred--;
+		if (!deferred_tiocbs(share))
+			list_del_init(&share->next);
+
+		tiocb->share = &queue->share;
+		if (!deferred_tiocbs(tiocb->share))
+			list_add_tail(&tiocb->share->next, &queue->waiting);
+		tlist_add(&tiocb->share->deferred, tiocb);
+		tiocb->share->tiocbs_deferred++;
+		return;
+	}
+
+	share->inflight--;
+	queue->share.inflight++;
+
+out:
+	tiocb->share = &queue->share;
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
@@ -683,19 +946,36 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	else
 		io_prep_pread(iocb, fd, buf, size, offset);
 
-	iocb->data  = tiocb;
-	tiocb->cb   = cb;
-	tiocb->arg  = arg;
-	tiocb->next = NULL;
+	iocb->data   = tiocb;
+	tiocb->cb    = cb;
+	tiocb->arg   = arg;
+	tiocb->next  = NULL;
+	tiocb->share = NULL;
+	tiocb->prio  = TIOCB_PRIO_NORMAL;
 }
 
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
-	if (!tapdisk_queue_full(queue))
+	if (!tiocb->share)
+		tiocb->share = &queue->share;
+
+	if (tiocb->prio == TIOCB_PRIO_HIGH) {
+		if (!tapdisk_queue_full(queue))
+			queue_tiocb_prio(queue, tiocb);
+		else
+			defer_tiocb(queue, tiocb);
+		return;
+	}
+
+	/* don't jump ahead of shares already waiting for slots */
+	if (!tapdisk_queue_full(queue) && !share_full(tiocb->share) &&
+	    list_empty(&queue->waiting))
 		queue_tiocb(queue, tiocb);
-	else
+	else {
 		defer_tiocb(queue, tiocb);
+		queue_deferred_tiocbs(queue);
+	}
 }
 
 
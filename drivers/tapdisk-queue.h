@@ -12,11 +12,13 @@
 
 #include <libaio.h>
 
+#include "list.h"
 #include "io-optimize.h"
 #include "scheduler.h"
 
 struct tiocb;
 struct tfilter;
+struct tqueue_share;
 
 typedef void (*td_queue_callback_t)(void *arg, struct tiocb *, int err);
 
@@ -27,13 +29,48 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	struct tqueue_share  *share;
+	int                   prio;
 };
 
+/*
+ * High priority tiocbs (e.g. metadata other requests wait on) are
+ * submitted ahead of normal ones, and bypass share admission when
+ * deferred.
+ */
+#define TIOCB_PRIO_NORMAL     0
+#define TIOCB_PRIO_HIGH       1
+
 struct tlist {
 	struct tiocb         *head;
 	struct tiocb         *tail;
 };
 
+/*
+ * Producers (VBDs) sharing a queue are admitted by deficit round
+ * robin. Each share may queue 'weight' tiocbs per round once the
+ * queue is contended, and never holds more than 'limit' tiocbs in
+ * the queue and the aio layer at once (0: no limit).
+ */
+#define TQUEUE_SHARE_DEFAULT_WEIGHT  1
+
+struct tqueue_share {
+	int                   weight;
+	int                   percent;
+	int                   limit;
+	int                   deficit;
+
+	/* tiocbs queued or pending in the aio layer */
+	int                   inflight;
+
+	struct tlist          deferred;
+	int                   tiocbs_deferred;
+	uint64_t              deferrals;
+
+	struct list_head      next;
+};
+
 struct tqueue {
 	int                   size;
 
@@ -45,6 +82,9 @@ struct tqueue {
 	int                   queued;
 	struct iocb         **iocbs;
 
+	/* leading high priority iocbs in 'iocbs' */
+	int                   queued_prio;
+
 	/* number of iocbs pending in the aio layer */
 	int                   iocbs_pending;
 
@@ -53,12 +93,18 @@ struct tqueue {
 	 * due to request coalescing */
 	int                   tiocbs_pending;
 
-	/* iocbs may be deferred if the aio ring is full.
-	 * tapdisk_queue_complete will ensure deferred
-	 * iocbs are queued as slots become available. */
-	struct tlist          deferred;
+	/* iocbs may be deferred if the aio ring is full,
+	 * or their share is at its limit. tapdisk_queue_complete
+	 * will ensure deferred iocbs are queued as slots become
+	 * available: 'urgent' first, then round robin across
+	 * the shares in 'waiting'. */
+	struct list_head      waiting;
+	struct tlist          urgent;
 	int                   tiocbs_deferred;
 
+	/* used for tiocbs queued without a share */
+	struct tqueue_share   share;
+
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
@@ -100,6 +146,11 @@ int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+void tapdisk_queue_init_share(struct tqueue_share *);
+void tapdisk_queue_set_share(struct tqueue *, struct tqueue_share *,
+			     int weight, int percent);
+void tapdisk_queue_release_share(struct tqueue *, struct tqueue_share *);
+void tapdisk_queue_unshare_tiocb(struct tqueue *, struct tiocb *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
@@ -73,12 +73,19 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
+	tapdisk_server_for_each_vbd(vbd, tmpv) {
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
 			    !strcmp(img->name, image->name))
 				return img;
 
+		/* parents held by a vbd paused for a snapshot */
+		list_for_each_entry(img, &vbd->kept_images, next)
+			if (img->type == image->type &&
+			    !strcmp(img->name, image->name))
+				return img;
+	}
+
 	return NULL;
 }
 
@@ -120,6 +127,24 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+void
+tapdisk_server_set_share(struct tqueue_share *share, int weight, int percent)
+{
+	tapdisk_queue_set_share(&server.aio_queue, share, weight, percent);
+}
+
+void
+tapdisk_server_release_share(struct tqueue_share *share)
+{
+	tapdisk_queue_release_share(&server.aio_queue, share);
+}
+
+void
+tapdisk_server_unshare_tiocb(struct tiocb *tiocb)
+{
+	tapdisk_queue_unshare_tiocb(&server.aio_queue, tiocb);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -149,6 +174,14 @@ tapdisk_server_register_event(char mode, int fd,
 					mode, fd, timeout, cb, data);
 }
 
+event_id_t
+tapdisk_server_register_event_ms(char mode, int fd,
+				 long timeout_ms, event_cb_t cb, void *data)
+{
+	return scheduler_register_event_ms(&server.scheduler,
+					   mode, fd, timeout_ms, cb, data);
+}
+
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
@@ -167,6 +200,12 @@ tapdisk_server_set_max_timeout(int seconds)
 	scheduler_set_max_timeout(&server.scheduler, seconds);
 }
 
+void
+tapdisk_server_set_max_timeout_us(long usecs)
+{
+	scheduler_set_max_timeout_us(&server.scheduler, usecs);
+}
+
 static void
 tapdisk_server_assert_locks(void)
 {
@@ -179,10 +218,7 @@ tapdisk_server_set_retry_timeout(void)
 	td_vbd_t *vbd, *tmp;
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (tapdisk_vbd_retry_needed(vbd)) {
-			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
-			return;
-		}
+		tapdisk_server_set_max_timeout_us(tapdisk_vbd_retry_timeout(vbd));
 }
 
 static void
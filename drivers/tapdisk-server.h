@@ -47,13 +47,19 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_set_share(struct tqueue_share *, int, int);
+void tapdisk_server_release_share(struct tqueue_share *);
+void tapdisk_server_unshare_tiocb(struct tiocb *);
 
 void tapdisk_server_check_state(void);
 
 event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
+event_id_t tapdisk_server_register_event_ms(char, int, long,
+					   event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
 void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_set_max_timeout_us(long);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(const char *, const char *);
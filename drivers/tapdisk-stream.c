@@ -37,8 +37,12 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "list.h"
+#include "libvhd.h"
 #include "scheduler.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-server.h"
@@ -47,7 +51,41 @@
 #define POLL_READ                        0
 #define POLL_WRITE                       1
 
-#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+/*
+ * Sparse output (-S). Only sectors allocated somewhere in the image
+ * chain are read, and zero pages among them are dropped.
+ *
+ * A seekable output gets the data written in place, leaving holes,
+ * and is truncated to the full size at the end. A pipe gets a
+ * sequence of extents, in host byte order: a struct
+ * tapdisk_stream_extent header followed by length bytes of data. The
+ * last extent has length 0 and offset set to the size of the stream.
+ */
+#define TD_STREAM_EXTENT_MAGIC           0x54445358 /* "TDSX" */
+
+struct tapdisk_stream_extent {
+	uint32_t                         magic;
+	uint32_t                         pad;
+	uint64_t                         offset;
+	uint64_t                         length;
+};
+
+/*
+ * Allocation of the VHD chain, one block at a time: map has a bit
+ * per sector set where any image in the chain holds data.
+ */
+struct tapdisk_stream_map {
+	vhd_context_t                  **chain;
+	int                              depth;
+	int                              raw;
+
+	uint32_t                         spb;
+	uint64_t                         blk;
+	int                              loaded;
+	int                              full;
+	int                              empty;
+	char                            *map;
+};
 
 struct tapdisk_stream_poll {
 	int                              pipe[2];
@@ -78,6 +116,10 @@ struct tapdisk_stream {
 	uint64_t                         started;
 	uint64_t                         completed;
 
+	int                              sparse;
+	int                              seekable;
+	struct tapdisk_stream_map        alloc;
+
 	struct tapdisk_stream_poll       poll;
 	event_id_t                       enqueue_event_id;
 
@@ -96,7 +138,8 @@ static void
 usage(const char *app, int err)
 {
 	printf("usage: %s <-n type:/path/to/image> "
-	       "[-c sector count] [-s skip sectors]\n", app);
+	       "[-c sector count] [-s skip sectors] [-S sparse output]\n",
+	       app);
 	exit(err);
 }
 
@@ -202,13 +245,139 @@ tapdisk_stream_get_request(struct tapdisk_stream *s)
 	return req;
 }
 
+static int
+tapdisk_stream_write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(fd, buf, size);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf   = (const char *)buf + ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_stream_pwrite_all(int fd, const void *buf, size_t size, off_t off)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, buf, size, off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf   = (const char *)buf + ret;
+		off  += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int
+tapdisk_stream_write_extent(struct tapdisk_stream *s,
+			    uint64_t off, const char *buf, size_t size)
+{
+	struct tapdisk_stream_extent ext;
+	int err;
+
+	if (s->seekable)
+		return tapdisk_stream_pwrite_all(s->out_fd, buf, size, off);
+
+	memset(&ext, 0, sizeof(ext));
+	ext.magic  = TD_STREAM_EXTENT_MAGIC;
+	ext.offset = off;
+	ext.length = size;
+
+	err = tapdisk_stream_write_all(s->out_fd, &ext, sizeof(ext));
+	if (err)
+		return err;
+
+	return tapdisk_stream_write_all(s->out_fd, buf, size);
+}
+
+static inline int
+tapdisk_stream_zero_page(const char *buf, size_t size)
+{
+	const unsigned long *p = (const unsigned long *)buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+/* write the non-zero runs of a completed read, by page */
+static int
+tapdisk_stream_write_sparse(struct tapdisk_stream *s,
+			    uint64_t sec, const char *buf, size_t size)
+{
+	size_t psize, pos, run, len;
+	uint64_t off;
+	int err;
+
+	psize = getpagesize();
+	off   = (sec - s->start) << SECTOR_SHIFT;
+
+	pos = 0;
+	while (pos < size) {
+		len = MIN(psize, size - pos);
+		if (tapdisk_stream_zero_page(buf + pos, len)) {
+			pos += len;
+			continue;
+		}
+
+		run = len;
+		while (pos + run < size) {
+			len = MIN(psize, size - pos - run);
+			if (tapdisk_stream_zero_page(buf + pos + run, len))
+				break;
+			run += len;
+		}
+
+		err = tapdisk_stream_write_extent(s, off + pos,
+						  buf + pos, run);
+		if (err)
+			return err;
+
+		pos += run;
+	}
+
+	return 0;
+}
+
 static void
 tapdisk_stream_print_request(struct tapdisk_stream *s,
 			     struct tapdisk_stream_request *sreq)
 {
 	unsigned long idx = (unsigned long)tapdisk_stream_request_idx(s, sreq);
 	char *buf = (char *)MMAP_VADDR(s->vbd->ring.vstart, idx, 0);
-	int gcc = write(s->out_fd, buf, sreq->secs << SECTOR_SHIFT);
+	size_t size = sreq->secs << SECTOR_SHIFT;
+	int err;
+
+	if (s->sparse)
+		err = tapdisk_stream_write_sparse(s, sreq->sec, buf, size);
+	else
+		err = tapdisk_stream_write_all(s->out_fd, buf, size);
+
+	if (err && !s->err) {
+		fprintf(stderr, "error writing output: %d\n", err);
+		s->err = -err;
+	}
 }
 
 static void
@@ -251,9 +420,14 @@ tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
 
 	list_del_init(&sreq->next);
 
-	if (rsp->status == BLKIF_RSP_OKAY)
-		tapdisk_stream_queue_completed(s, sreq);
-	else {
+	if (rsp->status == BLKIF_RSP_OKAY) {
+		if (s->sparse && s->seekable) {
+			/* written in place: no need to keep them in order */
+			tapdisk_stream_print_request(s, sreq);
+			list_add_tail(&sreq->next, &s->free_list);
+		} else
+			tapdisk_stream_queue_completed(s, sreq);
+	} else {
 		s->err = EIO;
 		list_add_tail(&sreq->next, &s->free_list);
 		fprintf(stderr, "error reading sector 0x%llx\n", sreq->sec);
@@ -263,17 +437,273 @@ tapdisk_stream_dequeue(void *arg, blkif_response_t *rsp)
 	tapdisk_stream_poll_set(&s->poll);
 }
 
+static void
+tapdisk_stream_map_close(struct tapdisk_stream_map *m)
+{
+	int i;
+
+	for (i = 0; i < m->depth; i++) {
+		vhd_close(m->chain[i]);
+		free(m->chain[i]);
+	}
+
+	free(m->chain);
+	free(m->map);
+	memset(m, 0, sizeof(*m));
+}
+
+static int
+tapdisk_stream_map_open(struct tapdisk_stream_map *m, const char *path)
+{
+	vhd_context_t *vhd, **chain;
+	char *name, *parent;
+	int err;
+
+	memset(m, 0, sizeof(*m));
+
+	vhd  = NULL;
+	name = strdup(path);
+	if (!name)
+		return -ENOMEM;
+
+	for (;;) {
+		vhd = calloc(1, sizeof(*vhd));
+		if (!vhd) {
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		err = vhd_open(vhd, name, VHD_OPEN_RDONLY);
+		if (err) {
+			fprintf(stderr, "error opening %s: %d\n", name, err);
+			goto fail;
+		}
+
+		/* fixed vhds are fully allocated */
+		if (!vhd_type_dynamic(vhd)) {
+			vhd_close(vhd);
+			free(vhd);
+			vhd = NULL;
+			m->raw = 1;
+			break;
+		}
+
+		chain = realloc(m->chain, (m->depth + 1) * sizeof(*chain));
+		if (!chain) {
+			vhd_close(vhd);
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		m->chain = chain;
+		m->chain[m->depth++] = vhd;
+		vhd = NULL;
+
+		err = vhd_get_bat(m->chain[m->depth - 1]);
+		if (err)
+			goto fail;
+
+		if (vhd_has_batmap(m->chain[m->depth - 1])) {
+			err = vhd_get_batmap(m->chain[m->depth - 1]);
+			if (err)
+				goto fail;
+		}
+
+		if (!m->spb)
+			m->spb = m->chain[0]->spb;
+		else if (m->chain[m->depth - 1]->spb != m->spb) {
+			fprintf(stderr, "%s: block size mismatch\n", name);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		if (m->chain[m->depth - 1]->footer.type != HD_TYPE_DIFF)
+			break;
+
+		if (vhd_parent_raw(m->chain[m->depth - 1])) {
+			m->raw = 1;
+			break;
+		}
+
+		err = vhd_parent_locator_get(m->chain[m->depth - 1], &parent);
+		if (err) {
+			fprintf(stderr, "%s: error finding parent: %d\n",
+				name, err);
+			goto fail;
+		}
+
+		free(name);
+		name = parent;
+	}
+
+	if (m->depth) {
+		m->map = malloc((m->spb + 7) >> 3);
+		if (!m->map) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	free(name);
+	return 0;
+
+fail:
+	free(vhd);
+	free(name);
+	tapdisk_stream_map_close(m);
+	return err;
+}
+
+static int
+tapdisk_stream_map_load(struct tapdisk_stream_map *m, uint64_t blk)
+{
+	vhd_context_t *vhd;
+	size_t i, size;
+	char *bm;
+	int d, err;
+
+	m->loaded = 0;
+	m->blk    = blk;
+	m->full   = m->raw;
+	m->empty  = !m->raw;
+
+	size = (m->spb + 7) >> 3;
+	memset(m->map, 0, size);
+
+	for (d = 0; d < m->depth && !m->full; d++) {
+		vhd = m->chain[d];
+
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		m->empty = 0;
+
+		if (vhd_has_batmap(vhd) &&
+		    vhd_batmap_test(vhd, &vhd->batmap, blk)) {
+			m->full = 1;
+			break;
+		}
+
+		err = vhd_read_bitmap(vhd, blk, &bm);
+		if (err) {
+			fprintf(stderr, "%s: error reading bitmap 0x%llx: "
+				"%d\n", vhd->file, blk, err);
+			return err;
+		}
+
+		for (i = 0; i < size; i++)
+			m->map[i] |= bm[i];
+
+		free(bm);
+	}
+
+	m->loaded = 1;
+	return 0;
+}
+
+/*
+ * Advance *sec to the next allocated sector and return the length of
+ * the allocated run there, within one block. Zero at the end.
+ */
+static int
+tapdisk_stream_map_next(struct tapdisk_stream *s,
+			uint64_t *sec, uint64_t *secs)
+{
+	struct tapdisk_stream_map *m = &s->alloc;
+	uint64_t blk, end, i, n;
+	int err;
+
+	*secs = 0;
+
+	if (!m->depth) {
+		*secs = s->end - *sec;
+		return 0;
+	}
+
+	while (*sec < s->end) {
+		blk = *sec / m->spb;
+		end = MIN((blk + 1) * m->spb, s->end);
+
+		if (!m->loaded || m->blk != blk) {
+			err = tapdisk_stream_map_load(m, blk);
+			if (err)
+				return err;
+		}
+
+		if (m->empty) {
+			*sec = end;
+			continue;
+		}
+
+		if (m->full) {
+			*secs = end - *sec;
+			return 0;
+		}
+
+		i = *sec - blk * m->spb;
+		while (*sec < end &&
+		       !vhd_bitmap_test(m->chain[0], m->map, i)) {
+			(*sec)++;
+			i++;
+		}
+
+		if (*sec == end)
+			continue;
+
+		for (n = 0; *sec + n < end; n++)
+			if (!vhd_bitmap_test(m->chain[0], m->map, i + n))
+				break;
+
+		*secs = n;
+		return 0;
+	}
+
+	return 0;
+}
+
+static void
+tapdisk_stream_finish(struct tapdisk_stream *s)
+{
+	struct tapdisk_stream_extent ext;
+	struct stat st;
+	uint64_t size;
+	int err;
+
+	size = (s->end - s->start) << SECTOR_SHIFT;
+
+	if (s->seekable) {
+		err = 0;
+		if (!fstat(s->out_fd, &st) && S_ISREG(st.st_mode) &&
+		    st.st_size < size && ftruncate(s->out_fd, size))
+			err = -errno;
+	} else {
+		memset(&ext, 0, sizeof(ext));
+		ext.magic  = TD_STREAM_EXTENT_MAGIC;
+		ext.offset = size;
+
+		err = tapdisk_stream_write_all(s->out_fd, &ext, sizeof(ext));
+	}
+
+	if (err) {
+		fprintf(stderr, "error finishing output: %d\n", err);
+		s->err = -err;
+	}
+}
+
 static void
 tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 {
 	td_vbd_t *vbd;
-	int i, idx, psize;
+	int i, idx, psize, err;
 	struct tapdisk_stream *s = (struct tapdisk_stream *)arg;
 
 	vbd = s->vbd;
 	tapdisk_stream_poll_clear(&s->poll);
 
 	if (tapdisk_stream_stop(s)) {
+		if (s->sparse && !s->err)
+			tapdisk_stream_finish(s);
 		tapdisk_stream_close_image(s);
 		return;
 	}
@@ -284,11 +714,25 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 		blkif_request_t *breq;
 		td_vbd_request_t *vreq;
 		struct tapdisk_stream_request *sreq;
+		uint64_t run;
 
-		sreq = tapdisk_stream_get_request(s);
-		if (!sreq)
+		if (list_empty(&s->free_list))
 			break;
 
+		run = s->end - s->cur;
+		if (s->sparse) {
+			err = tapdisk_stream_map_next(s, &s->cur, &run);
+			if (err) {
+				s->err = -err;
+				break;
+			}
+
+			if (!run)
+				break;
+		}
+
+		sreq = tapdisk_stream_get_request(s);
+
 		idx                 = tapdisk_stream_request_idx(s, sreq);
 
 		sreq->sec           = s->cur;
@@ -302,7 +746,8 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 		breq->operation     = BLKIF_OP_READ;
 
 		for (i = 0; i < BLKIF_MAX_SEGMENTS_PER_REQUEST; i++) {
-			uint32_t secs = MIN(s->end - s->cur, psize >> SECTOR_SHIFT);
+			uint32_t secs = MIN(run - sreq->secs,
+					    psize >> SECTOR_SHIFT);
 			struct blkif_request_segment *seg = breq->seg + i;
 
 			if (!secs)
@@ -329,6 +774,10 @@ tapdisk_stream_enqueue(event_id_t id, char mode, void *arg)
 		list_add_tail(&sreq->next, &s->pending_list);
 	}
 
+	/* nothing left to read: no completion will come to close us */
+	if (tapdisk_stream_stop(s))
+		tapdisk_stream_poll_set(&s->poll);
+
 	tapdisk_vbd_issue_requests(vbd);
 }
 
@@ -489,22 +938,68 @@ tapdisk_stream_initialize(struct tapdisk_stream *s)
 static int
 tapdisk_stream_open_fds(struct tapdisk_stream *s)
 {
+	struct stat st;
+	int flags;
+
 	s->out_fd = dup(STDOUT_FILENO);
 	if (s->out_fd == -1) {
 		fprintf(stderr, "failed to open output: %d\n", errno);
 		return errno;
 	}
 
+	/* pwrite ignores the offset on files opened for append */
+	flags = fcntl(s->out_fd, F_GETFL);
+	if (!fstat(s->out_fd, &st) &&
+	    (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) &&
+	    flags != -1 && !(flags & O_APPEND))
+		s->seekable = 1;
+
+	return 0;
+}
+
+/*
+ * Sparse output skips zeros, so whatever the output held before must
+ * read back as zeros: truncate a regular file, zero a block device.
+ * If the device can't be zeroed cheaply, stream it dense instead.
+ */
+static int
+tapdisk_stream_prepare_sparse(struct tapdisk_stream *s)
+{
+	uint64_t range[2];
+	struct stat st;
+
+	if (!s->seekable)
+		return 0;
+
+	if (fstat(s->out_fd, &st))
+		return errno;
+
+	if (S_ISREG(st.st_mode)) {
+		if (ftruncate(s->out_fd, 0))
+			return errno;
+		return 0;
+	}
+
+	range[0] = 0;
+	range[1] = (s->end - s->start) << SECTOR_SHIFT;
+
+	if (S_ISBLK(st.st_mode) && !ioctl(s->out_fd, BLKZEROOUT, range))
+		return 0;
+
+	fprintf(stderr, "failed to zero output (%d), writing it dense\n",
+		errno);
+	s->sparse = 0;
 	return 0;
 }
 
 static int
 tapdisk_stream_open(struct tapdisk_stream *s, const char *path,
-		    int type, uint64_t count, uint64_t skip)
+		    int type, uint64_t count, uint64_t skip, int sparse)
 {
 	int err;
 
 	tapdisk_stream_initialize(s);
+	s->sparse = sparse;
 
 	err = tapdisk_stream_open_fds(s);
 	if (err)
@@ -518,6 +1013,20 @@ tapdisk_stream_open(struct tapdisk_stream *s, const char *path,
 	if (err)
 		return err;
 
+	if (s->sparse) {
+		err = tapdisk_stream_prepare_sparse(s);
+		if (err) {
+			fprintf(stderr, "failed to prepare output: %d\n", err);
+			return err;
+		}
+	}
+
+	if (s->sparse && type == DISK_TYPE_VHD) {
+		err = tapdisk_stream_map_open(&s->alloc, path);
+		if (err)
+			return err;
+	}
+
 	err = tapdisk_stream_initialize_requests(s);
 	if (err)
 		return err;
@@ -533,6 +1042,7 @@ static void
 tapdisk_stream_release(struct tapdisk_stream *s)
 {
 	close(s->out_fd);
+	tapdisk_stream_map_close(&s->alloc);
 	tapdisk_stream_close_image(s);
 	tapdisk_stream_unregister_enqueue_event(s);
 }
@@ -548,7 +1058,7 @@ tapdisk_stream_run(struct tapdisk_stream *s)
 int
 main(int argc, char *argv[])
 {
-	int c, err, type;
+	int c, err, type, sparse;
 	const char *params;
 	const disk_info_t *info;
 	const char *path;
@@ -557,10 +1067,11 @@ main(int argc, char *argv[])
 
 	err    = 0;
 	skip   = 0;
+	sparse = 0;
 	count  = (uint64_t)-1;
 	params = NULL;
 
-	while ((c = getopt(argc, argv, "n:c:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:c:s:Sh")) != -1) {
 		switch (c) {
 		case 'n':
 			params = optarg;
@@ -571,6 +1082,9 @@ main(int argc, char *argv[])
 		case 's':
 			skip = strtoull(optarg, NULL, 10);
 			break;
+		case 'S':
+			sparse = 1;
+			break;
 		default:
 			err = EINVAL;
 		case 'h':
@@ -590,7 +1104,7 @@ main(int argc, char *argv[])
 
 	tapdisk_start_logging("tapdisk-stream", "daemon");
 
-	err = tapdisk_stream_open(&stream, path, type, count, skip);
+	err = tapdisk_stream_open(&stream, path, type, count, skip, sparse);
 	if (err)
 		goto out;
 
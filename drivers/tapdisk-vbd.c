@@ -35,7 +35,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 
 #include "libvhd.h"
@@ -47,6 +49,8 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-stats.h"
 #include "tapdisk-storage.h"
+#include "tapdisk-job.h"
+#include "tapdisk-mirror.h"
 
 #include "blktap2.h"
 
@@ -70,12 +74,15 @@
 #define TD_VBD_EIO_RETRIES          10
 #define TD_VBD_EIO_SLEEP            1
 #define TD_VBD_WATCHDOG_TIMEOUT     10
+#define TD_VBD_OPEN_THREADS         8
 
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_queue_state(td_vbd_t *);
+static int  __tapdisk_vbd_kick(td_vbd_t *);
+static void tapdisk_vbd_release_parents(td_vbd_t *);
 
 /* 
  * initialization
@@ -115,12 +122,15 @@ tapdisk_vbd_create(uint16_t uuid)
 	vbd->argument = vbd;
 
 	INIT_LIST_HEAD(&vbd->images);
+	INIT_LIST_HEAD(&vbd->kept_images);
 	INIT_LIST_HEAD(&vbd->new_requests);
 	INIT_LIST_HEAD(&vbd->pending_requests);
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
 	tapdisk_vbd_mark_progress(vbd);
+	tapdisk_qos_init(&vbd->qos);
+	tapdisk_queue_init_share(&vbd->share);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
 		tapdisk_vbd_initialize_vreq(vbd->request_list + i);
@@ -181,11 +191,71 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return 0;
 }
 
+static void
+tapdisk_vbd_set_image_share(td_vbd_t *vbd, td_image_t *image)
+{
+	td_driver_t *driver = image->driver;
+
+	/*
+	 * Requests to shared parents are charged to the issuing vbd in
+	 * td_queue_read, anything they queue on their own goes to the
+	 * default share rather than whichever vbd opened them first.
+	 */
+	if (td_flag_test(image->flags, TD_OPEN_SHAREABLE))
+		return;
+
+	if (driver && !driver->share)
+		driver->share = &vbd->share;
+}
+
+static void
+tapdisk_vbd_clear_image_share(td_vbd_t *vbd, td_image_t *image)
+{
+	td_driver_t *driver = image->driver;
+
+	if (driver && driver->share == &vbd->share)
+		driver->share = NULL;
+}
+
+static void
+tapdisk_vbd_set_image_shares(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		tapdisk_vbd_set_image_share(vbd, image);
+
+	if (vbd->secondary)
+		tapdisk_vbd_set_image_share(vbd, vbd->secondary);
+}
+
+/*
+ * Unlink an image from a live chain, e.g. a parent merged or
+ * streamed away by a job. The queue must be quiesced.
+ */
 void
-tapdisk_vbd_close_vdi(td_vbd_t *vbd)
+tapdisk_vbd_drop_image(td_vbd_t *vbd, td_image_t *image)
+{
+	tapdisk_vbd_clear_image_share(vbd, image);
+	td_close(image);
+	tapdisk_image_free(image);
+}
+
+static void
+__tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	td_image_t *image, *tmp;
 
+	tapdisk_mirror_detach(vbd->mirror);
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		tapdisk_vbd_clear_image_share(vbd, image);
+	if (vbd->secondary)
+		tapdisk_vbd_clear_image_share(vbd, vbd->secondary);
+	if (vbd->retired)
+		tapdisk_vbd_clear_image_share(vbd, vbd->retired);
+	tapdisk_server_release_share(&vbd->share);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
 		td_close(image);
 		tapdisk_image_free(image);
@@ -209,6 +279,13 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 	td_flag_set(vbd->state, TD_VBD_CLOSED);
 }
 
+void
+tapdisk_vbd_close_vdi(td_vbd_t *vbd)
+{
+	tapdisk_job_close(vbd->job);
+	__tapdisk_vbd_close_vdi(vbd);
+}
+
 static int
 tapdisk_vbd_add_block_cache(td_vbd_t *vbd)
 {
@@ -326,6 +403,72 @@ done:
 	return 0;
 }
 
+static int
+tapdisk_vbd_add_readahead(td_vbd_t *vbd)
+{
+	int err;
+	td_image_t *ra, *leaf;
+
+	if (vbd->secondary) {
+		DPRINTF("Read-ahead not supported with a secondary image\n");
+		return 0;
+	}
+
+	leaf = tapdisk_vbd_first_image(vbd);
+	ra   = tapdisk_image_allocate(leaf->name,
+				      DISK_TYPE_READAHEAD,
+				      leaf->flags,
+				      leaf->private);
+	if (!ra)
+		return -ENOMEM;
+
+	ra->driver = tapdisk_driver_allocate(ra->type,
+					     ra->name,
+					     ra->flags);
+	if (!ra->driver) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	ra->driver->info = leaf->driver->info;
+
+	err = td_open(ra);
+	if (err)
+		goto fail;
+
+	/* insert on top of the leaf */
+	list_add(&ra->next, &vbd->images);
+
+	DPRINTF("Added read-ahead driver\n");
+	return 0;
+
+fail:
+	tapdisk_image_free(ra);
+	return err;
+}
+
+static int
+tapdisk_vbd_attach_mirror(td_vbd_t *vbd, td_image_t *second)
+{
+	int err;
+
+	/* the dirty map outlives pause/resume, unless the disk was resized */
+	if (vbd->mirror && vbd->mirror->sectors != second->info.size) {
+		tapdisk_mirror_free(vbd->mirror);
+		vbd->mirror = NULL;
+	}
+
+	if (!vbd->mirror) {
+		err = tapdisk_mirror_create(vbd, second->info.size,
+					    &vbd->mirror);
+		if (err)
+			return err;
+	}
+
+	tapdisk_mirror_attach(vbd->mirror, second);
+	return 0;
+}
+
 static int
 tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 {
@@ -335,7 +478,7 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 
 	DPRINTF("Adding secondary image: %s\n", vbd->secondary_name);
 
-	leaf = tapdisk_vbd_first_image(vbd);
+	leaf = tapdisk_vbd_leaf_image(vbd);
 	second = tapdisk_image_allocate(vbd->secondary_name,
 					vbd->secondary_type,
 					leaf->flags,
@@ -367,6 +510,14 @@ tapdisk_vbd_add_secondary(td_vbd_t *vbd)
 		goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_MIRROR_ASYNC)) {
+		err = tapdisk_vbd_attach_mirror(vbd, second);
+		if (err) {
+			td_close(second);
+			goto fail;
+		}
+	}
+
 	goto done;
 
 fail:
@@ -375,6 +526,14 @@ fail:
 
 done:
 	vbd->secondary = second;
+	if (td_flag_test(vbd->flags, TD_OPEN_MIRROR_ASYNC)) {
+		/* may lag the primary: never read, no fail-over on ENOSPC */
+		DPRINTF("In asynchronous mirror mode\n");
+		vbd->secondary_mode = TD_VBD_SECONDARY_ASYNC;
+		DPRINTF("Added secondary image\n");
+		return 0;
+	}
+
 	leaf->flags |= TD_IGNORE_ENOSPC;
 	if (td_flag_test(vbd->flags, TD_OPEN_STANDBY)) {
 		DPRINTF("In standby mode\n");
@@ -493,6 +652,222 @@ fail:
 	return err;
 }
 
+/*
+ * Parents of a VHD leaf are opened concurrently: the chain is walked
+ * first with query opens, which read only footers and headers, then
+ * the full opens, with their BAT and batmap reads, run on a few
+ * threads. Only VHD opens go to the threads; block-vhd serializes the
+ * parts of its open which touch global state.
+ */
+struct tapdisk_vbd_open_work {
+	td_image_t                **images;
+	int                        *errs;
+	int                         count;
+	int                         next;
+	pthread_mutex_t             lock;
+};
+
+static void *
+tapdisk_vbd_open_worker(void *arg)
+{
+	struct tapdisk_vbd_open_work *w = arg;
+	td_driver_t *driver;
+	td_image_t *image;
+	int i, err;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		i = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		if (i >= w->count)
+			break;
+
+		image  = w->images[i];
+		driver = image->driver;
+		if (image->type != DISK_TYPE_VHD || driver->refcnt ||
+		    td_flag_test(driver->state, TD_DRIVER_OPEN))
+			continue;
+
+		err = driver->ops->td_open(driver, image->name, image->flags);
+		if (!err)
+			td_flag_set(driver->state, TD_DRIVER_OPEN);
+		w->errs[i] = err;
+	}
+
+	return NULL;
+}
+
+static int
+tapdisk_vbd_query_parent(td_image_t *image, td_disk_id_t *id)
+{
+	td_image_t *query;
+	int err;
+
+	query = tapdisk_image_allocate(image->name, image->type,
+				       image->flags | TD_OPEN_QUERY,
+				       image->private);
+	if (!query)
+		return -ENOMEM;
+
+	err = td_open(query);
+	if (!err) {
+		err = td_get_parent_id(query, id);
+		td_close(query);
+	}
+
+	tapdisk_image_free(query);
+
+	if (err && err != TD_NO_PARENT)
+		return err;
+
+	image->driver = tapdisk_driver_allocate(image->type,
+						image->name,
+						image->flags);
+	if (!image->driver) {
+		if (!err)
+			free(id->name);
+		return -ENOMEM;
+	}
+
+	return err;
+}
+
+static int
+tapdisk_vbd_open_concurrent(td_vbd_t *vbd, int type)
+{
+	td_image_t *leaf = tapdisk_vbd_first_image(vbd);
+
+	return (type == DISK_TYPE_VHD && leaf->type == DISK_TYPE_VHD &&
+		!td_flag_test(vbd->flags,
+			      TD_OPEN_REUSE_PARENT | TD_OPEN_VHD_INDEX));
+}
+
+/*
+ * Takes @file. On failure, images not yet added to the vbd are
+ * released here; the caller closes the rest.
+ */
+static int
+tapdisk_vbd_open_parents(td_vbd_t *vbd, char *file, int type,
+			 td_flag_t flags)
+{
+	struct tapdisk_vbd_open_work w;
+	pthread_t threads[TD_VBD_OPEN_THREADS];
+	struct timeval start, now, delta;
+	td_image_t *image, **images;
+	td_driver_t *driver;
+	td_disk_id_t id;
+	int i, n, err, loaded;
+	void *tmp;
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.lock, NULL);
+	gettimeofday(&start, NULL);
+
+	n      = 0;
+	loaded = 0;
+
+	for (;;) {
+		err = -ENOMEM;
+		tmp = realloc(w.images, (w.count + 1) * sizeof(*w.images));
+		if (!tmp)
+			goto out;
+		w.images = tmp;
+
+		image = tapdisk_image_allocate(file, type, flags, vbd);
+		free(file);
+		file = NULL;
+		if (!image)
+			goto out;
+
+		w.images[w.count++] = image;
+
+		err = td_load(image);
+		if (!err) {
+			loaded++;
+			err = td_get_parent_id(image, &id);
+		} else if (err == -ENODEV)
+			err = tapdisk_vbd_query_parent(image, &id);
+
+		if (err == TD_NO_PARENT)
+			break;
+		if (err)
+			goto out;
+
+		file = id.name;
+		type = id.drivertype;
+	}
+
+	err = -ENOMEM;
+	w.errs = calloc(w.count, sizeof(*w.errs));
+	if (!w.errs)
+		goto out;
+
+	for (n = 0; n < TD_VBD_OPEN_THREADS && n < w.count - 1; n++)
+		if (pthread_create(&threads[n], NULL,
+				   tapdisk_vbd_open_worker, &w))
+			break;
+
+	tapdisk_vbd_open_worker(&w);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < w.count; i++) {
+		image = w.images[i];
+
+		err = w.errs[i];
+		if (err) {
+			EPRINTF("%s: opening %s: %d\n",
+				vbd->name, image->name, err);
+			goto out;
+		}
+
+		/* attach, or open what the threads left */
+		if (!image->driver->refcnt) {
+			err = td_open(image);
+			if (err)
+				goto out;
+		}
+
+		tapdisk_vbd_add_image(vbd, image);
+		w.images[i] = NULL;
+	}
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &delta);
+
+	DPRINTF("%s: opened %d parents (%d shared) in %lu.%06lus, "
+		"%d threads\n", vbd->name, w.count, loaded,
+		(unsigned long)delta.tv_sec, (unsigned long)delta.tv_usec,
+		n + 1);
+
+	err = 0;
+
+out:
+	for (i = 0; i < w.count; i++) {
+		image = w.images[i];
+		if (!image)
+			continue;
+
+		driver = image->driver;
+		if (driver && driver->refcnt)
+			td_close(image);
+		else if (driver && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+			driver->ops->td_close(driver);
+			td_flag_clear(driver->state, TD_DRIVER_OPEN);
+		}
+
+		tapdisk_image_free(image);
+	}
+
+	free(file);
+	free(w.images);
+	free(w.errs);
+	pthread_mutex_destroy(&w.lock);
+	return err;
+}
+
 static int
 __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 {
@@ -567,6 +942,13 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 			type = DISK_TYPE_AIO;
 		}
 		flags |= (TD_OPEN_RDONLY | TD_OPEN_SHAREABLE);
+
+		if (tapdisk_vbd_open_concurrent(vbd, type)) {
+			err = tapdisk_vbd_open_parents(vbd, file, type, flags);
+			if (err)
+				goto fail;
+			break;
+		}
 	}
 
 	if (td_flag_test(vbd->flags, TD_OPEN_LOG_DIRTY)) {
@@ -591,12 +973,27 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 	if (err)
 		goto fail;
 
+	if (td_flag_test(vbd->flags, TD_OPEN_4K) &&
+	    tapdisk_vbd_first_image(vbd)->info.size & TD_4K_SECTOR_MASK) {
+		EPRINTF("%s: size not a multiple of 4K\n", vbd->name);
+		err = -EINVAL;
+		goto fail;
+	}
+
 	if (td_flag_test(vbd->flags, TD_OPEN_SECONDARY)) {
 		err = tapdisk_vbd_add_secondary(vbd);
 		if (err)
 			goto fail;
 	}
 
+	if (td_flag_test(vbd->flags, TD_OPEN_READAHEAD)) {
+		err = tapdisk_vbd_add_readahead(vbd);
+		if (err)
+			goto fail;
+	}
+
+	tapdisk_vbd_set_image_shares(vbd);
+
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 
 	return 0;
@@ -829,10 +1226,12 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
 	int new, pending, failed, completed;
 
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_job_busy(vbd->job) ||
+	    tapdisk_mirror_busy(vbd->mirror))
 		return -EAGAIN;
 
-	tapdisk_vbd_kick(vbd);
+	__tapdisk_vbd_kick(vbd);
 	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
 
 	DPRINTF("%s: state: 0x%08x, new: 0x%02x, pending: 0x%02x, "
@@ -847,8 +1246,11 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->kicked, vbd->kicks_in, vbd->kicks_out);
 
 	tapdisk_vbd_close_vdi(vbd);
+	tapdisk_vbd_release_parents(vbd);
 	tapdisk_vbd_detach(vbd);
 	tapdisk_server_remove_vbd(vbd);
+	tapdisk_job_free(vbd->job);
+	tapdisk_mirror_free(vbd->mirror);
 	free(vbd->name);
 	free(vbd);
 
@@ -861,7 +1263,9 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_job_busy(vbd->job) ||
+	    tapdisk_mirror_busy(vbd->mirror))
 		goto fail;
 
 	/* 
@@ -934,6 +1338,9 @@ tapdisk_vbd_get_image_info(td_vbd_t *vbd, image_t *img)
 	img->secsize = image->info.sector_size;
 	img->info    = image->info.info;
 
+	if (td_flag_test(vbd->flags, TD_OPEN_4K))
+		img->secsize = TD_4K_SECTOR_SIZE;
+
 	return 0;
 }
 
@@ -946,11 +1353,44 @@ tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 		!td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED));
 }
 
-int
-tapdisk_vbd_retry_needed(td_vbd_t *vbd)
+/*
+ * Usecs until the next failed request is due for a retry, -1 if
+ * there's nothing to retry. New requests held back are looked at
+ * again every TD_VBD_RETRY_INTERVAL.
+ */
+long
+tapdisk_vbd_retry_timeout(td_vbd_t *vbd)
 {
-	return !(list_empty(&vbd->failed_requests) &&
-		 list_empty(&vbd->new_requests));
+	long usecs, timeout;
+	struct timeval now, delta;
+	td_vbd_request_t *vreq, *tmp;
+
+	timeout = -1;
+	if (!list_empty(&vbd->new_requests))
+		timeout = TD_VBD_RETRY_INTERVAL * 1000000L;
+
+	if (list_empty(&vbd->failed_requests))
+		return timeout;
+
+	gettimeofday(&now, NULL);
+
+	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->failed_requests) {
+		if (vreq->secs_pending)
+			continue;
+
+		/* due but held back, e.g. by a job: poll at the minimum */
+		usecs = TD_VBD_RETRY_MIN_USECS;
+		if (vreq->error != -EBUSY &&
+		    timercmp(&vreq->retry_at, &now, >)) {
+			timersub(&vreq->retry_at, &now, &delta);
+			usecs = delta.tv_sec * 1000000L + delta.tv_usec;
+		}
+
+		if (timeout < 0 || usecs < timeout)
+			timeout = usecs;
+	}
+
+	return timeout;
 }
 
 int
@@ -962,7 +1402,9 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	if (!list_empty(&vbd->pending_requests) ||
+	    tapdisk_job_busy(vbd->job) ||
+	    tapdisk_mirror_busy(vbd->mirror)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -1032,6 +1474,93 @@ tapdisk_vbd_close_and_reopen_image(td_vbd_t *vbd, td_image_t *image)
 	return err;
 }
 
+/*
+ * Fast pause, e.g. for a snapshot: hold on to the read-only parents
+ * while paused. On resume, td_load() finds them like parents shared
+ * with other vbds, so only the new leaf is opened, and the parent
+ * drivers keep their BAT and bitmap caches. Parents must not be
+ * modified while paused.
+ */
+static void
+tapdisk_vbd_keep_parents(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+
+	if (td_flag_test(vbd->flags,
+			 TD_OPEN_ADD_CACHE |
+			 TD_OPEN_LOCAL_CACHE |
+			 TD_OPEN_VHD_INDEX |
+			 TD_OPEN_REUSE_PARENT |
+			 TD_OPEN_SECONDARY)) {
+		DPRINTF("%s: not keeping parents in this configuration\n",
+			vbd->name);
+		return;
+	}
+
+	tapdisk_job_close(vbd->job);
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (!td_flag_test(image->flags, TD_OPEN_RDONLY) ||
+		    !td_flag_test(image->flags, TD_OPEN_SHAREABLE))
+			continue;
+
+		tapdisk_vbd_clear_image_share(vbd, image);
+		list_move_tail(&image->next, &vbd->kept_images);
+		vbd->parents_kept++;
+	}
+}
+
+static void
+tapdisk_vbd_release_parents(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+	int kept, reused;
+
+	kept   = 0;
+	reused = 0;
+
+	list_for_each_entry_safe(image, tmp, &vbd->kept_images, next) {
+		if (image->driver->refcnt > 1)
+			reused++;
+		kept++;
+
+		list_del_init(&image->next);
+		td_close(image);
+		tapdisk_image_free(image);
+	}
+
+	if (kept)
+		DPRINTF("%s: reused %d of %d parents\n",
+			vbd->name, reused, kept);
+
+	vbd->parents_reused += reused;
+}
+
+static void
+tapdisk_vbd_count_pause(td_vbd_t *vbd)
+{
+	struct timeval now, delta;
+	uint64_t usecs;
+
+	if (!timerisset(&vbd->pause_start))
+		return;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vbd->pause_start, &delta);
+	timerclear(&vbd->pause_start);
+
+	usecs = (uint64_t)delta.tv_sec * 1000000 + delta.tv_usec;
+
+	vbd->pauses++;
+	vbd->pause_usecs      += usecs;
+	vbd->pause_usecs_last  = usecs;
+	if (usecs > vbd->pause_usecs_max)
+		vbd->pause_usecs_max = usecs;
+
+	DPRINTF("%s: paused for %lu.%06lus\n", vbd->name,
+		(unsigned long)delta.tv_sec, (unsigned long)delta.tv_usec);
+}
+
 int
 tapdisk_vbd_pause(td_vbd_t *vbd)
 {
@@ -1039,12 +1568,18 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 
 	DBG(TLOG_DBG, "pause requested\n");
 
+	if (!td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
+		gettimeofday(&vbd->pause_start, NULL);
+
 	td_flag_set(vbd->state, TD_VBD_PAUSE_REQUESTED);
 
 	err = tapdisk_vbd_quiesce_queue(vbd);
 	if (err)
 		return err;
 
+	if (td_flag_test(vbd->state, TD_VBD_KEEP_PARENTS))
+		tapdisk_vbd_keep_parents(vbd);
+
 	tapdisk_vbd_close_vdi(vbd);
 
 	DBG(TLOG_DBG, "pause completed\n");
@@ -1100,11 +1635,15 @@ tapdisk_vbd_resume(td_vbd_t *vbd, int type, const char *path)
 		sleep(TD_VBD_EIO_SLEEP);
 	}
 
+	tapdisk_vbd_release_parents(vbd);
+	td_flag_clear(vbd->state, TD_VBD_KEEP_PARENTS);
+
 	if (err)
 		return err;
 
 	DBG(TLOG_DBG, "resume completed\n");
 
+	tapdisk_vbd_count_pause(vbd);
 	tapdisk_vbd_start_queue(vbd);
 	td_flag_clear(vbd->state, TD_VBD_PAUSED);
 	td_flag_clear(vbd->state, TD_VBD_PAUSE_REQUESTED);
@@ -1116,14 +1655,63 @@ tapdisk_vbd_resume(td_vbd_t *vbd, int type, const char *path)
 	return 0;
 }
 
+/*
+ * Internal pause/resume onto another image, e.g. to pivot to the
+ * target of a migration. The queue must be quiesced. On failure, the
+ * old chain is reopened.
+ */
 int
-tapdisk_vbd_kick(td_vbd_t *vbd)
+tapdisk_vbd_reopen_vdi(td_vbd_t *vbd, int type, const char *path)
+{
+	char *name, *old_name;
+	int err, old_type;
+	td_job_t *job;
+
+	name = strdup(path);
+	if (!name)
+		return -ENOMEM;
+
+	/* the job driving this one stays out of close_vdi */
+	job      = vbd->job;
+	vbd->job = NULL;
+
+	__tapdisk_vbd_close_vdi(vbd);
+
+	old_name  = vbd->name;
+	old_type  = vbd->type;
+	vbd->name = name;
+	vbd->type = type;
+
+	err = __tapdisk_vbd_open_vdi(vbd, TD_OPEN_STRICT);
+	if (!err) {
+		DPRINTF("%s: reopened from %s\n", vbd->name, old_name);
+		free(old_name);
+		goto out;
+	}
+
+	EPRINTF("%s: reopen failed: %d, going back to %s\n",
+		name, err, old_name);
+
+	vbd->name = old_name;
+	vbd->type = old_type;
+	free(name);
+
+	if (__tapdisk_vbd_open_vdi(vbd, TD_OPEN_STRICT)) {
+		EPRINTF("%s: lost the vdi\n", vbd->name);
+		td_flag_set(vbd->state, TD_VBD_DEAD);
+	}
+
+out:
+	vbd->job = job;
+	return err;
+}
+
+static int
+__tapdisk_vbd_kick(td_vbd_t *vbd)
 {
 	int n;
 	td_ring_t *ring;
 
-	tapdisk_vbd_check_queue_state(vbd);
-
 	ring = &vbd->ring;
 	if (!ring->sring)
 		return 0;
@@ -1134,6 +1722,7 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 
 	vbd->kicks_out++;
 	vbd->kicked += n;
+	timerclear(&vbd->kick_held);
 	RING_PUSH_RESPONSES(&ring->fe_ring);
 	ioctl(ring->fd, BLKTAP_IOCTL_KICK_FE, 0);
 
@@ -1143,6 +1732,62 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 	return n;
 }
 
+/*
+ * Kick moderation: while requests are still in flight, hold back
+ * responses for up to kick_usecs, or until kick_responses pile up,
+ * so they go out with fewer ioctls and guest events. An idle ring
+ * is kicked right away.
+ */
+static int
+tapdisk_vbd_hold_kick(td_vbd_t *vbd, int n)
+{
+	struct timeval now, delta;
+	long elapsed;
+
+	if (!vbd->kick_usecs || list_empty(&vbd->pending_requests))
+		return 0;
+
+	if (vbd->kick_responses && n >= vbd->kick_responses)
+		return 0;
+
+	gettimeofday(&now, NULL);
+
+	if (!timerisset(&vbd->kick_held)) {
+		vbd->kick_held = now;
+		vbd->kicks_held++;
+	}
+
+	timersub(&now, &vbd->kick_held, &delta);
+	elapsed = delta.tv_sec * 1000000 + delta.tv_usec;
+	if (elapsed >= vbd->kick_usecs)
+		return 0;
+
+	tapdisk_server_set_max_timeout_us(vbd->kick_usecs - elapsed);
+	return 1;
+}
+
+int
+tapdisk_vbd_kick(td_vbd_t *vbd)
+{
+	int n;
+	td_ring_t *ring;
+
+	tapdisk_vbd_check_queue_state(vbd);
+
+	ring = &vbd->ring;
+	if (!ring->sring)
+		return 0;
+
+	n    = (ring->fe_ring.rsp_prod_pvt - ring->fe_ring.sring->rsp_prod);
+	if (!n)
+		return 0;
+
+	if (tapdisk_vbd_hold_kick(vbd, n))
+		return 0;
+
+	return __tapdisk_vbd_kick(vbd);
+}
+
 static inline void
 tapdisk_vbd_write_response_to_ring(td_vbd_t *vbd, blkif_response_t *rsp)
 {
@@ -1162,6 +1807,25 @@ tapdisk_vbd_callback(void *arg, blkif_response_t *rsp)
 	tapdisk_vbd_write_response_to_ring(vbd, rsp);
 }
 
+static void
+tapdisk_vbd_count_retried(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	struct timeval now, delta;
+	uint64_t usecs;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &vreq->ts, &delta);
+	usecs = (uint64_t)delta.tv_sec * 1000000 + delta.tv_usec;
+
+	vbd->retried++;
+	if (vreq->status != BLKIF_RSP_OKAY)
+		vbd->retried_failed++;
+
+	vbd->retry_usecs += usecs;
+	if (usecs > vbd->retry_usecs_max)
+		vbd->retry_usecs_max = usecs;
+}
+
 static void
 tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
@@ -1181,6 +1845,9 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (rsp->status != BLKIF_RSP_OKAY)
 		ERR(-vreq->error, "returning BLKIF_RSP %d", rsp->status);
 
+	if (vreq->num_retries)
+		tapdisk_vbd_count_retried(vbd, vreq);
+
 	vbd->returned++;
 	vbd->callback(vbd->argument, rsp);
 }
@@ -1246,6 +1913,12 @@ tapdisk_vbd_check_state(td_vbd_t *vbd)
 	if (td_flag_test(vbd->state, TD_VBD_QUIESCE_REQUESTED))
 		tapdisk_vbd_quiesce_queue(vbd);
 
+	if (tapdisk_job_active(vbd->job))
+		tapdisk_job_check(vbd->job);
+
+	if (vbd->mirror)
+		tapdisk_mirror_check(vbd->mirror);
+
 	if (td_flag_test(vbd->state, TD_VBD_PAUSE_REQUESTED))
 		tapdisk_vbd_pause(vbd);
 
@@ -1318,14 +1991,51 @@ tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	return 1;
 }
 
+/*
+ * Failed requests back off exponentially, from TD_VBD_RETRY_MIN_USECS
+ * doubling with every retry up to TD_VBD_RETRY_MAX_USECS. -EBUSY
+ * means we ran out of resources and is retried without backoff.
+ */
+static void
+tapdisk_vbd_set_retry(td_vbd_request_t *vreq)
+{
+	struct timeval now, delay;
+	long usecs;
+	int i;
+
+	usecs = TD_VBD_RETRY_MIN_USECS;
+	for (i = 0; i < vreq->num_retries &&
+		     usecs < TD_VBD_RETRY_MAX_USECS; i++)
+		usecs <<= 1;
+	if (usecs > TD_VBD_RETRY_MAX_USECS)
+		usecs = TD_VBD_RETRY_MAX_USECS;
+
+	delay.tv_sec  = usecs / 1000000;
+	delay.tv_usec = usecs % 1000000;
+
+	gettimeofday(&now, NULL);
+	timeradd(&now, &delay, &vreq->retry_at);
+}
+
 static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
+	if (td_flag_test(vreq->flags, TD_VREQ_INTERNAL))
+		return;
+
 	if (!vreq->submitting && !vreq->secs_pending) {
+		if (td_flag_test(vreq->flags, TD_VREQ_MIRROR_DIRTY)) {
+			td_flag_clear(vreq->flags, TD_VREQ_MIRROR_DIRTY);
+			tapdisk_mirror_mark(vbd->mirror,
+					    vreq->req.sector_number,
+					    tapdisk_vbd_request_secs(vreq));
+		}
+
 		if (vreq->status == BLKIF_RSP_ERROR &&
-		    tapdisk_vbd_request_should_retry(vbd, vreq))
+		    tapdisk_vbd_request_should_retry(vbd, vreq)) {
+			tapdisk_vbd_set_retry(vreq);
 			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
+		} else
 			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
 	}
 }
@@ -1446,10 +2156,17 @@ tapdisk_vbd_forward_request(td_request_t treq)
 
 	tapdisk_vbd_mark_progress(vbd);
 
+	if (td_flag_test(vreq->flags, TD_VREQ_NOFORWARD)) {
+		td_complete_request(treq, -ENODATA);
+		return;
+	}
+
+	/* NB. complete through treq.cb: the request may be a clone
+	 * owned by a stacked driver, not sized like the vreq. */
 	if (tapdisk_vbd_queue_ready(vbd))
 		__tapdisk_vbd_reissue_td_request(vbd, image, treq);
 	else
-		__tapdisk_vbd_complete_td_request(vbd, vreq, treq, -EBUSY);
+		td_complete_request(treq, -EBUSY);
 }
 
 static void
@@ -1468,7 +2185,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	if (abs(res) == ENOSPC && td_flag_test(image->flags,
 				TD_IGNORE_ENOSPC)) {
 		res = 0;
-		leaf = tapdisk_vbd_first_image(vbd);
+		leaf = tapdisk_vbd_leaf_image(vbd);
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
 			DPRINTF("ENOSPC: disabling mirroring\n");
 			list_del_init(&leaf->next);
@@ -1500,13 +2217,41 @@ queue_mirror_req(td_vbd_t *vbd, td_request_t clone)
 	td_queue_write(vbd->secondary, clone);
 }
 
+static void
+tapdisk_vbd_complete_job_write(td_request_t treq, int res)
+{
+	td_vbd_t *vbd;
+	td_vbd_request_t *vreq;
+
+	vbd  = (td_vbd_t *)treq.image->private;
+	vreq = (td_vbd_request_t *)treq.private;
+
+	tapdisk_vbd_mark_progress(vbd);
+
+	/* the job copies it again, no need to fail the guest */
+	if (res)
+		tapdisk_job_mirror_failed(vbd->job, treq, res);
+
+	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, 0);
+}
+
+static inline void
+queue_job_write(td_vbd_t *vbd, td_image_t *target, td_request_t clone)
+{
+	clone.image = target;
+	clone.cb    = tapdisk_vbd_complete_job_write;
+	td_queue_write(target, clone);
+}
+
 static inline void
 tapdisk_vbd_submit_request(td_vbd_t *vbd, blkif_request_t *req,
-		td_request_t treq)
+		td_request_t treq, td_image_t *job_target)
 {
 	switch (req->operation)	{
 	case BLKIF_OP_WRITE:
 		treq.op = TD_OP_WRITE;
+		if (job_target)
+			queue_job_write(vbd, job_target, treq);
 		/* it's important to queue the mirror request before queuing 
 		 * the main one. If the main image runs into ENOSPC, the 
 		 * mirroring could be disabled before td_queue_write returns, 
@@ -1515,6 +2260,11 @@ tapdisk_vbd_submit_request(td_vbd_t *vbd, blkif_request_t *req,
 		 * hang with unacknowledged writes */
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR)
 			queue_mirror_req(vbd, treq);
+		else if (vbd->secondary_mode == TD_VBD_SECONDARY_ASYNC &&
+			 tapdisk_mirror_queue_write(vbd->mirror, treq)) {
+			td_vbd_request_t *vreq = treq.private;
+			td_flag_set(vreq->flags, TD_VREQ_MIRROR_DIRTY);
+		}
 		td_queue_write(treq.image, treq);
 		break;
 
@@ -1530,7 +2280,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
 	char *page;
 	td_ring_t *ring;
-	td_image_t *image;
+	td_image_t *image, *job_target;
 	td_request_t treq;
 	uint64_t sector_nr;
 	blkif_request_t *req;
@@ -1562,6 +2312,11 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
+	/* fixed up front, secs_pending counts both writes */
+	job_target = NULL;
+	if (req->operation == BLKIF_OP_WRITE)
+		job_target = tapdisk_job_mirror(vbd->job);
+
 	memset(&treq, 0, sizeof(td_request_t));
 	for (i = 0; i < req->nr_segments; i++) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
@@ -1573,7 +2328,8 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			if (page == treq.buf + (treq.secs << SECTOR_SHIFT)) {
 				treq.secs += nsects;
 			} else {
-				tapdisk_vbd_submit_request(vbd, req, treq);
+				tapdisk_vbd_submit_request(vbd, req, treq,
+							   job_target);
 				treq_started = 0;
 			}
 		}
@@ -1602,9 +2358,13 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			vreq->secs_pending += nsects;
 			vbd->secs_pending  += nsects;
 		}
+		if (job_target) {
+			vreq->secs_pending += nsects;
+			vbd->secs_pending  += nsects;
+		}
 
 		if (i == req->nr_segments - 1) {
-			tapdisk_vbd_submit_request(vbd, req, treq);
+			tapdisk_vbd_submit_request(vbd, req, treq, job_target);
 			treq_started = 0;
 		}
 
@@ -1653,7 +2413,10 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 		}
 
 		if (vreq->error != -EBUSY &&
-		    now.tv_sec - vreq->last_try.tv_sec < TD_VBD_RETRY_INTERVAL)
+		    timercmp(&now, &vreq->retry_at, <))
+			continue;
+
+		if (tapdisk_job_write_blocked(vbd->job, vreq))
 			continue;
 
 		vbd->retries++;
@@ -1692,13 +2455,59 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	}
 }
 
+static int
+tapdisk_vbd_qos_admit(td_vbd_t *vbd, td_vbd_request_t *vreq,
+		      const struct timeval *now)
+{
+	blkif_request_t *req = &vreq->req;
+	struct blkif_request_segment *seg;
+	uint64_t secs;
+	int write;
+
+	if (!tapdisk_qos_enabled(&vbd->qos))
+		return 1;
+
+	/* malformed requests are rejected on issue, don't charge them */
+	if (req->nr_segments > MAX_SEGMENTS_PER_REQ)
+		return 1;
+
+	write = req->operation == BLKIF_OP_WRITE;
+
+	secs = 0;
+	for (seg = &req->seg[0]; seg < &req->seg[req->nr_segments]; seg++)
+		secs += seg->last_sect - seg->first_sect + 1;
+
+	if (tapdisk_qos_admit(&vbd->qos, write, secs << SECTOR_SHIFT, now))
+		return 1;
+
+	/* come back as soon as the buckets can cover it */
+	tapdisk_server_set_max_timeout_us(
+		tapdisk_qos_wait(&vbd->qos, write, secs << SECTOR_SHIFT));
+
+	return 0;
+}
+
 static int
 tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 {
 	int err;
+	struct timeval now;
 	td_vbd_request_t *vreq, *tmp;
 
+	gettimeofday(&now, NULL);
+
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		/* writes racing a job chunk wait for it to complete */
+		if (tapdisk_job_write_blocked(vbd->job, vreq))
+			return 0;
+
+		/*
+		 * throttled requests stay on new_requests, in order.
+		 * the qos wait set on admit brings us back here.
+		 */
+		if (!tapdisk_vbd_qos_admit(vbd, vreq, &now))
+			return 0;
+
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		/*
 		 * if this request failed, but was not completed,
@@ -1938,5 +2747,132 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 			    "FIXME_enospc_redirect_count",
 			    "llu", vbd->FIXME_enospc_redirect_count);
 
+	tapdisk_stats_field(st, "qos", "{");
+	tapdisk_qos_stats(&vbd->qos, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "kicks", "{");
+	tapdisk_stats_field(st, "in", "llu", vbd->kicks_in);
+	tapdisk_stats_field(st, "out", "llu", vbd->kicks_out);
+	tapdisk_stats_field(st, "responses", "llu", vbd->kicked);
+	tapdisk_stats_field(st, "held", "llu", vbd->kicks_held);
+	tapdisk_stats_field(st, "usecs", "u", vbd->kick_usecs);
+	tapdisk_stats_field(st, "max_responses", "u", vbd->kick_responses);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "share", "{");
+	tapdisk_stats_field(st, "weight", "d", vbd->share.weight);
+	tapdisk_stats_field(st, "limit", "d", vbd->share.limit);
+	tapdisk_stats_field(st, "inflight", "d", vbd->share.inflight);
+	tapdisk_stats_field(st, "deferred", "d", vbd->share.tiocbs_deferred);
+	tapdisk_stats_field(st, "deferrals", "llu", vbd->share.deferrals);
 	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "retries", "{");
+	tapdisk_stats_field(st, "count", "llu", vbd->retries);
+	tapdisk_stats_field(st, "requests", "llu", vbd->retried);
+	tapdisk_stats_field(st, "failed", "llu", vbd->retried_failed);
+	tapdisk_stats_field(st, "usecs", "llu", vbd->retry_usecs);
+	tapdisk_stats_field(st, "max_usecs", "llu", vbd->retry_usecs_max);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "pause", "{");
+	tapdisk_stats_field(st, "count", "llu", vbd->pauses);
+	tapdisk_stats_field(st, "usecs", "llu", vbd->pause_usecs);
+	tapdisk_stats_field(st, "last_usecs", "llu", vbd->pause_usecs_last);
+	tapdisk_stats_field(st, "max_usecs", "llu", vbd->pause_usecs_max);
+	tapdisk_stats_field(st, "parents_kept", "llu", vbd->parents_kept);
+	tapdisk_stats_field(st, "parents_reused", "llu", vbd->parents_reused);
+	tapdisk_stats_leave(st, '}');
+
+	if (vbd->job) {
+		tapdisk_stats_field(st, "job", "{");
+		tapdisk_job_stats(vbd->job, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	if (vbd->mirror) {
+		tapdisk_stats_field(st, "mirror", "{");
+		tapdisk_mirror_stats(vbd->mirror, st);
+		tapdisk_stats_leave(st, '}');
+	}
+
+	tapdisk_stats_leave(st, '}');
+}
+
+void
+tapdisk_vbd_set_qos(td_vbd_t *vbd, const uint64_t iops[2],
+		    const uint64_t bps[2], unsigned int burst_ms)
+{
+	tapdisk_qos_set(&vbd->qos, iops, bps, burst_ms);
+
+	DBG(TLOG_WARN, "%s: qos iops %"PRIu64"/%"PRIu64", "
+	    "bps %"PRIu64"/%"PRIu64", burst %ums\n", vbd->name,
+	    iops[0], iops[1], bps[0], bps[1], burst_ms);
+
+	/* limits may have been lifted, don't wait for the retry timer */
+	if (!list_empty(&vbd->new_requests))
+		tapdisk_vbd_issue_requests(vbd);
+}
+
+void
+tapdisk_vbd_set_share(td_vbd_t *vbd, int weight, int percent)
+{
+	tapdisk_server_set_share(&vbd->share, weight, percent);
+
+	DBG(TLOG_WARN, "%s: queue share weight %d, limit %d\n",
+	    vbd->name, vbd->share.weight, vbd->share.limit);
+}
+
+void
+tapdisk_vbd_set_kick_moderation(td_vbd_t *vbd, unsigned int usecs,
+				unsigned int responses)
+{
+	vbd->kick_usecs     = usecs;
+	vbd->kick_responses = responses;
+
+	DBG(TLOG_WARN, "%s: kick moderation %uus, %u responses\n",
+	    vbd->name, usecs, responses);
+
+	/* flush anything held under the old settings */
+	__tapdisk_vbd_kick(vbd);
+}
+
+int
+tapdisk_vbd_start_job(td_vbd_t *vbd, int type, uint64_t rate, int depth,
+		      const char *params)
+{
+	td_job_t *job;
+	int err;
+
+	if (tapdisk_job_active(vbd->job))
+		return -EBUSY;
+
+	if (td_flag_test(vbd->state, TD_VBD_CLOSED) ||
+	    td_flag_test(vbd->state, TD_VBD_PAUSED) ||
+	    td_flag_test(vbd->state, TD_VBD_DEAD))
+		return -EINVAL;
+
+	err = tapdisk_job_create(vbd, type, rate, depth, params, &job);
+	if (err)
+		return err;
+
+	tapdisk_job_free(vbd->job);
+	vbd->job = job;
+
+	tapdisk_job_check(job);
+
+	return 0;
+}
+
+int
+tapdisk_vbd_cancel_job(td_vbd_t *vbd)
+{
+	if (!tapdisk_job_active(vbd->job))
+		return -ENOENT;
+
+	tapdisk_job_cancel(vbd->job);
+	tapdisk_job_check(vbd->job);
+
+	return 0;
 }
@@ -40,10 +40,15 @@
 #include "tapdisk.h"
 #include "scheduler.h"
 #include "tapdisk-image.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-qos.h"
+#include "tapdisk-disktype.h"
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
 #define TD_VBD_RETRY_INTERVAL       1
+#define TD_VBD_RETRY_MIN_USECS      2000
+#define TD_VBD_RETRY_MAX_USECS      1000000
 
 #define TD_VBD_DEAD                 0x0001
 #define TD_VBD_CLOSED               0x0002
@@ -54,16 +59,25 @@
 #define TD_VBD_SHUTDOWN_REQUESTED   0x0040
 #define TD_VBD_LOCKING              0x0080
 #define TD_VBD_LOG_DROPPED          0x0100
+#define TD_VBD_KEEP_PARENTS         0x0200
+
+#define TD_VREQ_INTERNAL            0x0001 /* job-owned, never on vbd lists */
+#define TD_VREQ_NOFORWARD           0x0002 /* gaps complete with -ENODATA */
+#define TD_VREQ_MIRROR_DIRTY        0x0004 /* not copied to the async mirror */
 
 #define TD_VBD_SECONDARY_DISABLED   0 
 #define TD_VBD_SECONDARY_MIRROR     1
 #define TD_VBD_SECONDARY_STANDBY    2
+#define TD_VBD_SECONDARY_ASYNC      3
 
 typedef struct td_ring              td_ring_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_handle        td_vbd_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
+struct td_job;
+struct td_mirror;
+
 struct td_ring {
 	int                         fd;
 	char                       *mem;
@@ -80,8 +94,10 @@ struct td_vbd_request {
 	int                         submitting;
 	int                         secs_pending;
 	int                         num_retries;
+	td_flag_t                   flags;
 	struct timeval		    ts;
 	struct timeval              last_try;
+	struct timeval              retry_at;
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -116,6 +132,13 @@ struct td_vbd_handle {
 	 * Therefore, we move it into 'retired' until shutdown. */
 	td_image_t                 *retired;
 
+	/* async mirror state, kept across pause/resume */
+	struct td_mirror           *mirror;
+
+	/* read-only parents held open while paused, see
+	 * tapdisk_vbd_keep_parents */
+	struct list_head            kept_images;
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
@@ -141,8 +164,35 @@ struct td_vbd_handle {
 	uint64_t                    errors;
 	td_sector_count_t           secs;
 
+	/* requests answered after one or more retries */
+	uint64_t                    retried;
+	uint64_t                    retried_failed;
+	uint64_t                    retry_usecs;
+	uint64_t                    retry_usecs_max;
+
 	uint64_t                    kicks_in;
 	uint64_t                    kicks_out;
+
+	/* response kick moderation, see tapdisk_vbd_kick */
+	unsigned int                kick_usecs;
+	unsigned int                kick_responses;
+	struct timeval              kick_held;
+	uint64_t                    kicks_held;
+
+	struct td_qos               qos;
+	struct tqueue_share         share;
+
+	/* background block job, kept for stats once ended */
+	struct td_job              *job;
+
+	/* pause window, from pause request to resume */
+	struct timeval              pause_start;
+	uint64_t                    pauses;
+	uint64_t                    pause_usecs;
+	uint64_t                    pause_usecs_last;
+	uint64_t                    pause_usecs_max;
+	uint64_t                    parents_kept;
+	uint64_t                    parents_reused;
 };
 
 #define tapdisk_vbd_for_each_request(vreq, tmp, list)	                \
@@ -160,6 +210,22 @@ tapdisk_vbd_move_request(td_vbd_request_t *vreq, struct list_head *dest)
 	vreq->list_head = dest;
 }
 
+static inline int
+tapdisk_vbd_request_secs(td_vbd_request_t *vreq)
+{
+	blkif_request_t *req = &vreq->req;
+	struct blkif_request_segment *seg;
+	int secs = 0;
+
+	if (req->nr_segments > MAX_SEGMENTS_PER_REQ)
+		return 0;
+
+	for (seg = &req->seg[0]; seg < &req->seg[req->nr_segments]; seg++)
+		secs += seg->last_sect - seg->first_sect + 1;
+
+	return secs;
+}
+
 static inline void
 tapdisk_vbd_add_image(td_vbd_t *vbd, td_image_t *image)
 {
@@ -190,6 +256,21 @@ tapdisk_vbd_next_image(td_image_t *image)
 	return list_entry(image->next.next, td_image_t, next);
 }
 
+/*
+ * The image guest writes land in, below any read-ahead stacked on top.
+ */
+static inline td_image_t *
+tapdisk_vbd_leaf_image(td_vbd_t *vbd)
+{
+	td_image_t *image = tapdisk_vbd_first_image(vbd);
+
+	if (image->type == DISK_TYPE_READAHEAD &&
+	    !tapdisk_vbd_is_last_image(vbd, image))
+		image = tapdisk_vbd_next_image(image);
+
+	return image;
+}
+
 td_vbd_t *tapdisk_vbd_create(td_uuid_t);
 int tapdisk_vbd_initialize(int, int, td_uuid_t);
 void tapdisk_vbd_set_callback(td_vbd_t *, td_vbd_cb_t, void *);
@@ -200,6 +281,7 @@ int tapdisk_vbd_close(td_vbd_t *);
 int tapdisk_vbd_open_vdi(td_vbd_t *, int, const char *, td_flag_t,
 			 int, int, const char *);
 void tapdisk_vbd_close_vdi(td_vbd_t *);
+void tapdisk_vbd_drop_image(td_vbd_t *, td_image_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
@@ -207,17 +289,26 @@ void tapdisk_vbd_detach(td_vbd_t *);
 void tapdisk_vbd_forward_request(td_request_t);
 
 int tapdisk_vbd_get_image_info(td_vbd_t *, image_t *);
-int tapdisk_vbd_retry_needed(td_vbd_t *);
+long tapdisk_vbd_retry_timeout(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
 int tapdisk_vbd_issue_requests(td_vbd_t *);
 int tapdisk_vbd_kill_queue(td_vbd_t *);
 int tapdisk_vbd_pause(td_vbd_t *);
 int tapdisk_vbd_resume(td_vbd_t *, int, const char *);
+int tapdisk_vbd_reopen_vdi(td_vbd_t *, int, const char *);
 int tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
 void tapdisk_vbd_stats(td_vbd_t *, td_stats_t *);
+void tapdisk_vbd_set_share(td_vbd_t *, int weight, int percent);
+void tapdisk_vbd_set_kick_moderation(td_vbd_t *, unsigned int usecs,
+				     unsigned int responses);
+void tapdisk_vbd_set_qos(td_vbd_t *, const uint64_t iops[2],
+			 const uint64_t bps[2], unsigned int);
+int tapdisk_vbd_start_job(td_vbd_t *, int type, uint64_t rate, int depth,
+			  const char *params);
+int tapdisk_vbd_cancel_job(td_vbd_t *);
 
 #endif
@@ -75,12 +75,16 @@
 #define SECTOR_SHIFT                 9
 #define DEFAULT_SECTOR_SIZE          512
 
+/* TD_OPEN_4K: advertised to the guest, requests still count 512B sectors */
+#define TD_4K_SECTOR_SIZE            4096
+#define TD_4K_SECTOR_MASK            ((TD_4K_SECTOR_SIZE >> SECTOR_SHIFT) - 1)
+
 #define TAPDISK_DATA_REQUESTS       (MAX_REQUESTS * MAX_SEGMENTS_PER_REQ)
 
 //#define BLK_NOT_ALLOCATED            (-99)
 #define TD_NO_PARENT                 1
 
-#define MAX_RAMDISK_SIZE             1024000 /*500MB disk limit*/
+#define MAX_RAMDISK_SIZE             1024000 /*500MB scratch ramdisk*/
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
@@ -98,6 +102,9 @@
 #define TD_OPEN_SECONDARY            0x00400
 #define TD_OPEN_STANDBY              0x00800
 #define TD_IGNORE_ENOSPC             0x01000
+#define TD_OPEN_READAHEAD            0x02000
+#define TD_OPEN_MIRROR_ASYNC         0x04000
+#define TD_OPEN_4K                   0x08000
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _VHD_AIO_H_
+#define _VHD_AIO_H_
+
+#include <inttypes.h>
+
+#include "libvhd.h"
+
+/*
+ * Batched asynchronous I/O on vhd images, backed by libaio.
+ *
+ * Requests are queued with vhd_aio_submit() and their callbacks run
+ * from vhd_aio_wait() as they complete, in any order. Up to the
+ * context's depth of reads and writes are in flight at once, requests
+ * beyond that wait in the context. Buffers must be sector aligned.
+ *
+ * Without kernel aio, and for vhds with their own devops (streams,
+ * icbinn), requests run synchronously as they are submitted.
+ */
+
+#define VHD_AIO_PREAD              1  /* size bytes at off */
+#define VHD_AIO_PWRITE             2
+#define VHD_AIO_READ_BITMAP        3  /* bitmap of block */
+#define VHD_AIO_WRITE_BITMAP       4
+#define VHD_AIO_READ_BLOCK         5  /* data of block */
+#define VHD_AIO_WRITE_BLOCK        6
+#define VHD_AIO_READ               7  /* secs virtual sectors at sec */
+
+#define VHD_AIO_DEFAULT_DEPTH      32
+#define VHD_AIO_MAX_DEPTH          1024
+
+typedef struct vhd_aio_context     vhd_aio_context_t;
+typedef struct vhd_aio_request     vhd_aio_request_t;
+typedef void (*vhd_aio_cb_t)       (vhd_aio_request_t *, int err);
+
+/*
+ * Block ops need the block allocated: allocation updates metadata and
+ * stays with vhd_io_write(). VHD_AIO_READ reads this image only, not
+ * its parents, and returns zeros for sectors it doesn't hold.
+ */
+struct vhd_aio_request {
+	int                        op;
+	vhd_context_t             *vhd;
+	char                      *buf;
+
+	off64_t                    off;
+	size_t                     size;
+	uint32_t                   block;
+	uint64_t                   sec;
+	uint32_t                   secs;
+
+	vhd_aio_cb_t               cb;
+	void                      *data;
+
+	/* private */
+	int                        error;
+	int                        pending;
+	uint64_t                   next;
+	struct list_head           queue;
+};
+
+int vhd_aio_create(int depth, vhd_aio_context_t **);
+void vhd_aio_destroy(vhd_aio_context_t *);
+int vhd_aio_submit(vhd_aio_context_t *, vhd_aio_request_t **, int);
+int vhd_aio_wait(vhd_aio_context_t *, int min);
+int vhd_aio_drain(vhd_aio_context_t *);
+int vhd_aio_run(vhd_aio_context_t *, vhd_aio_request_t **, int);
+
+#endif
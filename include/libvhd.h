@@ -396,6 +396,7 @@ int vhd_io_read(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_write(vhd_context_t *, char *, uint64_t, uint32_t);
 int vhd_io_read_bytes(vhd_context_t *, char *, size_t, uint64_t);
 int vhd_io_write_bytes(vhd_context_t *, char *, size_t, uint64_t);
+int vhd_io_allocate_block(vhd_context_t *, uint32_t block);
 
 int vhd_print_headers(vhd_context_t *, int hex);
 
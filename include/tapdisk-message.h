@@ -50,6 +50,10 @@
 #define TAPDISK_MESSAGE_FLAG_REUSE_PRT   0x040
 #define TAPDISK_MESSAGE_FLAG_SECONDARY   0x080
 #define TAPDISK_MESSAGE_FLAG_STANDBY     0x100
+#define TAPDISK_MESSAGE_FLAG_READAHEAD   0x200
+#define TAPDISK_MESSAGE_FLAG_ASYNC       0x400
+#define TAPDISK_MESSAGE_FLAG_KEEP_PARENTS 0x800
+#define TAPDISK_MESSAGE_FLAG_4K          0x1000
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint32_t                         tapdisk_message_flag_t;
@@ -60,6 +64,9 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_qos       tapdisk_message_qos_t;
+typedef struct tapdisk_message_kick      tapdisk_message_kick_t;
+typedef struct tapdisk_message_job       tapdisk_message_job_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -104,6 +111,56 @@ struct tapdisk_message_stat {
 	size_t                           length;
 };
 
+/*
+ * Per-VBD limits, indexed [read, write]. Zero means unlimited.
+ * burst_ms sizes every bucket to burst_ms worth of its rate.
+ * weight and queue_pct set the VBD's share of the aio queue
+ * relative to other VBDs in the same tapdisk (zero: defaults).
+ * Fields set to TAPDISK_MESSAGE_QOS_UNCHANGED keep their current value.
+ */
+#define TAPDISK_MESSAGE_QOS_UNCHANGED    ((uint64_t)-1)
+#define TAPDISK_MESSAGE_QOS_UNCHANGED32  ((uint32_t)-1)
+
+struct tapdisk_message_qos {
+	uint64_t                         iops[2];
+	uint64_t                         bps[2];
+	uint32_t                         burst_ms;
+	uint32_t                         weight;
+	uint32_t                         queue_pct;
+};
+
+/*
+ * Response kick moderation: while busy, hold responses up to usecs,
+ * or until this many responses are pending. Zero usecs disables.
+ * Fields set to TAPDISK_MESSAGE_KICK_UNCHANGED keep their current value.
+ */
+#define TAPDISK_MESSAGE_KICK_UNCHANGED   ((uint32_t)-1)
+
+struct tapdisk_message_kick {
+	uint32_t                         usecs;
+	uint32_t                         responses;
+};
+
+#define TAPDISK_MESSAGE_JOB_START        1
+#define TAPDISK_MESSAGE_JOB_CANCEL       2
+
+#define TAPDISK_MESSAGE_JOB_COALESCE     1
+#define TAPDISK_MESSAGE_JOB_STREAM       2
+#define TAPDISK_MESSAGE_JOB_MIGRATE      3
+
+/*
+ * Background block jobs. rate is in bytes/s, zero for unlimited.
+ * depth is the number of copy requests in flight (zero: default).
+ * params is the target (type:/path) of a migration.
+ */
+struct tapdisk_message_job {
+	uint32_t                         op;
+	uint32_t                         type;
+	uint64_t                         rate;
+	uint32_t                         depth;
+	char                             params[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
 
 struct tapdisk_message {
 	uint16_t                         type;
@@ -118,6 +175,9 @@ struct tapdisk_message {
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
 		tapdisk_message_stat_t   info;
+		tapdisk_message_qos_t    qos;
+		tapdisk_message_kick_t   kick;
+		tapdisk_message_job_t    job;
 	} u;
 };
 
@@ -146,9 +206,15 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_STATS_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_QOS,
+	TAPDISK_MESSAGE_QOS_RSP,
+	TAPDISK_MESSAGE_KICK,
+	TAPDISK_MESSAGE_KICK_RSP,
+	TAPDISK_MESSAGE_JOB,
+	TAPDISK_MESSAGE_JOB_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_JOB_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -223,6 +289,24 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_QOS:
+		return "qos";
+
+	case TAPDISK_MESSAGE_QOS_RSP:
+		return "qos response";
+
+	case TAPDISK_MESSAGE_KICK:
+		return "kick moderation";
+
+	case TAPDISK_MESSAGE_KICK_RSP:
+		return "kick moderation response";
+
+	case TAPDISK_MESSAGE_JOB:
+		return "job";
+
+	case TAPDISK_MESSAGE_JOB_RSP:
+		return "job response";
+
 	default:
 		return "unknown";
 	}
@@ -31,6 +31,9 @@
 #ifndef _VHD_UTIL_H_
 #define _VHD_UTIL_H_
 
+#include <stdio.h>
+#include <sys/time.h>
+
 #include "vhd.h"
 
 int vhd_util_create(int argc, char **argv);
@@ -51,6 +54,7 @@ int vhd_util_clone_metadata(int argc, char **argv);
 int vhd_util_dm_encrypt(int argc, char **argv);
 int vhd_util_dm_decrypt(int argc, char **argv);
 int vhd_util_key(int argc, char **argv);
+int vhd_util_changed_blocks(int argc, char **argv);
 
 int __vhd_util_clone_metadata(vhd_context_t *, const char *, int);
 int __vhd_util_clone_metadata_s(vhd_context_t *, const char *,
@@ -59,4 +63,38 @@ int __vhd_util_clone_metadata_s(vhd_context_t *, const char *,
 int __vhd_util_calculate_keyhash(struct vhd_keyhash *,
 				 const uint8_t *, size_t);
 
+#define VHD_UTIL_PIPELINE_THREADS 4
+
+struct vhd_util_pipeline_slot {
+	uint64_t                         seq;
+	uint32_t                         block;
+	char                            *buf;
+	uint64_t                         bytes;
+	int                              state;
+};
+
+struct vhd_util_pipeline_ops {
+	/* calling thread, in order: fill the slot, 1 at end of input */
+	int (*read)(void *, struct vhd_util_pipeline_slot *);
+	/* any worker thread */
+	int (*work)(void *, struct vhd_util_pipeline_slot *);
+	/* writer thread, in read order; optional */
+	int (*write)(void *, struct vhd_util_pipeline_slot *);
+};
+
+struct vhd_util_pipeline {
+	const struct vhd_util_pipeline_ops *ops;
+	void                            *data;
+	int                              threads;
+	size_t                           buf_size;
+
+	uint64_t                         blocks;
+	uint64_t                         bytes;
+	struct timeval                   start;
+	struct timeval                   end;
+};
+
+int vhd_util_pipeline_run(struct vhd_util_pipeline *);
+void vhd_util_pipeline_report(struct vhd_util_pipeline *, FILE *);
+
 #endif
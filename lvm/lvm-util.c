@@ -32,9 +32,15 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "lvm-util.h"
 
@@ -299,6 +305,912 @@ out:
 	return err;
 }
 
+/*
+ * Native metadata reader.
+ *
+ * Rather than forking vgs/lvs (which scan every device and take the
+ * VG lock), find the PVs from their labels and parse the committed
+ * text metadata straight from a metadata area. Reads bypass the page
+ * cache, so metadata changed by another host is seen. Anything
+ * unexpected sends lvm_scan_vg back to the tools.
+ */
+
+#define LVM_SECTOR_SIZE          512
+#define LVM_LABEL_SCAN_SECTORS   4
+#define LVM_LABEL_ID             "LABELONE"
+#define LVM_LABEL_TYPE           "LVM2 001"
+#define LVM_MDA_MAGIC            " LVM2 x[5A%r0N*>"
+#define LVM_MDA_HEADER_SIZE      512
+#define LVM_RAW_LOCN_IGNORED     0x00000001
+#define LVM_INITIAL_CRC          0xf597a6cf
+#define LVM_ID_LEN               32
+#define LVM_MAX_METADATA         (64 << 20)
+
+struct lvm_label_header {
+	char                     id[8];
+	uint64_t                 sector;
+	uint32_t                 crc;
+	uint32_t                 offset;
+	char                     type[8];
+} __attribute__((packed));
+
+struct lvm_disk_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+} __attribute__((packed));
+
+struct lvm_pv_header {
+	char                     uuid[LVM_ID_LEN];
+	uint64_t                 device_size;
+	struct lvm_disk_locn     areas[0];
+} __attribute__((packed));
+
+struct lvm_raw_locn {
+	uint64_t                 offset;
+	uint64_t                 size;
+	uint32_t                 checksum;
+	uint32_t                 flags;
+} __attribute__((packed));
+
+struct lvm_mda_header {
+	uint32_t                 checksum;
+	char                     magic[16];
+	uint32_t                 version;
+	uint64_t                 start;
+	uint64_t                 size;
+	struct lvm_raw_locn      raw_locns[0];
+} __attribute__((packed));
+
+struct lvm_pv_label {
+	char                     device[MAX_NAME_SIZE];
+	char                     uuid[LVM_ID_LEN + 1];
+	uint64_t                 mda_offset;
+	uint64_t                 mda_size;
+};
+
+#define LVM_CFG_SECTION          1
+#define LVM_CFG_STRING           2
+#define LVM_CFG_NUMBER           3
+#define LVM_CFG_ARRAY            4
+
+struct lvm_cfg {
+	int                      type;
+	char                    *key;
+	char                    *str;
+	uint64_t                 num;
+	struct lvm_cfg          *child;
+	struct lvm_cfg          *sibling;
+};
+
+struct lvm_parser {
+	char                    *pos;
+	char                    *end;
+};
+
+/* lvm2's crc32 flavour: reflected, no final inversion */
+static uint32_t
+lvm_crc(uint32_t crc, const void *data, size_t size)
+{
+	const uint8_t *buf = data;
+	int i;
+
+	while (size--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return crc;
+}
+
+static int
+lvm_pread(int fd, void *dst, size_t size, uint64_t off)
+{
+	uint64_t start, end;
+	char *buf;
+	ssize_t n;
+	int err;
+
+	start = off & ~((uint64_t)LVM_SECTOR_SIZE - 1);
+	end   = (off + size + LVM_SECTOR_SIZE - 1) &
+		~((uint64_t)LVM_SECTOR_SIZE - 1);
+
+	err = posix_memalign((void **)&buf, LVM_SECTOR_SIZE, end - start);
+	if (err)
+		return -err;
+
+	n = pread(fd, buf, end - start, start);
+	if (n != end - start)
+		err = (n == -1 ? -errno : -EIO);
+	else
+		memcpy(dst, buf + (off - start), size);
+
+	free(buf);
+	return err;
+}
+
+static int
+lvm_read_label(const char *device, struct lvm_pv_label *label)
+{
+	char buf[LVM_LABEL_SCAN_SECTORS * LVM_SECTOR_SIZE];
+	struct lvm_label_header *lh;
+	struct lvm_pv_header *ph;
+	struct lvm_disk_locn *dl, *last;
+	int i, fd, err;
+
+	fd = open(device, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd == -1)
+		return -errno;
+
+	err = lvm_pread(fd, buf, sizeof(buf), 0);
+	close(fd);
+	if (err)
+		return err;
+
+	for (i = 0; i < LVM_LABEL_SCAN_SECTORS; i++) {
+		lh = (struct lvm_label_header *)(buf + i * LVM_SECTOR_SIZE);
+
+		if (memcmp(lh->id, LVM_LABEL_ID, sizeof(lh->id)) ||
+		    le64toh(lh->sector) != i)
+			continue;
+
+		if (le32toh(lh->crc) !=
+		    lvm_crc(LVM_INITIAL_CRC, &lh->offset,
+			    LVM_SECTOR_SIZE -
+			    offsetof(struct lvm_label_header, offset)))
+			continue;
+
+		if (memcmp(lh->type, LVM_LABEL_TYPE, sizeof(lh->type)))
+			return -EINVAL;
+
+		goto found;
+	}
+
+	return -ENOENT;
+
+found:
+	if (le32toh(lh->offset) + sizeof(*ph) > LVM_SECTOR_SIZE)
+		return -EINVAL;
+
+	memset(label, 0, sizeof(*label));
+	if (lvm_copy_name(label->device, device, sizeof(label->device) - 1))
+		return -ENAMETOOLONG;
+
+	ph   = (struct lvm_pv_header *)((char *)lh + le32toh(lh->offset));
+	last = (struct lvm_disk_locn *)((char *)lh + LVM_SECTOR_SIZE) - 1;
+	memcpy(label->uuid, ph->uuid, LVM_ID_LEN);
+
+	/* data areas, then metadata areas, each list zero-terminated */
+	for (dl = ph->areas; dl <= last && dl->offset; dl++)
+		;
+	for (dl++; dl <= last && dl->offset; dl++)
+		if (!label->mda_offset) {
+			label->mda_offset = le64toh(dl->offset);
+			label->mda_size   = le64toh(dl->size);
+		}
+
+	return 0;
+}
+
+static int
+lvm_read_metadata(const struct lvm_pv_label *label, char **_text)
+{
+	char hdr[LVM_MDA_HEADER_SIZE], *text;
+	struct lvm_mda_header *mh;
+	struct lvm_raw_locn *rl;
+	uint64_t offset, size, wrap;
+	int fd, err;
+
+	*_text = NULL;
+
+	if (!label->mda_offset)
+		return -ENODATA;
+
+	fd = open(label->device, O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd == -1)
+		return -errno;
+
+	text = NULL;
+
+	err = lvm_pread(fd, hdr, sizeof(hdr), label->mda_offset);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	mh  = (struct lvm_mda_header *)hdr;
+	if (memcmp(mh->magic, LVM_MDA_MAGIC, sizeof(mh->magic)) ||
+	    le32toh(mh->checksum) !=
+	    lvm_crc(LVM_INITIAL_CRC, hdr + sizeof(mh->checksum),
+		    sizeof(hdr) - sizeof(mh->checksum)))
+		goto out;
+
+	rl     = mh->raw_locns;
+	offset = le64toh(rl->offset);
+	size   = le64toh(rl->size);
+
+	err = -ENODATA;
+	if (!offset || !size || le32toh(rl->flags) & LVM_RAW_LOCN_IGNORED)
+		goto out;
+
+	err = -EINVAL;
+	if (size > LVM_MAX_METADATA || offset >= label->mda_size ||
+	    size > label->mda_size - LVM_MDA_HEADER_SIZE)
+		goto out;
+
+	err  = -ENOMEM;
+	text = malloc(size + 1);
+	if (!text)
+		goto out;
+
+	/* the metadata area is a ring behind its header */
+	wrap = 0;
+	if (offset + size > label->mda_size)
+		wrap = offset + size - label->mda_size;
+
+	err = lvm_pread(fd, text, size - wrap, label->mda_offset + offset);
+	if (err)
+		goto out;
+
+	if (wrap) {
+		err = lvm_pread(fd, text + size - wrap, wrap,
+				label->mda_offset + LVM_MDA_HEADER_SIZE);
+		if (err)
+			goto out;
+	}
+
+	err = -EIO;
+	if (lvm_crc(LVM_INITIAL_CRC, text, size) != le32toh(rl->checksum))
+		goto out;
+
+	text[size] = '\0';
+	*_text     = text;
+	text       = NULL;
+	err        = 0;
+
+out:
+	free(text);
+	close(fd);
+	return err;
+}
+
+static void
+lvm_cfg_free(struct lvm_cfg *cfg)
+{
+	struct lvm_cfg *next;
+
+	while (cfg) {
+		next = cfg->sibling;
+		lvm_cfg_free(cfg->child);
+		free(cfg->key);
+		free(cfg->str);
+		free(cfg);
+		cfg = next;
+	}
+}
+
+static void
+lvm_cfg_skip(struct lvm_parser *p)
+{
+	while (p->pos < p->end) {
+		if (*p->pos == '#')
+			while (p->pos < p->end && *p->pos != '\n')
+				p->pos++;
+		else if (isspace(*p->pos))
+			p->pos++;
+		else
+			break;
+	}
+}
+
+static int
+lvm_cfg_peek(struct lvm_parser *p)
+{
+	lvm_cfg_skip(p);
+	return (p->pos < p->end ? *p->pos : -1);
+}
+
+static char *
+lvm_cfg_word(struct lvm_parser *p)
+{
+	char *start = p->pos;
+
+	while (p->pos < p->end &&
+	       (isalnum(*p->pos) || strchr("_.+-", *p->pos)))
+		p->pos++;
+
+	if (p->pos == start)
+		return NULL;
+
+	return strndup(start, p->pos - start);
+}
+
+static char *
+lvm_cfg_string(struct lvm_parser *p)
+{
+	char *str, *s, *c;
+
+	for (c = p->pos + 1; c < p->end && *c != '"'; c++)
+		if (*c == '\\')
+			c++;
+
+	if (c >= p->end)
+		return NULL;
+
+	str = malloc(c - p->pos);
+	if (!str)
+		return NULL;
+
+	for (s = str, p->pos++; p->pos < c; p->pos++) {
+		if (*p->pos == '\\')
+			p->pos++;
+		*s++ = *p->pos;
+	}
+
+	*s = '\0';
+	p->pos++;
+
+	return str;
+}
+
+static struct lvm_cfg *
+lvm_cfg_value(struct lvm_parser *p)
+{
+	struct lvm_cfg *cfg, **tail;
+	char *end;
+
+	cfg = calloc(1, sizeof(*cfg));
+	if (!cfg)
+		return NULL;
+
+	switch (lvm_cfg_peek(p)) {
+	case '"':
+		cfg->type = LVM_CFG_STRING;
+		cfg->str  = lvm_cfg_string(p);
+		if (!cfg->str)
+			goto fail;
+		break;
+
+	case '[':
+		cfg->type = LVM_CFG_ARRAY;
+		tail      = &cfg->child;
+		p->pos++;
+
+		while (lvm_cfg_peek(p) != ']') {
+			*tail = lvm_cfg_value(p);
+			if (!*tail)
+				goto fail;
+			tail = &(*tail)->sibling;
+
+			if (lvm_cfg_peek(p) == ',')
+				p->pos++;
+			else if (lvm_cfg_peek(p) != ']')
+				goto fail;
+		}
+
+		p->pos++;
+		break;
+
+	default:
+		cfg->type = LVM_CFG_NUMBER;
+		cfg->num  = strtoull(p->pos, &end, 0);
+		if (end == p->pos)
+			goto fail;
+		p->pos = end;
+		break;
+	}
+
+	return cfg;
+
+fail:
+	lvm_cfg_free(cfg);
+	return NULL;
+}
+
+/* key = value | key { ... }, until '}' or the end of text */
+static int
+lvm_cfg_section(struct lvm_parser *p, struct lvm_cfg **tail, int nested)
+{
+	struct lvm_cfg *cfg;
+	char *key;
+	int c, err;
+
+	for (;;) {
+		c = lvm_cfg_peek(p);
+		if (c == -1)
+			return (nested ? -EINVAL : 0);
+		if (c == '}') {
+			if (!nested)
+				return -EINVAL;
+			p->pos++;
+			return 0;
+		}
+
+		key = lvm_cfg_word(p);
+		if (!key)
+			return -EINVAL;
+
+		c = lvm_cfg_peek(p);
+		if (c == '{') {
+			p->pos++;
+
+			cfg = calloc(1, sizeof(*cfg));
+			if (!cfg) {
+				free(key);
+				return -ENOMEM;
+			}
+
+			cfg->type = LVM_CFG_SECTION;
+			err = lvm_cfg_section(p, &cfg->child, 1);
+		} else if (c == '=') {
+			p->pos++;
+
+			cfg = lvm_cfg_value(p);
+			err = (cfg ? 0 : -EINVAL);
+		} else {
+			cfg = NULL;
+			err = -EINVAL;
+		}
+
+		if (!cfg) {
+			free(key);
+			return err;
+		}
+
+		cfg->key = key;
+		*tail    = cfg;
+		tail     = &cfg->sibling;
+
+		if (err)
+			return err;
+	}
+}
+
+static int
+lvm_cfg_parse(char *text, struct lvm_cfg **_cfg)
+{
+	struct lvm_parser p;
+	int err;
+
+	p.pos = text;
+	p.end = text + strlen(text);
+
+	*_cfg = NULL;
+	err   = lvm_cfg_section(&p, _cfg, 0);
+	if (err) {
+		lvm_cfg_free(*_cfg);
+		*_cfg = NULL;
+	}
+
+	return err;
+}
+
+static struct lvm_cfg *
+lvm_cfg_find(struct lvm_cfg *section, const char *key, int type)
+{
+	struct lvm_cfg *cfg;
+
+	for (cfg = section->child; cfg; cfg = cfg->sibling)
+		if (cfg->type == type && !strcmp(cfg->key, key))
+			return cfg;
+
+	return NULL;
+}
+
+static int
+lvm_cfg_num(struct lvm_cfg *section, const char *key, uint64_t *num)
+{
+	struct lvm_cfg *cfg;
+
+	cfg = lvm_cfg_find(section, key, LVM_CFG_NUMBER);
+	if (!cfg)
+		return -EINVAL;
+
+	*num = cfg->num;
+	return 0;
+}
+
+static const char *
+lvm_cfg_str(struct lvm_cfg *section, const char *key)
+{
+	struct lvm_cfg *cfg;
+
+	cfg = lvm_cfg_find(section, key, LVM_CFG_STRING);
+	return (cfg ? cfg->str : NULL);
+}
+
+static int
+lvm_cfg_has_flag(struct lvm_cfg *section, const char *key, const char *flag)
+{
+	struct lvm_cfg *cfg;
+
+	cfg = lvm_cfg_find(section, key, LVM_CFG_ARRAY);
+	if (!cfg)
+		return 0;
+
+	for (cfg = cfg->child; cfg; cfg = cfg->sibling)
+		if (cfg->type == LVM_CFG_STRING && !strcmp(cfg->str, flag))
+			return 1;
+
+	return 0;
+}
+
+static int
+lvm_cfg_count(struct lvm_cfg *section)
+{
+	struct lvm_cfg *cfg;
+	int n = 0;
+
+	for (cfg = section->child; cfg; cfg = cfg->sibling)
+		if (cfg->type == LVM_CFG_SECTION)
+			n++;
+
+	return n;
+}
+
+/* the VG section, if this metadata describes vg_name */
+static struct lvm_cfg *
+lvm_cfg_vg(struct lvm_cfg *cfg, const char *vg_name)
+{
+	for (; cfg; cfg = cfg->sibling)
+		if (cfg->type == LVM_CFG_SECTION)
+			return (strcmp(cfg->key, vg_name) ? NULL : cfg);
+
+	return NULL;
+}
+
+static int
+lvm_uuid_match(const char *id, const char *uuid)
+{
+	int i;
+
+	for (i = 0; i < LVM_ID_LEN && *id; id++) {
+		if (*id == '-')
+			continue;
+		if (*id != uuid[i++])
+			return 0;
+	}
+
+	return (i == LVM_ID_LEN && !*id);
+}
+
+/* a device-mapper node created by LVM for a logical volume */
+static int
+lvm_dev_is_lv(const char *name)
+{
+	char path[MAX_NAME_SIZE + 32], uuid[8];
+	FILE *f;
+	int lv;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/dm/uuid", name);
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	lv = (fgets(uuid, sizeof(uuid), f) && !strncmp(uuid, "LVM-", 4));
+	fclose(f);
+
+	return lv;
+}
+
+/*
+ * A device stacked under something other than its own LVs, e.g. one
+ * path of a multipath device. Its label is read through the holder.
+ */
+static int
+lvm_dev_is_held(const char *name)
+{
+	char path[MAX_NAME_SIZE + 32];
+	struct dirent *d;
+	int held;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/holders", name);
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	held = 0;
+	while (!held && (d = readdir(dir)))
+		held = (d->d_name[0] != '.' && !lvm_dev_is_lv(d->d_name));
+
+	closedir(dir);
+	return held;
+}
+
+static int
+lvm_scan_labels(struct lvm_pv_label **_labels, int *_cnt)
+{
+	struct lvm_pv_label *labels, *new;
+	char buf[256], name[MAX_NAME_SIZE], dev[MAX_NAME_SIZE + 5];
+	unsigned long long blocks;
+	int cnt, size, err;
+	FILE *parts;
+
+	*_labels = NULL;
+	*_cnt    = 0;
+
+	parts = fopen("/proc/partitions", "r");
+	if (!parts)
+		return -errno;
+
+	cnt    = 0;
+	size   = 0;
+	err    = 0;
+	labels = NULL;
+
+	while (fgets(buf, sizeof(buf), parts)) {
+		if (sscanf(buf, "%*u %*u %llu "_NAME, &blocks, name) != 2)
+			continue;
+
+		/* extended partition stubs */
+		if (blocks < 2)
+			continue;
+
+		/* PVs nested in LVs belong to someone else, e.g. a guest */
+		if (lvm_dev_is_lv(name) || lvm_dev_is_held(name))
+			continue;
+
+		snprintf(dev, sizeof(dev), "/dev/%s", name);
+
+		if (cnt == size) {
+			size = (size ? size * 2 : 16);
+			new  = realloc(labels, size * sizeof(*labels));
+			if (!new) {
+				err = -ENOMEM;
+				break;
+			}
+			labels = new;
+		}
+
+		if (!lvm_read_label(dev, labels + cnt))
+			cnt++;
+	}
+
+	fclose(parts);
+
+	if (err) {
+		free(labels);
+		return err;
+	}
+
+	*_labels = labels;
+	*_cnt    = cnt;
+	return 0;
+}
+
+/*
+ * Multipath components were skipped while scanning, so a PV found on
+ * more than one device is a duplicate (e.g. a cloned LUN) and none of
+ * them can be trusted.
+ */
+static const char *
+lvm_find_pv_device(struct lvm_pv_label *labels, int cnt, const char *id)
+{
+	const char *device = NULL;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (!lvm_uuid_match(id, labels[i].uuid))
+			continue;
+
+		if (device) {
+			EPRINTF("pv %s found on both %s and %s\n",
+				id, device, labels[i].device);
+			return NULL;
+		}
+
+		device = labels[i].device;
+	}
+
+	return device;
+}
+
+/* whether the PV on @label is a member of the VG in @vgc */
+static int
+lvm_cfg_vg_has_pv(struct lvm_cfg *vgc, struct lvm_pv_label *label)
+{
+	struct lvm_cfg *pvs, *cfg;
+	const char *id;
+
+	pvs = lvm_cfg_find(vgc, "physical_volumes", LVM_CFG_SECTION);
+	if (!pvs)
+		return 0;
+
+	for (cfg = pvs->child; cfg; cfg = cfg->sibling) {
+		if (cfg->type != LVM_CFG_SECTION)
+			continue;
+
+		id = lvm_cfg_str(cfg, "id");
+		if (id && lvm_uuid_match(id, label->uuid))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+lvm_load_vg(struct vg *vg, struct lvm_cfg *vgc,
+	    struct lvm_pv_label *labels, int nlabels)
+{
+	struct lvm_cfg *pvs, *lvs, *cfg, *seg, *stripe, *pv;
+	uint64_t extent_size, pe_start, count, start, offset;
+	const char *id, *device, *type;
+	int i, j, err, pv_cnt, lv_cnt;
+	struct lv *lv;
+
+	if (lvm_cfg_num(vgc, "extent_size", &extent_size))
+		return -EINVAL;
+
+	pvs = lvm_cfg_find(vgc, "physical_volumes", LVM_CFG_SECTION);
+	lvs = lvm_cfg_find(vgc, "logical_volumes", LVM_CFG_SECTION);
+	if (!pvs)
+		return -EINVAL;
+
+	pv_cnt = lvm_cfg_count(pvs);
+	lv_cnt = (lvs ? lvm_cfg_count(lvs) : 0);
+
+	vg->pvs = calloc(pv_cnt, sizeof(struct pv));
+	vg->lvs = calloc(lv_cnt, sizeof(struct lv));
+	if ((pv_cnt && !vg->pvs) || (lv_cnt && !vg->lvs))
+		return -ENOMEM;
+
+	err = lvm_copy_name(vg->name, vgc->key, sizeof(vg->name) - 1);
+	if (err)
+		return err;
+
+	vg->extent_size = extent_size * LVM_SECTOR_SIZE;
+
+	i = 0;
+	for (cfg = pvs->child; cfg; cfg = cfg->sibling) {
+		if (cfg->type != LVM_CFG_SECTION)
+			continue;
+
+		id = lvm_cfg_str(cfg, "id");
+		if (!id || lvm_cfg_num(cfg, "pe_start", &pe_start))
+			return -EINVAL;
+
+		device = lvm_find_pv_device(labels, nlabels, id);
+		if (!device) {
+			EPRINTF("%s: no device for pv %s\n", vg->name, id);
+			return -ENODEV;
+		}
+
+		err = lvm_copy_name(vg->pvs[i].name, device,
+				    sizeof(vg->pvs[i].name) - 1);
+		if (err)
+			return err;
+
+		vg->pvs[i].start = pe_start * LVM_SECTOR_SIZE;
+		i++;
+	}
+	vg->pv_cnt = pv_cnt;
+
+	for (cfg = (lvs ? lvs->child : NULL); cfg; cfg = cfg->sibling) {
+		if (cfg->type != LVM_CFG_SECTION)
+			continue;
+
+		/* lvs only lists visible volumes */
+		if (!lvm_cfg_has_flag(cfg, "status", "VISIBLE"))
+			continue;
+
+		lv = vg->lvs + vg->lv_cnt;
+		err = lvm_copy_name(lv->name, cfg->key, sizeof(lv->name) - 1);
+		if (err)
+			return err;
+
+		for (seg = cfg->child; seg; seg = seg->sibling) {
+			if (seg->type != LVM_CFG_SECTION)
+				continue;
+
+			if (lvm_cfg_num(seg, "start_extent", &start) ||
+			    lvm_cfg_num(seg, "extent_count", &count))
+				return -EINVAL;
+
+			lv->segments++;
+			lv->size += count * vg->extent_size;
+
+			if (start)
+				continue;
+
+			lv->first_segment.type    = LVM_SEG_TYPE_UNKNOWN;
+			lv->first_segment.pe_size = count * vg->extent_size;
+
+			type = lvm_cfg_str(seg, "type");
+			if (!type || strcmp(type, "striped") ||
+			    lvm_cfg_num(seg, "stripe_count", &count) ||
+			    count != 1)
+				continue;
+
+			/* stripes = [ "pvN", first extent ] */
+			stripe = lvm_cfg_find(seg, "stripes", LVM_CFG_ARRAY);
+			stripe = (stripe ? stripe->child : NULL);
+			if (!stripe || stripe->type != LVM_CFG_STRING ||
+			    !stripe->sibling ||
+			    stripe->sibling->type != LVM_CFG_NUMBER)
+				return -EINVAL;
+
+			offset = stripe->sibling->num;
+
+			j = 0;
+			for (pv = pvs->child; pv; pv = pv->sibling) {
+				if (pv->type != LVM_CFG_SECTION)
+					continue;
+				if (!strcmp(pv->key, stripe->str))
+					break;
+				j++;
+			}
+			if (!pv)
+				return -EINVAL;
+
+			lv->first_segment.type     = LVM_SEG_TYPE_LINEAR;
+			lv->first_segment.pe_start =
+				offset * vg->extent_size + vg->pvs[j].start;
+			strcpy(lv->first_segment.device, vg->pvs[j].name);
+		}
+
+		vg->lv_cnt++;
+	}
+
+	return 0;
+}
+
+static int
+lvm_read_vg(const char *vg_name, struct vg *vg)
+{
+	struct lvm_cfg *cfg, *best, *vgc, *best_vgc;
+	struct lvm_pv_label *labels;
+	uint64_t seqno, best_seqno;
+	int i, err, cnt;
+	char *text;
+
+	memset(vg, 0, sizeof(*vg));
+
+	err = lvm_scan_labels(&labels, &cnt);
+	if (err)
+		return err;
+
+	best       = NULL;
+	best_vgc   = NULL;
+	best_seqno = 0;
+
+	/* any member PV's metadata area will do; take the newest copy */
+	for (i = 0; i < cnt; i++) {
+		if (lvm_read_metadata(labels + i, &text))
+			continue;
+
+		err = lvm_cfg_parse(text, &cfg);
+		free(text);
+		if (err)
+			continue;
+
+		vgc = lvm_cfg_vg(cfg, vg_name);
+		if (!vgc || !lvm_cfg_vg_has_pv(vgc, labels + i) ||
+		    lvm_cfg_num(vgc, "seqno", &seqno) ||
+		    (best && seqno <= best_seqno)) {
+			lvm_cfg_free(cfg);
+			continue;
+		}
+
+		lvm_cfg_free(best);
+		best       = cfg;
+		best_vgc   = vgc;
+		best_seqno = seqno;
+	}
+
+	err = -ENOENT;
+	if (best)
+		err = lvm_load_vg(vg, best_vgc, labels, cnt);
+
+	if (err)
+		lvm_free_vg(vg);
+
+	lvm_cfg_free(best);
+	free(labels);
+	return err;
+}
+
 void
 lvm_free_vg(struct vg *vg)
 {
@@ -312,6 +1224,13 @@ lvm_scan_vg(const char *vg_name, struct vg *vg)
 {
 	int err;
 
+	err = lvm_read_vg(vg_name, vg);
+	if (!err)
+		return 0;
+
+	EPRINTF("reading %s metadata failed: %d, trying lvm tools\n",
+		vg_name, err);
+
 	memset(vg, 0, sizeof(*vg));
 
 	err = lvm_open_vg(vg_name, vg);
@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libaio.h>
+
+#include "libvhd.h"
+#include "libvhd-aio.h"
+
+#define VHD_AIO_IO_DATA            0
+#define VHD_AIO_IO_BITMAP          1
+
+/*
+ * One read or write in flight. A VHD_AIO_READ of a partly populated
+ * block keeps its slot for two steps: the bitmap first, then the data,
+ * which is masked with the bitmap once it is in.
+ */
+struct vhd_aio_io {
+	struct iocb                iocb;
+	vhd_aio_request_t         *req;
+
+	int                        stage;
+	int                        write;
+	char                      *buf;
+	size_t                     size;
+	off64_t                    off;
+
+	uint32_t                   block;
+	uint32_t                   first;
+	uint32_t                   count;
+	char                      *dst;
+	char                      *map;
+	size_t                     map_size;
+	int                        masked;
+
+	struct vhd_aio_io         *next;
+};
+
+struct vhd_aio_context {
+	io_context_t               aio;
+	int                        sync;
+	int                        depth;
+	int                        inflight;
+	int                        queued;
+	int                        dispatching;
+
+	int                        outstanding;
+	int                        completed;
+
+	struct iocb              **iocbs;
+	struct io_event           *events;
+	struct vhd_aio_io         *ios;
+	struct vhd_aio_io         *free;
+
+	/* requests with pieces left to issue */
+	struct list_head           pending;
+};
+
+static void vhd_aio_io_done(vhd_aio_context_t *, struct vhd_aio_io *, long);
+
+static void
+vhd_aio_request_put(vhd_aio_context_t *ctx, vhd_aio_request_t *req, int err)
+{
+	if (err && !req->error)
+		req->error = err;
+
+	if (--req->pending)
+		return;
+
+	ctx->outstanding--;
+	ctx->completed++;
+
+	if (req->cb)
+		req->cb(req, req->error);
+}
+
+static void
+vhd_aio_put_io(vhd_aio_context_t *ctx, struct vhd_aio_io *io)
+{
+	io->req  = NULL;
+	io->next = ctx->free;
+	ctx->free = io;
+}
+
+static void
+vhd_aio_start_io(vhd_aio_context_t *ctx, struct vhd_aio_io *io)
+{
+	vhd_context_t *vhd = io->req->vhd;
+	int err;
+
+	if (ctx->sync || vhd->devops) {
+		if (io->write)
+			err = vhd_pwrite(vhd, io->buf, io->size, io->off);
+		else
+			err = vhd_pread(vhd, io->buf, io->size, io->off);
+		vhd_aio_io_done(ctx, io, (err ? : (long)io->size));
+		return;
+	}
+
+	if (io->write)
+		io_prep_pwrite(&io->iocb, vhd->fd, io->buf, io->size, io->off);
+	else
+		io_prep_pread(&io->iocb, vhd->fd, io->buf, io->size, io->off);
+
+	ctx->iocbs[ctx->queued++] = &io->iocb;
+}
+
+/*
+ * Bitmap of @io's block is in: read the requested sectors, or skip
+ * the read if the block holds none of them.
+ */
+static void
+vhd_aio_read_data(vhd_aio_context_t *ctx, struct vhd_aio_io *io)
+{
+	vhd_aio_request_t *req = io->req;
+	vhd_context_t *vhd = req->vhd;
+	uint32_t i;
+
+	for (i = 0; i < io->count; i++)
+		if (vhd_bitmap_test(vhd, io->map, io->first + i))
+			break;
+
+	if (i == io->count) {
+		memset(io->dst, 0, vhd_sectors_to_bytes(io->count));
+		vhd_aio_put_io(ctx, io);
+		vhd_aio_request_put(ctx, req, 0);
+		return;
+	}
+
+	io->stage  = VHD_AIO_IO_DATA;
+	io->masked = 1;
+	io->buf    = io->dst;
+	io->size   = vhd_sectors_to_bytes(io->count);
+	io->off    = vhd_sectors_to_bytes((off64_t)vhd->bat.bat[io->block] +
+					  vhd->bm_secs + io->first);
+
+	vhd_aio_start_io(ctx, io);
+}
+
+static void
+vhd_aio_io_done(vhd_aio_context_t *ctx, struct vhd_aio_io *io, long res)
+{
+	vhd_aio_request_t *req = io->req;
+	vhd_context_t *vhd = req->vhd;
+	uint32_t i;
+	int err;
+
+	err = 0;
+	if (res < 0)
+		err = res;
+	else if (res != io->size) {
+		/* reads of a short last block see zeros past the end */
+		if (io->write || req->op != VHD_AIO_READ)
+			err = -EIO;
+		else
+			memset(io->buf + res, 0, io->size - res);
+	}
+
+	if (!err && io->stage == VHD_AIO_IO_BITMAP) {
+		vhd_aio_read_data(ctx, io);
+		return;
+	}
+
+	if (!err && io->masked)
+		for (i = 0; i < io->count; i++)
+			if (!vhd_bitmap_test(vhd, io->map, io->first + i))
+				memset(io->dst + vhd_sectors_to_bytes(i), 0,
+				       VHD_SECTOR_SIZE);
+
+	vhd_aio_put_io(ctx, io);
+	vhd_aio_request_put(ctx, req, err);
+}
+
+static int
+vhd_aio_block_offset(vhd_context_t *vhd, uint32_t block, off64_t *off)
+{
+	if (!vhd_type_dynamic(vhd))
+		return -EINVAL;
+
+	if (block >= vhd->bat.entries)
+		return -ERANGE;
+
+	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+		return -EINVAL;
+
+	*off = vhd_sectors_to_bytes((off64_t)vhd->bat.bat[block]);
+	return 0;
+}
+
+/*
+ * Set up @io for the next piece of @req. Returns 1 if @io was used,
+ * 0 if the piece needed no I/O, negative if the request failed.
+ */
+static int
+vhd_aio_prep_read(vhd_aio_request_t *req, struct vhd_aio_io *io)
+{
+	vhd_context_t *vhd = req->vhd;
+	uint32_t blk, first, count;
+	size_t size;
+	char *dst, *map;
+	int err;
+
+	dst = req->buf + vhd_sectors_to_bytes(req->next - req->sec);
+
+	if (!vhd_type_dynamic(vhd)) {
+		count         = req->sec + req->secs - req->next;
+		io->buf       = dst;
+		io->size      = vhd_sectors_to_bytes(count);
+		io->off       = vhd_sectors_to_bytes(req->next);
+		req->next    += count;
+		return 1;
+	}
+
+	blk   = req->next / vhd->spb;
+	first = req->next % vhd->spb;
+	count = MIN(vhd->spb - first, req->sec + req->secs - req->next);
+
+	req->next += count;
+
+	if (blk >= vhd->bat.entries || vhd->bat.bat[blk] == DD_BLK_UNUSED) {
+		memset(dst, 0, vhd_sectors_to_bytes(count));
+		return 0;
+	}
+
+	io->block = blk;
+	io->first = first;
+	io->count = count;
+	io->dst   = dst;
+
+	if (vhd_has_batmap(vhd) && vhd->batmap.map &&
+	    vhd_batmap_test(vhd, &vhd->batmap, blk)) {
+		io->buf  = dst;
+		io->size = vhd_sectors_to_bytes(count);
+		io->off  = vhd_sectors_to_bytes((off64_t)vhd->bat.bat[blk] +
+						vhd->bm_secs + first);
+		return 1;
+	}
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+	if (io->map_size < size) {
+		err = posix_memalign((void **)&map, VHD_SECTOR_SIZE, size);
+		if (err)
+			return -err;
+
+		free(io->map);
+		io->map      = map;
+		io->map_size = size;
+	}
+
+	io->stage = VHD_AIO_IO_BITMAP;
+	io->buf   = io->map;
+	io->size  = size;
+	io->off   = vhd_sectors_to_bytes((off64_t)vhd->bat.bat[blk]);
+	return 1;
+}
+
+static int
+vhd_aio_prep(vhd_aio_request_t *req, struct vhd_aio_io *io)
+{
+	vhd_context_t *vhd = req->vhd;
+	off64_t off;
+	int err;
+
+	io->req    = req;
+	io->stage  = VHD_AIO_IO_DATA;
+	io->masked = 0;
+	io->write  = (req->op == VHD_AIO_PWRITE ||
+		      req->op == VHD_AIO_WRITE_BITMAP ||
+		      req->op == VHD_AIO_WRITE_BLOCK);
+
+	switch (req->op) {
+	case VHD_AIO_READ:
+		return vhd_aio_prep_read(req, io);
+
+	case VHD_AIO_PREAD:
+	case VHD_AIO_PWRITE:
+		io->buf  = req->buf;
+		io->size = req->size;
+		io->off  = req->off;
+		break;
+
+	case VHD_AIO_READ_BITMAP:
+	case VHD_AIO_WRITE_BITMAP:
+		err = vhd_aio_block_offset(vhd, req->block, &off);
+		if (err)
+			return err;
+
+		io->buf  = req->buf;
+		io->size = vhd_sectors_to_bytes(vhd->bm_secs);
+		io->off  = off;
+		break;
+
+	case VHD_AIO_READ_BLOCK:
+	case VHD_AIO_WRITE_BLOCK:
+		err = vhd_aio_block_offset(vhd, req->block, &off);
+		if (err)
+			return err;
+
+		io->buf  = req->buf;
+		io->size = vhd_sectors_to_bytes(vhd->spb);
+		io->off  = off + vhd_sectors_to_bytes(vhd->bm_secs);
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	req->next = 1;
+	return 1;
+}
+
+static int
+vhd_aio_request_issued(vhd_aio_request_t *req)
+{
+	if (req->op == VHD_AIO_READ)
+		return req->next == req->sec + req->secs;
+	return req->next;
+}
+
+static void
+vhd_aio_flush(vhd_aio_context_t *ctx)
+{
+	struct vhd_aio_io *io;
+	int i, ret;
+
+	while (ctx->queued) {
+		ret = io_submit(ctx->aio, ctx->queued, ctx->iocbs);
+		if (ret == -EAGAIN && ctx->inflight)
+			return;
+
+		if (ret <= 0) {
+			for (i = 0; i < ctx->queued; i++) {
+				io = (struct vhd_aio_io *)ctx->iocbs[i];
+				vhd_aio_io_done(ctx, io, (ret ? : -EIO));
+			}
+			ctx->queued = 0;
+			return;
+		}
+
+		ctx->inflight += ret;
+		ctx->queued   -= ret;
+		memmove(ctx->iocbs, ctx->iocbs + ret,
+			ctx->queued * sizeof(struct iocb *));
+	}
+}
+
+/*
+ * Hand out free slots to pending requests, in submission order.
+ * Completions in sync mode come back here through the callbacks.
+ */
+static void
+vhd_aio_dispatch(vhd_aio_context_t *ctx)
+{
+	vhd_aio_request_t *req;
+	struct vhd_aio_io *io;
+	int ret, issued;
+
+	if (ctx->dispatching)
+		return;
+
+	ctx->dispatching = 1;
+
+	while (!list_empty(&ctx->pending) && ctx->free) {
+		req = list_entry(ctx->pending.next, vhd_aio_request_t, queue);
+
+		io        = ctx->free;
+		ctx->free = io->next;
+
+		ret = vhd_aio_prep(req, io);
+		if (ret < 0)
+			req->error = (req->error ? : ret);
+
+		issued = (ret < 0 || vhd_aio_request_issued(req));
+		if (issued)
+			list_del_init(&req->queue);
+
+		if (ret == 1)
+			req->pending++;
+		else
+			vhd_aio_put_io(ctx, io);
+
+		/* drop the reference held while pieces were left */
+		if (issued)
+			vhd_aio_request_put(ctx, req, 0);
+
+		if (ret == 1)
+			vhd_aio_start_io(ctx, io);
+	}
+
+	ctx->dispatching = 0;
+
+	if (ctx->queued)
+		vhd_aio_flush(ctx);
+}
+
+int
+vhd_aio_create(int depth, vhd_aio_context_t **_ctx)
+{
+	vhd_aio_context_t *ctx;
+	int i, err;
+
+	*_ctx = NULL;
+
+	if (depth <= 0)
+		depth = VHD_AIO_DEFAULT_DEPTH;
+	if (depth > VHD_AIO_MAX_DEPTH)
+		return -EINVAL;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&ctx->pending);
+	ctx->depth = depth;
+
+	ctx->iocbs  = calloc(depth, sizeof(struct iocb *));
+	ctx->events = calloc(depth, sizeof(struct io_event));
+	ctx->ios    = calloc(depth, sizeof(struct vhd_aio_io));
+	if (!ctx->iocbs || !ctx->events || !ctx->ios) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = depth - 1; i >= 0; i--)
+		vhd_aio_put_io(ctx, &ctx->ios[i]);
+
+	/* no usable aio: run requests synchronously */
+	err = io_setup(depth, &ctx->aio);
+	if (err) {
+		ctx->aio  = 0;
+		ctx->sync = 1;
+	}
+
+	*_ctx = ctx;
+	return 0;
+
+fail:
+	vhd_aio_destroy(ctx);
+	return err;
+}
+
+/*
+ * Outstanding requests are waited for, not cancelled.
+ */
+void
+vhd_aio_destroy(vhd_aio_context_t *ctx)
+{
+	int i;
+
+	if (!ctx)
+		return;
+
+	if (ctx->outstanding)
+		vhd_aio_drain(ctx);
+
+	if (ctx->aio)
+		io_destroy(ctx->aio);
+
+	if (ctx->ios)
+		for (i = 0; i < ctx->depth; i++)
+			free(ctx->ios[i].map);
+
+	free(ctx->ios);
+	free(ctx->iocbs);
+	free(ctx->events);
+	free(ctx);
+}
+
+/**
+ * vhd_aio_submit() - queue @n requests on @ctx
+ *
+ * Issues as many as there are free slots right away; the rest go out
+ * as earlier ones complete in vhd_aio_wait(). Requests with invalid
+ * arguments complete with an error like any other. Callbacks may
+ * submit more requests, but not wait.
+ */
+int
+vhd_aio_submit(vhd_aio_context_t *ctx, vhd_aio_request_t **reqs, int n)
+{
+	vhd_aio_request_t *req;
+	int i, err;
+
+	for (i = 0; i < n; i++) {
+		req = reqs[i];
+
+		req->error   = 0;
+		req->pending = 1;
+		req->next    = (req->op == VHD_AIO_READ ? req->sec : 0);
+		INIT_LIST_HEAD(&req->queue);
+
+		if (vhd_type_dynamic(req->vhd)) {
+			err = vhd_get_bat(req->vhd);
+			if (err)
+				req->error = err;
+		}
+
+		ctx->outstanding++;
+
+		if (req->error ||
+		    (req->op == VHD_AIO_READ && !req->secs)) {
+			vhd_aio_request_put(ctx, req, req->error);
+			continue;
+		}
+
+		list_add_tail(&req->queue, &ctx->pending);
+	}
+
+	vhd_aio_dispatch(ctx);
+	return 0;
+}
+
+/**
+ * vhd_aio_wait() - complete at least @min requests
+ *
+ * Runs completion callbacks and issues waiting requests. Returns the
+ * number of requests completed, fewer than @min only if nothing is
+ * left outstanding.
+ */
+int
+vhd_aio_wait(vhd_aio_context_t *ctx, int min)
+{
+	struct vhd_aio_io *io;
+	int i, ret, start;
+
+	start = ctx->completed;
+
+	while (ctx->completed - start < min && ctx->outstanding) {
+		vhd_aio_dispatch(ctx);
+
+		if (!ctx->inflight)
+			break;
+
+		do {
+			ret = io_getevents(ctx->aio, 1, ctx->depth,
+					   ctx->events, NULL);
+		} while (ret == -EINTR);
+
+		if (ret < 0)
+			return ret;
+
+		ctx->inflight -= ret;
+
+		for (i = 0; i < ret; i++) {
+			io = (struct vhd_aio_io *)ctx->events[i].obj;
+			vhd_aio_io_done(ctx, io, ctx->events[i].res);
+		}
+
+		vhd_aio_flush(ctx);
+	}
+
+	return ctx->completed - start;
+}
+
+int
+vhd_aio_drain(vhd_aio_context_t *ctx)
+{
+	int ret;
+
+	while (ctx->outstanding) {
+		ret = vhd_aio_wait(ctx, ctx->outstanding);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * vhd_aio_run() - synchronous wrapper: submit @n requests and wait
+ * for all of them. Returns the first request error.
+ */
+int
+vhd_aio_run(vhd_aio_context_t *ctx, vhd_aio_request_t **reqs, int n)
+{
+	int i, err;
+
+	err = vhd_aio_submit(ctx, reqs, n);
+	if (err)
+		return err;
+
+	err = vhd_aio_drain(ctx);
+	if (err)
+		return err;
+
+	for (i = 0; i < n; i++)
+		if (reqs[i]->error)
+			return reqs[i]->error;
+
+	return 0;
+}
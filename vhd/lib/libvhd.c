@@ -3804,6 +3804,36 @@ vhd_io_write(vhd_context_t *ctx, char *buf, uint64_t sec, uint32_t secs)
 	return __vhd_io_dynamic_write(ctx, buf, sec, secs);
 }
 
+/*
+ * Allocate @block unless it already is, for callers doing their own
+ * data I/O against the returned BAT entry. The footer is rewritten
+ * past the new block before returning.
+ */
+int
+vhd_io_allocate_block(vhd_context_t *ctx, uint32_t block)
+{
+	int err;
+
+	if (!vhd_type_dynamic(ctx))
+		return -EINVAL;
+
+	err = vhd_get_bat(ctx);
+	if (err)
+		return err;
+
+	if (block >= ctx->bat.entries)
+		return -ERANGE;
+
+	if (ctx->bat.bat[block] != DD_BLK_UNUSED)
+		return 0;
+
+	err = __vhd_io_allocate_block(ctx, block);
+	if (err)
+		return err;
+
+	return vhd_write_footer(ctx, &ctx->footer);
+}
+
 static void
 vhd_cache_init(vhd_context_t *ctx)
 {
@@ -11,6 +11,9 @@
  *
  * Example usage:
  *   for i in {1..100}; do ./aio-test -f /mnt/ext4fs/foo; done
+ *
+ * With -l, runs the libvhd-aio tests on a scratch vhd instead:
+ *   ./aio-test -l /mnt/ext4fs/foo.vhd
  */
 
 #ifndef _GNU_SOURCE
@@ -30,6 +33,9 @@
 #include <inttypes.h>
 #include <sys/syscall.h>
 
+#include "libvhd.h"
+#include "libvhd-aio.h"
+
 typedef enum {
     EXT_NOOP,
     EXT_WRITE,
@@ -60,7 +66,7 @@ static void
 usage(const char *app, int err)
 {
     fprintf(stderr, "usage: %s <file> [-v verbose] [-h help]"
-            "[(-f fallocate|-t truncate|-w write)]\n", app);
+            "[(-f fallocate|-t truncate|-w write|-l libvhd-aio)]\n", app);
     exit(err);
 }
 
@@ -70,6 +76,320 @@ _fallocate(int fd, int mode, off_t offset, off_t length)
     return syscall(SYS_fallocate, fd, mode, offset, length);
 }
 
+/*
+ * libvhd-aio tests. The scratch vhd holds a full block 0, nothing in
+ * block 1 and VHD_TEST_SECS sectors at VHD_TEST_SEC in block 2, so
+ * reads see all three kinds of block.
+ */
+#define VHD_TEST_SIZE     (16ULL << 20)
+#define VHD_TEST_DEPTH    4
+#define VHD_TEST_SEC      8
+#define VHD_TEST_SECS     8
+#define VHD_TEST_REQS     16
+
+#define CHECK(_cond)                                                    \
+    do {                                                                \
+        if (!(_cond)) {                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __func__, __LINE__, #_cond);                        \
+            return EIO;                                                 \
+        }                                                               \
+    } while (0)
+
+struct vhd_test_req {
+    vhd_aio_request_t req;
+    int done;
+    int err;
+};
+
+static void
+vhd_test_cb(vhd_aio_request_t *req, int err)
+{
+    struct vhd_test_req *t = req->data;
+
+    t->done++;
+    t->err = err;
+}
+
+static void
+vhd_test_prep(struct vhd_test_req *t, vhd_context_t *vhd, int op, char *buf)
+{
+    memset(t, 0, sizeof(*t));
+    t->req.op   = op;
+    t->req.vhd  = vhd;
+    t->req.buf  = buf;
+    t->req.cb   = vhd_test_cb;
+    t->req.data = t;
+}
+
+/* what a read of @sec should return */
+static char
+vhd_test_byte(vhd_context_t *vhd, uint64_t sec)
+{
+    uint32_t blk = sec / vhd->spb, off = sec % vhd->spb;
+
+    if (blk == 0)
+        return (char)(off + 1);
+    if (blk == 2 && off >= VHD_TEST_SEC && off < VHD_TEST_SEC + VHD_TEST_SECS)
+        return (char)(off + 1);
+    return 0;
+}
+
+static int
+vhd_test_verify(vhd_context_t *vhd, const char *buf, uint64_t sec, uint32_t secs)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < secs; i++)
+        for (j = 0; j < VHD_SECTOR_SIZE; j++)
+            if (buf[i * VHD_SECTOR_SIZE + j] != vhd_test_byte(vhd, sec + i)) {
+                fprintf(stderr, "data mismatch: sector 0x%"PRIx64"\n",
+                        sec + i);
+                return EIO;
+            }
+
+    return 0;
+}
+
+static int
+vhd_test_setup(const char *path, vhd_context_t *vhd, char **_buf)
+{
+    uint32_t i;
+    char *buf;
+    int err;
+
+    unlink(path);
+
+    err = vhd_create(path, VHD_TEST_SIZE, HD_TYPE_DYNAMIC, 0, 0);
+    if (err) {
+        fprintf(stderr, "vhd_create: %s\n", strerror(-err));
+        return -err;
+    }
+
+    err = vhd_open(vhd, path, VHD_OPEN_RDWR);
+    if (err) {
+        fprintf(stderr, "vhd_open: %s\n", strerror(-err));
+        return -err;
+    }
+
+    err = posix_memalign((void *)&buf, 4096,
+                         vhd_sectors_to_bytes(3 * vhd->spb));
+    if (err) {
+        fprintf(stderr, "memalign: %s\n", strerror(err));
+        return err;
+    }
+
+    for (i = 0; i < vhd->spb; i++)
+        memset(buf + vhd_sectors_to_bytes(i), vhd_test_byte(vhd, i),
+               VHD_SECTOR_SIZE);
+
+    err = vhd_io_write(vhd, buf, 0, vhd->spb);
+    if (!err)
+        err = vhd_io_write(vhd, buf + vhd_sectors_to_bytes(VHD_TEST_SEC),
+                           2 * vhd->spb + VHD_TEST_SEC, VHD_TEST_SECS);
+    if (err) {
+        fprintf(stderr, "vhd_io_write: %s\n", strerror(-err));
+        free(buf);
+        return -err;
+    }
+
+    /* junk in block 2 outside its bitmap must still read as zeros */
+    err = vhd_get_bat(vhd);
+    if (!err) {
+        memset(buf, 0x5a, vhd_sectors_to_bytes(VHD_TEST_SEC));
+        err = vhd_pwrite(vhd, buf, vhd_sectors_to_bytes(VHD_TEST_SEC),
+                         vhd_sectors_to_bytes((off64_t)vhd->bat.bat[2] +
+                                              vhd->bm_secs));
+    }
+    if (err) {
+        fprintf(stderr, "vhd_pwrite: %s\n", strerror(-err));
+        free(buf);
+        return -err;
+    }
+
+    *_buf = buf;
+    return 0;
+}
+
+/* one read across an allocated, an empty and a partial block */
+static int
+vhd_test_submit_reap(vhd_context_t *vhd, char *buf)
+{
+    vhd_aio_context_t *ctx;
+    vhd_aio_request_t *reqs[1];
+    struct vhd_test_req t;
+    int err, n;
+
+    err = vhd_aio_create(VHD_TEST_DEPTH, &ctx);
+    CHECK(!err);
+
+    memset(buf, 0xff, vhd_sectors_to_bytes(3 * vhd->spb));
+    vhd_test_prep(&t, vhd, VHD_AIO_READ, buf);
+    t.req.sec  = 0;
+    t.req.secs = 3 * vhd->spb;
+    reqs[0]    = &t.req;
+
+    err = vhd_aio_submit(ctx, reqs, 1);
+    CHECK(!err);
+
+    n = 0;
+    while (!t.done) {
+        err = vhd_aio_wait(ctx, 1);
+        CHECK(err >= 0);
+        if (!err)
+            break;
+        n += err;
+    }
+
+    CHECK(t.done == 1);
+    CHECK(!t.err);
+    CHECK(n <= 1);
+    CHECK(vhd_aio_wait(ctx, 1) == 0);
+
+    vhd_aio_destroy(ctx);
+    return vhd_test_verify(vhd, buf, 0, 3 * vhd->spb);
+}
+
+/* more requests than slots: the rest wait for earlier completions */
+static int
+vhd_test_partial_batch(vhd_context_t *vhd, char *buf)
+{
+    vhd_aio_request_t *reqs[VHD_TEST_REQS];
+    struct vhd_test_req t[VHD_TEST_REQS];
+    vhd_aio_context_t *ctx;
+    uint64_t sec;
+    int i, err, done;
+    char *p;
+
+    err = vhd_aio_create(VHD_TEST_DEPTH, &ctx);
+    CHECK(!err);
+
+    memset(buf, 0xff, vhd_sectors_to_bytes(3 * vhd->spb));
+
+    for (i = 0; i < VHD_TEST_REQS; i++) {
+        /* alternate between block 0 and the partial block 2 */
+        sec = (i & 1 ? 2 * vhd->spb : 0) + i * VHD_TEST_SECS / 2;
+        p   = buf + vhd_sectors_to_bytes(i * VHD_TEST_SECS);
+
+        vhd_test_prep(t + i, vhd, VHD_AIO_READ, p);
+        t[i].req.sec  = sec;
+        t[i].req.secs = VHD_TEST_SECS;
+        reqs[i]       = &t[i].req;
+    }
+
+    err = vhd_aio_submit(ctx, reqs, VHD_TEST_REQS);
+    CHECK(!err);
+
+    /* without kernel aio, all of them ran in vhd_aio_submit */
+    for (i = 0, done = 0; i < VHD_TEST_REQS; i++)
+        done += t[i].done;
+
+    err = vhd_aio_wait(ctx, 1);
+    CHECK(done == VHD_TEST_REQS ? err == 0 : err >= 1);
+
+    err = vhd_aio_drain(ctx);
+    CHECK(!err);
+
+    for (i = 0; i < VHD_TEST_REQS; i++) {
+        CHECK(t[i].done == 1);
+        CHECK(!t[i].err);
+
+        err = vhd_test_verify(vhd, buf + vhd_sectors_to_bytes(i * VHD_TEST_SECS),
+                              t[i].req.sec, t[i].req.secs);
+        if (err)
+            return err;
+    }
+
+    vhd_aio_destroy(ctx);
+    return 0;
+}
+
+/* bad requests fail through their callbacks, good ones still run */
+static int
+vhd_test_errors(vhd_context_t *vhd, char *buf)
+{
+    vhd_aio_request_t *reqs[5];
+    struct vhd_test_req t[5];
+    vhd_aio_context_t *ctx;
+    int i, err;
+
+    err = vhd_aio_create(VHD_AIO_MAX_DEPTH + 1, &ctx);
+    CHECK(err == -EINVAL);
+    CHECK(!ctx);
+
+    err = vhd_aio_create(VHD_TEST_DEPTH, &ctx);
+    CHECK(!err);
+
+    /* block ops need the block allocated */
+    vhd_test_prep(t + 0, vhd, VHD_AIO_READ_BLOCK, buf);
+    t[0].req.block = 1;
+
+    vhd_test_prep(t + 1, vhd, VHD_AIO_READ_BITMAP, buf);
+    t[1].req.block = vhd->bat.entries;
+
+    vhd_test_prep(t + 2, vhd, 0, buf);
+
+    /* empty reads complete at submit */
+    vhd_test_prep(t + 3, vhd, VHD_AIO_READ, buf);
+
+    vhd_test_prep(t + 4, vhd, VHD_AIO_READ_BLOCK,
+                  buf + vhd_sectors_to_bytes(vhd->spb));
+    t[4].req.block = 0;
+
+    for (i = 0; i < 5; i++)
+        reqs[i] = &t[i].req;
+
+    err = vhd_aio_run(ctx, reqs, 5);
+    CHECK(err == -EINVAL);
+
+    for (i = 0; i < 5; i++)
+        CHECK(t[i].done == 1);
+
+    CHECK(t[0].err == -EINVAL);
+    CHECK(t[1].err == -ERANGE);
+    CHECK(t[2].err == -EINVAL);
+    CHECK(!t[3].err);
+    CHECK(!t[4].err);
+
+    vhd_aio_destroy(ctx);
+    return vhd_test_verify(vhd, buf + vhd_sectors_to_bytes(vhd->spb),
+                           0, vhd->spb);
+}
+
+static int
+vhd_aio_tests(const char *path)
+{
+    vhd_context_t vhd;
+    char *buf;
+    int err;
+
+    memset(&vhd, 0, sizeof(vhd));
+    buf = NULL;
+
+    err = vhd_test_setup(path, &vhd, &buf);
+    if (err)
+        goto out;
+
+    err = vhd_test_submit_reap(&vhd, buf);
+    if (err)
+        goto out;
+
+    err = vhd_test_partial_batch(&vhd, buf);
+    if (err)
+        goto out;
+
+    err = vhd_test_errors(&vhd, buf);
+
+ out:
+    free(buf);
+    if (vhd.file)
+        vhd_close(&vhd);
+    unlink(path);
+    if (!err)
+        printf("libvhd-aio: ok\n");
+    return err;
+}
+
 int
 main(int argc, char * const argv[])
 {
@@ -77,7 +397,7 @@ main(int argc, char * const argv[])
     extend_t extend;
     io_context_t aio;
     char *buf, *rbuf, *p;
-    int i, c, fd, err, verbose;
+    int i, c, fd, err, verbose, vhd_aio;
     struct io_event events[IOCBS], *ep;
     struct iocb iocbs[IOCBS], *piocbs[IOCBS];
 
@@ -86,9 +406,10 @@ main(int argc, char * const argv[])
     buf = NULL;
     rbuf = NULL;
     verbose = 0;
+    vhd_aio = 0;
     extend = EXT_NOOP;
 
-    while ((c = getopt(argc, argv, "wtfvh")) != -1) {
+    while ((c = getopt(argc, argv, "wtflvh")) != -1) {
         switch (c) {
         case 'w':
             extend = EXT_WRITE;
@@ -99,6 +420,9 @@ main(int argc, char * const argv[])
         case 'f':
             extend = EXT_FALLOCATE;
             break;
+        case 'l':
+            vhd_aio = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -111,6 +435,9 @@ main(int argc, char * const argv[])
     if (argc - optind != 1)
         usage(argv[0], EINVAL);
 
+    if (vhd_aio)
+        return vhd_aio_tests(argv[optind]);
+
     for (i = 0, len = 0; i < IOCBS; i++)
         len += workload[i].len;
 
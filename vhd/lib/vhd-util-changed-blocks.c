@@ -0,0 +1,497 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * List the sectors written since an older snapshot of a leaf, from
+ * chain metadata alone. Every image between the leaf and the snapshot
+ * owns exactly the sectors written while it was the leaf, so the
+ * union of their BATs and bitmaps is the change set.
+ *
+ * With -d the data is written too, in the same extent stream format as
+ * tapdisk-stream -S: each extent is a header followed by length bytes
+ * of data, and a last extent with length 0 carries the size of the
+ * disk. Data is read from the topmost image holding each sector.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+#define ERR(_fmt, _args...) fprintf(stderr, "%d: " _fmt, __LINE__, ##_args)
+
+#define VHD_CHANGED_EXTENT_MAGIC   0x54445358 /* "TDSX" */
+
+struct vhd_changed_extent {
+	uint32_t                   magic;
+	uint32_t                   pad;
+	uint64_t                   offset;
+	uint64_t                   length;
+};
+
+struct vhd_changed {
+	vhd_context_t            **vhds;
+	int                        depth;
+	uint32_t                   spb;
+
+	/* per sector of the current block: index of the owner, or -1 */
+	int                       *owner;
+
+	FILE                      *out;
+	int                        data;
+	char                      *buf;
+
+	/* pending text extent, merged across blocks */
+	uint64_t                   sec;
+	uint64_t                   secs;
+
+	uint64_t                   total;
+};
+
+static void
+vhd_changed_close(struct vhd_changed *c)
+{
+	int i;
+
+	for (i = 0; i < c->depth; i++) {
+		vhd_close(c->vhds[i]);
+		free(c->vhds[i]);
+	}
+
+	free(c->vhds);
+	free(c->owner);
+	free(c->buf);
+}
+
+/*
+ * Open @name and its ancestors, up to but not including the image
+ * whose uuid is @until.
+ */
+static int
+vhd_changed_open(struct vhd_changed *c, const char *name, uuid_t until)
+{
+	vhd_context_t *vhd, **vhds;
+	char *path, *parent;
+	int err;
+
+	vhd  = NULL;
+	path = strdup(name);
+	if (!path)
+		return -ENOMEM;
+
+	for (;;) {
+		vhd = calloc(1, sizeof(*vhd));
+		if (!vhd) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = vhd_open(vhd, path, VHD_OPEN_RDONLY);
+		if (err) {
+			ERR("error opening %s: %d\n", path, err);
+			free(vhd);
+			goto out;
+		}
+
+		vhds = realloc(c->vhds, (c->depth + 1) * sizeof(*vhds));
+		if (!vhds) {
+			vhd_close(vhd);
+			free(vhd);
+			err = -ENOMEM;
+			goto out;
+		}
+
+		c->vhds = vhds;
+		c->vhds[c->depth++] = vhd;
+
+		if (!uuid_compare(vhd->footer.uuid, until)) {
+			ERR("%s is the snapshot itself\n", path);
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (vhd->footer.type != HD_TYPE_DIFF) {
+			ERR("%s: snapshot not found in chain\n", path);
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (!c->spb)
+			c->spb = vhd->spb;
+		else if (vhd->spb != c->spb) {
+			ERR("%s: block size mismatch\n", path);
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = vhd_get_bat(vhd);
+		if (err) {
+			ERR("error reading BAT for %s: %d\n", path, err);
+			goto out;
+		}
+
+		if (vhd_has_batmap(vhd)) {
+			err = vhd_get_batmap(vhd);
+			if (err) {
+				ERR("error reading batmap for %s: %d\n",
+				    path, err);
+				goto out;
+			}
+		}
+
+		if (!uuid_compare(vhd->header.prt_uuid, until))
+			break;
+
+		if (vhd_parent_raw(vhd)) {
+			ERR("%s: snapshot not found in chain\n", path);
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = vhd_parent_locator_get(vhd, &parent);
+		if (err) {
+			ERR("%s: error finding parent: %d\n", path, err);
+			goto out;
+		}
+
+		free(path);
+		path = parent;
+	}
+
+	c->owner = malloc(c->spb * sizeof(*c->owner));
+	if (!c->owner)
+		err = -ENOMEM;
+
+out:
+	free(path);
+	return err;
+}
+
+static int
+vhd_changed_load(struct vhd_changed *c, uint32_t blk)
+{
+	vhd_context_t *vhd;
+	int d, left, err;
+	uint32_t i;
+	char *bm;
+
+	left = c->spb;
+	for (i = 0; i < c->spb; i++)
+		c->owner[i] = -1;
+
+	for (d = 0; d < c->depth && left; d++) {
+		vhd = c->vhds[d];
+
+		if (blk >= vhd->bat.entries ||
+		    vhd->bat.bat[blk] == DD_BLK_UNUSED)
+			continue;
+
+		if (vhd_has_batmap(vhd) &&
+		    vhd_batmap_test(vhd, &vhd->batmap, blk)) {
+			for (i = 0; i < c->spb; i++)
+				if (c->owner[i] == -1)
+					c->owner[i] = d;
+			break;
+		}
+
+		err = vhd_read_bitmap(vhd, blk, &bm);
+		if (err) {
+			ERR("%s: error reading bitmap 0x%x: %d\n",
+			    vhd->file, blk, err);
+			return err;
+		}
+
+		for (i = 0; i < c->spb; i++)
+			if (c->owner[i] == -1 && vhd_bitmap_test(vhd, bm, i)) {
+				c->owner[i] = d;
+				left--;
+			}
+
+		free(bm);
+	}
+
+	return 0;
+}
+
+static int
+vhd_changed_write(struct vhd_changed *c, const void *buf, size_t size)
+{
+	if (fwrite(buf, size, 1, c->out) != 1) {
+		ERR("error writing output: %d\n", errno);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Write sectors [i, i + cnt) of @blk as one extent, reading each
+ * stretch from the image that owns it.
+ */
+static int
+vhd_changed_write_data(struct vhd_changed *c, uint32_t blk,
+		       uint32_t i, uint32_t cnt)
+{
+	struct vhd_changed_extent ext;
+	vhd_context_t *vhd;
+	uint32_t end, n;
+	off64_t off;
+	int err;
+
+	memset(&ext, 0, sizeof(ext));
+	ext.magic  = VHD_CHANGED_EXTENT_MAGIC;
+	ext.offset = vhd_sectors_to_bytes((uint64_t)blk * c->spb + i);
+	ext.length = vhd_sectors_to_bytes(cnt);
+
+	err = vhd_changed_write(c, &ext, sizeof(ext));
+	if (err)
+		return err;
+
+	for (end = i + cnt; i < end; i += n) {
+		for (n = 1; i + n < end && c->owner[i + n] == c->owner[i]; n++)
+			;
+
+		vhd = c->vhds[c->owner[i]];
+		off = vhd_sectors_to_bytes((off64_t)vhd->bat.bat[blk] +
+					   vhd->bm_secs + i);
+
+		err = vhd_pread(vhd, c->buf, vhd_sectors_to_bytes(n), off);
+		if (err) {
+			ERR("%s: error reading block 0x%x: %d\n",
+			    vhd->file, blk, err);
+			return err;
+		}
+
+		err = vhd_changed_write(c, c->buf, vhd_sectors_to_bytes(n));
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static void
+vhd_changed_flush(struct vhd_changed *c)
+{
+	if (c->secs)
+		fprintf(c->out, "%"PRIu64" %"PRIu64"\n", c->sec, c->secs);
+	c->secs = 0;
+}
+
+static int
+vhd_changed_block(struct vhd_changed *c, uint32_t blk)
+{
+	uint32_t i, cnt;
+	uint64_t sec;
+	int err;
+
+	err = vhd_changed_load(c, blk);
+	if (err)
+		return err;
+
+	for (i = 0; i < c->spb; i += cnt) {
+		for (cnt = 0; i + cnt < c->spb; cnt++)
+			if ((c->owner[i + cnt] == -1) != (c->owner[i] == -1))
+				break;
+
+		if (c->owner[i] == -1)
+			continue;
+
+		c->total += cnt;
+
+		if (c->data) {
+			err = vhd_changed_write_data(c, blk, i, cnt);
+			if (err)
+				return err;
+			continue;
+		}
+
+		sec = (uint64_t)blk * c->spb + i;
+		if (c->secs && c->sec + c->secs == sec) {
+			c->secs += cnt;
+			continue;
+		}
+
+		vhd_changed_flush(c);
+		c->sec  = sec;
+		c->secs = cnt;
+	}
+
+	return 0;
+}
+
+static int
+vhd_changed_run(struct vhd_changed *c)
+{
+	struct vhd_changed_extent ext;
+	uint32_t blk, blks;
+	int d, err;
+
+	blks = 0;
+	for (d = 0; d < c->depth; d++)
+		blks = MAX(blks, c->vhds[d]->bat.entries);
+
+	if (c->data) {
+		err = posix_memalign((void **)&c->buf, VHD_SECTOR_SIZE,
+				     vhd_sectors_to_bytes(c->spb));
+		if (err) {
+			c->buf = NULL;
+			return -err;
+		}
+	}
+
+	for (blk = 0; blk < blks; blk++) {
+		for (d = 0; d < c->depth; d++)
+			if (blk < c->vhds[d]->bat.entries &&
+			    c->vhds[d]->bat.bat[blk] != DD_BLK_UNUSED)
+				break;
+
+		if (d == c->depth)
+			continue;
+
+		err = vhd_changed_block(c, blk);
+		if (err)
+			return err;
+	}
+
+	if (!c->data) {
+		vhd_changed_flush(c);
+		return 0;
+	}
+
+	memset(&ext, 0, sizeof(ext));
+	ext.magic  = VHD_CHANGED_EXTENT_MAGIC;
+	ext.offset = c->vhds[0]->footer.curr_size;
+
+	return vhd_changed_write(c, &ext, sizeof(ext));
+}
+
+int
+vhd_util_changed_blocks(int argc, char **argv)
+{
+	char *name, *snap, *output;
+	struct vhd_changed changed;
+	vhd_context_t vsnap;
+	int c, err, quiet;
+
+	name   = NULL;
+	snap   = NULL;
+	output = NULL;
+	quiet  = 0;
+
+	memset(&changed, 0, sizeof(changed));
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:p:do:qh")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'p':
+			snap = optarg;
+			break;
+		case 'd':
+			changed.data = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || !snap || optind != argc)
+		goto usage;
+
+	err = vhd_open(&vsnap, snap, VHD_OPEN_RDONLY);
+	if (err) {
+		ERR("error opening %s: %d\n", snap, err);
+		return err;
+	}
+
+	err = vhd_changed_open(&changed, name, vsnap.footer.uuid);
+	vhd_close(&vsnap);
+	if (err)
+		goto out;
+
+	changed.out = stdout;
+	if (output) {
+		changed.out = fopen(output, "w");
+		if (!changed.out) {
+			err = -errno;
+			ERR("error opening %s: %d\n", output, err);
+			goto out;
+		}
+	}
+
+	err = vhd_changed_run(&changed);
+
+	if (fflush(changed.out) && !err)
+		err = -errno;
+
+	if (output && fclose(changed.out) && !err)
+		err = -errno;
+
+	if (!err && !quiet && changed.data)
+		fprintf(stderr, "%"PRIu64" sectors changed\n", changed.total);
+
+out:
+	vhd_changed_close(&changed);
+	return err;
+
+usage:
+	printf("vhd-util changed-blocks lists the sectors written to a VHD "
+	       "since an older\nsnapshot in its chain, from the chain's "
+	       "metadata alone.\n"
+	       "Options:\n"
+	       "-h          Print this help message.\n"
+	       "-n NAME     NAME of the newer VHD (the leaf).\n"
+	       "-p NAME     NAME of the older snapshot, an ancestor of -n.\n"
+	       "-d          Write the changed data as an extent stream "
+	       "instead of\n"
+	       "            a list of <sector> <count> lines.\n"
+	       "-o FILE     Write to FILE instead of stdout.\n"
+	       "-q          With -d, don't print the number of sectors "
+	       "changed.\n");
+	return EINVAL;
+}
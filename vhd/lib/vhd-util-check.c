@@ -35,6 +35,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <inttypes.h>
 #include <sys/stat.h>
 
@@ -46,6 +48,12 @@
 // account for time skew with NFS servers
 #define TIMESTAMP_MAX_SLACK 1800
 
+#define VHD_CHECK_THREADS     4
+#define VHD_CHECK_MAX_THREADS 64
+#define VHD_CHECK_BATCH       64
+
+#define CPRINTF(_f, _a...)    vhd_util_check_printf(_f, ##_a)
+
 struct vhd_util_check_options {
 	char                             ignore_footer;
 	char                             ignore_parent_uuid;
@@ -53,6 +61,7 @@ struct vhd_util_check_options {
 	char                             check_data;
 	char                             check_bitmaps;
 	char                             collect_stats;
+	int                              threads;
 };
 
 struct vhd_util_check_stats {
@@ -70,6 +79,56 @@ struct vhd_util_check_ctx {
 	int                              primary_footer_missing;
 };
 
+struct vhd_util_check_extent {
+	uint32_t                         block;
+	uint32_t                         offset;
+};
+
+/*
+ * Block checks are spread over worker threads, each taking batches
+ * of the offset-sorted extents so reads stay mostly sequential.
+ */
+struct vhd_util_check_pool {
+	struct vhd_util_check_ctx       *ctx;
+	vhd_context_t                   *vhd;
+	struct vhd_util_check_extent    *extents;
+	uint32_t                         count;
+	uint32_t                         next;
+	int                              err;
+	pthread_mutex_t                  lock;
+};
+
+/*
+ * In machine-readable mode (-m), diagnostics are not printed; the
+ * last one is kept and reported on a single key=value line per vhd.
+ */
+static int vhd_util_check_machine;
+static char vhd_util_check_msg[256];
+static pthread_mutex_t vhd_util_check_msg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void __attribute__((format(printf, 1, 2)))
+vhd_util_check_printf(const char *fmt, ...)
+{
+	va_list ap;
+	size_t len;
+
+	pthread_mutex_lock(&vhd_util_check_msg_lock);
+
+	va_start(ap, fmt);
+	if (!vhd_util_check_machine)
+		vprintf(fmt, ap);
+	else {
+		vsnprintf(vhd_util_check_msg,
+			  sizeof(vhd_util_check_msg), fmt, ap);
+		len = strlen(vhd_util_check_msg);
+		if (len && vhd_util_check_msg[len - 1] == '\n')
+			vhd_util_check_msg[len - 1] = '\0';
+	}
+	va_end(ap);
+
+	pthread_mutex_unlock(&vhd_util_check_msg_lock);
+}
+
 #define ctx_cur_stats(ctx) \
 	list_entry((ctx)->stats.next, struct vhd_util_check_stats, next)
 
@@ -130,7 +189,7 @@ vhd_util_check_stats_alloc_one(struct vhd_util_check_ctx *ctx,
 
 fail:
 	vhd_util_check_stats_free_one(stats);
-	printf("failed to allocate stats for %s\n", vhd->file);
+	CPRINTF("failed to allocate stats for %s\n", vhd->file);
 	return -ENOMEM;
 }
 
@@ -171,9 +230,16 @@ vhd_util_check_stats_print(struct vhd_util_check_ctx *ctx)
 		return;
 
 	head = list_entry(ctx->stats.next, struct vhd_util_check_stats, next);
-	printf("%s: secs allocated: 0x%llx secs written: 0x%llx (%.2f%%)\n",
-	       name(head->name), head->secs_allocated, head->secs_written,
-	       pct(head->secs_written, head->secs_allocated));
+	if (vhd_util_check_machine)
+		printf("vhd=%s secs_allocated=%"PRIu64" "
+		       "secs_written=%"PRIu64"\n", head->name,
+		       head->secs_allocated, head->secs_written);
+	else
+		printf("%s: secs allocated: 0x%llx secs written: 0x%llx "
+		       "(%.2f%%)\n",
+		       name(head->name), head->secs_allocated,
+		       head->secs_written,
+		       pct(head->secs_written, head->secs_allocated));
 
 	if (list_is_last(&head->next, &ctx->stats))
 		return;
@@ -206,6 +272,17 @@ vhd_util_check_stats_print(struct vhd_util_check_ctx *ctx)
 			}
 		}
 
+		if (vhd_util_check_machine) {
+			printf("vhd=%s secs_allocated=%"PRIu64" "
+			       "secs_written=%"PRIu64" "
+			       "secs_not_in_parent=%"PRIu64" "
+			       "secs_not_in_ancestors=%"PRIu64"\n",
+			       cur->name, cur->secs_allocated,
+			       cur->secs_written, up, uc);
+			prev = cur;
+			continue;
+		}
+
 		printf("%s: secs allocated: 0x%llx secs written: 0x%llx "
 		       "(%.2f%%) secs not in parent: 0x%llx (%.2f%%) "
 		       "secs not in ancestors: 0x%llx (%.2f%%)\n",
@@ -520,7 +597,7 @@ vhd_util_check_footer(struct vhd_util_check_ctx *ctx,
 
 	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, sizeof(primary));
 	if (err) {
-		printf("error allocating buffer: %d\n", err);
+		CPRINTF("error allocating buffer: %d\n", err);
 		return -err;
 	}
 
@@ -529,7 +606,7 @@ vhd_util_check_footer(struct vhd_util_check_ctx *ctx,
 	eof = lseek64(fd, 0, SEEK_END);
 	if (eof == (off64_t)-1) {
 		err = -errno;
-		printf("error calculating end of file: %d\n", err);
+		CPRINTF("error calculating end of file: %d\n", err);
 		goto out;
 	}
 
@@ -537,14 +614,14 @@ vhd_util_check_footer(struct vhd_util_check_ctx *ctx,
 	eof  = lseek64(fd, eof - size, SEEK_SET);
 	if (eof == (off64_t)-1) {
 		err = -errno;
-		printf("error calculating end of file: %d\n", err);
+		CPRINTF("error calculating end of file: %d\n", err);
 		goto out;
 	}
 
 	err = read(fd, buf, 512);
 	if (err != size) {
 		err = (errno ? -errno : -EIO);
-		printf("error reading primary footer: %d\n", err);
+		CPRINTF("error reading primary footer: %d\n", err);
 		goto out;
 	}
 
@@ -559,7 +636,7 @@ vhd_util_check_footer(struct vhd_util_check_ctx *ctx,
 			goto check_backup;
 
 		err = -EINVAL;
-		printf("primary footer invalid: %s\n", msg);
+		CPRINTF("primary footer invalid: %s\n", msg);
 		goto out;
 	}
 
@@ -572,7 +649,7 @@ check_backup:
 	off = lseek64(fd, 0, SEEK_SET);
 	if (off == (off64_t)-1) {
 		err = -errno;
-		printf("error seeking to backup footer: %d\n", err);
+		CPRINTF("error seeking to backup footer: %d\n", err);
 		goto out;
 	}
 
@@ -582,7 +659,7 @@ check_backup:
 	err = read(fd, buf, size);
 	if (err != size) {
 		err = (errno ? -errno : -EIO);
-		printf("error reading backup footer: %d\n", err);
+		CPRINTF("error reading backup footer: %d\n", err);
 		goto out;
 	}
 
@@ -592,7 +669,7 @@ check_backup:
 	msg = vhd_util_check_validate_footer(ctx, &backup);
 	if (msg) {
 		err = -EINVAL;
-		printf("backup footer invalid: %s\n", msg);
+		CPRINTF("backup footer invalid: %s\n", msg);
 		goto out;
 	}
 
@@ -615,7 +692,7 @@ check_backup:
 		}
 
 		err = -EINVAL;
-		printf("primary and backup footers do not match\n");
+		CPRINTF("primary and backup footers do not match\n");
 		goto out;
 	}
 
@@ -638,7 +715,7 @@ vhd_util_check_header(int fd, vhd_footer_t *footer)
 
 	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, sizeof(header));
 	if (err) {
-		printf("error allocating header: %d\n", err);
+		CPRINTF("error allocating header: %d\n", err);
 		return err;
 	}
 
@@ -646,14 +723,14 @@ vhd_util_check_header(int fd, vhd_footer_t *footer)
 	off = lseek64(fd, off, SEEK_SET);
 	if (off == (off64_t)-1) {
 		err = -errno;
-		printf("error seeking to header: %d\n", err);
+		CPRINTF("error seeking to header: %d\n", err);
 		goto out;
 	}
 
 	err = read(fd, buf, sizeof(header));
 	if (err != sizeof(header)) {
 		err = (errno ? -errno : -EIO);
-		printf("error reading header: %d\n", err);
+		CPRINTF("error reading header: %d\n", err);
 		goto out;
 	}
 
@@ -663,7 +740,7 @@ vhd_util_check_header(int fd, vhd_footer_t *footer)
 	msg = vhd_util_check_validate_header(fd, &header);
 	if (msg) {
 		err = -EINVAL;
-		printf("header is invalid: %s\n", msg);
+		CPRINTF("header is invalid: %s\n", msg);
 		goto out;
 	}
 
@@ -682,7 +759,7 @@ vhd_util_check_differencing_header(struct vhd_util_check_ctx *ctx,
 
 	msg = vhd_util_check_validate_differencing_header(ctx, vhd);
 	if (msg) {
-		printf("differencing header is invalid: %s\n", msg);
+		CPRINTF("differencing header is invalid: %s\n", msg);
 		return -EINVAL;
 	}
 
@@ -690,30 +767,71 @@ vhd_util_check_differencing_header(struct vhd_util_check_ctx *ctx,
 }
 
 static int
-vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
-		      vhd_context_t *vhd, uint32_t block)
+vhd_util_check_read_block(vhd_context_t *vhd, uint32_t offset,
+			  char *buf, size_t size)
+{
+	int err;
+	ssize_t n;
+	off64_t off;
+
+	off = vhd_sectors_to_bytes(offset);
+
+	if (vhd->devops) {
+		err = vhd_seek(vhd, off, SEEK_SET);
+		if (err)
+			return err;
+
+		return vhd_read(vhd, buf, size);
+	}
+
+	n = pread(vhd->fd, buf, size, off);
+	if (n == size)
+		return 0;
+
+	return (n == -1 ? -errno : -EIO);
+}
+
+static size_t
+vhd_util_check_block_size(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
+{
+	size_t size;
+
+	size = vhd_sectors_to_bytes(vhd->bm_secs);
+	if (ctx->opts.check_data)
+		size += vhd_sectors_to_bytes(vhd->spb);
+
+	return size;
+}
+
+/*
+ * Reads the bitmap, and the data with -d, of one block in a single
+ * request into buf. Written sectors are counted in *written and set
+ * in the stats bitmap, whose bytes are private to each block.
+ */
+static int
+vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd,
+		      struct vhd_util_check_extent *ext, char *buf,
+		      uint64_t *written)
 {
 	int err, i, bits;
+	uint32_t block;
 	uint64_t sector;
 	char *bitmap, *data;
 
 	bits   = 0;
-	data   = NULL;
-	bitmap = NULL;
+	block  = ext->block;
+	bitmap = buf;
+	data   = buf + vhd_sectors_to_bytes(vhd->bm_secs);
 	sector = (uint64_t)block * vhd->spb;
 
-	err = vhd_read_bitmap(vhd, block, &bitmap);
+	err = vhd_util_check_read_block(vhd, ext->offset, buf,
+					vhd_util_check_block_size(ctx, vhd));
 	if (err) {
-		printf("error reading bitmap 0x%x\n", block);
-		goto out;
-	}
-
-	if (ctx->opts.check_data) {
-		err = vhd_read_block(vhd, block, &data);
-		if (err) {
-			printf("error reading data block 0x%x\n", block);
-			goto out;
-		}
+		if (ctx->opts.check_data)
+			CPRINTF("error reading data block 0x%x\n", block);
+		else
+			CPRINTF("error reading bitmap 0x%x\n", block);
+		return err;
 	}
 
 	for (i = 0; i < vhd->spb; i++) {
@@ -722,7 +840,7 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 			bits++;
 
 		if (ctx->opts.collect_stats && map) {
-			ctx_cur_stats(ctx)->secs_written++;
+			(*written)++;
 			set_bit_u64(ctx_cur_stats(ctx)->bitmap, sector + i);
 		}
 
@@ -731,8 +849,8 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 			int set   = vhd_util_check_zeros(buf, VHD_SECTOR_SIZE);
 
 			if (set && !map) {
-				printf("sector 0x%x of block 0x%x has data "
-				       "where bitmap is clear\n", i, block);
+				CPRINTF("sector 0x%x of block 0x%x has data "
+					"where bitmap is clear\n", i, block);
 				err = -EINVAL;
 			}
 		}
@@ -741,22 +859,129 @@ vhd_util_check_bitmap(struct vhd_util_check_ctx *ctx,
 	if (ctx->opts.check_bitmaps) {
 		if (bits == vhd->spb &&
 		    !vhd_batmap_test(vhd, &vhd->batmap, block))
-			printf("bitmap of block 0x%x is full "
-			       "where batmap is clear\n", block);
+			CPRINTF("bitmap of block 0x%x is full "
+				"where batmap is clear\n", block);
 		else if (bits < vhd->spb &&
 			 vhd_batmap_test(vhd, &vhd->batmap, block)) {
-			printf("bitmap of block 0x%x is not full "
-			       "where batmap is set\n", block);
+			CPRINTF("bitmap of block 0x%x is not full "
+				"where batmap is set\n", block);
 			err = -EINVAL;
 		}
 	}
 
-out:
-	free(data);
-	free(bitmap);
 	return err;
 }
 
+static void *
+vhd_util_check_worker(void *arg)
+{
+	struct vhd_util_check_pool *pool = arg;
+	struct vhd_util_check_ctx *ctx = pool->ctx;
+	uint32_t i, end;
+	uint64_t written;
+	char *buf;
+	int err;
+
+	buf     = NULL;
+	written = 0;
+
+	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE,
+			     vhd_util_check_block_size(ctx, pool->vhd));
+	if (err) {
+		buf = NULL;
+		err = -err;
+		CPRINTF("error allocating block buffer: %d\n", err);
+		goto out;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->err || pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		i   = pool->next;
+		end = i + VHD_CHECK_BATCH;
+		if (end > pool->count)
+			end = pool->count;
+		pool->next = end;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (; i < end; i++) {
+			err = vhd_util_check_bitmap(ctx, pool->vhd,
+						    pool->extents + i,
+						    buf, &written);
+			if (err)
+				goto out;
+		}
+	}
+
+out:
+	pthread_mutex_lock(&pool->lock);
+	if (err && !pool->err)
+		pool->err = err;
+	if (ctx->opts.collect_stats)
+		ctx_cur_stats(ctx)->secs_written += written;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static int
+vhd_util_check_blocks(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd,
+		      struct vhd_util_check_extent *extents, uint32_t count)
+{
+	struct vhd_util_check_pool pool;
+	pthread_t *threads;
+	int i, n, err;
+
+	threads = NULL;
+
+	n = ctx->opts.threads;
+	if ((count + VHD_CHECK_BATCH - 1) / VHD_CHECK_BATCH < n)
+		n = (count + VHD_CHECK_BATCH - 1) / VHD_CHECK_BATCH;
+
+	/*
+	 * the icbinn client is not thread-safe, and blocks of less than
+	 * 8 sectors would share bytes of the stats bitmap
+	 */
+	if (vhd->devops || (vhd->spb & 7))
+		n = 1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ctx     = ctx;
+	pool.vhd     = vhd;
+	pool.extents = extents;
+	pool.count   = count;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	if (n > 1) {
+		threads = calloc(n - 1, sizeof(*threads));
+		if (!threads)
+			n = 1;
+	}
+
+	/* the calling thread is worker n - 1 */
+	for (i = 0; i < n - 1; i++) {
+		err = pthread_create(&threads[i], NULL,
+				     vhd_util_check_worker, &pool);
+		if (err)
+			break;
+	}
+
+	vhd_util_check_worker(&pool);
+
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+
+	return pool.err;
+}
+
 static int
 vhd_util_check_get_batmap(vhd_context_t *vhd)
 {
@@ -772,24 +997,39 @@ vhd_util_check_get_batmap(vhd_context_t *vhd)
 	if (err) {
 		err = vhd_read_batmap_header(vhd, &vhd->batmap);
 		if (err) {
-			printf("failed to read batmap header: %d\n", err);
+			CPRINTF("failed to read batmap header: %d\n", err);
 			return err;
 		}
 
 		err = vhd_read_batmap_map(vhd, &vhd->batmap);
 		if (err)
-			printf("failed to read batmap: %d\n", err);
+			CPRINTF("failed to read batmap: %d\n", err);
 	}
 
 	return err;
 }
 
+static int
+vhd_util_check_extent_cmp(const void *a, const void *b)
+{
+	const struct vhd_util_check_extent *x = a, *y = b;
+
+	if (x->offset != y->offset)
+		return (x->offset < y->offset ? -1 : 1);
+
+	return (x->block < y->block ? -1 : x->block > y->block);
+}
+
 static int
 vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 {
 	off64_t eof, eoh;
 	uint64_t vhd_blks;
-	int i, j, err, block_size;
+	uint32_t i, n, block_size;
+	struct vhd_util_check_extent *extents, *prev, *cur;
+	int err;
+
+	extents = NULL;
 
 	if (ctx->opts.collect_stats) {
 		err = vhd_util_check_stats_alloc_one(ctx, vhd);
@@ -799,20 +1039,20 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 
 	err = vhd_seek(vhd, 0, SEEK_END);
 	if (err) {
-		printf("error calculating eof: %d\n", err);
+		CPRINTF("error calculating eof: %d\n", err);
 		return err;
 	}
 
 	eof = vhd_position(vhd);
 	if (eof == (off64_t)-1) {
-		printf("error calculating eof: %d\n", -errno);
+		CPRINTF("error calculating eof: %d\n", -errno);
 		return -errno;
 	}
 
 	/* adjust eof for vhds with short footers */
 	if (eof % 512) {
 		if (eof % 512 != 511) {
-			printf("invalid file size: 0x%"PRIx64"\n", eof);
+			CPRINTF("invalid file size: 0x%"PRIx64"\n", eof);
 			return -EINVAL;
 		}
 
@@ -821,13 +1061,13 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 
 	err = vhd_get_bat(vhd);
 	if (err) {
-		printf("error reading bat: %d\n", err);
+		CPRINTF("error reading bat: %d\n", err);
 		return err;
 	}
 
 	err = vhd_end_of_headers(vhd, &eoh);
 	if (err) {
-		printf("error calculating end of metadata: %d\n", err);
+		CPRINTF("error calculating end of metadata: %d\n", err);
 		return err;
 	}
 
@@ -838,8 +1078,8 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 
 	vhd_blks = vhd->footer.curr_size >> VHD_BLOCK_SHIFT;
 	if (vhd_blks > vhd->header.max_bat_size) {
-		printf("VHD size (%llu blocks) exceeds BAT size (%u)\n",
-		       vhd_blks, vhd->header.max_bat_size);
+		CPRINTF("VHD size (%llu blocks) exceeds BAT size (%u)\n",
+			vhd_blks, vhd->header.max_bat_size);
 		return -EINVAL;
 	}
 
@@ -847,67 +1087,77 @@ vhd_util_check_bat(struct vhd_util_check_ctx *ctx, vhd_context_t *vhd)
 	vhd->batmap.map = NULL;
 	vhd_util_check_get_batmap(vhd);
 
-	for (i = 0; i < vhd_blks; i++) {
+	extents = malloc(vhd_blks * sizeof(*extents));
+	if (!extents && vhd_blks) {
+		CPRINTF("error allocating block list\n");
+		return -ENOMEM;
+	}
+
+	for (n = 0, i = 0; i < vhd_blks; i++) {
 		uint32_t off = vhd->bat.bat[i];
 		if (off == DD_BLK_UNUSED)
 			continue;
 
 		if (off < eoh) {
-			printf("block %d (offset 0x%x) clobbers headers\n",
-			       i, off);
-			return -EINVAL;
+			CPRINTF("block %d (offset 0x%x) clobbers headers\n",
+				i, off);
+			err = -EINVAL;
+			goto out;
 		}
 
 		if (off + block_size > eof) {
 			if (!(ctx->primary_footer_missing &&
 			      ctx->opts.ignore_footer     &&
 			      off + block_size == eof + 1)) {
-				printf("block %d (offset 0x%x) clobbers "
-				       "footer\n", i, off);
-				return -EINVAL;
+				CPRINTF("block %d (offset 0x%x) clobbers "
+					"footer\n", i, off);
+				err = -EINVAL;
+				goto out;
 			}
 		}
 
-		for (j = 0; j < vhd_blks; j++) {
-			uint32_t joff = vhd->bat.bat[j];
-
-			if (i == j)
-				continue;
-
-			if (joff == DD_BLK_UNUSED)
-				continue;
-
-			if (off == joff)
-				err = -EINVAL;
-
-			if (off > joff && off < joff + block_size)
-				err = -EINVAL;
-
-			if (off + block_size > joff &&
-			    off + block_size < joff + block_size)
-				err = -EINVAL;
+		extents[n].block  = i;
+		extents[n].offset = off;
+		n++;
+	}
 
-			if (err) {
-				printf("block %d (offset 0x%x) clobbers "
-				       "block %d (offset 0x%x)\n",
-				       i, off, j, joff);
-				return err;
-			}
+	/*
+	 * Blocks are all the same size: sorted by offset, any overlap
+	 * shows up between neighbours.
+	 */
+	qsort(extents, n, sizeof(*extents), vhd_util_check_extent_cmp);
+
+	for (i = 1; i < n; i++) {
+		prev = extents + i - 1;
+		cur  = extents + i;
+
+		if (cur->offset < prev->offset + block_size) {
+			CPRINTF("block %d (offset 0x%x) clobbers "
+				"block %d (offset 0x%x)\n",
+				cur->block, cur->offset,
+				prev->block, prev->offset);
+			err = -EINVAL;
+			goto out;
 		}
+	}
 
-		if (ctx->opts.check_data ||
-		    ctx->opts.check_bitmaps ||
-		    ctx->opts.collect_stats) {
-			if (ctx->opts.collect_stats)
-				ctx_cur_stats(ctx)->secs_allocated += vhd->spb;
+	if (ctx->opts.check_data ||
+	    ctx->opts.check_bitmaps ||
+	    ctx->opts.collect_stats) {
+		if (ctx->opts.collect_stats)
+			ctx_cur_stats(ctx)->secs_allocated +=
+				(uint64_t)vhd->spb * n;
 
-			err = vhd_util_check_bitmap(ctx, vhd, i);
-			if (err)
-				return err;
-		}
+		err = vhd_util_check_blocks(ctx, vhd, extents, n);
+		if (err)
+			goto out;
 	}
 
-	return 0;
+	err = 0;
+
+out:
+	free(extents);
+	return err;
 }
 
 static int
@@ -919,19 +1169,19 @@ vhd_util_check_batmap(vhd_context_t *vhd)
 
 	err = vhd_get_bat(vhd);
 	if (err) {
-		printf("error reading bat: %d\n", err);
+		CPRINTF("error reading bat: %d\n", err);
 		return err;
 	}
 
 	err = vhd_util_check_get_batmap(vhd);
 	if (err) {
-		printf("error reading batmap: %d\n", err);
+		CPRINTF("error reading batmap: %d\n", err);
 		return err;
 	}
 
 	msg = vhd_util_check_validate_batmap(vhd, &vhd->batmap);
 	if (msg) {
-		printf("batmap is invalid: %s\n", msg);
+		CPRINTF("batmap is invalid: %s\n", msg);
 		return -EINVAL;
 	}
 
@@ -940,7 +1190,7 @@ vhd_util_check_batmap(vhd_context_t *vhd)
 			continue;
 
 		if (vhd->bat.bat[i] == DD_BLK_UNUSED) {
-			printf("batmap shows unallocated block %d full\n", i);
+			CPRINTF("batmap shows unallocated block %d full\n", i);
 			return -EINVAL;
 		}
 	}
@@ -970,7 +1220,7 @@ vhd_util_check_parent_locators(struct vhd_util_check_ctx *ctx,
 
 	err = vhd_header_decode_parent(vhd, &vhd->header, &pname);
 	if (err) {
-		printf("error decoding parent name: %d\n", err);
+		CPRINTF("error decoding parent name: %d\n", err);
 		return err;
 	}
 
@@ -983,7 +1233,7 @@ vhd_util_check_parent_locators(struct vhd_util_check_ctx *ctx,
 		msg = vhd_util_check_validate_parent_locator(vhd, loc);
 		if (msg) {
 			err = -EINVAL;
-			printf("invalid parent locator %d: %s\n", i, msg);
+			CPRINTF("invalid parent locator %d: %s\n", i, msg);
 			goto out;
 		}
 
@@ -1023,7 +1273,7 @@ vhd_util_check_parent_locators(struct vhd_util_check_ctx *ctx,
 
 		default:
 			err = -EINVAL;
-			printf("invalid  platform code for locator %d\n", i);
+			CPRINTF("invalid  platform code for locator %d\n", i);
 			goto out;
 		}
 
@@ -1034,36 +1284,37 @@ vhd_util_check_parent_locators(struct vhd_util_check_ctx *ctx,
 
 		err = vhd_parent_locator_read(vhd, loc, &ppath);
 		if (err) {
-			printf("error reading parent locator %d: %d\n", i, err);
+			CPRINTF("error reading parent locator %d: %d\n",
+				i, err);
 			goto out;
 		}
 
 		file = basename(ppath);
 		if (strcmp(pname, file)) {
 			err = -EINVAL;
-			printf("parent locator %d name (%s) does not match "
-			       "header name (%s)\n", i, file, pname);
+			CPRINTF("parent locator %d name (%s) does not match "
+				"header name (%s)\n", i, file, pname);
 			goto out;
 		}
 
 		err = vhd_find_parent(vhd, ppath, &location);
 		if (err) {
-			printf("error resolving %s: %d\n", ppath, err);
+			CPRINTF("error resolving %s: %d\n", ppath, err);
 			goto out;
 		}
 
 		err = access(location, R_OK);
 		if (err && loc->code == PLAT_CODE_MACX) {
 			err = -errno;
-			printf("parent locator %d points to missing file %s "
-				"(resolved to %s)\n", i, ppath, location);
+			CPRINTF("parent locator %d points to missing file %s "
+				 "(resolved to %s)\n", i, ppath, location);
 			goto out;
 		}
 
 		msg = vhd_util_check_validate_parent(ctx, vhd, location);
 		if (msg) {
 			err = -EINVAL;
-			printf("invalid parent %s: %s\n", location, msg);
+			CPRINTF("invalid parent %s: %s\n", location, msg);
 			goto out;
 		}
 
@@ -1076,15 +1327,15 @@ vhd_util_check_parent_locators(struct vhd_util_check_ctx *ctx,
 		continue;
 
 	dup:
-		printf("duplicate platform code in locator %d: 0x%x\n",
-		       i, loc->code);
+		CPRINTF("duplicate platform code in locator %d: 0x%x\n",
+			i, loc->code);
 		err = -EINVAL;
 		goto out;
 	}
 
 	if (!found) {
 		err = -EINVAL;
-		printf("could not find parent %s\n", pname);
+		CPRINTF("could not find parent %s\n", pname);
 		goto out;
 	}
 
@@ -1103,7 +1354,7 @@ vhd_util_dump_headers(const char *name)
 	char *argv[] = { "read", "-p", "-n", (char *)name };
 	int argc = sizeof(argv) / sizeof(argv[0]);
 
-	printf("%s appears invalid; dumping metadata\n", name);
+	CPRINTF("%s appears invalid; dumping metadata\n", name);
 	vhd_util_read(argc, argv);
 }
 
@@ -1117,22 +1368,26 @@ vhd_util_check_vhd(struct vhd_util_check_ctx *ctx, const char *name)
 
 	fd = -1;
 	memset(&vhd, 0, sizeof(vhd));
+	vhd_util_check_msg[0] = '\0';
 
 	err = stat(name, &stats);
 	if (err == -1) {
-		printf("cannot stat %s: %d\n", name, errno);
-		return -errno;
+		err = -errno;
+		CPRINTF("cannot stat %s: %d\n", name, -err);
+		goto done;
 	}
 
 	if (!S_ISREG(stats.st_mode) && !S_ISBLK(stats.st_mode)) {
-		printf("%s is not a regular file or block device\n", name);
-		return -EINVAL;
+		CPRINTF("%s is not a regular file or block device\n", name);
+		err = -EINVAL;
+		goto done;
 	}
 
 	fd = open(name, O_RDONLY | O_DIRECT | O_LARGEFILE);
 	if (fd == -1) {
-		printf("error opening %s\n", name);
-		return -errno;
+		err = -errno;
+		CPRINTF("error opening %s\n", name);
+		goto done;
 	}
 
 	err = vhd_util_check_footer(ctx, fd, &footer);
@@ -1172,15 +1427,19 @@ vhd_util_check_vhd(struct vhd_util_check_ctx *ctx, const char *name)
 
 	err = 0;
 
-	if (!ctx->opts.collect_stats)
+	if (!ctx->opts.collect_stats && !vhd_util_check_machine)
 		printf("%s is valid\n", name);
 
 out:
-	if (err)
+	if (err && !vhd_util_check_machine)
 		vhd_util_dump_headers(name);
 	if (fd != -1)
 		close(fd);
 	vhd_close(&vhd);
+done:
+	if (vhd_util_check_machine)
+		printf("vhd=%s valid=%d error=%d message=\"%s\"\n",
+		       name, !err, err, vhd_util_check_msg);
 	return err;
 }
 
@@ -1208,7 +1467,7 @@ vhd_util_check_parents(struct vhd_util_check_ctx *ctx, const char *name)
 		vhd_close(&vhd);
 
 		if (err) {
-			printf("error getting parent: %d\n", err);
+			CPRINTF("error getting parent: %d\n", err);
 			goto out;
 		}
 
@@ -1223,7 +1482,7 @@ vhd_util_check_parents(struct vhd_util_check_ctx *ctx, const char *name)
 
 out:
 	if (err)
-		printf("error checking parents: %d\n", err);
+		CPRINTF("error checking parents: %d\n", err);
 	if (cur != name)
 		free(cur);
 	return err;
@@ -1246,8 +1505,11 @@ vhd_util_check(int argc, char **argv)
 	memset(&ctx, 0, sizeof(ctx));
 	vhd_util_check_stats_init(&ctx);
 
+	ctx.opts.threads = VHD_CHECK_THREADS;
+	vhd_util_check_machine = 0;
+
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:iItpbsh")) != -1) {
+	while ((c = getopt(argc, argv, "n:iItpbdsmj:h")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -1273,6 +1535,17 @@ vhd_util_check(int argc, char **argv)
 		case 's':
 			ctx.opts.collect_stats = 1;
 			break;
+		case 'm':
+			vhd_util_check_machine = 1;
+			break;
+		case 'j':
+			ctx.opts.threads = strtol(optarg, NULL, 10);
+			if (ctx.opts.threads < 1 ||
+			    ctx.opts.threads > VHD_CHECK_MAX_THREADS) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
 		case 'h':
 			err = 0;
 			goto usage;
@@ -1306,6 +1579,7 @@ usage:
 	printf("options: -n <file> [-i ignore missing primary footers] "
 	       "[-I ignore parent uuids] [-t ignore timestamps] "
 	       "[-p check parents] [-b check bitmaps] [-d check data] "
-	       "[-s stats] [-h help]\n");
+	       "[-s stats] [-m machine-readable output] "
+	       "[-j threads (default %d)] [-h help]\n", VHD_CHECK_THREADS);
 	return err;
 }
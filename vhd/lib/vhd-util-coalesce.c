@@ -33,9 +33,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <libaio.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
 
+#define VHD_COALESCE_QUEUE_DEPTH   16
+#define VHD_COALESCE_MAX_DEPTH     256
+#define VHD_COALESCE_CHUNK_SECS    2048	/* 1MB per request */
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
@@ -64,7 +70,7 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
  */
 static int
 vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-			int parent_fd, uint64_t block)
+			int parent_fd, uint64_t block, uint64_t *bytes)
 {
 	int i, err;
 	char *buf, *map;
@@ -90,6 +96,8 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 			err = vhd_io_write(parent, buf, sec, vhd->spb);
 		else
 			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
+		if (!err)
+			*bytes += vhd->header.block_size;
 		goto done;
 	}
 
@@ -116,6 +124,7 @@ vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
 		if (err)
 			goto done;
 
+		*bytes += vhd_sectors_to_bytes(secs);
 		i += secs;
 	}
 
@@ -127,12 +136,480 @@ done:
 	return err;
 }
 
+static double
+vhd_util_coalesce_elapsed(const struct timeval *t0, const struct timeval *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) +
+		(t1->tv_usec - t0->tv_usec) / 1000000.0;
+}
+
+static double
+vhd_util_coalesce_rate(uint64_t bytes,
+		       const struct timeval *t0, const struct timeval *t1)
+{
+	double secs = vhd_util_coalesce_elapsed(t0, t1);
+
+	return (secs > 0 ? (double)bytes / (1 << 20) / secs : 0);
+}
+
+/*
+ * Pipelined coalesce: only sectors set in the child's bitmaps are
+ * read, straight from the child's data blocks, and written to the
+ * parent with up to @depth requests in flight on a private aio
+ * context. Each request buffer is reused for the read and then the
+ * write of its extent. Parent blocks are allocated up front, and
+ * parent bitmaps are updated only once all data of a block is down.
+ */
+struct vhd_coalesce_block {
+	uint64_t                   block;
+	char                      *map;		/* NULL: whole block */
+	int                        pending;
+	int                        issued;
+	struct list_head           next;
+};
+
+struct vhd_coalesce_io {
+	struct iocb                iocb;
+	char                      *buf;
+	size_t                     size;
+	off64_t                    dst;
+	struct vhd_coalesce_block *blk;
+	struct vhd_coalesce_io    *next;
+};
+
+struct vhd_coalesce_engine {
+	vhd_context_t             *child;
+	vhd_context_t             *parent;
+	int                        parent_fd;
+
+	io_context_t               aio;
+	int                        depth;
+	int                        inflight;
+	int                        queued;
+	struct iocb              **iocbs;
+	struct io_event           *events;
+	struct vhd_coalesce_io    *ios;
+	struct vhd_coalesce_io    *free;
+	struct list_head           blocks;
+
+	uint64_t                   bytes;
+	int                        err;
+};
+
+static void
+vhd_coalesce_engine_free(struct vhd_coalesce_engine *e)
+{
+	struct vhd_coalesce_block *blk, *tmp;
+	int i;
+
+	list_for_each_entry_safe(blk, tmp, &e->blocks, next) {
+		list_del(&blk->next);
+		free(blk->map);
+		free(blk);
+	}
+
+	if (e->ios)
+		for (i = 0; i < e->depth; i++)
+			free(e->ios[i].buf);
+
+	if (e->aio)
+		io_destroy(e->aio);
+
+	free(e->ios);
+	free(e->iocbs);
+	free(e->events);
+	memset(e, 0, sizeof(*e));
+}
+
+static int
+vhd_coalesce_engine_init(struct vhd_coalesce_engine *e,
+			 vhd_context_t *child, vhd_context_t *parent,
+			 int parent_fd, int depth)
+{
+	int i, err;
+
+	memset(e, 0, sizeof(*e));
+	INIT_LIST_HEAD(&e->blocks);
+
+	e->child     = child;
+	e->parent    = parent;
+	e->parent_fd = (parent->file ? parent->fd : parent_fd);
+	e->depth     = depth;
+
+	/* -ENOSYS: no usable aio, callers fall back to synchronous I/O */
+	err = io_setup(depth, &e->aio);
+	if (err) {
+		e->aio = 0;
+		err = -ENOSYS;
+		goto fail;
+	}
+
+	e->iocbs  = calloc(depth, sizeof(struct iocb *));
+	e->events = calloc(depth, sizeof(struct io_event));
+	e->ios    = calloc(depth, sizeof(struct vhd_coalesce_io));
+	if (!e->iocbs || !e->events || !e->ios) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < depth; i++) {
+		struct vhd_coalesce_io *io = &e->ios[i];
+
+		err = posix_memalign((void **)&io->buf, 4096,
+				     vhd_sectors_to_bytes(VHD_COALESCE_CHUNK_SECS));
+		if (err) {
+			io->buf = NULL;
+			err = -err;
+			goto fail;
+		}
+
+		io->next = e->free;
+		e->free  = io;
+	}
+
+	return 0;
+
+fail:
+	vhd_coalesce_engine_free(e);
+	return err;
+}
+
+/*
+ * Parent data for @blk is on disk: mark it present in the parent.
+ */
+static int
+vhd_coalesce_engine_finish_block(struct vhd_coalesce_engine *e,
+				 struct vhd_coalesce_block *blk)
+{
+	vhd_context_t *child = e->child, *parent = e->parent;
+	char *map = NULL;
+	int i, err = 0;
+
+	if (!parent->file)
+		goto out;
+
+	if (vhd_has_batmap(parent) &&
+	    vhd_batmap_test(parent, &parent->batmap, blk->block))
+		goto out;
+
+	err = vhd_read_bitmap(parent, blk->block, &map);
+	if (err)
+		goto out;
+
+	for (i = 0; i < parent->spb; i++)
+		if (!blk->map || vhd_bitmap_test(child, blk->map, i))
+			vhd_bitmap_set(parent, map, i);
+
+	err = vhd_write_bitmap(parent, blk->block, map);
+	if (err)
+		goto out;
+
+	if (vhd_has_batmap(parent)) {
+		for (i = 0; i < parent->spb; i++)
+			if (!vhd_bitmap_test(parent, map, i))
+				goto out;
+
+		vhd_batmap_set(parent, &parent->batmap, blk->block);
+		err = vhd_write_batmap(parent, &parent->batmap);
+	}
+
+out:
+	free(map);
+	list_del(&blk->next);
+	free(blk->map);
+	free(blk);
+	return err;
+}
+
+static void
+vhd_coalesce_engine_put_io(struct vhd_coalesce_engine *e,
+			   struct vhd_coalesce_io *io)
+{
+	struct vhd_coalesce_block *blk = io->blk;
+	int err;
+
+	io->blk  = NULL;
+	io->next = e->free;
+	e->free  = io;
+
+	if (--blk->pending || !blk->issued || e->err)
+		return;
+
+	err = vhd_coalesce_engine_finish_block(e, blk);
+	if (err && !e->err)
+		e->err = err;
+}
+
+static void
+vhd_coalesce_engine_queue(struct vhd_coalesce_engine *e,
+			  struct vhd_coalesce_io *io)
+{
+	e->iocbs[e->queued++] = &io->iocb;
+}
+
+static int
+vhd_coalesce_engine_submit(struct vhd_coalesce_engine *e)
+{
+	int i, ret;
+
+	while (e->queued) {
+		ret = io_submit(e->aio, e->queued, e->iocbs);
+		if (ret == -EAGAIN && e->inflight)
+			return 0;
+		if (ret <= 0) {
+			if (!e->err)
+				e->err = (ret ? : -EIO);
+			for (i = 0; i < e->queued; i++)
+				vhd_coalesce_engine_put_io(e,
+					(struct vhd_coalesce_io *)e->iocbs[i]);
+			e->queued = 0;
+			return e->err;
+		}
+
+		e->inflight += ret;
+		e->queued   -= ret;
+		memmove(e->iocbs, e->iocbs + ret,
+			e->queued * sizeof(struct iocb *));
+	}
+
+	return 0;
+}
+
+static void
+vhd_coalesce_engine_complete(struct vhd_coalesce_engine *e,
+			     struct vhd_coalesce_io *io, long res)
+{
+	if (res != io->size) {
+		if (!e->err)
+			e->err = (res < 0 ? res : -EIO);
+		vhd_coalesce_engine_put_io(e, io);
+		return;
+	}
+
+	if (io->iocb.aio_lio_opcode == IO_CMD_PREAD && !e->err) {
+		io_prep_pwrite(&io->iocb, e->parent_fd,
+			       io->buf, io->size, io->dst);
+		vhd_coalesce_engine_queue(e, io);
+		return;
+	}
+
+	if (io->iocb.aio_lio_opcode == IO_CMD_PWRITE)
+		e->bytes += io->size;
+
+	vhd_coalesce_engine_put_io(e, io);
+}
+
+/*
+ * Wait for at least one request to complete, and resubmit reads
+ * which turned into writes.
+ */
+static int
+vhd_coalesce_engine_reap(struct vhd_coalesce_engine *e)
+{
+	int i, ret;
+
+	vhd_coalesce_engine_submit(e);
+
+	if (!e->inflight)
+		return e->err;
+
+	do {
+		ret = io_getevents(e->aio, 1, e->depth, e->events, NULL);
+	} while (ret == -EINTR);
+
+	if (ret < 0) {
+		/* io_destroy() will wait for whatever is still out */
+		if (!e->err)
+			e->err = ret;
+		e->inflight = 0;
+		return e->err;
+	}
+
+	for (i = 0; i < ret; i++) {
+		struct io_event *ep = &e->events[i];
+		struct vhd_coalesce_io *io = (struct vhd_coalesce_io *)ep->obj;
+
+		e->inflight--;
+		vhd_coalesce_engine_complete(e, io, (long)ep->res);
+	}
+
+	return vhd_coalesce_engine_submit(e) ? : e->err;
+}
+
 static int
-vhd_util_coalesce_onto(vhd_context_t *from,
-		       vhd_context_t *to, int to_fd, int progress)
+vhd_coalesce_engine_drain(struct vhd_coalesce_engine *e)
 {
+	while (e->inflight || e->queued) {
+		vhd_coalesce_engine_reap(e);
+		if (e->err && !e->inflight)
+			break;
+	}
+
+	return e->err;
+}
+
+static int
+vhd_coalesce_engine_extent(struct vhd_coalesce_engine *e,
+			   struct vhd_coalesce_block *blk,
+			   uint32_t sec, uint32_t secs)
+{
+	vhd_context_t *child = e->child, *parent = e->parent;
+	struct vhd_coalesce_io *io;
+	off64_t src, dst;
+	uint32_t n;
+
+	while (secs) {
+		while (!e->free) {
+			vhd_coalesce_engine_reap(e);
+			if (e->err)
+				return e->err;
+		}
+
+		io      = e->free;
+		e->free = io->next;
+
+		n   = MIN(secs, VHD_COALESCE_CHUNK_SECS);
+		src = (off64_t)child->bat.bat[blk->block] + child->bm_secs + sec;
+		if (parent->file)
+			dst = (off64_t)parent->bat.bat[blk->block] +
+				parent->bm_secs + sec;
+		else
+			dst = blk->block * child->spb + sec;
+
+		io->blk  = blk;
+		io->size = vhd_sectors_to_bytes(n);
+		io->dst  = vhd_sectors_to_bytes(dst);
+		io_prep_pread(&io->iocb, child->fd, io->buf, io->size,
+			      vhd_sectors_to_bytes(src));
+
+		blk->pending++;
+		vhd_coalesce_engine_queue(e, io);
+
+		sec  += n;
+		secs -= n;
+	}
+
+	return 0;
+}
+
+static int
+vhd_coalesce_engine_block(struct vhd_coalesce_engine *e, uint64_t block)
+{
+	vhd_context_t *child = e->child, *parent = e->parent;
+	struct vhd_coalesce_block *blk;
+	uint32_t i, secs;
+	char *map = NULL;
 	int err;
+
+	if (child->bat.bat[block] == DD_BLK_UNUSED)
+		return 0;
+
+	if (!vhd_has_batmap(child) ||
+	    !vhd_batmap_test(child, &child->batmap, block)) {
+		err = vhd_read_bitmap(child, block, &map);
+		if (err)
+			return err;
+
+		for (i = 0; i < child->spb; i++)
+			if (vhd_bitmap_test(child, map, i))
+				break;
+
+		if (i == child->spb) {
+			free(map);
+			return 0;
+		}
+	}
+
+	if (parent->file) {
+		err = vhd_io_allocate_block(parent, block);
+		if (err) {
+			free(map);
+			return err;
+		}
+	}
+
+	blk = calloc(1, sizeof(*blk));
+	if (!blk) {
+		free(map);
+		return -ENOMEM;
+	}
+
+	blk->block = block;
+	blk->map   = map;
+	list_add_tail(&blk->next, &e->blocks);
+
+	if (!map)
+		err = vhd_coalesce_engine_extent(e, blk, 0, child->spb);
+	else
+		for (err = 0, i = 0; !err && i < child->spb; i += secs) {
+			secs = 1;
+			if (!vhd_bitmap_test(child, map, i))
+				continue;
+
+			while (i + secs < child->spb &&
+			       vhd_bitmap_test(child, map, i + secs))
+				secs++;
+
+			err = vhd_coalesce_engine_extent(e, blk, i, secs);
+		}
+
+	blk->issued = 1;
+	if (err)
+		return err;
+
+	if (!blk->pending)
+		return vhd_coalesce_engine_finish_block(e, blk);
+
+	return vhd_coalesce_engine_submit(e);
+}
+
+static int
+vhd_util_coalesce_pipelined(vhd_context_t *from, vhd_context_t *to,
+			    int to_fd, int depth, int progress,
+			    uint64_t *bytes, const struct timeval *t0)
+{
+	struct vhd_coalesce_engine e;
+	struct timeval now;
 	uint64_t i;
+	int err;
+
+	err = vhd_coalesce_engine_init(&e, from, to, to_fd, depth);
+	if (err)
+		return err;
+
+	for (i = 0; i < from->bat.entries; i++) {
+		if (progress) {
+			gettimeofday(&now, NULL);
+			printf("\r%6.2f%% %9.2f MB/s",
+			       ((float)i / (float)from->bat.entries) * 100.00,
+			       vhd_util_coalesce_rate(e.bytes, t0, &now));
+			fflush(stdout);
+		}
+
+		err = vhd_coalesce_engine_block(&e, i);
+		if (err)
+			break;
+	}
+
+	vhd_coalesce_engine_drain(&e);
+	if (!err)
+		err = e.err;
+
+	*bytes = e.bytes;
+	vhd_coalesce_engine_free(&e);
+	return err;
+}
+
+static int
+vhd_util_coalesce_onto(vhd_context_t *from, vhd_context_t *to,
+		       int to_fd, int depth, int progress)
+{
+	int err;
+	uint64_t i, bytes;
+	struct timeval t0, now;
+
+	bytes = 0;
+	gettimeofday(&t0, NULL);
 
 	err = vhd_get_bat(from);
 	if (err)
@@ -144,28 +621,62 @@ vhd_util_coalesce_onto(vhd_context_t *from,
 			goto out;
 	}
 
+	if (to->file) {
+		err = vhd_get_bat(to);
+		if (err)
+			goto out;
+
+		if (vhd_has_batmap(to)) {
+			err = vhd_get_batmap(to);
+			if (err)
+				goto out;
+		}
+	}
+
+	/*
+	 * The pipelined path does its own data I/O on the image fds, so
+	 * it needs local files and matching block geometry.
+	 */
+	if (depth > 0 && !from->devops &&
+	    (!to->file || (!to->devops && to->spb == from->spb))) {
+		err = vhd_util_coalesce_pipelined(from, to, to_fd, depth,
+						  progress, &bytes, &t0);
+		if (err != -ENOSYS)
+			goto done;
+		bytes = 0;
+	}
+
 	for (i = 0; i < from->bat.entries; i++) {
 		if (progress) {
-			printf("\r%6.2f%%",
-			       ((float)i / (float)from->bat.entries) * 100.00);
+			gettimeofday(&now, NULL);
+			printf("\r%6.2f%% %9.2f MB/s",
+			       ((float)i / (float)from->bat.entries) * 100.00,
+			       vhd_util_coalesce_rate(bytes, &t0, &now));
 			fflush(stdout);
 		}
-		err = vhd_util_coalesce_block(from, to, to_fd, i);
+		err = vhd_util_coalesce_block(from, to, to_fd, i, &bytes);
 		if (err)
 			goto out;
 	}
 
 	err = 0;
 
-	if (progress)
+done:
+	if (progress && !err) {
+		gettimeofday(&now, NULL);
 		printf("\r100.00%%\n");
+		printf("coalesced %.2f MB in %.2fs: %.2f MB/s\n",
+		       (double)bytes / (1 << 20),
+		       vhd_util_coalesce_elapsed(&t0, &now),
+		       vhd_util_coalesce_rate(bytes, &t0, &now));
+	}
 
 out:
 	return err;
 }
 
 static int
-vhd_util_coalesce_parent(const char *name, int sparse, int progress)
+vhd_util_coalesce_parent(const char *name, int sparse, int depth, int progress)
 {
 	char *pname;
 	int err, parent_fd;
@@ -207,7 +718,7 @@ vhd_util_coalesce_parent(const char *name, int sparse, int progress)
 		}
 	}
 
-	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, progress);
+	err = vhd_util_coalesce_onto(&vhd, &parent, parent_fd, depth, progress);
 
 	free(pname);
 	vhd_close(&vhd);
@@ -475,8 +986,8 @@ out:
 }
 
 static int
-vhd_util_coalesce_ancestor(const char *cname,
-			   const char *aname, int sparse, int progress)
+vhd_util_coalesce_ancestor(const char *cname, const char *aname,
+			   int sparse, int depth, int progress)
 {
 	uint64_t i;
 	int err, raw_fd;
@@ -506,7 +1017,7 @@ vhd_util_coalesce_ancestor(const char *cname,
 		goto out;
 	}
 
-	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, progress);
+	err = vhd_util_coalesce_onto(child, ancestor, raw_fd, depth, progress);
 	if (err)
 		goto out;
 
@@ -648,19 +1159,20 @@ int
 vhd_util_coalesce(int argc, char **argv)
 {
 	char *name, *oname, *ancestor;
-	int err, c, progress, sparse;
+	int err, c, progress, sparse, depth;
 
 	name      = NULL;
 	oname     = NULL;
 	ancestor  = NULL;
 	sparse    = 0;
 	progress  = 0;
+	depth     = VHD_COALESCE_QUEUE_DEPTH;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:o:a:sph")) != -1) {
+	while ((c = getopt(argc, argv, "n:o:a:q:sph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
@@ -674,6 +1186,11 @@ vhd_util_coalesce(int argc, char **argv)
 		case 's':
 			sparse = 1;
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth < 0 || depth > VHD_COALESCE_MAX_DEPTH)
+				goto usage;
+			break;
 		case 'p':
 			progress = 1;
 			break;
@@ -693,9 +1210,9 @@ vhd_util_coalesce(int argc, char **argv)
 		err = vhd_util_coalesce_out(name, oname, sparse, progress);
 	else if (ancestor)
 		err = vhd_util_coalesce_ancestor(name, ancestor,
-						 sparse, progress);
+						 sparse, depth, progress);
 	else
-		err = vhd_util_coalesce_parent(name, sparse, progress);
+		err = vhd_util_coalesce_parent(name, sparse, depth, progress);
 
 	if (err)
 		printf("error coalescing: %d\n", err);
@@ -704,6 +1221,7 @@ vhd_util_coalesce(int argc, char **argv)
 
 usage:
 	printf("options: <-n name> [-a ancestor] "
-	       "[-o output] [-s sparse] [-p progress] [-h help]\n");
+	       "[-o output] [-s sparse] [-q queue depth (0: synchronous)] "
+	       "[-p progress] [-h help]\n");
 	return -EINVAL;
 }
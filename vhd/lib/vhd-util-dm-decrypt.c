@@ -35,6 +35,7 @@
 #include <stddef.h>
 
 #include "libvhd.h"
+#include "vhd-util.h"
 
 struct vhd_decrypt_progress {
 	char                          display;
@@ -47,6 +48,8 @@ struct vhd_decrypt_context {
 	vhd_context_t                *src_vhd;
 	vhd_context_t                *dst_vhd;
 	struct vhd_decrypt_progress   progress;
+	uint32_t                      next;
+	int                           threads;
 };
 
 #define ERR(_fmt, _args...) fprintf(stderr, "%d: " _fmt, __LINE__, ##_args)
@@ -73,75 +76,86 @@ struct vhd_decrypt_context {
 static int
 vhd_util_pread_data(int fd, char *buf, size_t size, off64_t off)
 {
-	int err;
 	ssize_t ret;
 
-	err = 0;
-
-	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1) {
-		err = -errno;
-		goto out;
-	}
-
 	while (size) {
-		ret = read(fd, buf, size);
+		ret = pread(fd, buf, size, off);
 		if (ret == -1) {
-			if (errno == EAGAIN)
+			if (errno == EAGAIN || errno == EINTR)
 				continue;
-			err = -errno;
-			goto out;
+			return -errno;
 		}
 
+		if (!ret)
+			return -EIO;
+
 		buf  += ret;
+		off  += ret;
 		size -= ret;
 	}
 
-out:
-	return err;
+	return 0;
 }
 
+/*
+ * Reader: hand out allocated blocks in order. The output BAT is
+ * sorted, so this is also the order they go out on the stream.
+ */
 static int
-vhd_util_stream_copy_block(struct vhd_decrypt_context *ctx, uint32_t blk)
+vhd_util_stream_next_block(void *data, struct vhd_util_pipeline_slot *slot)
 {
-	int err, i;
-	off64_t off;
-	char *bm, *data;
-	vhd_context_t *src, *dst;
-
-	bm    = NULL;
-	data  = NULL;
-	src   = ctx->src_vhd;
-	dst   = ctx->dst_vhd;
-
-	if (src->bat.bat[blk] == DD_BLK_UNUSED) {
-		if (dst->bat.bat[blk] == DD_BLK_UNUSED)
-			err = 0;
-		else {
-			err = -EIO;
+	struct vhd_decrypt_context *ctx = data;
+	vhd_context_t *src = ctx->src_vhd;
+	vhd_context_t *dst = ctx->dst_vhd;
+	uint32_t blk;
+
+	for (; ctx->next < src->bat.entries; ctx->next++) {
+		blk = ctx->next;
+
+		if (src->bat.bat[blk] != DD_BLK_UNUSED) {
+			slot->block = blk;
+			ctx->next++;
+			return 0;
+		}
+
+		if (dst->bat.bat[blk] != DD_BLK_UNUSED) {
 			ERR("skipping allocated block 0x%x\n", blk);
+			return -EIO;
 		}
-		goto out;
 	}
 
-	PROGRESS(ctx);
+	return 1;
+}
 
-	err = posix_memalign((void **)&data,
-			     VHD_SECTOR_SIZE, src->header.block_size);
-	if (err) {
-		err  = -err;
-		data = NULL;
-		ERR("allocating block 0x%x\n", blk);
-		goto out;
-	}
+/*
+ * Worker threads: read the bitmap from the source vhd and the
+ * allocated sectors from the dm-crypt target into the slot. Reads
+ * from the workers run concurrently, which spreads the decryption
+ * over the kernel's per-cpu crypt workers.
+ */
+static int
+vhd_util_stream_read_block(void *data, struct vhd_util_pipeline_slot *slot)
+{
+	struct vhd_decrypt_context *ctx = data;
+	vhd_context_t *src = ctx->src_vhd;
+	char *bm, *block;
+	uint32_t blk;
+	off64_t off;
+	int err, i;
+
+	blk   = slot->block;
+	bm    = slot->buf;
+	block = slot->buf + vhd_sectors_to_bytes(src->bm_secs);
 
-	memset(data, 0, src->header.block_size);
+	memset(block, 0, src->header.block_size);
 	off = ((uint64_t)blk * src->header.block_size) >> VHD_SECTOR_SHIFT;
 
-	err = vhd_read_bitmap(src, blk, &bm);
+	err = vhd_pread(src, bm, vhd_sectors_to_bytes(src->bm_secs),
+			vhd_sectors_to_bytes(src->bat.bat[blk]));
 	if (err) {
 		ERR("error reading source bitmap for "
 		    "block 0x%x: %d\n", blk, err);
-		goto out;
+		return err;
 	}
 
 	i = 0;
@@ -152,7 +166,7 @@ vhd_util_stream_copy_block(struct vhd_decrypt_context *ctx, uint32_t blk)
 
 		cnt  = 1;
 		pos  = off + i;
-		buf  = data + vhd_sectors_to_bytes(i);
+		buf  = block + vhd_sectors_to_bytes(i);
 		copy = vhd_bitmap_test(src, bm, i);
 
 		while (i + cnt < src->spb &&
@@ -165,31 +179,59 @@ vhd_util_stream_copy_block(struct vhd_decrypt_context *ctx, uint32_t blk)
 						  vhd_sectors_to_bytes(pos));
 			if (err) {
 				ERR("reading dev block 0x%x: %d\n", blk, err);
-				goto out;
+				return err;
 			}
+
+			slot->bytes += vhd_sectors_to_bytes(cnt);
 		}
 
 		i += cnt;
 	}
 
+	return 0;
+}
+
+/*
+ * Writer: blocks go out on the stream in the order they were handed
+ * out.
+ */
+static int
+vhd_util_stream_copy_block(void *data, struct vhd_util_pipeline_slot *slot)
+{
+	struct vhd_decrypt_context *ctx = data;
+	vhd_context_t *dst = ctx->dst_vhd;
+	uint32_t blk = slot->block;
+	char *bm, *block;
+	int err;
+
+	bm    = slot->buf;
+	block = slot->buf + vhd_sectors_to_bytes(ctx->src_vhd->bm_secs);
+
+	PROGRESS(ctx);
+
 	err = vhd_write_bitmap(dst, blk, bm);
 	if (err) {
 		ERR("writing bitmap 0x%x: %d\n", blk, err);
-		goto out;
+		return err;
 	}
 
-	err = vhd_write_block(dst, blk, data);
+	err = vhd_write_block(dst, blk, block);
 	if (err) {
 		ERR("writing data 0x%x: %d\n", blk, err);
-		goto out;
+		return err;
 	}
 
-out:
-	free(bm);
-	free(data);
-	return err;
+	ctx->progress.cur++;
+
+	return 0;
 }
 
+static const struct vhd_util_pipeline_ops vhd_util_dm_decrypt_ops = {
+	.read  = vhd_util_stream_next_block,
+	.work  = vhd_util_stream_read_block,
+	.write = vhd_util_stream_copy_block,
+};
+
 static int
 __vhd_util_dm_decrypt(struct vhd_decrypt_context *ctx)
 {
@@ -200,6 +242,7 @@ __vhd_util_dm_decrypt(struct vhd_decrypt_context *ctx)
 	off64_t off, eoh;
 	vhd_context_t *src;
 	vhd_context_t *dst;
+	struct vhd_util_pipeline pipeline;
 
 	buf = NULL;
 	src = ctx->src_vhd;
@@ -275,11 +318,16 @@ __vhd_util_dm_decrypt(struct vhd_decrypt_context *ctx)
 		goto out;
 	}
 
-	for (i = 0; i < src->bat.entries; i++) {
-		err = vhd_util_stream_copy_block(ctx, i);
-		if (err)
-			goto out;
-	}
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.ops      = &vhd_util_dm_decrypt_ops;
+	pipeline.data     = ctx;
+	pipeline.threads  = ctx->threads;
+	pipeline.buf_size = vhd_sectors_to_bytes(src->bm_secs) +
+		src->header.block_size;
+
+	err = vhd_util_pipeline_run(&pipeline);
+	if (err)
+		goto out;
 
 	err = vhd_end_of_data(dst, &off);
 	if (err) {
@@ -295,6 +343,11 @@ __vhd_util_dm_decrypt(struct vhd_decrypt_context *ctx)
 
 	PROGRESS(ctx);
 
+	if (ctx->progress.display) {
+		fprintf(stderr, "\n");
+		vhd_util_pipeline_report(&pipeline, stderr);
+	}
+
 out:
 	free(buf);
 	return err;
@@ -349,12 +402,13 @@ vhd_util_dm_decrypt(int argc, char **argv)
 	memset(&ctx, 0, sizeof(ctx));
 
 	ctx.src_raw = -1;
+	ctx.threads = VHD_UTIL_PIPELINE_THREADS;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "i:I:o:ph")) != -1) {
+	while ((c = getopt(argc, argv, "i:I:o:j:ph")) != -1) {
 		switch (c) {
 		case 'i':
 			raw_in = optarg;
@@ -368,6 +422,11 @@ vhd_util_dm_decrypt(int argc, char **argv)
 		case 'p':
 			ctx.progress.display = 1;
 			break;
+		case 'j':
+			ctx.threads = atoi(optarg);
+			if (ctx.threads < 1)
+				goto usage;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -420,9 +479,12 @@ usage:
 	       "dm target and writes it to a new vhd.\n"
 	       "Options:\n"
 	       "-h          Print this help message.\n"
-	       "-p          Display progress.\n"
+	       "-p          Display progress and throughput.\n"
+	       "-j THREADS  Number of THREADS reading from the device "
+	       "(default %d).\n"
 	       "-o NAME     NAME of output VHD to create ('-' for stdout).\n"
 	       "-i NAME     NAME of input device to read.\n"
-	       "-I NAME     NAME of input vhd to read.\n");
+	       "-I NAME     NAME of input vhd to read.\n",
+	       VHD_UTIL_PIPELINE_THREADS);
 	return EINVAL;
 }
@@ -47,33 +47,30 @@
 		ERR("%s: " _fmt, uuid, ##_args);			\
 	} while (0)							\
 
+struct vhd_encrypt_context {
+	vhd_context_t                *src;
+	int                           fd;
+	uint64_t                     *p2v;
+	uint32_t                      next;
+	int                           progress;
+	uint64_t                      cur;
+	uint64_t                      total;
+};
+
 static int
-vhd_util_stream_transfer_sectors(vhd_context_t *src, int fd,
+vhd_util_stream_transfer_sectors(vhd_context_t *src, int fd, char *data,
 				 uint32_t blk, uint32_t sec, uint32_t cnt)
 {
 	int err;
 	char *buf;
-	off64_t off;
 	size_t size;
 	ssize_t ret;
 	uint64_t sout;
 
+	err  = 0;
 	size = vhd_sectors_to_bytes(cnt);
 	sout = vhd_sectors_to_bytes((uint64_t)blk * src->spb + sec);
-	off  = src->bat.bat[blk] + src->bm_secs + sec;
-
-	err = posix_memalign((void **)&buf, VHD_SECTOR_SIZE, size);
-	if (err) {
-		err = -err;
-		buf = NULL;
-		goto out;
-	}
-
-	err = vhd_pread(src, buf, size, vhd_sectors_to_bytes(off));
-	if (err) {
-		VERR(src, "error reading from stream\n");
-		goto out;
-	}
+	buf  = data + vhd_sectors_to_bytes(sec);
 
 	errno = 0;
 	ret = pwrite(fd, buf, size, sout);
@@ -81,11 +78,8 @@ vhd_util_stream_transfer_sectors(vhd_context_t *src, int fd,
 		err = (errno ? -errno : -EIO);
 		VERR(src, "error writing 0x%x sectors at 0x%llx to output: "
 		     "%d\n", cnt, sout, err);
-		goto out;
 	}
 
-out:
-	free(buf);
 	return err;
 }
 
@@ -119,27 +113,27 @@ out:
 	return err;
 }
 
+/*
+ * Worker threads: write the allocated sectors of one block, already
+ * read into the slot as bitmap followed by data. Writes from the
+ * workers go to the dm-crypt target concurrently, which spreads the
+ * encryption over the kernel's per-cpu crypt workers.
+ */
 static int
-vhd_util_stream_copy_block(vhd_context_t *src, int fd, uint32_t blk)
+vhd_util_stream_copy_block(void *data, struct vhd_util_pipeline_slot *slot)
 {
-	char *bm;
+	struct vhd_encrypt_context *ctx = data;
+	vhd_context_t *src = ctx->src;
 	int err, i, allocated;
+	uint32_t blk;
+	char *bm, *buf;
 
-	bm = NULL;
+	err = 0;
+	blk = slot->block;
+	bm  = slot->buf;
+	buf = slot->buf + vhd_sectors_to_bytes(src->bm_secs);
 	allocated = 0;
 
-	if (src->bat.bat[blk] == DD_BLK_UNUSED) {
-		err = 0;
-		goto out;
-	}
-
-	err = vhd_read_bitmap(src, blk, &bm);
-	if (err) {
-		ERR("error reading source bitmap for "
-		    "block 0x%x: %d\n", blk, err);
-		goto out;
-	}
-
 	i = 0;
 	while (i < src->spb) {
 		int cnt, copy;
@@ -152,11 +146,12 @@ vhd_util_stream_copy_block(vhd_context_t *src, int fd, uint32_t blk)
 			cnt++;
 
 		if (copy) {
-			err = vhd_util_stream_transfer_sectors(src, fd,
+			err = vhd_util_stream_transfer_sectors(src, ctx->fd, buf,
 							       blk, i, cnt);
 			if (err)
 				goto out;
 
+			slot->bytes += vhd_sectors_to_bytes(cnt);
 			allocated = 1;
 		}
 
@@ -170,11 +165,10 @@ vhd_util_stream_copy_block(vhd_context_t *src, int fd, uint32_t blk)
 		 * force the output VHD size to match the original VHD size,
 		 * we'll write one sector of zeros here to allocate the block.
 		 */
-		err = vhd_util_stream_allocate_block(src, fd, blk);
+		err = vhd_util_stream_allocate_block(src, ctx->fd, blk);
 	}
 
 out:
-	free(bm);
 	return err;
 }
 
@@ -192,62 +186,113 @@ p2v_compare(const void *p1, const void *p2)
 	return (phy1 < phy2 ? -1 : 1);
 }
 
+/*
+ * Reader: the input may be a pipe, so blocks are read whole, bitmap
+ * and data, in physical order. Unused entries sort last.
+ */
 static int
-__vhd_util_dm_encrypt(vhd_context_t *src, const char *output, int progress)
+vhd_util_stream_read_block(void *data, struct vhd_util_pipeline_slot *slot)
 {
-	int fd, err;
+	struct vhd_encrypt_context *ctx = data;
+	vhd_context_t *src = ctx->src;
+	uint32_t phys, virt;
+	int err;
+
+	if (ctx->next == src->bat.entries)
+		return 1;
+
+	phys = p2v_physical(ctx->p2v[ctx->next]);
+	virt = p2v_virtual(ctx->p2v[ctx->next]);
+	if (phys == DD_BLK_UNUSED)
+		return 1;
+
+	err = vhd_pread(src, slot->buf,
+			vhd_sectors_to_bytes(src->bm_secs + src->spb),
+			vhd_sectors_to_bytes(phys));
+	if (err) {
+		ERR("error reading source block 0x%x: %d\n", virt, err);
+		return err;
+	}
+
+	slot->block = virt;
+	ctx->next++;
+
+	return 0;
+}
+
+static int
+vhd_util_stream_block_done(void *data, struct vhd_util_pipeline_slot *slot)
+{
+	struct vhd_encrypt_context *ctx = data;
+
+	if (ctx->progress && ctx->total) {
+		printf("\r%6.2f%%",
+		       ((float)ctx->cur / (float)ctx->total) * 100.0);
+		fflush(stdout);
+		ctx->cur++;
+	}
+
+	return 0;
+}
+
+static const struct vhd_util_pipeline_ops vhd_util_dm_encrypt_ops = {
+	.read  = vhd_util_stream_read_block,
+	.work  = vhd_util_stream_copy_block,
+	.write = vhd_util_stream_block_done,
+};
+
+static int
+__vhd_util_dm_encrypt(vhd_context_t *src, const char *output,
+		      int progress, int threads)
+{
+	int err;
 	uint32_t i;
-	uint64_t *p2v, cur, total;
+	struct vhd_util_pipeline pipeline;
+	struct vhd_encrypt_context ctx;
 
-	cur   = 0;
-	total = 0;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src      = src;
+	ctx.progress = progress;
 
-	fd = open(output, O_WRONLY | O_LARGEFILE | O_DIRECT);
-	if (fd == -1) {
+	ctx.fd = open(output, O_WRONLY | O_LARGEFILE | O_DIRECT);
+	if (ctx.fd == -1) {
 		err = -errno;
 		goto out;
 	}
 
-	p2v = malloc(src->bat.entries * sizeof(*p2v));
-	if (!p2v) {
+	ctx.p2v = malloc(src->bat.entries * sizeof(*ctx.p2v));
+	if (!ctx.p2v) {
 		err = -ENOMEM;
 		goto out;
 	}
 
 	for (i = 0; i < src->bat.entries; i++) {
 		if (progress && src->bat.bat[i] != DD_BLK_UNUSED)
-			total++;
-		p2v[i] = p2v_entry(src->bat.bat[i], i);
+			ctx.total++;
+		ctx.p2v[i] = p2v_entry(src->bat.bat[i], i);
 	}
 
-	qsort(p2v, src->bat.entries, sizeof(*p2v), p2v_compare);
+	qsort(ctx.p2v, src->bat.entries, sizeof(*ctx.p2v), p2v_compare);
 
-	for (i = 0; i < src->bat.entries; i++) {
-		uint32_t phys = p2v_physical(p2v[i]);
-		uint32_t virt = p2v_virtual(p2v[i]);
-
-		if (phys != DD_BLK_UNUSED) {
-			if (progress && total) {
-				printf("\r%6.2f%%",
-				       ((float)cur / (float)total) * 100.0);
-				fflush(stdout);
-				cur++;
-			}
-
-			err = vhd_util_stream_copy_block(src, fd, virt);
-			if (err)
-				goto out;
-		}
-	}
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.ops      = &vhd_util_dm_encrypt_ops;
+	pipeline.data     = &ctx;
+	pipeline.threads  = threads;
+	pipeline.buf_size = vhd_sectors_to_bytes(src->bm_secs + src->spb);
+
+	err = vhd_util_pipeline_run(&pipeline);
+	if (err)
+		goto out;
 
 	if (progress) {
 		printf("\r%6.2f%%\n", 100.0);
-		fflush(stdout);
+		vhd_util_pipeline_report(&pipeline, stdout);
 	}
 
 out:
-	free(p2v);
-	close(fd);
+	free(ctx.p2v);
+	if (ctx.fd != -1)
+		close(ctx.fd);
 	return err;
 }
 
@@ -291,11 +336,12 @@ vhd_util_dm_encrypt(int argc, char **argv)
 {
 	FILE *file;
 	vhd_context_t *vhd;
-	int c, fd, err, progress;
+	int c, fd, err, progress, threads;
 	const char *input, *raw_out, *vhd_out, *command;
 
 	err      = 0;
 	progress = 0;
+	threads  = VHD_UTIL_PIPELINE_THREADS;
 	vhd      = NULL;
 	file     = NULL;
 	input    = NULL;
@@ -307,7 +353,7 @@ vhd_util_dm_encrypt(int argc, char **argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "i:o:c:C:ph")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:c:C:j:ph")) != -1) {
 		switch (c) {
 		case 'i':
 			input = optarg;
@@ -324,6 +370,11 @@ vhd_util_dm_encrypt(int argc, char **argv)
 		case 'p':
 			progress = 1;
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				goto usage;
+			break;
 		case 'h':
 		default:
 			goto usage;
@@ -370,7 +421,7 @@ vhd_util_dm_encrypt(int argc, char **argv)
 		}
 	}
 
-	err = __vhd_util_dm_encrypt(vhd, raw_out, progress);
+	err = __vhd_util_dm_encrypt(vhd, raw_out, progress, threads);
 	if (err) {
 		ERR("error encrypting data: %d\n", err);
 		goto cleanup;
@@ -417,10 +468,13 @@ usage:
 	       "\n"
 	       "Options:\n"
 	       "-h          Print this help message.\n"
-	       "-p          Display progress.\n"
+	       "-p          Display progress and throughput.\n"
+	       "-j THREADS  Number of THREADS writing to the device "
+	       "(default %d).\n"
 	       "-o NAME     NAME of file/device to write to.\n"
 	       "-i NAME     NAME of input VHD to copy ('-' for stdin).\n"
 	       "-c NAME     NAME of vhd to create (requires -C option).\n"
-	       "-C COMMAND  COMMAND to instantiate created vhd.\n");
+	       "-C COMMAND  COMMAND to instantiate created vhd.\n",
+	       VHD_UTIL_PIPELINE_THREADS);
 	return EINVAL;
 }
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2010, Citrix Systems, Inc.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A three stage block pipeline: the calling thread reads blocks in
+ * order into a ring of slots, worker threads process them in any
+ * order, and a writer thread retires them in the order they were
+ * read. The ring holds two slots per worker, so reading the next
+ * blocks overlaps with the work and writeback of the current ones.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "libvhd.h"
+#include "vhd-util.h"
+
+#define VHD_PIPELINE_FREE    0
+#define VHD_PIPELINE_READY   1
+#define VHD_PIPELINE_BUSY    2
+#define VHD_PIPELINE_DONE    3
+
+struct vhd_util_pipeline_state {
+	struct vhd_util_pipeline        *p;
+	struct vhd_util_pipeline_slot   *slots;
+	int                              nslots;
+
+	uint64_t                         nread;
+	uint64_t                         nwork;
+	int                              eof;
+	int                              err;
+
+	pthread_mutex_t                  lock;
+	pthread_cond_t                   cond;
+};
+
+#define pipeline_slot(_s, _seq) ((_s)->slots + ((_seq) % (_s)->nslots))
+
+static void
+vhd_util_pipeline_fail(struct vhd_util_pipeline_state *s, int err)
+{
+	pthread_mutex_lock(&s->lock);
+	if (!s->err)
+		s->err = err;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+vhd_util_pipeline_worker(void *arg)
+{
+	struct vhd_util_pipeline_state *s = arg;
+	struct vhd_util_pipeline_slot *slot;
+	int err;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->err && s->nwork == s->nread && !s->eof)
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		if (s->err || s->nwork == s->nread) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+
+		slot = pipeline_slot(s, s->nwork++);
+		slot->state = VHD_PIPELINE_BUSY;
+		pthread_mutex_unlock(&s->lock);
+
+		err = s->p->ops->work(s->p->data, slot);
+		if (err) {
+			vhd_util_pipeline_fail(s, err);
+			break;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		slot->state = VHD_PIPELINE_DONE;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+static void *
+vhd_util_pipeline_writer(void *arg)
+{
+	struct vhd_util_pipeline_state *s = arg;
+	struct vhd_util_pipeline_slot *slot;
+	uint64_t seq;
+	int err;
+
+	for (seq = 0;; seq++) {
+		slot = pipeline_slot(s, seq);
+
+		pthread_mutex_lock(&s->lock);
+		while (!s->err && slot->state != VHD_PIPELINE_DONE &&
+		       !(s->eof && seq == s->nread))
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		if (s->err || slot->state != VHD_PIPELINE_DONE) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		if (s->p->ops->write) {
+			err = s->p->ops->write(s->p->data, slot);
+			if (err) {
+				vhd_util_pipeline_fail(s, err);
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->p->blocks++;
+		s->p->bytes += slot->bytes;
+		slot->state = VHD_PIPELINE_FREE;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+static int
+vhd_util_pipeline_read(struct vhd_util_pipeline_state *s)
+{
+	struct vhd_util_pipeline_slot *slot;
+	uint64_t seq;
+	int err;
+
+	for (seq = 0;; seq++) {
+		slot = pipeline_slot(s, seq);
+
+		pthread_mutex_lock(&s->lock);
+		while (!s->err && slot->state != VHD_PIPELINE_FREE)
+			pthread_cond_wait(&s->cond, &s->lock);
+		err = s->err;
+		pthread_mutex_unlock(&s->lock);
+
+		if (err)
+			return err;
+
+		slot->seq   = seq;
+		slot->bytes = 0;
+
+		err = s->p->ops->read(s->p->data, slot);
+		if (err < 0) {
+			vhd_util_pipeline_fail(s, err);
+			return err;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if (err > 0)
+			s->eof = 1;
+		else {
+			slot->state = VHD_PIPELINE_READY;
+			s->nread++;
+		}
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		if (err > 0)
+			return 0;
+	}
+}
+
+/**
+ * vhd_util_pipeline_run() - run @p until ops->read() reports the end
+ *
+ * @p: pipeline with ops, data, threads and buf_size set
+ *
+ * Each slot has an aligned buffer of buf_size bytes. ops->read() fills
+ * the next slot and returns 0, or 1 when there is nothing left to read.
+ * Slot bytes set by the callbacks are summed into p->bytes for
+ * vhd_util_pipeline_report(). The first error from any stage stops
+ * the pipeline and is returned.
+ */
+int
+vhd_util_pipeline_run(struct vhd_util_pipeline *p)
+{
+	struct vhd_util_pipeline_state s;
+	pthread_t *workers, writer;
+	int i, n, err;
+
+	memset(&s, 0, sizeof(s));
+	s.p     = p;
+	workers = NULL;
+	n       = 0;
+
+	if (p->threads < 1)
+		p->threads = 1;
+
+	p->blocks = 0;
+	p->bytes  = 0;
+	gettimeofday(&p->start, NULL);
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+
+	s.nslots = 2 * p->threads;
+	s.slots  = calloc(s.nslots, sizeof(*s.slots));
+	workers  = calloc(p->threads, sizeof(*workers));
+	if (!s.slots || !workers) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < s.nslots; i++) {
+		err = posix_memalign((void **)&s.slots[i].buf,
+				     VHD_SECTOR_SIZE, p->buf_size);
+		if (err) {
+			s.slots[i].buf = NULL;
+			err = -err;
+			goto out;
+		}
+	}
+
+	err = pthread_create(&writer, NULL, vhd_util_pipeline_writer, &s);
+	if (err) {
+		err = -err;
+		goto out;
+	}
+
+	for (n = 0; n < p->threads; n++) {
+		err = pthread_create(&workers[n], NULL,
+				     vhd_util_pipeline_worker, &s);
+		if (err) {
+			vhd_util_pipeline_fail(&s, -err);
+			break;
+		}
+	}
+
+	if (n == p->threads)
+		vhd_util_pipeline_read(&s);
+
+	while (n-- > 0)
+		pthread_join(workers[n], NULL);
+
+	pthread_join(writer, NULL);
+	err = s.err;
+
+out:
+	gettimeofday(&p->end, NULL);
+
+	if (s.slots)
+		for (i = 0; i < s.nslots; i++)
+			free(s.slots[i].buf);
+
+	free(s.slots);
+	free(workers);
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+	return err;
+}
+
+void
+vhd_util_pipeline_report(struct vhd_util_pipeline *p, FILE *stream)
+{
+	double secs, mb;
+
+	secs  = (p->end.tv_sec - p->start.tv_sec) +
+		(p->end.tv_usec - p->start.tv_usec) / 1000000.0;
+	mb    = (double)p->bytes / (1024 * 1024);
+
+	fprintf(stream, "%"PRIu64" blocks, %.1f MiB in %.1fs (%.1f MiB/s)\n",
+		p->blocks, mb, secs, (secs > 0 ? mb / secs : 0.0));
+	fflush(stream);
+}
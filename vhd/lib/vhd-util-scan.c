@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include <fnmatch.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "list.h"
@@ -51,6 +52,9 @@
 #define VHD_SCAN_PARENTS     0x20
 #define VHD_SCAN_MARKERS     0x40
 
+#define VHD_SCAN_THREADS     8
+#define VHD_SCAN_MAX_THREADS 64
+
 #define VHD_TYPE_RAW_FILE    0x01
 #define VHD_TYPE_VHD_FILE    0x02
 #define VHD_TYPE_RAW_VOLUME  0x04
@@ -971,12 +975,12 @@ iterator_free(struct iterator *itr)
 
 static void
 vhd_util_scan_add_parent(struct iterator *itr,
-			 vhd_context_t *vhd, struct vhd_image *image)
+			 struct vhd_image *image, int parent_raw)
 {
 	int err;
 	uint8_t type;
 
-	if (vhd_parent_raw(vhd))
+	if (parent_raw)
 		type = target_volume(image->target->type) ? 
 			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
 	else
@@ -988,13 +992,81 @@ vhd_util_scan_add_parent(struct iterator *itr,
 		vhd_util_scan_error(image->parent, err);
 }
 
+/*
+ * Open a target and read what we report about it. Touches nothing
+ * but the target and image, so it is safe to run from a worker.
+ */
 static int
-vhd_util_scan_targets(int cnt, struct target *targets)
+vhd_util_scan_target(struct target *target,
+		     struct vhd_image *image, int *parent_raw)
 {
-	int ret, err;
+	int err;
 	vhd_context_t vhd;
+
+	memset(&vhd, 0, sizeof(vhd));
+	memset(image, 0, sizeof(*image));
+
+	image->target = target;
+	*parent_raw   = 0;
+
+	err = vhd_util_scan_open(&vhd, image);
+	if (err)
+		goto out;
+
+	err = vhd_util_scan_get_size(&vhd, image);
+	if (err) {
+		image->message = "getting physical size";
+		image->error   = err;
+		goto out;
+	}
+
+	err = vhd_util_scan_get_hidden(&vhd, image);
+	if (err) {
+		image->message = "checking 'hidden' field";
+		image->error   = err;
+		goto out;
+	}
+
+	if (flags & VHD_SCAN_MARKERS) {
+		err = vhd_util_scan_get_markers(&vhd, image);
+		if (err) {
+			image->message = "checking markers";
+			image->error   = err;
+			goto out;
+		}
+	}
+
+	if (vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_util_scan_get_parent(&vhd, image);
+		if (err) {
+			image->message = "getting parent";
+			image->error   = err;
+			goto out;
+		}
+
+		*parent_raw = vhd_parent_raw(&vhd);
+	}
+
+out:
+	if (vhd.file)
+		vhd_close(&vhd);
+	return err;
+}
+
+static void
+vhd_util_scan_put_image(struct vhd_image *image)
+{
+	if (image->name != image->target->name)
+		free(image->name);
+	free(image->parent);
+}
+
+static int
+vhd_util_scan_targets_serial(int cnt, struct target *targets)
+{
+	int ret, err, parent_raw;
 	struct iterator itr;
-	struct target *target;
+	struct target *next, target;
 	struct vhd_image image;
 
 	ret = 0;
@@ -1004,72 +1076,260 @@ vhd_util_scan_targets(int cnt, struct target *targets)
 	if (err)
 		return err;
 
-	while ((target = iterator_next(&itr))) {
-		memset(&vhd, 0, sizeof(vhd));
-		memset(&image, 0, sizeof(image));
-
-		image.target = target;
+	while ((next = iterator_next(&itr))) {
+		/* adding parents may move the iterator's targets */
+		target = *next;
 
-		err = vhd_util_scan_open(&vhd, &image);
-		if (err) {
+		err = vhd_util_scan_target(&target, &image, &parent_raw);
+		if (err)
 			ret = -EAGAIN;
-			goto end;
-		}
 
-		err = vhd_util_scan_get_size(&vhd, &image);
-		if (err) {
-			ret           = -EAGAIN;
-			image.message = "getting physical size";
-			image.error   = err;
-			goto end;
+		vhd_util_scan_print_image(&image);
+
+		if (flags & VHD_SCAN_PARENTS && image.parent)
+			vhd_util_scan_add_parent(&itr, &image, parent_raw);
+
+		vhd_util_scan_put_image(&image);
+
+		if (err && !(flags & VHD_SCAN_NOFAIL))
+			break;
+	}
+
+	iterator_free(&itr);
+
+	if (flags & VHD_SCAN_NOFAIL)
+		return ret;
+
+	return err;
+}
+
+/*
+ * Parallel scan: workers open and read targets in iterator order,
+ * the main thread prints results in that same order and adds any
+ * parents found, so output matches a serial scan.
+ */
+struct vhd_scan_result {
+	struct target        target;
+	struct vhd_image     image;
+	int                  parent_raw;
+	int                  err;
+	int                  done;
+};
+
+struct vhd_scan_pool {
+	pthread_mutex_t      lock;
+	pthread_cond_t       work;
+	pthread_cond_t       done;
+
+	struct iterator     *itr;
+	struct vhd_scan_result **results;
+	int                  size;
+	int                  next;
+	int                  stop;
+};
+
+/* called with the pool locked */
+static int
+vhd_util_scan_pool_grow(struct vhd_scan_pool *pool)
+{
+	struct vhd_scan_result **new;
+	int i, size;
+
+	if (pool->size >= pool->itr->cur_size)
+		return 0;
+
+	size = pool->itr->max_size;
+	new  = realloc(pool->results, size * sizeof(*new));
+	if (!new)
+		return -ENOMEM;
+
+	for (i = pool->size; i < size; i++)
+		new[i] = NULL;
+
+	pool->results = new;
+	pool->size    = size;
+
+	return 0;
+}
+
+static void *
+vhd_util_scan_worker(void *arg)
+{
+	struct vhd_scan_pool *pool = arg;
+	struct vhd_scan_result *result;
+	int idx;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (!pool->stop && pool->next >= pool->itr->cur_size)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->stop)
+			break;
+
+		idx    = pool->next++;
+		result = pool->results[idx];
+		result->target = pool->itr->targets[idx];
+
+		pthread_mutex_unlock(&pool->lock);
+
+		result->err = vhd_util_scan_target(&result->target,
+						   &result->image,
+						   &result->parent_raw);
+
+		pthread_mutex_lock(&pool->lock);
+
+		result->done = 1;
+		pthread_cond_broadcast(&pool->done);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*
+ * called with the pool locked. on failure, targets without a
+ * result slot are dropped.
+ */
+static int
+vhd_util_scan_pool_alloc(struct vhd_scan_pool *pool)
+{
+	int i, err;
+
+	err = vhd_util_scan_pool_grow(pool);
+	if (err) {
+		pool->itr->cur_size = pool->size;
+		return err;
+	}
+
+	for (i = 0; i < pool->itr->cur_size; i++) {
+		if (pool->results[i])
+			continue;
+
+		pool->results[i] = calloc(1, sizeof(struct vhd_scan_result));
+		if (!pool->results[i]) {
+			pool->itr->cur_size = i;
+			return -ENOMEM;
 		}
+	}
+
+	return 0;
+}
+
+static int
+vhd_util_scan_targets_parallel(int cnt, struct target *targets, int threads)
+{
+	int i, n, ret, err;
+	pthread_t *tids;
+	struct iterator itr;
+	struct vhd_scan_pool pool;
+	struct vhd_scan_result *result;
+
+	ret = 0;
+	err = 0;
+	n   = 0;
+
+	err = iterator_init(&itr, cnt, targets);
+	if (err)
+		return err;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.itr = &itr;
+
+	tids = calloc(threads, sizeof(pthread_t));
+	if (!tids) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-		err = vhd_util_scan_get_hidden(&vhd, &image);
+	err = vhd_util_scan_pool_alloc(&pool);
+	if (err)
+		goto out;
+
+	for (n = 0; n < threads; n++) {
+		err = pthread_create(&tids[n], NULL,
+				     vhd_util_scan_worker, &pool);
 		if (err) {
-			ret           = -EAGAIN;
-			image.message = "checking 'hidden' field";
-			image.error   = err;
-			goto end;
+			err = -err;
+			goto out;
 		}
+	}
 
-		if (flags & VHD_SCAN_MARKERS) {
-			err = vhd_util_scan_get_markers(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "checking markers";
-				image.error   = err;
-				goto end;
-			}
-		}
+	for (i = 0;; i++) {
+		pthread_mutex_lock(&pool.lock);
 
-		if (vhd.footer.type == HD_TYPE_DIFF) {
-			err = vhd_util_scan_get_parent(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "getting parent";
-				image.error   = err;
-				goto end;
-			}
+		/* nothing left in flight can add more */
+		if (i >= itr.cur_size) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
 		}
 
-	end:
-		vhd_util_scan_print_image(&image);
+		while (!pool.results[i]->done)
+			pthread_cond_wait(&pool.done, &pool.lock);
 
-		if (flags & VHD_SCAN_PARENTS && image.parent)
-			vhd_util_scan_add_parent(&itr, &vhd, &image);
+		result = pool.results[i];
+		pool.results[i] = NULL;
+
+		pthread_mutex_unlock(&pool.lock);
+
+		err = result->err;
+		if (err)
+			ret = -EAGAIN;
+
+		vhd_util_scan_print_image(&result->image);
 
-		if (vhd.file)
-			vhd_close(&vhd);
-		if (image.name != target->name)
-			free(image.name);
-		free(image.parent);
+		if (flags & VHD_SCAN_PARENTS && result->image.parent) {
+			pthread_mutex_lock(&pool.lock);
+
+			vhd_util_scan_add_parent(&itr, &result->image,
+						 result->parent_raw);
+			if (vhd_util_scan_pool_alloc(&pool))
+				vhd_util_scan_error(result->image.parent,
+						    -ENOMEM);
+			pthread_cond_broadcast(&pool.work);
+
+			pthread_mutex_unlock(&pool.lock);
+		}
+
+		vhd_util_scan_put_image(&result->image);
+		free(result);
 
 		if (err && !(flags & VHD_SCAN_NOFAIL))
 			break;
 	}
 
+out:
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (n--)
+		pthread_join(tids[n], NULL);
+
+	for (i = 0; i < pool.size; i++) {
+		result = pool.results[i];
+		if (!result)
+			continue;
+
+		if (result->done)
+			vhd_util_scan_put_image(&result->image);
+		free(result);
+	}
+
+	free(pool.results);
+	free(tids);
 	iterator_free(&itr);
 
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.work);
+	pthread_mutex_destroy(&pool.lock);
+
 	if (flags & VHD_SCAN_NOFAIL)
 		return ret;
 
@@ -1077,7 +1337,23 @@ vhd_util_scan_targets(int cnt, struct target *targets)
 }
 
 static int
-vhd_util_scan_targets_pretty(int cnt, struct target *targets)
+vhd_util_scan_targets(int cnt, struct target *targets, int threads)
+{
+	/* the icbinn client is shared and not thread-safe */
+	if (getenv("LIBVHD_ICBINN_VHD_SERVER"))
+		threads = 1;
+
+	if (threads > cnt && !(flags & VHD_SCAN_PARENTS))
+		threads = cnt;
+
+	if (threads <= 1)
+		return vhd_util_scan_targets_serial(cnt, targets);
+
+	return vhd_util_scan_targets_parallel(cnt, targets, threads);
+}
+
+static int
+vhd_util_scan_targets_pretty(int cnt, struct target *targets, int threads)
 {
 	int err;
 
@@ -1087,7 +1363,7 @@ vhd_util_scan_targets_pretty(int cnt, struct target *targets)
 		return -ENOMEM;
 	}
 
-	err = vhd_util_scan_targets(cnt, targets);
+	err = vhd_util_scan_targets(cnt, targets, threads);
 
 	vhd_util_scan_pretty_print_images();
 	vhd_util_scan_pretty_free_list();
@@ -1306,7 +1582,7 @@ vhd_util_scan_find_targets(int cnt, char **names,
 int
 vhd_util_scan(int argc, char **argv)
 {
-	int c, ret, err, cnt, markers;
+	int c, ret, err, cnt, markers, threads;
 	char *filter, *volume;
 	struct target *targets;
 
@@ -1315,12 +1591,13 @@ vhd_util_scan(int argc, char **argv)
 	err     = 0;
 	flags   = 0;
 	markers = 0;
+	threads = VHD_SCAN_THREADS;
 	filter  = NULL;
 	volume  = NULL;
 	targets = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "m:fcl:pavMh")) != -1) {
+	while ((c = getopt(argc, argv, "m:fcl:pavMj:h")) != -1) {
 		switch (c) {
 		case 'm':
 			filter = optarg;
@@ -1347,6 +1624,13 @@ vhd_util_scan(int argc, char **argv)
 		case 'M':
 			flags |= VHD_SCAN_MARKERS;
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > VHD_SCAN_MAX_THREADS) {
+				err = -EINVAL;
+				goto usage;
+			}
+			break;
 		case 'h':
 			goto usage;
 		default:
@@ -1374,9 +1658,9 @@ vhd_util_scan(int argc, char **argv)
 		return 0;
 
 	if (flags & VHD_SCAN_PRETTY)
-		err = vhd_util_scan_targets_pretty(cnt, targets);
+		err = vhd_util_scan_targets_pretty(cnt, targets, threads);
 	else
-		err = vhd_util_scan_targets(cnt, targets);
+		err = vhd_util_scan_targets(cnt, targets, threads);
 
 	free(targets);
 	lvm_free_vg(&vg);
@@ -1387,6 +1671,7 @@ usage:
 	printf("usage: [OPTIONS] FILES\n"
 	       "options: [-m match filter] [-f fast] [-c continue on failure] "
 	       "[-l LVM volume] [-p pretty print] [-a scan parents] "
-	       "[-v verbose] [-h help] [-M show markers]\n");
+	       "[-v verbose] [-h help] [-M show markers] "
+	       "[-j threads, 1 for serial]\n");
 	return err;
 }
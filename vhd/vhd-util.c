@@ -68,6 +68,7 @@ struct command commands[] = {
 	{ .name = "key",         .func = vhd_util_key           },
 	{ .name = "clone-metadata", .func = vhd_util_clone_metadata },
 	{ .name = "stream-coalesce", .func = vhd_util_stream_coalesce },
+	{ .name = "changed-blocks", .func = vhd_util_changed_blocks },
 };
 
 #define print_commands()					\